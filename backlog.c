@@ -0,0 +1,143 @@
+/*
+ * IceStreamer - A simple live audio streamer
+ *
+ * Copyright (C) 2017 George Kiagiadakis <gkiagia@tolabaki.gr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "icestreamer.h"
+
+/*
+ * A bounded FIFO of encoded buffers. The buffers are only referenced,
+ * never copied, and the oldest ones are dropped when it is full.
+ * It is not thread-safe; it is only used from the streaming thread
+ * of the stream that feeds it.
+ */
+
+typedef struct _IcstrBacklogEntry IcstrBacklogEntry;
+struct _IcstrBacklogEntry
+{
+  GstBuffer *buffer;
+  gint64 arrival;               /* monotonic time */
+};
+
+struct _IcstrBacklog
+{
+  GQueue entries;
+  gsize bytes;
+  gsize max_bytes;
+  GstClockTime max_time;
+  guint64 dropped;
+};
+
+IcstrBacklog *
+icstr_backlog_new (gsize max_bytes, GstClockTime max_time)
+{
+  IcstrBacklog *backlog = g_new0 (IcstrBacklog, 1);
+
+  g_queue_init (&backlog->entries);
+  backlog->max_bytes = max_bytes;
+  backlog->max_time = max_time;
+
+  return backlog;
+}
+
+static void
+icstr_backlog_entry_free (IcstrBacklogEntry *entry)
+{
+  gst_buffer_unref (entry->buffer);
+  g_free (entry);
+}
+
+void
+icstr_backlog_clear (IcstrBacklog *backlog)
+{
+  g_queue_clear_full (&backlog->entries,
+                      (GDestroyNotify) icstr_backlog_entry_free);
+  backlog->bytes = 0;
+}
+
+void
+icstr_backlog_free (IcstrBacklog *backlog)
+{
+  icstr_backlog_clear (backlog);
+  g_free (backlog);
+}
+
+gboolean
+icstr_backlog_is_empty (IcstrBacklog *backlog)
+{
+  return g_queue_is_empty (&backlog->entries);
+}
+
+GstBuffer *
+icstr_backlog_pop (IcstrBacklog *backlog)
+{
+  IcstrBacklogEntry *entry = NULL;
+  GstBuffer *buffer = NULL;
+
+  entry = g_queue_pop_head (&backlog->entries);
+  if (!entry)
+    return NULL;
+
+  buffer = entry->buffer;
+  backlog->bytes -= gst_buffer_get_size (buffer);
+  g_free (entry);
+
+  return buffer;
+}
+
+static gboolean
+icstr_backlog_is_full (IcstrBacklog *backlog, gint64 now)
+{
+  IcstrBacklogEntry *head = g_queue_peek_head (&backlog->entries);
+
+  if (!head)
+    return FALSE;
+
+  if (backlog->bytes > backlog->max_bytes)
+    return TRUE;
+
+  if (GST_CLOCK_TIME_IS_VALID (backlog->max_time) &&
+      (now - head->arrival) * GST_USECOND > backlog->max_time)
+    return TRUE;
+
+  return FALSE;
+}
+
+/* takes ownership of the buffer */
+void
+icstr_backlog_push (IcstrBacklog *backlog, GstBuffer *buffer)
+{
+  IcstrBacklogEntry *entry = g_new (IcstrBacklogEntry, 1);
+  gint64 now = g_get_monotonic_time ();
+  IcstrBacklogEntry *head;
+
+  entry->buffer = buffer;
+  entry->arrival = now;
+  g_queue_push_tail (&backlog->entries, entry);
+  backlog->bytes += gst_buffer_get_size (buffer);
+
+  while (icstr_backlog_is_full (backlog, now)) {
+    gst_buffer_unref (icstr_backlog_pop (backlog));
+    backlog->dropped++;
+
+    /* always start from a point where the stream can be picked up */
+    while ((head = g_queue_peek_head (&backlog->entries)) &&
+        GST_BUFFER_FLAG_IS_SET (head->buffer, GST_BUFFER_FLAG_DELTA_UNIT)) {
+      gst_buffer_unref (icstr_backlog_pop (backlog));
+      backlog->dropped++;
+    }
+  }
+}
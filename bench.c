@@ -0,0 +1,273 @@
+/*
+ * IceStreamer - A simple live audio streamer
+ *
+ * Copyright (C) 2017 George Kiagiadakis <gkiagia@tolabaki.gr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "icestreamer.h"
+#include <stdatomic.h>
+#include <stdio.h>
+#include <sys/resource.h>
+#include <time.h>
+
+/*
+ * Benchmarking. The pipeline is run as usual, but with a source that is
+ * not live, so that it runs as fast as it can until the end of the input.
+ * Then the real-time factor, the CPU time spent by the threads of each
+ * stream, the allocation rate and the peak RSS are written as JSON.
+ *
+ * The CPU time of each streaming thread is measured from the thread
+ * itself, between its STREAM_STATUS enter and leave messages.
+ */
+
+typedef struct _IcstrBench IcstrBench;
+struct _IcstrBench
+{
+  gint64 start;                 /* monotonic time */
+  gint64 end;                   /* monotonic time, at the end of the input */
+  atomic_uint_fast64_t audio;   /* duration of the captured audio */
+
+  GMutex lock;
+  GHashTable *threads;          /* owner GstElement -> CPU time in ns */
+};
+
+static IcstrBench *bench = NULL;
+
+/* the thread's CPU time when it entered its task */
+static GPrivate thread_cpu_start = G_PRIVATE_INIT (g_free);
+
+#ifdef HAVE___LIBC_MALLOC
+/*
+ * The allocations are counted by interposing the allocator of the C
+ * library, which everything else, including GLib, ends up calling.
+ * This costs a single relaxed load per allocation when not benchmarking.
+ */
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t n_members, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+
+static atomic_bool counting_allocations;
+static atomic_uint_fast64_t allocations;
+
+static inline void
+icstr_bench_count_allocation (void)
+{
+  if (atomic_load_explicit (&counting_allocations, memory_order_relaxed))
+    atomic_fetch_add_explicit (&allocations, 1, memory_order_relaxed);
+}
+
+void *
+malloc (size_t size)
+{
+  icstr_bench_count_allocation ();
+  return __libc_malloc (size);
+}
+
+void *
+calloc (size_t n_members, size_t size)
+{
+  icstr_bench_count_allocation ();
+  return __libc_calloc (n_members, size);
+}
+
+void *
+realloc (void *ptr, size_t size)
+{
+  icstr_bench_count_allocation ();
+  return __libc_realloc (ptr, size);
+}
+
+static void
+icstr_bench_count_allocations (gboolean count)
+{
+  atomic_store_explicit (&counting_allocations, count, memory_order_relaxed);
+}
+#else
+static void
+icstr_bench_count_allocations (gboolean count)
+{
+}
+#endif
+
+static guint64
+icstr_bench_thread_cpu_time (void)
+{
+  struct timespec ts;
+
+  if (clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts) < 0)
+    return 0;
+
+  return ts.tv_sec * G_GUINT64_CONSTANT (1000000000) + ts.tv_nsec;
+}
+
+static GstPadProbeReturn
+icstr_bench_audio_probe (GstPad *pad, GstPadProbeInfo *info, gpointer data)
+{
+  GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+
+  if (GST_BUFFER_DURATION_IS_VALID (buffer))
+    atomic_fetch_add_explicit (&bench->audio, GST_BUFFER_DURATION (buffer),
+                               memory_order_relaxed);
+
+  return GST_PAD_PROBE_OK;
+}
+
+void
+icstr_bench_start (IceStreamer *self)
+{
+  g_autoptr (GstPad) pad = gst_element_get_static_pad (self->tee, "sink");
+
+  bench = g_new0 (IcstrBench, 1);
+  g_mutex_init (&bench->lock);
+  bench->threads = g_hash_table_new_full (NULL, NULL, gst_object_unref,
+                                          g_free);
+
+  gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER, icstr_bench_audio_probe,
+                     NULL, NULL);
+
+  bench->start = g_get_monotonic_time ();
+  icstr_bench_count_allocations (TRUE);
+}
+
+void
+icstr_bench_stop (void)
+{
+  if (!bench || bench->end)
+    return;
+
+  icstr_bench_count_allocations (FALSE);
+  bench->end = g_get_monotonic_time ();
+}
+
+/* called from the bus sync handler, i.e. from the streaming thread itself */
+void
+icstr_bench_handle_stream_status (GstMessage *msg)
+{
+  GstStreamStatusType type;
+  GstElement *owner = NULL;
+  guint64 *start, *total;
+
+  if (!bench)
+    return;
+
+  gst_message_parse_stream_status (msg, &type, &owner);
+
+  if (type == GST_STREAM_STATUS_TYPE_ENTER) {
+    start = g_new (guint64, 1);
+    *start = icstr_bench_thread_cpu_time ();
+    g_private_replace (&thread_cpu_start, start);
+  } else if (type == GST_STREAM_STATUS_TYPE_LEAVE) {
+    start = g_private_get (&thread_cpu_start);
+    if (!start)
+      return;
+
+    g_mutex_lock (&bench->lock);
+    total = g_hash_table_lookup (bench->threads, owner);
+    if (!total) {
+      total = g_new0 (guint64, 1);
+      g_hash_table_insert (bench->threads, gst_object_ref (owner), total);
+    }
+    *total += icstr_bench_thread_cpu_time () - *start;
+    g_mutex_unlock (&bench->lock);
+
+    g_private_replace (&thread_cpu_start, NULL);
+  }
+}
+
+/* the CPU time of the threads of the elements inside a bin, in seconds */
+static gdouble
+icstr_bench_cpu_time_of (GstElement *bin)
+{
+  GHashTableIter iter;
+  gpointer owner, total;
+  guint64 sum = 0;
+
+  g_hash_table_iter_init (&iter, bench->threads);
+  while (g_hash_table_iter_next (&iter, &owner, &total)) {
+    if (gst_object_has_as_ancestor (GST_OBJECT (owner), GST_OBJECT (bin)))
+      sum += *(guint64 *) total;
+  }
+
+  return (gdouble) sum / GST_SECOND;
+}
+
+/* to be called after the pipeline has stopped, so that all threads left */
+gboolean
+icstr_bench_write_results (IceStreamer *self, const gchar *file,
+    GError **error)
+{
+  g_autoptr (GString) out = g_string_new (NULL);
+  g_autoptr (GstElement) source = NULL;
+  struct rusage usage;
+  gdouble audio, wall, cpu;
+  GList *curr;
+
+  if (!bench || !bench->end) {
+    g_set_error (error, ICSTR_ERROR, 0,
+        "The benchmark did not reach the end of the input");
+    return FALSE;
+  }
+
+  getrusage (RUSAGE_SELF, &usage);
+  audio = (gdouble) atomic_load (&bench->audio) / GST_SECOND;
+  wall = (gdouble) (bench->end - bench->start) / G_TIME_SPAN_SECOND;
+  cpu = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+      (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+
+  g_string_append_printf (out, "{\n"
+      "  \"audio_seconds\": %.3f,\n"
+      "  \"wall_seconds\": %.3f,\n"
+      "  \"realtime_factor\": %.2f,\n"
+      "  \"cpu_seconds\": %.3f,\n",
+      audio, wall, wall > 0 ? audio / wall : 0, cpu);
+
+  /* the primary input; a backup input is not benchmarked */
+  source = gst_bin_get_by_name (GST_BIN (self->pipeline), "source_bin");
+  g_string_append_printf (out, "  \"source_cpu_seconds\": %.3f,\n",
+      source ? icstr_bench_cpu_time_of (source) : 0);
+
+  g_string_append (out, "  \"streams\": [");
+  for (curr = self->streams; curr != NULL; curr = g_list_next (curr)) {
+    IcstrStream *stream = curr->data;
+
+    g_string_append_printf (out, "%s\n    {\"name\": \"%s\", "
+        "\"cpu_seconds\": %.3f}", curr != self->streams ? "," : "",
+        stream->name, icstr_bench_cpu_time_of (stream->bin));
+  }
+  g_string_append (out, "\n  ],\n");
+
+#ifdef HAVE___LIBC_MALLOC
+  g_string_append_printf (out,
+      "  \"allocations\": %" G_GUINT64_FORMAT ",\n"
+      "  \"allocations_per_second\": %.0f,\n",
+      (guint64) atomic_load (&allocations),
+      wall > 0 ? atomic_load (&allocations) / wall : 0);
+#else
+  g_string_append (out,
+      "  \"allocations\": null,\n"
+      "  \"allocations_per_second\": null,\n");
+#endif
+
+  /* ru_maxrss is in kilobytes on Linux */
+  g_string_append_printf (out, "  \"peak_rss_kb\": %ld\n}\n",
+                          usage.ru_maxrss);
+
+  if (g_str_equal (file, "-")) {
+    fputs (out->str, stdout);
+    return TRUE;
+  }
+
+  return g_file_set_contents (file, out->str, out->len, error);
+}
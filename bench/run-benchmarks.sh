@@ -0,0 +1,86 @@
+#!/bin/sh
+#
+# Runs icestreamer with a set of standard configurations, faster than
+# real time, with a test source that is not live and destinations that
+# discard their data, and collects the figures of each run in a JSON file.
+#
+# Usage: run-benchmarks.sh [path/to/icestreamer]
+#
+# Environment:
+#   BENCH_OUTPUT   the results file (default: benchmark-results.json)
+#   BENCH_SECONDS  seconds of audio encoded by each run (default: 60)
+#   BENCH_STREAMS  the numbers of streams to try (default: "1 4 16 64")
+#   BENCH_CODECS   encoder/container pairs to try
+#                  (default: "opus/ogg opus/webm vorbis/ogg vorbis/webm mp3/-")
+
+set -e
+
+ICESTREAMER=${1:-./icestreamer}
+OUTPUT=${BENCH_OUTPUT:-benchmark-results.json}
+AUDIO_SECONDS=${BENCH_SECONDS:-60}
+STREAMS=${BENCH_STREAMS:-"1 4 16 64"}
+CODECS=${BENCH_CODECS:-"opus/ogg opus/webm vorbis/ogg vorbis/webm mp3/-"}
+
+RATE=48000
+SAMPLES_PER_BUFFER=1024
+
+tmpdir=$(mktemp -d)
+trap 'rm -rf "$tmpdir"' EXIT
+
+# $1: number of streams, $2: encoder, $3: container or -
+write_config ()
+{
+  cat <<EOC
+[input]
+source=test
+is-live=false
+wave=pink-noise
+samplesperbuffer=$SAMPLES_PER_BUFFER
+num-buffers=$((AUDIO_SECONDS * RATE / SAMPLES_PER_BUFFER))
+format=S16LE
+channels=2
+rate=$RATE
+EOC
+
+  i=1
+  while [ "$i" -le "$1" ]; do
+    printf '\n[stream%d]\nencoder=%s\n' "$i" "$2"
+    [ "$3" != "-" ] && printf 'container=%s\n' "$3"
+    printf 'output=discard\nqueue-leaky=false\n'
+    i=$((i + 1))
+  done
+}
+
+first=1
+printf '[' > "$OUTPUT"
+
+for codec in $CODECS; do
+  encoder=${codec%/*}
+  container=${codec#*/}
+
+  for streams in $STREAMS; do
+    if [ "$container" = "-" ]; then
+      name="$encoder-$streams"
+    else
+      name="$encoder-$container-$streams"
+    fi
+    echo "Running $name..." >&2
+
+    write_config "$streams" "$encoder" "$container" > "$tmpdir/$name.conf"
+    if ! "$ICESTREAMER" -c "$tmpdir/$name.conf" -b "$tmpdir/$name.json"; then
+      echo "Benchmark $name failed" >&2
+      exit 1
+    fi
+
+    [ "$first" = 1 ] || printf ',' >> "$OUTPUT"
+    first=0
+    printf '\n{"name": "%s", "encoder": "%s", "container": "%s", ' \
+        "$name" "$encoder" "$container" >> "$OUTPUT"
+    printf '"streams": %d, "results": ' "$streams" >> "$OUTPUT"
+    cat "$tmpdir/$name.json" >> "$OUTPUT"
+    printf '}' >> "$OUTPUT"
+  done
+done
+
+printf '\n]\n' >> "$OUTPUT"
+echo "Results written to $OUTPUT" >&2
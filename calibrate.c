@@ -0,0 +1,296 @@
+/*
+ * IceStreamer - A simple live audio streamer
+ *
+ * Copyright (C) 2017 George Kiagiadakis <gkiagia@tolabaki.gr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "icestreamer.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+
+/*
+ * Calibration. Each stream of a configuration is built on its own, as it
+ * would be by icstr_load(), conversion included, and fed with
+ * CALIBRATE_DURATION seconds of noise in the format of the input, as fast
+ * as it can take them. Its destinations throw the data away and its
+ * queues block instead of leaking. A first run without any stream
+ * measures the test input itself, which is then subtracted from the CPU
+ * time of the others, as the real input costs next to nothing.
+ *
+ * What it costs in CPU time per second of audio is what it will take from
+ * a core when running live, so the sum is the number of cores needed.
+ */
+
+#define CALIBRATE_DURATION 30           /* seconds of audio */
+#define CALIBRATE_SAMPLES 1024          /* per buffer */
+
+/* for what the input leaves open, as most capture devices run */
+#define CALIBRATE_RATE 48000
+#define CALIBRATE_CHANNELS 2
+
+typedef struct _IcstrCalibration IcstrCalibration;
+struct _IcstrCalibration
+{
+  gdouble audio;                /* seconds */
+  gdouble wall;                 /* seconds */
+  gdouble cpu;                  /* seconds */
+  guint64 bytes;                /* of encoded output */
+  gint64 memory;                /* peak RSS increase, in kB, or -1 */
+};
+
+static gdouble
+icstr_calibrate_cpu_time (void)
+{
+  struct rusage usage;
+
+  getrusage (RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+      (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+/* a field of /proc/self/status, in kB, or -1 */
+static gint64
+icstr_calibrate_read_status (const gchar *field)
+{
+  g_autofree gchar *contents = NULL;
+  const gchar *line;
+
+  if (!g_file_get_contents ("/proc/self/status", &contents, NULL, NULL))
+    return -1;
+
+  line = strstr (contents, field);
+  if (!line)
+    return -1;
+
+  return g_ascii_strtoll (line + strlen (field), NULL, 10);
+}
+
+/* so that VmHWM is the peak of the next run only */
+static gboolean
+icstr_calibrate_reset_peak (void)
+{
+  FILE *f = fopen ("/proc/self/clear_refs", "w");
+  gboolean ret;
+
+  if (!f)
+    return FALSE;
+
+  ret = fputs ("5", f) >= 0;
+  return (fclose (f) == 0) && ret;
+}
+
+static GstCaps *
+icstr_calibrate_get_caps (GKeyFile *keyfile)
+{
+  g_autofree gchar *codec = icstr_source_get_relay_codec (keyfile);
+  GstCaps *caps;
+  GstStructure *s;
+
+  /* a relayed input is measured as decoded */
+  caps = codec ? gst_caps_new_empty_simple ("audio/x-raw") :
+      icstr_source_get_caps (keyfile);
+  s = gst_caps_get_structure (caps, 0);
+
+  if (!gst_structure_has_field (s, "rate"))
+    gst_structure_set (s, "rate", G_TYPE_INT, CALIBRATE_RATE, NULL);
+  if (!gst_structure_has_field (s, "channels"))
+    gst_structure_set (s, "channels", G_TYPE_INT, CALIBRATE_CHANNELS, NULL);
+
+  return caps;
+}
+
+static GstPadProbeReturn
+icstr_calibrate_count_bytes (GstPad *pad, GstPadProbeInfo *info,
+    gpointer data)
+{
+  guint64 *bytes = data;
+
+  /* only this streaming thread, until the pipeline has stopped */
+  *bytes += gst_buffer_get_size (GST_PAD_PROBE_INFO_BUFFER (info));
+
+  return GST_PAD_PROBE_OK;
+}
+
+static void
+icstr_calibrate_block_queue (const GValue *item, gpointer data)
+{
+  GstElement *element = g_value_get_object (item);
+  GstElementFactory *factory = gst_element_get_factory (element);
+
+  if (factory && g_str_equal (GST_OBJECT_NAME (factory), "queue"))
+    g_object_set (element, "leaky", 0, NULL);
+}
+
+/* runs the stream in group, or only the input if NULL */
+static gboolean
+icstr_calibrate_run (GKeyFile *keyfile, const gchar *group,
+    IcstrCalibration *result, GError **error)
+{
+  IceStreamer self = { 0 };
+  g_autoptr (GstBus) bus = NULL;
+  g_autoptr (GstMessage) msg = NULL;
+  g_autoptr (GstCaps) caps = NULL;
+  g_autoptr (GstPad) pad = NULL;
+  GstElement *source, *capsfilter, *fakesink;
+  IcstrStream *stream = NULL;
+  GstIterator *it;
+  gboolean peak_reset;
+  gint64 start, rss;
+  gdouble cpu;
+  gint rate;
+  guint n_buffers;
+  gboolean ret = FALSE;
+
+  caps = icstr_calibrate_get_caps (keyfile);
+  gst_structure_get_int (gst_caps_get_structure (caps, 0), "rate", &rate);
+  n_buffers = (CALIBRATE_DURATION * rate + CALIBRATE_SAMPLES - 1) /
+      CALIBRATE_SAMPLES;
+
+  self.pipeline = gst_object_ref_sink (gst_pipeline_new (NULL));
+  source = gst_element_factory_make ("audiotestsrc", NULL);
+  capsfilter = gst_element_factory_make ("capsfilter", NULL);
+  self.tee = gst_element_factory_make ("tee", NULL);
+  fakesink = gst_element_factory_make ("fakesink", NULL);
+
+  /* noise is what is hardest to encode */
+  g_object_set (source, "is-live", FALSE, "samplesperbuffer",
+                CALIBRATE_SAMPLES, "num-buffers", n_buffers, NULL);
+  gst_util_set_object_arg (G_OBJECT (source), "wave", "pink-noise");
+  g_object_set (capsfilter, "caps", caps, NULL);
+  g_object_set (self.tee, "allow-not-linked", TRUE, NULL);
+
+  /* the end of the input, with or without a stream */
+  gst_bin_add_many (GST_BIN (self.pipeline), source, capsfilter, self.tee,
+                    fakesink, NULL);
+  gst_element_link_many (source, capsfilter, self.tee, fakesink, NULL);
+
+  if (group) {
+    stream = icstr_construct_stream (&self, keyfile, group, error);
+    if (!stream)
+      goto out;
+
+    gst_bin_add (GST_BIN (self.pipeline), stream->bin);
+    if (!icstr_link_stream (&self, keyfile, stream, error))
+      goto out;
+
+    pad = gst_element_get_static_pad (stream->tee, "sink");
+    gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER,
+        icstr_calibrate_count_bytes, &result->bytes, NULL);
+  }
+
+  it = gst_bin_iterate_recurse (GST_BIN (self.pipeline));
+  gst_iterator_foreach (it, icstr_calibrate_block_queue, NULL);
+  gst_iterator_free (it);
+
+  peak_reset = icstr_calibrate_reset_peak ();
+  rss = icstr_calibrate_read_status ("VmRSS:");
+  cpu = icstr_calibrate_cpu_time ();
+  start = g_get_monotonic_time ();
+
+  gst_element_set_state (self.pipeline, GST_STATE_PLAYING);
+
+  bus = gst_pipeline_get_bus (GST_PIPELINE (self.pipeline));
+  msg = gst_bus_timed_pop_filtered (bus, GST_CLOCK_TIME_NONE,
+      GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+
+  result->wall = (gdouble) (g_get_monotonic_time () - start) /
+      G_TIME_SPAN_SECOND;
+  result->cpu = icstr_calibrate_cpu_time () - cpu;
+  result->audio = (gdouble) n_buffers * CALIBRATE_SAMPLES / rate;
+  result->memory = (peak_reset && rss >= 0) ?
+      MAX (icstr_calibrate_read_status ("VmHWM:") - rss, 0) : -1;
+
+  if (GST_MESSAGE_TYPE (msg) == GST_MESSAGE_ERROR) {
+    g_autoptr (GError) internal_error = NULL;
+
+    gst_message_parse_error (msg, &internal_error, NULL);
+    g_propagate_prefixed_error (error, g_steal_pointer (&internal_error),
+        "%s: ", group ? group : "input");
+    goto out;
+  }
+
+  ret = TRUE;
+
+out:
+  gst_element_set_state (self.pipeline, GST_STATE_NULL);
+  g_clear_pointer (&stream, icstr_stream_free);
+  g_list_free_full (self.conversions, (GDestroyNotify) icstr_conversion_free);
+  gst_object_unref (self.pipeline);
+
+  return ret;
+}
+
+/* measures each stream of the configuration and prints the results */
+gboolean
+icstr_calibrate (const gchar *conf_file, GError **error)
+{
+  g_autoptr (GKeyFile) keyfile = g_key_file_new ();
+  g_auto (GStrv) groups = NULL;
+  IcstrCalibration input = { 0 };
+  gdouble cores = 0;
+  gchar **group, **dest_group;
+
+  if (!g_key_file_load_from_file (keyfile, conf_file, G_KEY_FILE_NONE,
+                                  error))
+    return FALSE;
+
+  /* nothing leaves the host */
+  groups = icstr_keyfile_get_stream_groups (keyfile);
+  for (group = groups; *group; group++) {
+    g_auto (GStrv) destinations = icstr_keyfile_get_destinations (keyfile,
+                                                                  *group);
+
+    for (dest_group = destinations; *dest_group; dest_group++)
+      g_key_file_set_string (keyfile, *dest_group, "output", "discard");
+  }
+
+  if (!icstr_calibrate_run (keyfile, NULL, &input, error))
+    return FALSE;
+
+  g_print ("Encoding %d s of audio with each stream, as fast as possible\n\n",
+           CALIBRATE_DURATION);
+  g_print ("%-20s %-12s %9s %12s %9s %11s\n", "stream", "encoder",
+           "realtime", "cpu ms/s", "kbit/s", "memory MiB");
+
+  for (group = groups; *group; group++) {
+    IcstrCalibration run = { 0 };
+    g_autoptr (GError) run_error = NULL;
+    g_autofree gchar *memory = NULL;
+    g_autofree gchar *encoder = NULL;
+    gdouble cpu;
+
+    if (!icstr_calibrate_run (keyfile, *group, &run, &run_error)) {
+      g_print ("%-20s failed: %s\n", *group, run_error->message);
+      continue;
+    }
+
+    encoder = icstr_keyfile_get_string_with_fallback (keyfile, *group,
+        "encoder", "vorbis");
+    cpu = MAX (run.cpu - input.cpu, 0) / run.audio;
+    cores += cpu;
+
+    memory = (run.memory >= 0) ? g_strdup_printf ("%.1f",
+        run.memory / 1024.0) : g_strdup ("?");
+
+    g_print ("%-20s %-12s %8.1fx %12.2f %9.1f %11s\n", *group, encoder,
+             run.wall > 0 ? run.audio / run.wall : 0, cpu * 1000,
+             run.bytes * 8 / run.audio / 1000, memory);
+  }
+
+  g_print ("\nPredicted CPU usage: %.2f cores\n", cores);
+
+  return TRUE;
+}
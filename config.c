@@ -34,6 +34,38 @@ icstr_keyfile_get_string_with_fallback (GKeyFile *keyfile,
   return value;
 }
 
+gint
+icstr_keyfile_get_integer_with_fallback (GKeyFile *keyfile,
+    const gchar *group, const gchar *key, gint fallback)
+{
+  GError *error = NULL;
+  gint value;
+
+  value = g_key_file_get_integer (keyfile, group, key, &error);
+  if (error) {
+    value = fallback;
+    g_clear_error (&error);
+  }
+
+  return value;
+}
+
+gdouble
+icstr_keyfile_get_double_with_fallback (GKeyFile *keyfile,
+    const gchar *group, const gchar *key, gdouble fallback)
+{
+  GError *error = NULL;
+  gdouble value;
+
+  value = g_key_file_get_double (keyfile, group, key, &error);
+  if (error) {
+    value = fallback;
+    g_clear_error (&error);
+  }
+
+  return value;
+}
+
 gboolean
 icstr_object_set_properties_from_keyfile (gpointer object,
     GKeyFile *keyfile, const gchar *group, GError **error)
@@ -87,3 +119,75 @@ icstr_element_factory_make_with_group_name (const gchar *factory,
   /* clear floating reference for use with g_autoptr */
   return gst_object_ref_sink (element);
 }
+
+/* the groups that are not streams, and what parses them */
+static const gchar *reserved_groups[] = {
+  "input",                      /* icstr_construct_source() */
+  "input.backup",               /* icstr_construct_source() */
+  "metadata",                   /* icstr_metadata_setup() */
+  "metrics",                    /* icstr_metrics_setup() */
+  "latency",                    /* icstr_latency_setup() */
+  "silence",                    /* icstr_silence_setup() */
+  "control",                    /* icstr_control_setup() */
+  NULL
+};
+
+gboolean
+icstr_keyfile_is_reserved_group (const gchar *group)
+{
+  return g_strv_contains (reserved_groups, group);
+}
+
+/* returns the destination groups of a stream: the ones that it lists,
+ * or the stream group itself if there is no such list */
+gchar **
+icstr_keyfile_get_destinations (GKeyFile *keyfile, const gchar *group)
+{
+  gchar **destinations;
+
+  destinations = g_key_file_get_string_list (keyfile, group, "destinations",
+                                             NULL, NULL);
+  if (!destinations) {
+    destinations = g_new0 (gchar *, 2);
+    destinations[0] = g_strdup (group);
+  }
+
+  return destinations;
+}
+
+/* returns the stream groups, in order: all groups but the reserved ones and
+ * the ones that are listed as destinations of another group */
+gchar **
+icstr_keyfile_get_stream_groups (GKeyFile *keyfile)
+{
+  g_auto (GStrv) groups = g_key_file_get_groups (keyfile, NULL);
+  g_autoptr (GHashTable) dest_groups = NULL;
+  GPtrArray *streams = g_ptr_array_new ();
+  gchar **group;
+  gchar **dest;
+
+  dest_groups = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  for (group = groups; *group; group++) {
+    g_auto (GStrv) destinations = NULL;
+
+    destinations = g_key_file_get_string_list (keyfile, *group,
+                                               "destinations", NULL, NULL);
+    if (!destinations)
+      continue;
+
+    for (dest = destinations; *dest; dest++) {
+      if (!g_str_equal (*dest, *group))
+        g_hash_table_add (dest_groups, g_strdup (*dest));
+    }
+  }
+
+  for (group = groups; *group; group++) {
+    if (icstr_keyfile_is_reserved_group (*group) ||
+        g_hash_table_contains (dest_groups, *group))
+      continue;
+    g_ptr_array_add (streams, g_strdup (*group));
+  }
+
+  g_ptr_array_add (streams, NULL);
+  return (gchar **) g_ptr_array_free (streams, FALSE);
+}
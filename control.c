@@ -0,0 +1,447 @@
+/*
+ * IceStreamer - A simple live audio streamer
+ *
+ * Copyright (C) 2017 George Kiagiadakis <gkiagia@tolabaki.gr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "icestreamer.h"
+#include <gio/gunixsocketaddress.h>
+#include <glib/gstdio.h>
+#include <string.h>
+
+/*
+ * A local control socket, served from the main loop. Clients send one
+ * command per line, with its arguments quoted like in a shell, and get
+ * back any number of lines followed by "OK" or "ERROR <message>".
+ * Commands are handled one at a time, in the order they arrive.
+ */
+
+struct _IcstrControl
+{
+  IceStreamer *self;
+  GSocketService *service;
+  gchar *socket_path;
+};
+
+typedef struct _IcstrControlClient IcstrControlClient;
+struct _IcstrControlClient
+{
+  IcstrControl *control;
+  GSocketConnection *connection;
+  GDataInputStream *input;
+  gchar *response;
+};
+
+typedef gboolean (*IcstrControlFunc) (IceStreamer *self, gchar **args,
+    GString *out, GError **error);
+
+static IcstrStream *
+icstr_control_find_stream (IceStreamer *self, const gchar *name,
+    GError **error)
+{
+  GList *curr;
+
+  for (curr = self->streams; curr != NULL; curr = g_list_next (curr)) {
+    IcstrStream *stream = curr->data;
+    if (g_str_equal (stream->name, name))
+      return stream;
+  }
+
+  g_set_error (error, ICSTR_ERROR, 0, "No such stream: %s", name);
+  return NULL;
+}
+
+/* the commands */
+
+static gboolean
+icstr_control_list (IceStreamer *self, gchar **args, GString *out,
+    GError **error)
+{
+  GList *curr, *dcurr;
+
+  for (curr = self->streams; curr != NULL; curr = g_list_next (curr)) {
+    IcstrStream *stream = curr->data;
+
+    g_string_append_printf (out, "stream %s %s %s\n", stream->name,
+        stream->stopped ? "stopped" : "running",
+        GST_OBJECT_NAME (gst_element_get_factory (stream->encoder)));
+
+    for (dcurr = stream->destinations; dcurr != NULL;
+        dcurr = g_list_next (dcurr)) {
+      IcstrDestination *dest = dcurr->data;
+
+      g_string_append_printf (out, "destination %s %s %s\n", stream->name,
+          dest->name, g_atomic_int_get (&dest->connected) ?
+          "connected" : "disconnected");
+    }
+  }
+
+  if (self->failover) {
+    g_string_append_printf (out, "input %s\n",
+        icstr_failover_get_state (self->failover, NULL) ?
+        "backup" : "primary");
+  }
+
+  return TRUE;
+}
+
+static gboolean
+icstr_control_start (IceStreamer *self, gchar **args, GString *out,
+    GError **error)
+{
+  IcstrStream *stream = icstr_control_find_stream (self, args[1], error);
+
+  return stream && icstr_stream_start (self, stream, error);
+}
+
+static gboolean
+icstr_control_stop (IceStreamer *self, gchar **args, GString *out,
+    GError **error)
+{
+  IcstrStream *stream = icstr_control_find_stream (self, args[1], error);
+
+  if (!stream)
+    return FALSE;
+
+  icstr_stream_stop (self, stream);
+  return TRUE;
+}
+
+static gboolean
+icstr_control_restart (IceStreamer *self, gchar **args, GString *out,
+    GError **error)
+{
+  IcstrStream *stream = icstr_control_find_stream (self, args[1], error);
+
+  if (!stream)
+    return FALSE;
+
+  icstr_stream_stop (self, stream);
+  return icstr_stream_start (self, stream, error);
+}
+
+static gboolean
+icstr_control_metadata (IceStreamer *self, gchar **args, GString *out,
+    GError **error)
+{
+  if (!g_utf8_validate (args[1], -1, NULL) ||
+      !g_utf8_validate (args[2], -1, NULL)) {
+    g_set_error (error, ICSTR_ERROR, 0, "Malformed metadata");
+    return FALSE;
+  }
+
+  icstr_metadata_set (self->metadata, args[1], args[2]);
+  return TRUE;
+}
+
+/* in the unit of the encoder, e.g. kbit/s for mp3 and bit/s otherwise;
+ * it is not saved in the configuration, so a restart or a reload that
+ * rebuilds the stream brings back the configured one */
+static gboolean
+icstr_control_bitrate (IceStreamer *self, gchar **args, GString *out,
+    GError **error)
+{
+  IcstrStream *stream = icstr_control_find_stream (self, args[1], error);
+  g_autoptr (GError) internal_error = NULL;
+  g_autofree gchar *bitrate = NULL;
+  GParamSpec *pspec;
+  guint64 value, min = 1, max = G_MAXINT;
+  gboolean stopped;
+
+  if (!stream)
+    return FALSE;
+
+  pspec = g_object_class_find_property (G_OBJECT_GET_CLASS (stream->encoder),
+                                        "bitrate");
+  if (!pspec) {
+    g_set_error (error, ICSTR_ERROR, 0, "The encoder of %s has no bitrate",
+                 stream->name);
+    return FALSE;
+  }
+
+  /* within what the encoder takes, and never 0 or negative */
+  if (G_IS_PARAM_SPEC_INT (pspec)) {
+    min = MAX (G_PARAM_SPEC_INT (pspec)->minimum, 1);
+    max = MAX (G_PARAM_SPEC_INT (pspec)->maximum, 1);
+  } else if (G_IS_PARAM_SPEC_UINT (pspec)) {
+    min = MAX (G_PARAM_SPEC_UINT (pspec)->minimum, 1);
+    max = MAX (G_PARAM_SPEC_UINT (pspec)->maximum, 1);
+  }
+
+  if (!g_ascii_string_to_unsigned (args[2], 10, min, max, &value,
+                                   &internal_error)) {
+    g_set_error (error, ICSTR_ERROR, 0, "Invalid bitrate: %s",
+                 internal_error->message);
+    return FALSE;
+  }
+  bitrate = g_strdup_printf ("%" G_GUINT64_FORMAT, value);
+
+  if (pspec->flags & GST_PARAM_MUTABLE_PLAYING) {
+    gst_util_set_object_arg (G_OBJECT (stream->encoder), "bitrate", bitrate);
+    return TRUE;
+  }
+
+  /* the others only take it when they start */
+  stopped = stream->stopped;
+  icstr_stream_stop (self, stream);
+  gst_util_set_object_arg (G_OBJECT (stream->encoder), "bitrate", bitrate);
+  return stopped || icstr_stream_start (self, stream, error);
+}
+
+static gboolean
+icstr_control_input (IceStreamer *self, gchar **args, GString *out,
+    GError **error)
+{
+  if (!self->failover) {
+    g_set_error (error, ICSTR_ERROR, 0, "There is no backup input");
+    return FALSE;
+  }
+
+  if (g_str_equal (args[1], "primary")) {
+    icstr_failover_force (self->failover, FALSE);
+  } else if (g_str_equal (args[1], "backup")) {
+    icstr_failover_force (self->failover, TRUE);
+  } else {
+    g_set_error (error, ICSTR_ERROR, 0, "Unknown input: %s", args[1]);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static gboolean
+icstr_control_stats (IceStreamer *self, gchar **args, GString *out,
+    GError **error)
+{
+  g_autofree gchar *json = NULL;
+
+  if (!self->metrics) {
+    g_set_error (error, ICSTR_ERROR, 0, "Metrics are disabled");
+    return FALSE;
+  }
+
+  /* a single line, ending in a newline */
+  json = icstr_metrics_format_json (self->metrics);
+  g_string_append (out, json);
+  return TRUE;
+}
+
+static gboolean icstr_control_help (IceStreamer *self, gchar **args,
+    GString *out, GError **error);
+
+static const struct {
+  const gchar *name;
+  guint n_args;
+  const gchar *usage;
+  IcstrControlFunc func;
+} commands[] = {
+  { "list", 0, "list", icstr_control_list },
+  { "start", 1, "start <stream>", icstr_control_start },
+  { "stop", 1, "stop <stream>", icstr_control_stop },
+  { "restart", 1, "restart <stream>", icstr_control_restart },
+  { "metadata", 2, "metadata <artist> <title>", icstr_control_metadata },
+  { "bitrate", 2, "bitrate <stream> <bitrate>", icstr_control_bitrate },
+  { "input", 1, "input primary|backup", icstr_control_input },
+  { "stats", 0, "stats", icstr_control_stats },
+  { "help", 0, "help", icstr_control_help },
+};
+
+static gboolean
+icstr_control_help (IceStreamer *self, gchar **args, GString *out,
+    GError **error)
+{
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (commands); i++)
+    g_string_append_printf (out, "%s\n", commands[i].usage);
+
+  return TRUE;
+}
+
+static gchar *
+icstr_control_execute (IceStreamer *self, const gchar *line)
+{
+  g_autoptr (GError) error = NULL;
+  g_auto (GStrv) args = NULL;
+  GString *out = g_string_new (NULL);
+  guint i, n_args;
+
+  if (!g_shell_parse_argv (line, NULL, &args, &error))
+    goto out;
+
+  n_args = g_strv_length (args) - 1;
+  for (i = 0; i < G_N_ELEMENTS (commands); i++) {
+    if (g_str_equal (args[0], commands[i].name))
+      break;
+  }
+
+  if (i == G_N_ELEMENTS (commands)) {
+    g_set_error (&error, ICSTR_ERROR, 0, "Unknown command: %s", args[0]);
+    goto out;
+  }
+
+  if (n_args != commands[i].n_args) {
+    g_set_error (&error, ICSTR_ERROR, 0, "Usage: %s", commands[i].usage);
+    goto out;
+  }
+
+  GST_DEBUG ("Control command: %s", line);
+  commands[i].func (self, args, out, &error);
+
+out:
+  if (error)
+    g_string_append_printf (out, "ERROR %s\n", error->message);
+  else
+    g_string_append (out, "OK\n");
+
+  return g_string_free (out, FALSE);
+}
+
+/* the connections */
+
+static void icstr_control_read_command (IcstrControlClient *client);
+
+static void
+icstr_control_client_free (IcstrControlClient *client)
+{
+  g_object_unref (client->input);
+  g_object_unref (client->connection);
+  g_free (client->response);
+  g_free (client);
+}
+
+static void
+icstr_control_response_written (GObject *stream, GAsyncResult *res,
+    gpointer data)
+{
+  IcstrControlClient *client = data;
+
+  g_clear_pointer (&client->response, g_free);
+
+  if (!g_output_stream_write_all_finish (G_OUTPUT_STREAM (stream), res, NULL,
+                                         NULL)) {
+    icstr_control_client_free (client);
+    return;
+  }
+
+  icstr_control_read_command (client);
+}
+
+static void
+icstr_control_command_read (GObject *stream, GAsyncResult *res,
+    gpointer data)
+{
+  IcstrControlClient *client = data;
+  g_autofree gchar *line = NULL;
+  GOutputStream *output;
+
+  line = g_data_input_stream_read_line_finish (G_DATA_INPUT_STREAM (stream),
+                                               res, NULL, NULL);
+  if (!line) {
+    icstr_control_client_free (client);
+    return;
+  }
+
+  g_strstrip (line);
+  if (line[0] == '\0') {
+    icstr_control_read_command (client);
+    return;
+  }
+
+  client->response = icstr_control_execute (client->control->self, line);
+
+  output = g_io_stream_get_output_stream (G_IO_STREAM (client->connection));
+  g_output_stream_write_all_async (output, client->response,
+      strlen (client->response), G_PRIORITY_DEFAULT, NULL,
+      icstr_control_response_written, client);
+}
+
+static void
+icstr_control_read_command (IcstrControlClient *client)
+{
+  g_data_input_stream_read_line_async (client->input, G_PRIORITY_DEFAULT,
+      NULL, icstr_control_command_read, client);
+}
+
+static gboolean
+icstr_control_incoming (GSocketService *service,
+    GSocketConnection *connection, GObject *source, gpointer data)
+{
+  IcstrControlClient *client = g_new0 (IcstrControlClient, 1);
+  GInputStream *input;
+
+  client->control = data;
+  client->connection = g_object_ref (connection);
+
+  input = g_io_stream_get_input_stream (G_IO_STREAM (connection));
+  client->input = g_data_input_stream_new (input);
+  g_data_input_stream_set_newline_type (client->input,
+      G_DATA_STREAM_NEWLINE_TYPE_ANY);
+
+  icstr_control_read_command (client);
+
+  return TRUE;
+}
+
+void
+icstr_control_free (IcstrControl *control)
+{
+  if (control->service) {
+    g_socket_service_stop (control->service);
+    g_socket_listener_close (G_SOCKET_LISTENER (control->service));
+    g_object_unref (control->service);
+  }
+  if (control->socket_path)
+    g_unlink (control->socket_path);
+
+  g_free (control->socket_path);
+  g_free (control);
+}
+
+gboolean
+icstr_control_setup (IceStreamer *self, GKeyFile *keyfile, GError **error)
+{
+  IcstrControl *control = g_new0 (IcstrControl, 1);
+  g_autoptr (GSocketAddress) addr = NULL;
+
+  /* keep it before anything fails, so that it is always freed */
+  self->control = control;
+  control->self = self;
+
+  control->socket_path = g_key_file_get_string (keyfile, "control", "socket",
+                                                NULL);
+  if (!control->socket_path) {
+    g_set_error (error, ICSTR_ERROR, 0, "No control socket provided");
+    return FALSE;
+  }
+
+  /* a stale socket from a previous run */
+  g_unlink (control->socket_path);
+  addr = g_unix_socket_address_new (control->socket_path);
+
+  control->service = g_socket_service_new ();
+  if (!g_socket_listener_add_address (G_SOCKET_LISTENER (control->service),
+          addr, G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_DEFAULT, NULL, NULL,
+          error))
+    return FALSE;
+
+  g_signal_connect (control->service, "incoming",
+                    G_CALLBACK (icstr_control_incoming), control);
+  g_socket_service_start (control->service);
+
+  GST_INFO ("Listening for commands on %s", control->socket_path);
+
+  return TRUE;
+}
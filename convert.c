@@ -0,0 +1,329 @@
+/*
+ * IceStreamer - A simple live audio streamer
+ *
+ * Copyright (C) 2017 George Kiagiadakis <gkiagia@tolabaki.gr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "icestreamer.h"
+#include <gst/audio/audio.h>
+
+void
+icstr_conversion_free (IcstrConversion *conv)
+{
+  g_list_free (conv->streams);
+  g_clear_pointer (&conv->caps, gst_caps_unref);
+  g_free (conv);
+}
+
+/* what is picked for what the input leaves open, as most capture devices
+ * run at it and all of our encoders take it */
+#define TARGET_RATE 48000
+#define TARGET_CHANNELS 2
+
+/*
+ * Figures out the raw format that the encoder of a stream will be fed
+ * with: what it accepts, as asked by the stream, and otherwise as close
+ * to the input as possible. It is always fixed, so that streams whose
+ * encoders take the same format share its conversion, whether the input
+ * format is known in advance or not.
+ */
+static GstCaps *
+icstr_stream_get_target_caps (IcstrStream *stream, GKeyFile *keyfile,
+    const GstCaps *input_caps, GError **error)
+{
+  g_autoptr (GstPad) pad = NULL;
+  g_autoptr (GstCaps) accepted = NULL;
+  g_autoptr (GstCaps) requested = NULL;
+  GstStructure *input_s = gst_caps_get_structure (input_caps, 0);
+  GstStructure *s = NULL;
+  GstCaps *target = NULL;
+  const gchar *format;
+  gint channels = TARGET_CHANNELS;
+  gint rate = TARGET_RATE;
+
+  /* explicitly requested by the stream */
+  requested = gst_caps_new_empty_simple ("audio/x-raw");
+  s = gst_caps_get_structure (requested, 0);
+  if (g_key_file_has_key (keyfile, stream->name, "format", NULL)) {
+    g_autofree gchar *value = g_key_file_get_string (keyfile, stream->name,
+                                                     "format", NULL);
+    gst_structure_set (s, "format", G_TYPE_STRING, value, NULL);
+  }
+  if (g_key_file_has_key (keyfile, stream->name, "channels", NULL)) {
+    gst_structure_set (s, "channels", G_TYPE_INT, g_key_file_get_integer (
+            keyfile, stream->name, "channels", NULL), NULL);
+  }
+  if (g_key_file_has_key (keyfile, stream->name, "rate", NULL)) {
+    gst_structure_set (s, "rate", G_TYPE_INT, g_key_file_get_integer (
+            keyfile, stream->name, "rate", NULL), NULL);
+  }
+
+  /* within what the encoder accepts */
+  pad = gst_element_get_static_pad (stream->encoder, "sink");
+  accepted = gst_pad_query_caps (pad, NULL);
+  target = gst_caps_intersect (accepted, requested);
+  if (gst_caps_is_empty (target)) {
+    g_autofree gchar *requested_str = gst_caps_to_string (requested);
+
+    g_set_error (error, ICSTR_ERROR, 0,
+        "The encoder of stream '%s' does not take %s", stream->name,
+        requested_str);
+    gst_caps_unref (target);
+    return NULL;
+  }
+
+  target = gst_caps_truncate (target);
+  target = gst_caps_make_writable (target);
+  s = gst_caps_get_structure (target, 0);
+
+  /* as close to the input as possible */
+  format = gst_structure_get_string (input_s, "format");
+  if (format) {
+    g_autoptr (GstCaps) test = gst_caps_new_simple ("audio/x-raw",
+        "format", G_TYPE_STRING, format, NULL);
+
+    if (gst_caps_can_intersect (test, target))
+      gst_structure_set (s, "format", G_TYPE_STRING, format, NULL);
+  }
+  gst_structure_get_int (input_s, "channels", &channels);
+  gst_structure_get_int (input_s, "rate", &rate);
+
+  /* an encoder that takes anything gets what the input has */
+  if (!gst_structure_has_field (s, "channels"))
+    gst_structure_set (s, "channels", G_TYPE_INT, channels, NULL);
+  if (!gst_structure_has_field (s, "rate"))
+    gst_structure_set (s, "rate", G_TYPE_INT, rate, NULL);
+
+  gst_structure_fixate_field (s, "format");
+  gst_structure_fixate_field_nearest_int (s, "channels", channels);
+  gst_structure_fixate_field_nearest_int (s, "rate", rate);
+  gst_structure_set (s, "layout", G_TYPE_STRING, "interleaved", NULL);
+
+  gst_structure_get_int (s, "channels", &channels);
+  if (channels > 2)
+    gst_structure_set (s, "channel-mask", GST_TYPE_BITMASK,
+        gst_audio_channel_get_fallback_mask (channels), NULL);
+  else
+    gst_structure_remove_field (s, "channel-mask");
+
+  return gst_caps_fixate (target);
+}
+
+/* whether the input is known to be in the target format already */
+static gboolean
+icstr_input_matches_target (const GstCaps *input_caps, const GstCaps *target)
+{
+  GstStructure *input_s = gst_caps_get_structure (input_caps, 0);
+  GstStructure *target_s = gst_caps_get_structure (target, 0);
+  const gchar *fields[] = { "format", "channels", "rate" };
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (fields); i++) {
+    const GValue *input_v = gst_structure_get_value (input_s, fields[i]);
+    const GValue *target_v = gst_structure_get_value (target_s, fields[i]);
+
+    if (!input_v || !target_v ||
+        gst_value_compare (input_v, target_v) != GST_VALUE_EQUAL)
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+static IcstrConversion *
+icstr_construct_conversion (IceStreamer *self, GstCaps *caps, GError **error)
+{
+  g_autoptr (GstElement) bin = NULL;
+  g_autofree gchar *name = NULL;
+  GstElement *queue, *convert, *resample, *capsfilter, *tee;
+  GstPad *pad;
+  IcstrConversion *conv = NULL;
+  static guint n_conversions = 0;
+
+  /* numbered in order of creation, as they may be removed on reload */
+  name = g_strdup_printf ("conversion-%u", n_conversions++);
+  bin = gst_object_ref_sink (gst_bin_new (name));
+
+  queue = gst_element_factory_make ("queue", NULL);
+  convert = gst_element_factory_make ("audioconvert", NULL);
+  resample = gst_element_factory_make ("audioresample", NULL);
+  capsfilter = gst_element_factory_make ("capsfilter", NULL);
+  tee = gst_element_factory_make ("tee", NULL);
+
+  /* do not let a slow conversion hold back the input */
+  g_object_set (queue, "leaky", 2, NULL);
+  g_object_set (capsfilter, "caps", caps, NULL);
+  g_object_set (tee, "allow-not-linked", TRUE, NULL);
+
+  gst_bin_add_many (GST_BIN (bin), queue, convert, resample, capsfilter, tee,
+                    NULL);
+  if (!gst_element_link_many (queue, convert, resample, capsfilter, tee,
+                              NULL)) {
+    g_set_error (error, ICSTR_ERROR, 0, "Failed to link conversion %s", name);
+    return NULL;
+  }
+
+  pad = gst_element_get_static_pad (queue, "sink");
+  gst_element_add_pad (bin, gst_ghost_pad_new ("sink", pad));
+  gst_object_unref (pad);
+
+  /* when added while running, it has to be ready before it gets data */
+  gst_bin_add (GST_BIN (self->pipeline), bin);
+  gst_element_sync_state_with_parent (bin);
+  if (!gst_element_link_pads (self->tee, "src_%u", bin, "sink")) {
+    gst_element_set_state (bin, GST_STATE_NULL);
+    gst_bin_remove (GST_BIN (self->pipeline), bin);
+    g_set_error (error, ICSTR_ERROR, 0,
+        "Failed to link conversion %s with the input", name);
+    return NULL;
+  }
+
+  conv = g_new0 (IcstrConversion, 1);
+  conv->caps = gst_caps_ref (caps);
+  conv->bin = bin;
+  conv->tee = tee;
+
+  self->conversions = g_list_append (self->conversions, conv);
+
+  return conv;
+}
+
+gboolean
+icstr_link_stream (IceStreamer *self, GKeyFile *keyfile,
+    IcstrStream *stream, GError **error)
+{
+  g_autoptr (GstCaps) input_caps = NULL;
+  g_autoptr (GstCaps) target = NULL;
+  IcstrConversion *conv = NULL;
+  GList *curr;
+
+  /* an encoded input is passed through or decoded by the stream itself */
+  if (!self->relay_codec) {
+    input_caps = icstr_source_get_caps (keyfile);
+    target = icstr_stream_get_target_caps (stream, keyfile, input_caps,
+                                           error);
+    if (!target)
+      return FALSE;
+  }
+
+  /* nothing to convert, feed it from the input directly */
+  if (!target || icstr_input_matches_target (input_caps, target)) {
+    stream->conversion = NULL;
+    stream->upstream_tee = self->tee;
+    if (!gst_element_link_pads (self->tee, "src_%u", stream->bin, "sink")) {
+      g_set_error (error, ICSTR_ERROR, 0,
+          "Failed to link stream '%s' with the input", stream->name);
+      return FALSE;
+    }
+    return TRUE;
+  }
+
+  for (curr = self->conversions; curr != NULL; curr = g_list_next (curr)) {
+    IcstrConversion *candidate = curr->data;
+    if (gst_caps_is_equal (candidate->caps, target)) {
+      conv = candidate;
+      break;
+    }
+  }
+
+  if (!conv) {
+    conv = icstr_construct_conversion (self, target, error);
+    if (!conv)
+      return FALSE;
+  }
+
+  if (!gst_element_link_pads (conv->tee, "src_%u", stream->bin, "sink")) {
+    g_set_error (error, ICSTR_ERROR, 0,
+        "Failed to link stream '%s' with its conversion", stream->name);
+    return FALSE;
+  }
+
+  conv->streams = g_list_append (conv->streams, stream);
+  stream->conversion = conv;
+  stream->upstream_tee = conv->tee;
+
+  return TRUE;
+}
+
+/* unlinks the element from the tee that feeds it and releases the pad */
+static void
+icstr_unlink_from_tee (GstElement *element, GstElement *tee)
+{
+  g_autoptr (GstPad) pad = gst_element_get_static_pad (element, "sink");
+  g_autoptr (GstPad) tee_pad = gst_pad_get_peer (pad);
+
+  if (!tee_pad)
+    return;
+
+  gst_pad_unlink (tee_pad, pad);
+  gst_element_release_request_pad (tee, tee_pad);
+}
+
+/* the reverse of icstr_link_stream(); a conversion that no longer feeds
+ * any stream is removed as well */
+void
+icstr_unlink_stream (IceStreamer *self, IcstrStream *stream)
+{
+  IcstrConversion *conv = stream->conversion;
+
+  if (stream->upstream_tee)
+    icstr_unlink_from_tee (stream->bin, stream->upstream_tee);
+  stream->upstream_tee = NULL;
+  stream->conversion = NULL;
+
+  if (!conv)
+    return;
+
+  conv->streams = g_list_remove (conv->streams, stream);
+  if (conv->streams)
+    return;
+
+  GST_INFO ("Removing conversion %s", GST_OBJECT_NAME (conv->bin));
+
+  icstr_unlink_from_tee (conv->bin, self->tee);
+  gst_element_set_state (conv->bin, GST_STATE_NULL);
+  gst_bin_remove (GST_BIN (self->pipeline), conv->bin);
+  self->conversions = g_list_remove (self->conversions, conv);
+  icstr_conversion_free (conv);
+}
+
+void
+icstr_log_conversions (IceStreamer *self)
+{
+  g_autoptr (GString) names = g_string_new (NULL);
+  GList *curr, *scurr;
+
+  for (curr = self->streams; curr != NULL; curr = g_list_next (curr)) {
+    IcstrStream *stream = curr->data;
+    if (!stream->conversion)
+      g_string_append_printf (names, " %s", stream->name);
+  }
+  if (names->len > 0)
+    GST_INFO ("Streams fed directly from the input:%s", names->str);
+
+  for (curr = self->conversions; curr != NULL; curr = g_list_next (curr)) {
+    IcstrConversion *conv = curr->data;
+    g_autofree gchar *caps_str = gst_caps_to_string (conv->caps);
+
+    g_string_truncate (names, 0);
+    for (scurr = conv->streams; scurr != NULL; scurr = g_list_next (scurr)) {
+      IcstrStream *stream = scurr->data;
+      g_string_append_printf (names, " %s", stream->name);
+    }
+
+    GST_INFO ("Conversion %s (%s) feeds:%s", GST_OBJECT_NAME (conv->bin),
+              caps_str, names->str);
+  }
+}
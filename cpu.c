@@ -0,0 +1,270 @@
+/*
+ * IceStreamer - A simple live audio streamer
+ *
+ * Copyright (C) 2017 George Kiagiadakis <gkiagia@tolabaki.gr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "icestreamer.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+ * CPU usage of each stream. The streaming threads are identified by the
+ * STREAM_STATUS messages that they post when they enter and leave their
+ * task, which are handled synchronously, in the thread itself, so that
+ * its id is known. Their CPU time is sampled from /proc every
+ * CPU_SAMPLE_INTERVAL seconds, in the main thread, and added up by the
+ * top-level bin of the pipeline that each of them belongs to: the bin of
+ * a stream, with its destinations, or the input, with the conversions it
+ * feeds. Work done outside of the streaming threads, e.g. sending from
+ * the I/O thread, is not accounted for.
+ */
+
+#define CPU_SAMPLE_INTERVAL 5           /* seconds */
+#define CPU_LOG_INTERVAL 12             /* samples, i.e. a minute */
+
+typedef struct _IcstrCpuThread IcstrCpuThread;
+struct _IcstrCpuThread
+{
+  GstElement *owner;            /* of the task */
+  guint64 ticks;                /* CPU time at the last sample */
+};
+
+struct _IcstrCpu
+{
+  IceStreamer *self;
+
+  /* the threads, by id, protected by lock */
+  GMutex lock;
+  GHashTable *threads;
+
+  /* the last sample, only used from the main thread */
+  GHashTable *usage;            /* top-level element -> gdouble percent */
+  gdouble input;                /* percent */
+  gint64 last_sample;           /* monotonic time */
+  guint sample_source;
+  guint n_samples;
+};
+
+/* the user and system time of a thread of ours, in clock ticks */
+static gboolean
+icstr_cpu_read_ticks (gint tid, guint64 *ticks)
+{
+  g_autofree gchar *path = g_strdup_printf ("/proc/self/task/%d/stat", tid);
+  g_autofree gchar *contents = NULL;
+  guint64 utime, stime;
+  const gchar *fields;
+
+  if (!g_file_get_contents (path, &contents, NULL, NULL))
+    return FALSE;
+
+  /* after the name of the thread, which may contain anything */
+  fields = strrchr (contents, ')');
+  if (!fields || sscanf (fields + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u "
+          "%*u %*u %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT,
+          &utime, &stime) != 2)
+    return FALSE;
+
+  *ticks = utime + stime;
+  return TRUE;
+}
+
+static void
+icstr_cpu_thread_free (IcstrCpuThread *thread)
+{
+  gst_object_unref (thread->owner);
+  g_free (thread);
+}
+
+/* called from the bus sync handler, i.e. from the streaming thread itself */
+void
+icstr_cpu_handle_stream_status (IcstrCpu *cpu, GstMessage *msg)
+{
+  GstStreamStatusType type;
+  GstElement *owner = NULL;
+  IcstrCpuThread *thread;
+  gint tid = syscall (SYS_gettid);
+
+  gst_message_parse_stream_status (msg, &type, &owner);
+
+  if (type == GST_STREAM_STATUS_TYPE_ENTER) {
+    thread = g_new0 (IcstrCpuThread, 1);
+    thread->owner = gst_object_ref (owner);
+
+    /* threads come from a pool, so only what is spent from now on counts */
+    icstr_cpu_read_ticks (tid, &thread->ticks);
+
+    g_mutex_lock (&cpu->lock);
+    g_hash_table_replace (cpu->threads, GINT_TO_POINTER (tid), thread);
+    g_mutex_unlock (&cpu->lock);
+  } else if (type == GST_STREAM_STATUS_TYPE_LEAVE) {
+    g_mutex_lock (&cpu->lock);
+    g_hash_table_remove (cpu->threads, GINT_TO_POINTER (tid));
+    g_mutex_unlock (&cpu->lock);
+  }
+}
+
+/* the child of the pipeline that the element is in, or NULL if it is not
+ * in the pipeline anymore; only used as a key, so no reference is kept */
+static GstObject *
+icstr_cpu_get_top_level (IcstrCpu *cpu, GstElement *element)
+{
+  GstObject *object = gst_object_ref (element);
+  GstObject *parent;
+
+  while ((parent = gst_object_get_parent (object)) != NULL) {
+    if (parent == GST_OBJECT (cpu->self->pipeline)) {
+      gst_object_unref (parent);
+      gst_object_unref (object);
+      return object;
+    }
+    gst_object_unref (object);
+    object = parent;
+  }
+
+  gst_object_unref (object);
+  return NULL;
+}
+
+static gboolean
+icstr_cpu_is_stream (IcstrCpu *cpu, GstObject *object)
+{
+  GList *curr;
+
+  for (curr = cpu->self->streams; curr != NULL; curr = g_list_next (curr)) {
+    IcstrStream *stream = curr->data;
+    if (GST_OBJECT (stream->bin) == object)
+      return TRUE;
+  }
+  return FALSE;
+}
+
+static void
+icstr_cpu_log (IcstrCpu *cpu)
+{
+  g_autoptr (GString) out = g_string_new (NULL);
+  GList *curr;
+
+  g_string_append_printf (out, "input %.1f%%", cpu->input);
+  for (curr = cpu->self->streams; curr != NULL; curr = g_list_next (curr)) {
+    IcstrStream *stream = curr->data;
+    g_string_append_printf (out, ", %s %.1f%%", stream->name,
+                            icstr_cpu_get_stream (cpu, stream));
+  }
+
+  GST_INFO ("CPU usage: %s", out->str);
+}
+
+static gboolean
+icstr_cpu_sample (gpointer data)
+{
+  IcstrCpu *cpu = data;
+  gint64 now = g_get_monotonic_time ();
+  gdouble seconds = (gdouble) (now - cpu->last_sample) / G_TIME_SPAN_SECOND;
+  gdouble ticks_per_second = sysconf (_SC_CLK_TCK);
+  GHashTableIter iter;
+  gpointer key, value;
+
+  cpu->last_sample = now;
+  if (seconds <= 0 || ticks_per_second <= 0)
+    return G_SOURCE_CONTINUE;
+
+  g_hash_table_remove_all (cpu->usage);
+  cpu->input = 0;
+
+  g_mutex_lock (&cpu->lock);
+  g_hash_table_iter_init (&iter, cpu->threads);
+  while (g_hash_table_iter_next (&iter, &key, &value)) {
+    IcstrCpuThread *thread = value;
+    GstObject *top_level;
+    gdouble *usage;
+    guint64 ticks;
+    gdouble percent;
+
+    if (!icstr_cpu_read_ticks (GPOINTER_TO_INT (key), &ticks))
+      continue;
+
+    percent = (ticks - thread->ticks) / ticks_per_second / seconds * 100;
+    thread->ticks = ticks;
+
+    top_level = icstr_cpu_get_top_level (cpu, thread->owner);
+    if (!top_level)
+      continue;
+
+    /* everything that is not a stream works for the input */
+    if (!icstr_cpu_is_stream (cpu, top_level)) {
+      cpu->input += percent;
+      continue;
+    }
+
+    usage = g_hash_table_lookup (cpu->usage, top_level);
+    if (!usage) {
+      usage = g_new0 (gdouble, 1);
+      g_hash_table_insert (cpu->usage, top_level, usage);
+    }
+    *usage += percent;
+  }
+  g_mutex_unlock (&cpu->lock);
+
+  if (++cpu->n_samples % CPU_LOG_INTERVAL == 0)
+    icstr_cpu_log (cpu);
+
+  return G_SOURCE_CONTINUE;
+}
+
+/* in percent of a core, as of the last sample */
+gdouble
+icstr_cpu_get_stream (IcstrCpu *cpu, IcstrStream *stream)
+{
+  gdouble *usage = g_hash_table_lookup (cpu->usage, stream->bin);
+
+  return usage ? *usage : 0;
+}
+
+gdouble
+icstr_cpu_get_input (IcstrCpu *cpu)
+{
+  return cpu->input;
+}
+
+IcstrCpu *
+icstr_cpu_new (IceStreamer *self)
+{
+  IcstrCpu *cpu = g_new0 (IcstrCpu, 1);
+
+  cpu->self = self;
+  g_mutex_init (&cpu->lock);
+  cpu->threads = g_hash_table_new_full (NULL, NULL, NULL,
+      (GDestroyNotify) icstr_cpu_thread_free);
+  cpu->usage = g_hash_table_new_full (NULL, NULL, NULL, g_free);
+
+  cpu->last_sample = g_get_monotonic_time ();
+  cpu->sample_source = g_timeout_add_seconds (CPU_SAMPLE_INTERVAL,
+      icstr_cpu_sample, cpu);
+
+  return cpu;
+}
+
+void
+icstr_cpu_free (IcstrCpu *cpu)
+{
+  g_source_remove (cpu->sample_source);
+  g_hash_table_unref (cpu->threads);
+  g_hash_table_unref (cpu->usage);
+  g_mutex_clear (&cpu->lock);
+  g_free (cpu);
+}
@@ -0,0 +1,365 @@
+/*
+ * IceStreamer - A simple live audio streamer
+ *
+ * Copyright (C) 2017 George Kiagiadakis <gkiagia@tolabaki.gr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "icestreamer.h"
+#include <stdatomic.h>
+
+/*
+ * Input failover. The primary and the backup inputs both run all the time
+ * and feed an input-selector in front of the tee, so that switching between
+ * them is immediate and nothing downstream (encoders, connections) notices.
+ *
+ * The selector switches to the backup when the primary input fails, stops
+ * producing buffers for stall-time, or is silent (see silence.c), and back
+ * once the primary has been fine again for failback-time. A failed input is
+ * stopped and restarted periodically, on its own, until it works again.
+ */
+
+/* milliseconds without buffers before an input is considered stalled */
+#define FAILOVER_STALL_TIME 500
+
+/* seconds the primary input has to be fine before switching back to it */
+#define FAILOVER_FAILBACK_TIME 5
+
+/* seconds between attempts to restart a failed input */
+#define FAILOVER_RESTART_INTERVAL 2
+
+/* seconds an input has to produce its first buffer after (re)starting */
+#define FAILOVER_STARTUP_TIME 2
+
+enum
+{
+  INPUT_PRIMARY,
+  INPUT_BACKUP,
+  N_INPUTS
+};
+
+typedef struct _IcstrFailoverInput IcstrFailoverInput;
+struct _IcstrFailoverInput
+{
+  IcstrFailover *failover;
+  const gchar *name;
+  GstElement *bin;              /* owned by the pipeline */
+  GstPad *pad;                  /* the sink pad of the selector */
+  gulong probe;
+
+  /* updated from the capture thread */
+  atomic_int_fast64_t last_buffer;      /* monotonic time */
+
+  gint64 started;               /* monotonic time */
+  gboolean failed;
+  guint restart_source;
+};
+
+struct _IcstrFailover
+{
+  GstElement *selector;         /* owned by the pipeline */
+  IcstrFailoverInput inputs[N_INPUTS];
+  IcstrMeter *meter;            /* of the primary input, if needed */
+
+  gint64 stall_time;
+  gint64 failback_time;
+  guint restart_interval;
+
+  guint active;
+  guint switches;
+  gboolean silent;              /* the primary input */
+  gint64 fine_since;            /* monotonic time, while on the backup */
+  guint check_source;
+};
+
+static GstPadProbeReturn
+icstr_failover_input_probe (GstPad *pad, GstPadProbeInfo *info, gpointer data)
+{
+  IcstrFailoverInput *input = data;
+
+  if (info->type & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM) {
+    /* a source that fails sends EOS after the error, which would end every
+     * stream; its input just stops producing instead */
+    if (GST_EVENT_TYPE (GST_PAD_PROBE_INFO_EVENT (info)) == GST_EVENT_EOS) {
+      GST_DEBUG ("Dropping EOS from the %s input", input->name);
+      return GST_PAD_PROBE_DROP;
+    }
+    return GST_PAD_PROBE_OK;
+  }
+
+  atomic_store_explicit (&input->last_buffer, g_get_monotonic_time (),
+                         memory_order_relaxed);
+  return GST_PAD_PROBE_OK;
+}
+
+static gboolean
+icstr_failover_input_stalled (IcstrFailoverInput *input, gint64 now)
+{
+  gint64 last = atomic_load_explicit (&input->last_buffer,
+                                      memory_order_relaxed);
+
+  if (input->failed)
+    return TRUE;
+  if (last > input->started)
+    return now - last > input->failover->stall_time;
+  return now - input->started > FAILOVER_STARTUP_TIME * G_TIME_SPAN_SECOND;
+}
+
+/* unlike the above, only true once buffers flow since the last start */
+static gboolean
+icstr_failover_input_producing (IcstrFailoverInput *input, gint64 now)
+{
+  gint64 last = atomic_load_explicit (&input->last_buffer,
+                                      memory_order_relaxed);
+
+  return !input->failed && last > input->started &&
+      now - last <= input->failover->stall_time;
+}
+
+static void
+icstr_failover_switch (IcstrFailover *failover, guint active,
+    const gchar *reason)
+{
+  GST_WARNING ("Switching to the %s input: %s",
+               failover->inputs[active].name, reason);
+
+  g_object_set (failover->selector, "active-pad",
+                failover->inputs[active].pad, NULL);
+  failover->active = active;
+  failover->switches++;
+  failover->fine_since = 0;
+}
+
+static gboolean
+icstr_failover_check (gpointer data)
+{
+  IcstrFailover *failover = data;
+  IcstrFailoverInput *primary = &failover->inputs[INPUT_PRIMARY];
+  IcstrFailoverInput *backup = &failover->inputs[INPUT_BACKUP];
+  gint64 now = g_get_monotonic_time ();
+  const gchar *reason = NULL;
+
+  if (failover->active == INPUT_PRIMARY) {
+    if (primary->failed)
+      reason = "the primary input failed";
+    else if (icstr_failover_input_stalled (primary, now))
+      reason = "no audio from the primary input";
+    else if (failover->silent)
+      reason = "the primary input is silent";
+
+    /* there is no point in switching to a backup that does not work */
+    if (reason && !icstr_failover_input_stalled (backup, now))
+      icstr_failover_switch (failover, INPUT_BACKUP, reason);
+  } else if (icstr_failover_input_producing (primary, now) &&
+      !failover->silent) {
+    if (!failover->fine_since)
+      failover->fine_since = now;
+    else if (now - failover->fine_since >= failover->failback_time)
+      icstr_failover_switch (failover, INPUT_PRIMARY,
+                             "the primary input recovered");
+  } else {
+    failover->fine_since = 0;
+  }
+
+  return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+icstr_failover_restart (gpointer data)
+{
+  IcstrFailoverInput *input = data;
+
+  GST_INFO ("Restarting the %s input", input->name);
+
+  input->started = g_get_monotonic_time ();
+  if (!gst_element_sync_state_with_parent (input->bin)) {
+    GST_WARNING ("Failed to restart the %s input, retrying in %u seconds",
+                 input->name, input->failover->restart_interval);
+    gst_element_set_state (input->bin, GST_STATE_NULL);
+    return G_SOURCE_CONTINUE;
+  }
+
+  input->failed = FALSE;
+  input->restart_source = 0;
+  return G_SOURCE_REMOVE;
+}
+
+static void
+icstr_failover_init_input (IcstrFailover *failover, guint index,
+    const gchar *name, GstElement *bin)
+{
+  IcstrFailoverInput *input = &failover->inputs[index];
+
+  input->failover = failover;
+  input->name = name;
+  input->bin = bin;
+  input->pad = gst_element_get_request_pad (failover->selector, "sink_%u");
+  input->started = g_get_monotonic_time ();
+  atomic_init (&input->last_buffer, 0);
+  input->probe = gst_pad_add_probe (input->pad,
+      GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST |
+      GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+      icstr_failover_input_probe, input, NULL);
+}
+
+/* adds the backup input and the selector to the pipeline and links both
+ * inputs through it to the tee; the primary input is already there */
+IcstrFailover *
+icstr_failover_new (IceStreamer *self, GKeyFile *keyfile,
+    GstElement *primary, GstElement *backup, GError **error)
+{
+  g_autoptr (GstPad) primary_pad = NULL;
+  g_autoptr (GstPad) backup_pad = NULL;
+  IcstrFailover *failover;
+  gint stall_time, failback_time, restart_interval;
+
+  stall_time = icstr_keyfile_get_integer_with_fallback (keyfile,
+      "input.backup", "stall-time", FAILOVER_STALL_TIME);
+  failback_time = icstr_keyfile_get_integer_with_fallback (keyfile,
+      "input.backup", "failback-time", FAILOVER_FAILBACK_TIME);
+  restart_interval = icstr_keyfile_get_integer_with_fallback (keyfile,
+      "input.backup", "restart-interval", FAILOVER_RESTART_INTERVAL);
+
+  failover = g_new0 (IcstrFailover, 1);
+  failover->stall_time = MAX (stall_time, 10) * G_TIME_SPAN_MILLISECOND;
+  failover->failback_time = MAX (failback_time, 0) * G_TIME_SPAN_SECOND;
+  failover->restart_interval = MAX (restart_interval, 1);
+
+  failover->selector = gst_element_factory_make ("input-selector", NULL);
+  gst_bin_add_many (GST_BIN (self->pipeline), backup, failover->selector,
+                    NULL);
+
+  icstr_failover_init_input (failover, INPUT_PRIMARY, "primary", primary);
+  icstr_failover_init_input (failover, INPUT_BACKUP, "backup", backup);
+  g_object_set (failover->selector, "active-pad",
+                failover->inputs[INPUT_PRIMARY].pad, NULL);
+
+  primary_pad = gst_element_get_static_pad (primary, "src");
+  backup_pad = gst_element_get_static_pad (backup, "src");
+  if (gst_pad_link (primary_pad, failover->inputs[INPUT_PRIMARY].pad) !=
+          GST_PAD_LINK_OK ||
+      gst_pad_link (backup_pad, failover->inputs[INPUT_BACKUP].pad) !=
+          GST_PAD_LINK_OK ||
+      !gst_element_link (failover->selector, self->tee)) {
+    g_set_error (error, ICSTR_ERROR, 0,
+        "Failed to link the inputs with the input selector");
+    icstr_failover_free (failover);
+    return NULL;
+  }
+
+  /* a few checks per stall time, so that a stall is noticed in time */
+  failover->check_source = g_timeout_add (MAX (stall_time / 4, 10),
+      icstr_failover_check, failover);
+
+  return failover;
+}
+
+void
+icstr_failover_free (IcstrFailover *failover)
+{
+  guint i;
+
+  if (failover->check_source)
+    g_source_remove (failover->check_source);
+  g_clear_pointer (&failover->meter, icstr_meter_free);
+
+  for (i = 0; i < N_INPUTS; i++) {
+    IcstrFailoverInput *input = &failover->inputs[i];
+
+    if (input->restart_source)
+      g_source_remove (input->restart_source);
+    gst_pad_remove_probe (input->pad, input->probe);
+    gst_object_unref (input->pad);
+  }
+
+  g_free (failover);
+}
+
+/* called with the errors of the pipeline; returns TRUE if the error comes
+ * from one of the inputs, which is then stopped and restarted later on */
+gboolean
+icstr_failover_handle_error (IcstrFailover *failover, GstObject *src,
+    const GError *error)
+{
+  IcstrFailoverInput *input = NULL;
+  guint i, other;
+
+  for (i = 0; i < N_INPUTS && !input; i++) {
+    if (gst_object_has_as_ancestor (src, GST_OBJECT (failover->inputs[i].bin)))
+      input = &failover->inputs[i];
+  }
+
+  if (!input)
+    return FALSE;
+
+  /* a failure is usually reported by more than one element */
+  if (input->failed)
+    return TRUE;
+
+  GST_WARNING ("The %s input failed: %s", input->name, error->message);
+  input->failed = TRUE;
+
+  other = (failover->active == INPUT_PRIMARY) ? INPUT_BACKUP : INPUT_PRIMARY;
+  if (input == &failover->inputs[failover->active] &&
+      !failover->inputs[other].failed) {
+    icstr_failover_switch (failover, other, other == INPUT_BACKUP ?
+        "the primary input failed" : "the backup input failed");
+  }
+
+  gst_element_set_state (input->bin, GST_STATE_NULL);
+  input->restart_source = g_timeout_add_seconds (
+      failover->restart_interval, icstr_failover_restart, input);
+
+  return TRUE;
+}
+
+/* called by the silence detector, when it watches the primary input */
+void
+icstr_failover_set_silent (IcstrFailover *failover, gboolean silent)
+{
+  failover->silent = silent;
+  icstr_failover_check (failover);
+}
+
+/* a meter of the primary input itself, which keeps running while the
+ * backup is on air; to be used before the pipeline starts */
+IcstrMeter *
+icstr_failover_get_primary_meter (IcstrFailover *failover)
+{
+  if (!failover->meter)
+    failover->meter = icstr_meter_new (failover->inputs[INPUT_PRIMARY].pad);
+  return failover->meter;
+}
+
+/* switches on request, e.g. for a drill; the usual checks still apply
+ * afterwards, so the primary input comes back once it has been fine for
+ * failback-time */
+void
+icstr_failover_force (IcstrFailover *failover, gboolean backup)
+{
+  guint active = backup ? INPUT_BACKUP : INPUT_PRIMARY;
+
+  if (failover->active != active)
+    icstr_failover_switch (failover, active, "requested");
+}
+
+/* returns whether the backup input is on air, and the number of switches
+ * between the inputs so far */
+gboolean
+icstr_failover_get_state (IcstrFailover *failover, guint *switches)
+{
+  if (switches)
+    *switches = failover->switches;
+  return failover->active == INPUT_BACKUP;
+}
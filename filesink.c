@@ -0,0 +1,600 @@
+/*
+ * IceStreamer - A simple live audio streamer
+ *
+ * Copyright (C) 2017 George Kiagiadakis <gkiagia@tolabaki.gr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "icestreamer.h"
+#include <gst/base/gstbasesink.h>
+#include <glib/gstdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * A sink that archives the stream into files that start anew every
+ * segment-time seconds, aligned to the clock, e.g. on the hour. Each file
+ * starts with the stream headers and at a buffer that does not depend on
+ * the previous ones, i.e. on a page of the container, so that it can be
+ * played on its own. The name of each file is the location, formatted
+ * with strftime() at the time it starts.
+ *
+ * The streaming thread only copies the buffers into large page-aligned
+ * chunks and hands them to a thread of its own, which writes them and
+ * syncs the file to disk every sync-interval seconds. If the disk does not
+ * keep up with max-pending bytes, chunks are dropped rather than holding
+ * back the stream, and if writing fails an error is posted, so that the
+ * destination is restarted like any other.
+ */
+
+#define ICSTR_TYPE_FILE_SINK (icstr_file_sink_get_type ())
+#define ICSTR_FILE_SINK(obj) \
+  (G_TYPE_CHECK_INSTANCE_CAST ((obj), ICSTR_TYPE_FILE_SINK, IcstrFileSink))
+
+#define DEFAULT_LOCATION "%Y%m%d-%H%M%S"
+#define DEFAULT_SEGMENT_TIME 3600       /* seconds */
+#define DEFAULT_SYNC_INTERVAL 10        /* seconds */
+#define DEFAULT_CHUNK_SIZE (1024 * 1024)
+#define DEFAULT_MAX_PENDING (64 * 1024 * 1024)
+
+/* seconds that data may wait in a chunk that is not full */
+#define FLUSH_INTERVAL 1
+
+#define CHUNK_ALIGNMENT 4096
+
+enum
+{
+  PROP_0,
+  PROP_LOCATION,
+  PROP_SEGMENT_TIME,
+  PROP_SYNC_INTERVAL,
+  PROP_CHUNK_SIZE,
+  PROP_MAX_PENDING,
+};
+
+typedef struct _IcstrFileChunk IcstrFileChunk;
+typedef struct _IcstrFileSink IcstrFileSink;
+typedef struct _IcstrFileSinkClass IcstrFileSinkClass;
+
+struct _IcstrFileChunk
+{
+  gchar *filename;              /* starts a new file, if set */
+  gboolean last;                /* ends the writer */
+  guint8 *data;                 /* CHUNK_ALIGNMENT aligned */
+  gsize size;
+  gsize capacity;
+};
+
+struct _IcstrFileSink
+{
+  GstBaseSink parent;
+
+  /* properties, protected by the object lock */
+  gchar *location;
+  guint segment_time;           /* seconds, 0 for a single file */
+  guint sync_interval;          /* seconds */
+  guint chunk_size;             /* bytes */
+  guint max_pending;            /* bytes */
+
+  /* also protected by the object lock */
+  GBytes *headers;              /* from the caps, NULL if none */
+
+  /* only used from the streaming thread, start() & stop() */
+  IcstrFileChunk *chunk;        /* being filled, NULL if none */
+  gint64 chunk_since;           /* monotonic time */
+  gint64 next_segment;          /* real time, 0 before the first file */
+  gboolean dropping;
+
+  /* the writer */
+  GThread *thread;
+  GAsyncQueue *queue;
+  atomic_size_t pending_bytes;
+  atomic_bool failed;
+};
+
+struct _IcstrFileSinkClass
+{
+  GstBaseSinkClass parent_class;
+};
+
+static GType icstr_file_sink_get_type (void);
+
+G_DEFINE_TYPE (IcstrFileSink, icstr_file_sink, GST_TYPE_BASE_SINK);
+
+static GstStaticPadTemplate sink_template = GST_STATIC_PAD_TEMPLATE ("sink",
+    GST_PAD_SINK,
+    GST_PAD_ALWAYS,
+    GST_STATIC_CAPS_ANY);
+
+static IcstrFileChunk *
+icstr_file_chunk_new (gsize capacity)
+{
+  IcstrFileChunk *chunk = g_new0 (IcstrFileChunk, 1);
+
+  if (capacity > 0 &&
+      posix_memalign ((void **) &chunk->data, CHUNK_ALIGNMENT, capacity) != 0)
+    g_error ("Failed to allocate %" G_GSIZE_FORMAT " bytes", capacity);
+  chunk->capacity = capacity;
+
+  return chunk;
+}
+
+static void
+icstr_file_chunk_free (IcstrFileChunk *chunk)
+{
+  g_free (chunk->filename);
+  free (chunk->data);
+  g_free (chunk);
+}
+
+/* the writer thread */
+
+static void
+icstr_file_sink_fail (IcstrFileSink *sink, const gchar *filename,
+    const gchar *what, gint err)
+{
+  /* reported once, until the destination is restarted */
+  if (atomic_exchange (&sink->failed, TRUE))
+    return;
+
+  GST_ELEMENT_ERROR (sink, RESOURCE, WRITE,
+      ("Failed to archive the stream"),
+      ("%s %s: %s", what, filename, g_strerror (err)));
+}
+
+static gboolean
+icstr_file_sink_write_all (gint fd, const guint8 *data, gsize size)
+{
+  while (size > 0) {
+    gssize written = write (fd, data, size);
+
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return FALSE;
+    }
+    data += written;
+    size -= written;
+  }
+
+  return TRUE;
+}
+
+static gpointer
+icstr_file_sink_writer (gpointer data)
+{
+  IcstrFileSink *sink = data;
+  g_autofree gchar *filename = NULL;
+  gint64 sync_interval, last_sync = 0;
+  gboolean dirty = FALSE;
+  gint fd = -1;
+
+  GST_OBJECT_LOCK (sink);
+  sync_interval = MAX (sink->sync_interval, 1) * G_TIME_SPAN_SECOND;
+  GST_OBJECT_UNLOCK (sink);
+
+  for (;;) {
+    IcstrFileChunk *chunk = g_async_queue_timeout_pop (sink->queue,
+                                                       sync_interval);
+    gint64 now = g_get_monotonic_time ();
+
+    if (chunk && (chunk->filename || chunk->last) && fd >= 0) {
+      if (dirty)
+        fdatasync (fd);
+      close (fd);
+      fd = -1;
+      dirty = FALSE;
+    }
+
+    if (chunk && chunk->last) {
+      icstr_file_chunk_free (chunk);
+      break;
+    }
+
+    if (chunk && chunk->filename) {
+      g_autofree gchar *dir = g_path_get_dirname (chunk->filename);
+
+      g_free (filename);
+      filename = g_strdup (chunk->filename);
+      GST_INFO_OBJECT (sink, "Archiving into %s", filename);
+
+      g_mkdir_with_parents (dir, 0755);
+      fd = g_open (filename, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+      if (fd < 0)
+        icstr_file_sink_fail (sink, filename, "Failed to open", errno);
+      last_sync = now;
+    }
+
+    if (chunk && chunk->size > 0 && fd >= 0) {
+      if (icstr_file_sink_write_all (fd, chunk->data, chunk->size)) {
+        dirty = TRUE;
+      } else {
+        icstr_file_sink_fail (sink, filename, "Failed to write", errno);
+        close (fd);
+        fd = -1;
+        dirty = FALSE;
+      }
+    }
+
+    if (chunk) {
+      atomic_fetch_sub (&sink->pending_bytes, chunk->size);
+      icstr_file_chunk_free (chunk);
+    }
+
+    /* batched, rather than after every write */
+    if (dirty && now - last_sync >= sync_interval) {
+      fdatasync (fd);
+      dirty = FALSE;
+      last_sync = now;
+    }
+  }
+
+  return NULL;
+}
+
+/* the streaming thread */
+
+static void
+icstr_file_sink_push (IcstrFileSink *sink, IcstrFileChunk *chunk)
+{
+  guint max_pending;
+
+  GST_OBJECT_LOCK (sink);
+  max_pending = sink->max_pending;
+  GST_OBJECT_UNLOCK (sink);
+
+  /* the disk is not keeping up; new files are always started, though */
+  if (!chunk->filename && chunk->size > 0 &&
+      atomic_load (&sink->pending_bytes) + chunk->size > max_pending) {
+    if (!sink->dropping)
+      GST_WARNING_OBJECT (sink, "The disk is not keeping up, dropping data");
+    sink->dropping = TRUE;
+    icstr_file_chunk_free (chunk);
+    return;
+  }
+
+  sink->dropping = FALSE;
+  atomic_fetch_add (&sink->pending_bytes, chunk->size);
+  g_async_queue_push (sink->queue, chunk);
+}
+
+static void
+icstr_file_sink_flush (IcstrFileSink *sink)
+{
+  if (sink->chunk && sink->chunk->size > 0)
+    icstr_file_sink_push (sink, g_steal_pointer (&sink->chunk));
+}
+
+static void
+icstr_file_sink_append (IcstrFileSink *sink, const guint8 *data, gsize size)
+{
+  guint chunk_size;
+
+  GST_OBJECT_LOCK (sink);
+  chunk_size = sink->chunk_size;
+  GST_OBJECT_UNLOCK (sink);
+
+  while (size > 0) {
+    gsize n;
+
+    if (!sink->chunk) {
+      sink->chunk = icstr_file_chunk_new (chunk_size);
+      sink->chunk_since = g_get_monotonic_time ();
+    }
+
+    n = MIN (size, sink->chunk->capacity - sink->chunk->size);
+    memcpy (sink->chunk->data + sink->chunk->size, data, n);
+    sink->chunk->size += n;
+    data += n;
+    size -= n;
+
+    if (sink->chunk->size == sink->chunk->capacity)
+      icstr_file_sink_flush (sink);
+  }
+}
+
+static void
+icstr_file_sink_start_segment (IcstrFileSink *sink, gint64 now)
+{
+  g_autoptr (GDateTime) time = g_date_time_new_from_unix_local (
+      now / G_USEC_PER_SEC);
+  g_autoptr (GBytes) headers = NULL;
+  g_autofree gchar *location = NULL;
+  IcstrFileChunk *chunk;
+  gint64 segment;
+  gsize size = 0;
+
+  GST_OBJECT_LOCK (sink);
+  location = g_strdup (sink->location);
+  segment = (gint64) sink->segment_time * G_USEC_PER_SEC;
+  headers = sink->headers ? g_bytes_ref (sink->headers) : NULL;
+  GST_OBJECT_UNLOCK (sink);
+
+  /* the rest of the previous file goes first */
+  icstr_file_sink_flush (sink);
+
+  chunk = icstr_file_chunk_new (headers ? g_bytes_get_size (headers) : 0);
+  chunk->filename = g_date_time_format (time, location);
+  if (!chunk->filename)
+    chunk->filename = g_strdup (location);
+  if (headers) {
+    memcpy (chunk->data, g_bytes_get_data (headers, &size), size);
+    chunk->size = size;
+  }
+  icstr_file_sink_push (sink, chunk);
+
+  sink->next_segment = segment > 0 ? (now / segment + 1) * segment :
+      G_MAXINT64;
+}
+
+static GstFlowReturn
+icstr_file_sink_render (GstBaseSink *bsink, GstBuffer *buffer)
+{
+  IcstrFileSink *sink = ICSTR_FILE_SINK (bsink);
+  gint64 now = g_get_real_time ();
+  gboolean caps_headers;
+  GstMapInfo map;
+
+  /* until the destination is restarted */
+  if (atomic_load (&sink->failed))
+    return GST_FLOW_OK;
+
+  /* each file starts with the headers from the caps instead */
+  GST_OBJECT_LOCK (sink);
+  caps_headers = sink->headers != NULL;
+  GST_OBJECT_UNLOCK (sink);
+  if (caps_headers && GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_HEADER))
+    return GST_FLOW_OK;
+
+  if (!sink->next_segment || (now >= sink->next_segment &&
+          !GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT)))
+    icstr_file_sink_start_segment (sink, now);
+
+  if (!gst_buffer_map (buffer, &map, GST_MAP_READ))
+    return GST_FLOW_OK;
+  icstr_file_sink_append (sink, map.data, map.size);
+  gst_buffer_unmap (buffer, &map);
+
+  if (sink->chunk &&
+      g_get_monotonic_time () - sink->chunk_since >
+      FLUSH_INTERVAL * G_TIME_SPAN_SECOND)
+    icstr_file_sink_flush (sink);
+
+  return GST_FLOW_OK;
+}
+
+static gboolean
+icstr_file_sink_set_caps (GstBaseSink *bsink, GstCaps *caps)
+{
+  IcstrFileSink *sink = ICSTR_FILE_SINK (bsink);
+  GstStructure *s = gst_caps_get_structure (caps, 0);
+  g_autoptr (GByteArray) headers = NULL;
+  const GValue *streamheader = NULL;
+  guint i;
+
+  streamheader = gst_structure_get_value (s, "streamheader");
+  if (streamheader && GST_VALUE_HOLDS_ARRAY (streamheader)) {
+    headers = g_byte_array_new ();
+    for (i = 0; i < gst_value_array_get_size (streamheader); i++) {
+      GstBuffer *buf = gst_value_get_buffer (
+          gst_value_array_get_value (streamheader, i));
+      GstMapInfo map;
+
+      if (gst_buffer_map (buf, &map, GST_MAP_READ)) {
+        g_byte_array_append (headers, map.data, map.size);
+        gst_buffer_unmap (buf, &map);
+      }
+    }
+  }
+
+  GST_OBJECT_LOCK (sink);
+  g_clear_pointer (&sink->headers, g_bytes_unref);
+  if (headers)
+    sink->headers = g_byte_array_free_to_bytes (g_steal_pointer (&headers));
+  GST_OBJECT_UNLOCK (sink);
+
+  return TRUE;
+}
+
+static gboolean
+icstr_file_sink_start (GstBaseSink *bsink)
+{
+  IcstrFileSink *sink = ICSTR_FILE_SINK (bsink);
+  g_autoptr (GError) error = NULL;
+
+  sink->next_segment = 0;
+  sink->dropping = FALSE;
+  atomic_store (&sink->pending_bytes, 0);
+  atomic_store (&sink->failed, FALSE);
+
+  sink->queue = g_async_queue_new_full (
+      (GDestroyNotify) icstr_file_chunk_free);
+  sink->thread = g_thread_try_new ("icstr-archive", icstr_file_sink_writer,
+                                   sink, &error);
+  if (!sink->thread) {
+    GST_ELEMENT_ERROR (sink, RESOURCE, FAILED,
+        ("Failed to start the archive writer"), ("%s", error->message));
+    g_clear_pointer (&sink->queue, g_async_queue_unref);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static gboolean
+icstr_file_sink_stop (GstBaseSink *bsink)
+{
+  IcstrFileSink *sink = ICSTR_FILE_SINK (bsink);
+  IcstrFileChunk *last;
+
+  if (!sink->thread)
+    return TRUE;
+
+  /* whatever is left, then close the file */
+  icstr_file_sink_flush (sink);
+  g_clear_pointer (&sink->chunk, icstr_file_chunk_free);
+
+  last = icstr_file_chunk_new (0);
+  last->last = TRUE;
+  g_async_queue_push (sink->queue, last);
+
+  g_thread_join (sink->thread);
+  sink->thread = NULL;
+  g_clear_pointer (&sink->queue, g_async_queue_unref);
+
+  return TRUE;
+}
+
+/* GObject */
+
+static void
+icstr_file_sink_set_property (GObject *object, guint prop_id,
+    const GValue *value, GParamSpec *pspec)
+{
+  IcstrFileSink *sink = ICSTR_FILE_SINK (object);
+
+  GST_OBJECT_LOCK (sink);
+  switch (prop_id) {
+    case PROP_LOCATION:
+      g_free (sink->location);
+      sink->location = g_value_dup_string (value);
+      break;
+    case PROP_SEGMENT_TIME:
+      sink->segment_time = g_value_get_uint (value);
+      break;
+    case PROP_SYNC_INTERVAL:
+      sink->sync_interval = g_value_get_uint (value);
+      break;
+    case PROP_CHUNK_SIZE:
+      sink->chunk_size = g_value_get_uint (value);
+      break;
+    case PROP_MAX_PENDING:
+      sink->max_pending = g_value_get_uint (value);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+  GST_OBJECT_UNLOCK (sink);
+}
+
+static void
+icstr_file_sink_get_property (GObject *object, guint prop_id,
+    GValue *value, GParamSpec *pspec)
+{
+  IcstrFileSink *sink = ICSTR_FILE_SINK (object);
+
+  GST_OBJECT_LOCK (sink);
+  switch (prop_id) {
+    case PROP_LOCATION:
+      g_value_set_string (value, sink->location);
+      break;
+    case PROP_SEGMENT_TIME:
+      g_value_set_uint (value, sink->segment_time);
+      break;
+    case PROP_SYNC_INTERVAL:
+      g_value_set_uint (value, sink->sync_interval);
+      break;
+    case PROP_CHUNK_SIZE:
+      g_value_set_uint (value, sink->chunk_size);
+      break;
+    case PROP_MAX_PENDING:
+      g_value_set_uint (value, sink->max_pending);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+  GST_OBJECT_UNLOCK (sink);
+}
+
+static void
+icstr_file_sink_finalize (GObject *object)
+{
+  IcstrFileSink *sink = ICSTR_FILE_SINK (object);
+
+  g_free (sink->location);
+  g_clear_pointer (&sink->headers, g_bytes_unref);
+
+  G_OBJECT_CLASS (icstr_file_sink_parent_class)->finalize (object);
+}
+
+static void
+icstr_file_sink_init (IcstrFileSink *sink)
+{
+  sink->location = g_strdup (DEFAULT_LOCATION);
+  sink->segment_time = DEFAULT_SEGMENT_TIME;
+  sink->sync_interval = DEFAULT_SYNC_INTERVAL;
+  sink->chunk_size = DEFAULT_CHUNK_SIZE;
+  sink->max_pending = DEFAULT_MAX_PENDING;
+
+  /* written as soon as it arrives */
+  gst_base_sink_set_sync (GST_BASE_SINK (sink), FALSE);
+}
+
+static void
+icstr_file_sink_class_init (IcstrFileSinkClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+  GstElementClass *element_class = GST_ELEMENT_CLASS (klass);
+  GstBaseSinkClass *basesink_class = GST_BASE_SINK_CLASS (klass);
+  const GParamFlags flags = G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS;
+
+  gobject_class->set_property = icstr_file_sink_set_property;
+  gobject_class->get_property = icstr_file_sink_get_property;
+  gobject_class->finalize = icstr_file_sink_finalize;
+
+  g_object_class_install_property (gobject_class, PROP_LOCATION,
+      g_param_spec_string ("location", "location",
+          "Path of the files, formatted with strftime() when each starts",
+          DEFAULT_LOCATION, flags));
+  g_object_class_install_property (gobject_class, PROP_SEGMENT_TIME,
+      g_param_spec_uint ("segment-time", "segment-time",
+          "Seconds after which a new file is started (0 = never)",
+          0, G_MAXUINT, DEFAULT_SEGMENT_TIME, flags));
+  g_object_class_install_property (gobject_class, PROP_SYNC_INTERVAL,
+      g_param_spec_uint ("sync-interval", "sync-interval",
+          "Seconds between syncs of the file to the disk",
+          1, G_MAXUINT, DEFAULT_SYNC_INTERVAL, flags));
+  g_object_class_install_property (gobject_class, PROP_CHUNK_SIZE,
+      g_param_spec_uint ("chunk-size", "chunk-size",
+          "Bytes written to the disk at once",
+          CHUNK_ALIGNMENT, G_MAXUINT, DEFAULT_CHUNK_SIZE, flags));
+  g_object_class_install_property (gobject_class, PROP_MAX_PENDING,
+      g_param_spec_uint ("max-pending", "max-pending",
+          "Bytes waiting for the disk before data is dropped",
+          0, G_MAXUINT, DEFAULT_MAX_PENDING, flags));
+
+  gst_element_class_add_static_pad_template (element_class, &sink_template);
+  gst_element_class_set_static_metadata (element_class,
+      "Stream archiver", "Sink/File",
+      "Archives the stream into files of a fixed duration",
+      "George Kiagiadakis <gkiagia@tolabaki.gr>");
+
+  basesink_class->start = GST_DEBUG_FUNCPTR (icstr_file_sink_start);
+  basesink_class->stop = GST_DEBUG_FUNCPTR (icstr_file_sink_stop);
+  basesink_class->set_caps = GST_DEBUG_FUNCPTR (icstr_file_sink_set_caps);
+  basesink_class->render = GST_DEBUG_FUNCPTR (icstr_file_sink_render);
+}
+
+gboolean
+icstr_file_sink_register (void)
+{
+  return gst_element_register (NULL, "icstrfilesink", GST_RANK_NONE,
+                               ICSTR_TYPE_FILE_SINK);
+}
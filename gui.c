@@ -32,7 +32,10 @@ const char css_style[] = ".time_label {"\
 
 struct status_widget_map {
 	GtkWidget *stream_box;
+	GtkWidget *cpu_label;
 	GstElement *shout2send;
+	IcstrCpu *cpu;
+	IcstrStream *stream;
 };
 
 static void
@@ -46,6 +49,9 @@ void
 icstr_gui_destroy (IceStreamer *self)
 {
 	struct icsr_gui *gui = &self->gui;
+	if (gui->meter_source)
+		g_source_remove (gui->meter_source);
+	gui->meter_source = 0;
 	if (gui->window)
 		gtk_widget_destroy(GTK_WIDGET(gui->window));
 }
@@ -180,6 +186,12 @@ icstr_gui_update_stream_status(gpointer data)
 	GtkWidget *status_widget = NULL;
 	GtkWidget *new_status_widget = NULL;
 	g_autoptr (GList) children = NULL;
+	g_autofree gchar *cpu_str = NULL;
+
+	/* shared by all the destinations of the stream */
+	cpu_str = g_strdup_printf ("CPU %.1f%%",
+				   icstr_cpu_get_stream (wmap->cpu, wmap->stream));
+	gtk_label_set_text (GTK_LABEL(wmap->cpu_label), cpu_str);
 
 	children = gtk_container_get_children (GTK_CONTAINER(wmap->stream_box));
 	if (!children)
@@ -233,19 +245,18 @@ icstr_gui_realize_streambox(GtkWidget *stream_box, gpointer data)
 }
 
 static void
-icstr_gui_add_stream(IceStreamer *self, GstElement *stream_bin)
+icstr_gui_add_stream(IceStreamer *self, IcstrStream *stream,
+		     IcstrDestination *dest)
 {
 	struct icsr_gui *gui = &self->gui;
 	GtkWidget* separator = NULL;
 	GtkWidget* stream_box = NULL;
 	GtkWidget* status_widget = NULL;
 	GtkWidget* stream_label = NULL;
+	GtkWidget* cpu_label = NULL;
 	GtkWidget* stream_info_button = NULL;
 	GtkWidget* info_button_image = NULL;
-	g_autofree gchar *bin_name = NULL;
-	gchar **bin_name_parts = NULL;
-	gchar shout2send_name[32] = {0};
-	GstElement* shout2send = NULL;
+	GstElement* shout2send = dest->sink;
 	const gchar *stream_name_str = NULL;
 	struct status_widget_map *wmap = NULL;
 
@@ -267,14 +278,6 @@ icstr_gui_add_stream(IceStreamer *self, GstElement *stream_bin)
 	gtk_box_pack_start (GTK_BOX(stream_box), status_widget, FALSE, FALSE, 3);
 	gtk_spinner_start (GTK_SPINNER(status_widget));
 
-	bin_name = gst_object_get_name(GST_OBJECT(stream_bin));
-	bin_name_parts = g_strsplit (bin_name,"-", 2);
-	g_snprintf (shout2send_name, 32, "shout2send-%s", bin_name_parts[1]);
-
-	shout2send = gst_bin_get_by_name (GST_BIN(stream_bin), shout2send_name);
-	if (!shout2send)
-		goto fail;
-
 	g_object_get (G_OBJECT(shout2send), "streamname", &stream_name_str, NULL);
 	if (!stream_name_str)
 		goto fail;
@@ -285,6 +288,12 @@ icstr_gui_add_stream(IceStreamer *self, GstElement *stream_bin)
 		goto fail;
 	gtk_box_pack_start (GTK_BOX(stream_box), stream_label, TRUE, TRUE, 3);
 
+	/* Label to hold the CPU usage of the stream */
+	cpu_label = gtk_label_new("CPU -");
+	if (!cpu_label)
+		goto fail;
+	gtk_box_pack_start (GTK_BOX(stream_box), cpu_label, FALSE, FALSE, 3);
+
 	stream_info_button = gtk_toggle_button_new ();
 	if (!stream_info_button)
 		goto fail;
@@ -303,7 +312,10 @@ icstr_gui_add_stream(IceStreamer *self, GstElement *stream_bin)
 		goto fail;
 
 	wmap->stream_box = stream_box;
+	wmap->cpu_label = cpu_label;
 	wmap->shout2send = shout2send;
+	wmap->cpu = self->cpu;
+	wmap->stream = stream;
 	g_signal_connect(stream_box, "delete-event", G_CALLBACK(g_free), wmap);
 	g_signal_connect(stream_box, "realize", G_CALLBACK(icstr_gui_realize_streambox), gui);
 	gtk_box_pack_start (GTK_BOX(gui->streams_box), stream_box, TRUE, FALSE, 3);
@@ -322,15 +334,19 @@ static void
 icstr_gui_add_streams(IceStreamer *self)
 {
 	GList *curr = NULL;
-	GstElement *stream_bin = NULL;
+	GList *dcurr = NULL;
+	IcstrStream *stream = NULL;
 
+	/* one line per destination, they all connect independently */
 	for (curr = self->streams; curr != NULL; curr = g_list_next (curr)) {
-		stream_bin = curr->data;
-		icstr_gui_add_stream(self, stream_bin);
+		stream = curr->data;
+		for (dcurr = stream->destinations; dcurr != NULL;
+		     dcurr = g_list_next (dcurr))
+			icstr_gui_add_stream(self, stream, dcurr->data);
 	}
 }
 
-void
+static void
 icstr_gui_update_time_label(IceStreamer *self, GstClockTime tstamp)
 {
 	struct icsr_gui *gui = &self->gui;
@@ -342,7 +358,7 @@ icstr_gui_update_time_label(IceStreamer *self, GstClockTime tstamp)
 	gtk_label_set_markup (GTK_LABEL(gui->time_label), tl_markup);
 }
 
-void
+static void
 icstr_gui_update_levels(IceStreamer *self, double rms_l, double rms_r)
 {
 	struct icsr_gui *gui = &self->gui;
@@ -358,6 +374,29 @@ icstr_gui_update_levels(IceStreamer *self, double rms_l, double rms_r)
                          rms_r_normalized);
 }
 
+static gboolean
+icstr_gui_update_meter(gpointer data)
+{
+	IceStreamer *self = data;
+	gdouble rms[2] = {ICSTR_METER_FLOOR, ICSTR_METER_FLOOR};
+	GstClockTime running_time;
+	guint channels;
+
+	running_time = icstr_meter_get_running_time (self->meter);
+	if (GST_CLOCK_TIME_IS_VALID (running_time))
+		icstr_gui_update_time_label(self, running_time);
+
+	/* Mono is shown on both bars, and only the first two channels
+	 * of anything wider */
+	channels = icstr_meter_get_levels (self->meter, rms, NULL, 2);
+	if (channels == 1)
+		rms[1] = rms[0];
+	if (channels > 0)
+		icstr_gui_update_levels(self, rms[0], rms[1]);
+
+	return G_SOURCE_CONTINUE;
+}
+
 static void
 icstr_gui_realize_sourcestats(GtkWidget *source_frame, gpointer data)
 {
@@ -490,6 +529,9 @@ icstr_init_gui (IceStreamer *self)
 
 	icstr_gui_add_streams(self);
 
+	/* Poll the levels of the input */
+	gui->meter_source = g_timeout_add (85, icstr_gui_update_meter, self);
+
 	/* Add signal handler for setting window geometry after all inner
 	 * widgets have been realized. I used state-flags-changed because
 	 * it does the trick and doesn't get triggered all the time. We want
@@ -0,0 +1,855 @@
+/*
+ * IceStreamer - A simple live audio streamer
+ *
+ * Copyright (C) 2017 George Kiagiadakis <gkiagia@tolabaki.gr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "icestreamer.h"
+#include <gst/base/gstbasesink.h>
+#include <glib/gstdio.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <string.h>
+
+/*
+ * A sink that publishes the stream as HLS, in a directory that any static
+ * web server can serve. The stream is cut into segments of segment-time
+ * seconds, at frame boundaries, either in MPEG-TS, as muxed by mpegtsmux,
+ * e.g. AAC, or in the packed audio format of HLS, i.e. the MP3 frames
+ * themselves, preceded by an ID3 tag with the timestamp of their first
+ * sample. Each MPEG-TS segment starts with the last PAT and PMT seen, so
+ * that it can be played on its own.
+ *
+ * The target duration is fixed for the whole run, a second more than
+ * segment-time, so that cutting at a frame boundary never makes a
+ * segment longer than it.
+ *
+ * The streaming thread only collects the frames of the current segment.
+ * Finished segments are handed to a thread of their own, which writes
+ * them, then replaces the playlist, both through a temporary file and a
+ * rename, so that the web server never serves a partial file. Segments
+ * that have left the playlist are kept for as long again, for clients
+ * that are behind, and then deleted.
+ *
+ * A restarted sink carries on with the playlist of the previous run: its
+ * segments stay listed until they slide out, the new ones are numbered
+ * after them, and the first of those is marked as a discontinuity. Any
+ * other segments of ours that are lying around are deleted right away.
+ */
+
+#define ICSTR_TYPE_HLS_SINK (icstr_hls_sink_get_type ())
+#define ICSTR_HLS_SINK(obj) \
+  (G_TYPE_CHECK_INSTANCE_CAST ((obj), ICSTR_TYPE_HLS_SINK, IcstrHlsSink))
+
+#define DEFAULT_DIRECTORY "."
+#define DEFAULT_PLAYLIST "live.m3u8"
+#define DEFAULT_SEGMENT_TIME 6          /* seconds */
+#define DEFAULT_PLAYLIST_LENGTH 6       /* segments */
+
+/* of a segment, past segment-time, for cutting at a frame boundary */
+#define TARGET_DURATION_SLACK 1         /* seconds */
+
+#define PACKED_AUDIO_EXTENSION "mp3"
+#define TS_EXTENSION "ts"
+
+#define TS_PACKET_SIZE 188
+#define TS_SYNC_BYTE 0x47
+#define TS_PAT_PID 0
+
+/* the ID3 PRIV frame that carries the timestamp of a packed audio segment */
+#define ID3_TIMESTAMP_OWNER "com.apple.streaming.transportStreamTimestamp"
+
+enum
+{
+  PROP_0,
+  PROP_DIRECTORY,
+  PROP_PLAYLIST,
+  PROP_SEGMENT_TIME,
+  PROP_PLAYLIST_LENGTH,
+};
+
+typedef struct _IcstrHlsSegment IcstrHlsSegment;
+typedef struct _IcstrHlsSink IcstrHlsSink;
+typedef struct _IcstrHlsSinkClass IcstrHlsSinkClass;
+
+struct _IcstrHlsSegment
+{
+  guint64 sequence;
+  const gchar *extension;       /* of the file, by its format */
+  gdouble duration;             /* seconds */
+  gboolean discontinuity;       /* with the previous segment */
+  GByteArray *data;             /* NULL once written */
+  gboolean last;                /* ends the writer */
+};
+
+struct _IcstrHlsSink
+{
+  GstBaseSink parent;
+
+  /* properties, protected by the object lock */
+  gchar *directory;
+  gchar *playlist;
+  guint segment_time;           /* seconds */
+  guint playlist_length;        /* segments */
+
+  /* set by start(), before the writer is started */
+  guint target_duration;        /* seconds */
+  GQueue resumed;               /* of the previous run, for the writer */
+  guint64 discontinuity_sequence;
+
+  /* only used from the streaming thread, start() & stop() */
+  gboolean ts;                  /* MPEG-TS, or else packed audio */
+  IcstrHlsSegment *segment;     /* being collected, NULL if none */
+  GstClockTime segment_start;
+  GstClockTime segment_end;
+  guint64 next_sequence;
+  gboolean discontinuity;       /* before the next segment */
+  guint8 pat[TS_PACKET_SIZE];   /* the last ones seen, if valid */
+  guint8 pmt[TS_PACKET_SIZE];
+  gboolean pat_valid, pmt_valid;
+  guint pmt_pid;
+
+  /* the writer */
+  GThread *thread;
+  GAsyncQueue *queue;
+  atomic_bool failed;
+};
+
+struct _IcstrHlsSinkClass
+{
+  GstBaseSinkClass parent_class;
+};
+
+static GType icstr_hls_sink_get_type (void);
+
+G_DEFINE_TYPE (IcstrHlsSink, icstr_hls_sink, GST_TYPE_BASE_SINK);
+
+static GstStaticPadTemplate sink_template = GST_STATIC_PAD_TEMPLATE ("sink",
+    GST_PAD_SINK,
+    GST_PAD_ALWAYS,
+    GST_STATIC_CAPS ("video/mpegts, systemstream = (boolean) true, "
+        "packetsize = (int) 188; "
+        "audio/mpeg, mpegversion = (int) 1, layer = (int) 3"));
+
+static void
+icstr_hls_segment_free (IcstrHlsSegment *segment)
+{
+  if (segment->data)
+    g_byte_array_unref (segment->data);
+  g_free (segment);
+}
+
+/* the name of the playlist without its extension */
+static gchar *
+icstr_hls_sink_base_name (const gchar *playlist)
+{
+  gchar *base = g_strdup (playlist);
+  gchar *dot = strrchr (base, '.');
+
+  if (dot)
+    *dot = '\0';
+  return base;
+}
+
+static gchar *
+icstr_hls_sink_segment_name (const gchar *playlist,
+    IcstrHlsSegment *segment)
+{
+  g_autofree gchar *base = icstr_hls_sink_base_name (playlist);
+
+  return g_strdup_printf ("%s-%" G_GUINT64_FORMAT ".%s", base,
+                          segment->sequence, segment->extension);
+}
+
+/* the sequence number and the extension of a segment of ours, by its
+ * file name */
+static gboolean
+icstr_hls_sink_parse_segment_name (const gchar *playlist, const gchar *name,
+    guint64 *sequence, const gchar **extension)
+{
+  static const gchar *extensions[] = {
+    PACKED_AUDIO_EXTENSION, TS_EXTENSION
+  };
+  g_autofree gchar *base = icstr_hls_sink_base_name (playlist);
+  g_autofree gchar *prefix = g_strconcat (base, "-", NULL);
+  const gchar *dot = strrchr (name, '.');
+  g_autofree gchar *number = NULL;
+  guint i;
+
+  if (!g_str_has_prefix (name, prefix) || !dot ||
+      dot < name + strlen (prefix))
+    return FALSE;
+
+  for (i = 0; i < G_N_ELEMENTS (extensions); i++) {
+    if (g_str_equal (dot + 1, extensions[i]))
+      break;
+  }
+  if (i == G_N_ELEMENTS (extensions))
+    return FALSE;
+  *extension = extensions[i];
+
+  number = g_strndup (name + strlen (prefix), dot - name - strlen (prefix));
+  return g_ascii_string_to_unsigned (number, 10, 0, G_MAXUINT64, sequence,
+                                     NULL);
+}
+
+/* the playlist of a previous run, which the new segments are added to */
+static void
+icstr_hls_sink_resume (IcstrHlsSink *sink, const gchar *playlist,
+    const gchar *playlist_path)
+{
+  g_autofree gchar *contents = NULL;
+  g_auto (GStrv) lines = NULL;
+  gdouble duration = 0;
+  gboolean discontinuity = FALSE;
+  gchar **line;
+
+  sink->discontinuity_sequence = 0;
+
+  if (!g_file_get_contents (playlist_path, &contents, NULL, NULL))
+    return;
+
+  lines = g_strsplit (contents, "\n", -1);
+  for (line = lines; *line; line++) {
+    const gchar *tag = g_strstrip (*line);
+    const gchar *extension;
+    IcstrHlsSegment *segment;
+    guint64 sequence;
+
+    if (g_str_has_prefix (tag, "#EXT-X-DISCONTINUITY-SEQUENCE:")) {
+      sink->discontinuity_sequence = g_ascii_strtoull (
+          tag + strlen ("#EXT-X-DISCONTINUITY-SEQUENCE:"), NULL, 10);
+    } else if (g_str_equal (tag, "#EXT-X-DISCONTINUITY")) {
+      discontinuity = TRUE;
+    } else if (g_str_has_prefix (tag, "#EXTINF:")) {
+      duration = g_ascii_strtod (tag + strlen ("#EXTINF:"), NULL);
+    } else if (icstr_hls_sink_parse_segment_name (playlist, tag, &sequence,
+                                                  &extension)) {
+      segment = g_new0 (IcstrHlsSegment, 1);
+      segment->sequence = sequence;
+      segment->extension = extension;
+      segment->duration = duration;
+      segment->discontinuity = discontinuity;
+      g_queue_push_tail (&sink->resumed, segment);
+
+      duration = 0;
+      discontinuity = FALSE;
+    }
+  }
+}
+
+/* the writer thread */
+
+static void
+icstr_hls_sink_fail (IcstrHlsSink *sink, const GError *error)
+{
+  /* reported once, until the destination is restarted */
+  if (atomic_exchange (&sink->failed, TRUE))
+    return;
+
+  GST_ELEMENT_ERROR (sink, RESOURCE, WRITE,
+      ("Failed to publish the HLS stream"), ("%s", error->message));
+}
+
+/* deletes the segments of ours that are not listed, which no client knows
+ * about anymore */
+static void
+icstr_hls_sink_clean_up (const gchar *directory, const gchar *playlist,
+    GQueue *listed)
+{
+  g_autoptr (GHashTable) names = g_hash_table_new_full (g_str_hash,
+      g_str_equal, g_free, NULL);
+  g_autoptr (GDir) dir = NULL;
+  const gchar *name;
+  GList *curr;
+
+  for (curr = listed->head; curr != NULL; curr = g_list_next (curr))
+    g_hash_table_add (names, icstr_hls_sink_segment_name (playlist,
+                                                          curr->data));
+
+  dir = g_dir_open (directory, 0, NULL);
+  if (!dir)
+    return;
+
+  while ((name = g_dir_read_name (dir)) != NULL) {
+    g_autofree gchar *path = NULL;
+    const gchar *extension = NULL;
+    guint64 sequence;
+
+    if (!icstr_hls_sink_parse_segment_name (playlist, name, &sequence,
+                                            &extension) ||
+        g_hash_table_contains (names, name))
+      continue;
+
+    path = g_build_filename (directory, name, NULL);
+    g_unlink (path);
+  }
+}
+
+static gboolean
+icstr_hls_sink_write_playlist (const gchar *path, GQueue *segments,
+    const gchar *playlist, guint target_duration,
+    guint64 discontinuity_sequence, GError **error)
+{
+  g_autoptr (GString) out = g_string_new ("#EXTM3U\n#EXT-X-VERSION:3\n");
+  IcstrHlsSegment *first = g_queue_peek_head (segments);
+  GList *curr;
+
+  g_string_append_printf (out, "#EXT-X-TARGETDURATION:%u\n",
+                          target_duration);
+  g_string_append_printf (out, "#EXT-X-MEDIA-SEQUENCE:%" G_GUINT64_FORMAT
+                          "\n", first->sequence);
+  if (discontinuity_sequence > 0)
+    g_string_append_printf (out, "#EXT-X-DISCONTINUITY-SEQUENCE:%"
+                            G_GUINT64_FORMAT "\n", discontinuity_sequence);
+
+  for (curr = segments->head; curr != NULL; curr = g_list_next (curr)) {
+    IcstrHlsSegment *segment = curr->data;
+    g_autofree gchar *name = icstr_hls_sink_segment_name (playlist,
+                                                          segment);
+
+    if (segment->discontinuity)
+      g_string_append (out, "#EXT-X-DISCONTINUITY\n");
+    g_string_append_printf (out, "#EXTINF:%.3f,\n%s\n", segment->duration,
+                            name);
+  }
+
+  /* replaced with a rename */
+  return g_file_set_contents (path, out->str, out->len, error);
+}
+
+static gpointer
+icstr_hls_sink_writer (gpointer data)
+{
+  IcstrHlsSink *sink = data;
+  g_autofree gchar *directory = NULL;
+  g_autofree gchar *playlist = NULL;
+  g_autofree gchar *playlist_path = NULL;
+  GQueue listed = sink->resumed;
+  GQueue expired = G_QUEUE_INIT;
+  guint64 discontinuity_sequence = sink->discontinuity_sequence;
+  guint playlist_length;
+  IcstrHlsSegment *segment;
+
+  g_queue_init (&sink->resumed);
+
+  GST_OBJECT_LOCK (sink);
+  directory = g_strdup (sink->directory);
+  playlist = g_strdup (sink->playlist);
+  playlist_length = MAX (sink->playlist_length, 1);
+  GST_OBJECT_UNLOCK (sink);
+
+  playlist_path = g_build_filename (directory, playlist, NULL);
+  g_mkdir_with_parents (directory, 0755);
+  icstr_hls_sink_clean_up (directory, playlist, &listed);
+
+  while (!(segment = g_async_queue_pop (sink->queue))->last) {
+    g_autoptr (GError) error = NULL;
+    g_autofree gchar *name = NULL;
+    g_autofree gchar *path = NULL;
+
+    if (atomic_load (&sink->failed)) {
+      icstr_hls_segment_free (segment);
+      continue;
+    }
+
+    name = icstr_hls_sink_segment_name (playlist, segment);
+    path = g_build_filename (directory, name, NULL);
+
+    if (!g_file_set_contents (path, (const gchar *) segment->data->data,
+                              segment->data->len, &error)) {
+      icstr_hls_sink_fail (sink, error);
+      icstr_hls_segment_free (segment);
+      continue;
+    }
+    g_clear_pointer (&segment->data, g_byte_array_unref);
+
+    g_queue_push_tail (&listed, segment);
+    while (g_queue_get_length (&listed) > playlist_length) {
+      IcstrHlsSegment *old = g_queue_pop_head (&listed);
+
+      /* numbers the discontinuities, from the first segment listed */
+      if (old->discontinuity)
+        discontinuity_sequence++;
+      g_queue_push_tail (&expired, old);
+    }
+
+    if (!icstr_hls_sink_write_playlist (playlist_path, &listed, playlist,
+                                        sink->target_duration,
+                                        discontinuity_sequence, &error)) {
+      icstr_hls_sink_fail (sink, error);
+      continue;
+    }
+
+    /* kept for clients that loaded an older playlist */
+    while (g_queue_get_length (&expired) > playlist_length) {
+      IcstrHlsSegment *old = g_queue_pop_head (&expired);
+      g_autofree gchar *old_name = icstr_hls_sink_segment_name (playlist,
+                                                                old);
+      g_autofree gchar *old_path = g_build_filename (directory, old_name,
+                                                     NULL);
+
+      g_unlink (old_path);
+      icstr_hls_segment_free (old);
+    }
+  }
+
+  icstr_hls_segment_free (segment);
+  g_queue_clear_full (&listed, (GDestroyNotify) icstr_hls_segment_free);
+  g_queue_clear_full (&expired, (GDestroyNotify) icstr_hls_segment_free);
+
+  return NULL;
+}
+
+/* the streaming thread */
+
+static void
+icstr_hls_sink_put_synchsafe (guint8 *out, guint32 value)
+{
+  out[0] = (value >> 21) & 0x7f;
+  out[1] = (value >> 14) & 0x7f;
+  out[2] = (value >> 7) & 0x7f;
+  out[3] = value & 0x7f;
+}
+
+/* an ID3v2.4 tag with a single PRIV frame, with the timestamp of the first
+ * sample of the segment at 90 kHz, as in MPEG-TS */
+static void
+icstr_hls_sink_append_timestamp (GByteArray *data, GstClockTime pts)
+{
+  const gsize owner_size = sizeof (ID3_TIMESTAMP_OWNER);
+  const gsize frame_size = owner_size + 8;
+  guint64 timestamp = gst_util_uint64_scale (pts, 90000, GST_SECOND) &
+      G_GUINT64_CONSTANT (0x1ffffffff);
+  guint8 header[10] = { 'I', 'D', '3', 4, 0, 0 };
+  guint8 frame[10] = { 'P', 'R', 'I', 'V' };
+  guint8 value[8];
+  guint i;
+
+  icstr_hls_sink_put_synchsafe (header + 6, sizeof (frame) + frame_size);
+  icstr_hls_sink_put_synchsafe (frame + 4, frame_size);
+  for (i = 0; i < 8; i++)
+    value[i] = (timestamp >> (56 - 8 * i)) & 0xff;
+
+  g_byte_array_append (data, header, sizeof (header));
+  g_byte_array_append (data, frame, sizeof (frame));
+  g_byte_array_append (data, (const guint8 *) ID3_TIMESTAMP_OWNER,
+                       owner_size);
+  g_byte_array_append (data, value, sizeof (value));
+}
+
+static guint
+icstr_hls_sink_ts_pid (const guint8 *packet)
+{
+  return ((packet[1] & 0x1f) << 8) | packet[2];
+}
+
+/* whether the packet starts a PES packet or a table, i.e. a frame of ours
+ * or the PAT and PMT that mpegtsmux writes before one */
+static gboolean
+icstr_hls_sink_ts_unit_start (const guint8 *packet)
+{
+  return packet[0] == TS_SYNC_BYTE && (packet[1] & 0x40);
+}
+
+/* the PID of the PMT of the first program in a PAT that fits in a single
+ * packet, as those of mpegtsmux do, or 0 if there is none */
+static guint
+icstr_hls_sink_ts_parse_pat (const guint8 *packet)
+{
+  const guint8 *end = packet + TS_PACKET_SIZE;
+  const guint8 *section = packet + 4;
+  const guint8 *program;
+  guint length;
+
+  if (!(packet[3] & 0x10))              /* no payload */
+    return 0;
+  if (packet[3] & 0x20)                 /* skip the adaptation field */
+    section += 1 + packet[4];
+  if (section >= end)
+    return 0;
+  section += 1 + section[0];            /* skip the pointer field */
+  if (section + 8 > end)
+    return 0;
+
+  /* the programs are between the header and the CRC */
+  length = ((section[1] & 0x0f) << 8) | section[2];
+  if (length < 9)
+    return 0;
+  for (program = section + 8;
+       program + 4 <= MIN (section + 3 + length - 4, end); program += 4) {
+    /* 0 is the network PID */
+    if (((program[0] << 8) | program[1]) != 0)
+      return ((program[2] & 0x1f) << 8) | program[3];
+  }
+
+  return 0;
+}
+
+/* keeps the last PAT and PMT, for the start of the next segment */
+static void
+icstr_hls_sink_ts_scan_tables (IcstrHlsSink *sink, const guint8 *data,
+    gsize size)
+{
+  gsize offset;
+
+  for (offset = 0; offset + TS_PACKET_SIZE <= size;
+       offset += TS_PACKET_SIZE) {
+    const guint8 *packet = data + offset;
+    guint pid = icstr_hls_sink_ts_pid (packet);
+
+    if (!icstr_hls_sink_ts_unit_start (packet))
+      continue;
+
+    if (pid == TS_PAT_PID) {
+      memcpy (sink->pat, packet, TS_PACKET_SIZE);
+      sink->pat_valid = TRUE;
+      sink->pmt_pid = icstr_hls_sink_ts_parse_pat (packet);
+    } else if (sink->pat_valid && sink->pmt_pid && pid == sink->pmt_pid) {
+      memcpy (sink->pmt, packet, TS_PACKET_SIZE);
+      sink->pmt_valid = TRUE;
+    }
+  }
+}
+
+static void
+icstr_hls_sink_start_segment (IcstrHlsSink *sink, GstClockTime pts,
+    const guint8 *data)
+{
+  sink->segment = g_new0 (IcstrHlsSegment, 1);
+  sink->segment->sequence = sink->next_sequence++;
+  sink->segment->data = g_byte_array_new ();
+  sink->segment->discontinuity = sink->discontinuity;
+  sink->segment_start = pts;
+  sink->segment_end = pts;
+  sink->discontinuity = FALSE;
+
+  if (!sink->ts) {
+    sink->segment->extension = PACKED_AUDIO_EXTENSION;
+    icstr_hls_sink_append_timestamp (sink->segment->data, pts);
+    return;
+  }
+
+  /* unless it starts with them anyway */
+  sink->segment->extension = TS_EXTENSION;
+  if (sink->pat_valid && sink->pmt_valid &&
+      icstr_hls_sink_ts_pid (data) != TS_PAT_PID) {
+    g_byte_array_append (sink->segment->data, sink->pat, TS_PACKET_SIZE);
+    g_byte_array_append (sink->segment->data, sink->pmt, TS_PACKET_SIZE);
+  }
+}
+
+/* the segment ends where the next one starts, unless the timestamps went
+ * back, and never after the target duration */
+static void
+icstr_hls_sink_finish_segment (IcstrHlsSink *sink, GstClockTime next)
+{
+  IcstrHlsSegment *segment = g_steal_pointer (&sink->segment);
+  GstClockTime end = next >= sink->segment_start ? next : sink->segment_end;
+  gdouble duration;
+
+  if (!segment)
+    return;
+
+  duration = (gdouble) (end - sink->segment_start) / GST_SECOND;
+  if (duration > sink->target_duration) {
+    GST_WARNING_OBJECT (sink, "Segment of %.3f s, over the target "
+        "duration of %u s, because of a gap", duration,
+        sink->target_duration);
+    duration = sink->target_duration;
+  }
+
+  segment->duration = duration;
+  g_async_queue_push (sink->queue, segment);
+}
+
+static GstFlowReturn
+icstr_hls_sink_render (GstBaseSink *bsink, GstBuffer *buffer)
+{
+  IcstrHlsSink *sink = ICSTR_HLS_SINK (bsink);
+  GstClockTime pts = GST_BUFFER_PTS (buffer);
+  GstClockTime duration = GST_BUFFER_DURATION (buffer);
+  GstClockTime segment_time, target, end;
+  gboolean can_cut;
+  GstMapInfo map;
+
+  /* until the destination is restarted */
+  if (atomic_load (&sink->failed))
+    return GST_FLOW_OK;
+
+  if (!gst_buffer_map (buffer, &map, GST_MAP_READ))
+    return GST_FLOW_OK;
+
+  if (sink->ts && (map.size < TS_PACKET_SIZE || map.data[0] != TS_SYNC_BYTE))
+    goto done;
+
+  GST_OBJECT_LOCK (sink);
+  segment_time = MAX (sink->segment_time, 1) * GST_SECOND;
+  GST_OBJECT_UNLOCK (sink);
+  target = sink->target_duration * GST_SECOND;
+  end = pts + (GST_CLOCK_TIME_IS_VALID (duration) ? duration : 0);
+
+  /* segments are cut by time, at the start of a frame, early enough for
+   * the target duration */
+  can_cut = GST_CLOCK_TIME_IS_VALID (pts) &&
+      (!sink->ts || icstr_hls_sink_ts_unit_start (map.data));
+
+  if (sink->segment && can_cut && pts < sink->segment_start) {
+    GST_WARNING_OBJECT (sink, "Timestamps went back, starting a new segment");
+    icstr_hls_sink_finish_segment (sink, pts);
+    sink->discontinuity = TRUE;
+  } else if (sink->segment && can_cut &&
+      (pts >= sink->segment_start + segment_time ||
+       end > sink->segment_start + target)) {
+    icstr_hls_sink_finish_segment (sink, pts);
+  }
+
+  /* what comes before the first frame cannot be played anyway */
+  if (!sink->segment && can_cut)
+    icstr_hls_sink_start_segment (sink, pts, map.data);
+
+  if (sink->segment) {
+    g_byte_array_append (sink->segment->data, map.data, map.size);
+    if (GST_CLOCK_TIME_IS_VALID (pts))
+      sink->segment_end = MAX (sink->segment_end, end);
+  }
+
+  if (sink->ts)
+    icstr_hls_sink_ts_scan_tables (sink, map.data, map.size);
+
+done:
+  gst_buffer_unmap (buffer, &map);
+  return GST_FLOW_OK;
+}
+
+static gboolean
+icstr_hls_sink_set_caps (GstBaseSink *bsink, GstCaps *caps)
+{
+  IcstrHlsSink *sink = ICSTR_HLS_SINK (bsink);
+  gboolean ts = gst_structure_has_name (gst_caps_get_structure (caps, 0),
+                                        "video/mpegts");
+
+  /* a segment is all in one format */
+  if (sink->segment && ts != sink->ts) {
+    g_clear_pointer (&sink->segment, icstr_hls_segment_free);
+    sink->discontinuity = TRUE;
+  }
+
+  sink->ts = ts;
+  return TRUE;
+}
+
+static gboolean
+icstr_hls_sink_start (GstBaseSink *bsink)
+{
+  IcstrHlsSink *sink = ICSTR_HLS_SINK (bsink);
+  g_autoptr (GError) error = NULL;
+  g_autofree gchar *playlist = NULL;
+  g_autofree gchar *playlist_path = NULL;
+  IcstrHlsSegment *last;
+  GList *curr;
+
+  GST_OBJECT_LOCK (sink);
+  playlist = g_strdup (sink->playlist);
+  playlist_path = g_build_filename (sink->directory, sink->playlist, NULL);
+  sink->target_duration = MAX (sink->segment_time, 1) +
+      TARGET_DURATION_SLACK;
+  GST_OBJECT_UNLOCK (sink);
+
+  icstr_hls_sink_resume (sink, playlist, playlist_path);
+
+  /* it may not change while they are listed */
+  for (curr = sink->resumed.head; curr != NULL; curr = g_list_next (curr)) {
+    IcstrHlsSegment *segment = curr->data;
+    sink->target_duration = MAX (sink->target_duration,
+                                 (guint) ceil (segment->duration));
+  }
+
+  /* without a playlist to carry on with, the numbers still have to move
+   * on from the previous run, so they start from the clock */
+  last = g_queue_peek_tail (&sink->resumed);
+  sink->next_sequence = last ? last->sequence + 1 :
+      (guint64) (g_get_real_time () / G_USEC_PER_SEC);
+  sink->discontinuity = last != NULL;
+  sink->pat_valid = sink->pmt_valid = FALSE;
+  atomic_store (&sink->failed, FALSE);
+
+  sink->queue = g_async_queue_new_full (
+      (GDestroyNotify) icstr_hls_segment_free);
+  sink->thread = g_thread_try_new ("icstr-hls", icstr_hls_sink_writer, sink,
+                                   &error);
+  if (!sink->thread) {
+    GST_ELEMENT_ERROR (sink, RESOURCE, FAILED,
+        ("Failed to start the HLS writer"), ("%s", error->message));
+    g_queue_clear_full (&sink->resumed,
+                        (GDestroyNotify) icstr_hls_segment_free);
+    g_clear_pointer (&sink->queue, g_async_queue_unref);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static gboolean
+icstr_hls_sink_stop (GstBaseSink *bsink)
+{
+  IcstrHlsSink *sink = ICSTR_HLS_SINK (bsink);
+  IcstrHlsSegment *last;
+
+  if (!sink->thread)
+    return TRUE;
+
+  /* a partial segment would be too short for the target duration */
+  g_clear_pointer (&sink->segment, icstr_hls_segment_free);
+
+  last = g_new0 (IcstrHlsSegment, 1);
+  last->last = TRUE;
+  g_async_queue_push (sink->queue, last);
+
+  g_thread_join (sink->thread);
+  sink->thread = NULL;
+  g_clear_pointer (&sink->queue, g_async_queue_unref);
+
+  return TRUE;
+}
+
+/* GObject */
+
+static void
+icstr_hls_sink_set_property (GObject *object, guint prop_id,
+    const GValue *value, GParamSpec *pspec)
+{
+  IcstrHlsSink *sink = ICSTR_HLS_SINK (object);
+
+  GST_OBJECT_LOCK (sink);
+  switch (prop_id) {
+    case PROP_DIRECTORY:
+      g_free (sink->directory);
+      sink->directory = g_value_dup_string (value);
+      break;
+    case PROP_PLAYLIST:
+      g_free (sink->playlist);
+      sink->playlist = g_value_dup_string (value);
+      break;
+    case PROP_SEGMENT_TIME:
+      sink->segment_time = g_value_get_uint (value);
+      break;
+    case PROP_PLAYLIST_LENGTH:
+      sink->playlist_length = g_value_get_uint (value);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+  GST_OBJECT_UNLOCK (sink);
+}
+
+static void
+icstr_hls_sink_get_property (GObject *object, guint prop_id,
+    GValue *value, GParamSpec *pspec)
+{
+  IcstrHlsSink *sink = ICSTR_HLS_SINK (object);
+
+  GST_OBJECT_LOCK (sink);
+  switch (prop_id) {
+    case PROP_DIRECTORY:
+      g_value_set_string (value, sink->directory);
+      break;
+    case PROP_PLAYLIST:
+      g_value_set_string (value, sink->playlist);
+      break;
+    case PROP_SEGMENT_TIME:
+      g_value_set_uint (value, sink->segment_time);
+      break;
+    case PROP_PLAYLIST_LENGTH:
+      g_value_set_uint (value, sink->playlist_length);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+  GST_OBJECT_UNLOCK (sink);
+}
+
+static void
+icstr_hls_sink_finalize (GObject *object)
+{
+  IcstrHlsSink *sink = ICSTR_HLS_SINK (object);
+
+  g_free (sink->directory);
+  g_free (sink->playlist);
+
+  G_OBJECT_CLASS (icstr_hls_sink_parent_class)->finalize (object);
+}
+
+static void
+icstr_hls_sink_init (IcstrHlsSink *sink)
+{
+  sink->directory = g_strdup (DEFAULT_DIRECTORY);
+  sink->playlist = g_strdup (DEFAULT_PLAYLIST);
+  sink->segment_time = DEFAULT_SEGMENT_TIME;
+  sink->playlist_length = DEFAULT_PLAYLIST_LENGTH;
+
+  /* written as soon as it arrives */
+  gst_base_sink_set_sync (GST_BASE_SINK (sink), FALSE);
+}
+
+static void
+icstr_hls_sink_class_init (IcstrHlsSinkClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+  GstElementClass *element_class = GST_ELEMENT_CLASS (klass);
+  GstBaseSinkClass *basesink_class = GST_BASE_SINK_CLASS (klass);
+  const GParamFlags flags = G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS;
+
+  gobject_class->set_property = icstr_hls_sink_set_property;
+  gobject_class->get_property = icstr_hls_sink_get_property;
+  gobject_class->finalize = icstr_hls_sink_finalize;
+
+  g_object_class_install_property (gobject_class, PROP_DIRECTORY,
+      g_param_spec_string ("directory", "directory",
+          "Directory of the playlist and the segments", DEFAULT_DIRECTORY,
+          flags));
+  g_object_class_install_property (gobject_class, PROP_PLAYLIST,
+      g_param_spec_string ("playlist", "playlist",
+          "File name of the playlist, also the prefix of the segments",
+          DEFAULT_PLAYLIST, flags));
+  g_object_class_install_property (gobject_class, PROP_SEGMENT_TIME,
+      g_param_spec_uint ("segment-time", "segment-time",
+          "Duration of each segment in seconds",
+          1, G_MAXUINT, DEFAULT_SEGMENT_TIME, flags));
+  g_object_class_install_property (gobject_class, PROP_PLAYLIST_LENGTH,
+      g_param_spec_uint ("playlist-length", "playlist-length",
+          "Number of segments in the playlist",
+          1, G_MAXUINT, DEFAULT_PLAYLIST_LENGTH, flags));
+
+  gst_element_class_add_static_pad_template (element_class, &sink_template);
+  gst_element_class_set_static_metadata (element_class,
+      "HLS publisher", "Sink/File",
+      "Publishes the stream as HLS, in MPEG-TS or packed audio segments",
+      "George Kiagiadakis <gkiagia@tolabaki.gr>");
+
+  basesink_class->start = GST_DEBUG_FUNCPTR (icstr_hls_sink_start);
+  basesink_class->stop = GST_DEBUG_FUNCPTR (icstr_hls_sink_stop);
+  basesink_class->set_caps = GST_DEBUG_FUNCPTR (icstr_hls_sink_set_caps);
+  basesink_class->render = GST_DEBUG_FUNCPTR (icstr_hls_sink_render);
+}
+
+gboolean
+icstr_hls_sink_register (void)
+{
+  return gst_element_register (NULL, "icstrhlssink", GST_RANK_NONE,
+                               ICSTR_TYPE_HLS_SINK);
+}
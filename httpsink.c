@@ -0,0 +1,1183 @@
+/*
+ * IceStreamer - A simple live audio streamer
+ *
+ * Copyright (C) 2017 George Kiagiadakis <gkiagia@tolabaki.gr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "icestreamer.h"
+#include <gst/base/gstbasesink.h>
+#include <string.h>
+
+/*
+ * A sink that serves the stream to HTTP listeners directly, for setups
+ * that do not need a separate Icecast server.
+ *
+ * The encoded buffers are kept, without copying, in a ring that all the
+ * listeners of a mount read from, each one at its own position. All the
+ * sockets are non-blocking and are served from the shared I/O thread.
+ * A listener that falls behind the end of the ring is disconnected.
+ * New listeners start with the stream headers, followed by a burst of
+ * the most recent data, so that playback starts right away.
+ *
+ * Sinks listening on the same address and port share the listening socket
+ * and are told apart by their mount.
+ */
+
+#define ICSTR_TYPE_HTTP_SINK (icstr_http_sink_get_type ())
+#define ICSTR_HTTP_SINK(obj) \
+  (G_TYPE_CHECK_INSTANCE_CAST ((obj), ICSTR_TYPE_HTTP_SINK, IcstrHttpSink))
+
+/* number of buffers in the ring; must be a power of two */
+#define RING_SLOTS 1024
+#define RING_SLOT(sink, seq) (&(sink)->ring[(seq) & (RING_SLOTS - 1)])
+
+/* the maximum number of buffers sent with a single writev */
+#define MAX_VECTORS 64
+
+#define MAX_REQUEST_SIZE 8192
+#define REQUEST_TIMEOUT 10      /* seconds */
+#define LISTEN_BACKLOG 256
+
+#define DEFAULT_ADDRESS "0.0.0.0"
+#define DEFAULT_PORT 8000
+#define DEFAULT_BURST_SIZE (64 * 1024)
+#define DEFAULT_BUFFER_SIZE (2 * 1024 * 1024)
+#define DEFAULT_MAX_LISTENERS 0
+
+enum
+{
+  PROP_0,
+  PROP_ADDRESS,
+  PROP_PORT,
+  PROP_MOUNT,
+  PROP_STREAMNAME,
+  PROP_DESCRIPTION,
+  PROP_GENRE,
+  PROP_URL,
+  PROP_BURST_SIZE,
+  PROP_BUFFER_SIZE,
+  PROP_MAX_LISTENERS,
+  PROP_LISTENERS,
+};
+
+typedef struct _IcstrHttpServer IcstrHttpServer;
+typedef struct _IcstrHttpClient IcstrHttpClient;
+typedef struct _IcstrHttpListener IcstrHttpListener;
+typedef struct _IcstrHttpPacket IcstrHttpPacket;
+typedef struct _IcstrHttpSink IcstrHttpSink;
+typedef struct _IcstrHttpSinkClass IcstrHttpSinkClass;
+
+/* A listening socket, shared by the sinks that use the same address & port */
+struct _IcstrHttpServer
+{
+  gchar *key;                   /* "address:port" */
+  guint refcount;
+  GSocket *socket;
+  GSource *accept_source;
+  GSource *sweep_source;
+  GHashTable *mounts;           /* mount -> IcstrHttpSink, weak */
+  GList *clients;               /* connections still sending their request */
+};
+
+/* A connection whose request has not been read yet */
+struct _IcstrHttpClient
+{
+  IcstrHttpServer *server;
+  GSocket *socket;
+  GSource *source;
+  GString *request;
+  gint64 since;                 /* monotonic time */
+};
+
+/* A connection that receives the stream */
+struct _IcstrHttpListener
+{
+  gint refcount;                /* atomic; held by the sink and the source */
+  IcstrHttpSink *sink;
+  GSocket *socket;
+  gchar *peer;
+  GList *link;                  /* in the listeners of the sink */
+  GSource *source;              /* waiting for the socket, NULL if not */
+
+  /* the response & stream headers, sent before anything else */
+  GBytes *prefix;
+  gsize prefix_offset;
+
+  /* the position in the ring */
+  guint64 seq;
+  gsize offset;
+};
+
+struct _IcstrHttpPacket
+{
+  GstBuffer *buffer;
+  GstMapInfo map;
+};
+
+struct _IcstrHttpSink
+{
+  GstBaseSink parent;
+
+  /* properties, protected by the object lock */
+  gchar *address;
+  gint port;
+  gchar *mount;
+  gchar *streamname;
+  gchar *description;
+  gchar *genre;
+  gchar *url;
+  guint burst_size;             /* bytes */
+  guint buffer_size;            /* bytes */
+  guint max_listeners;          /* 0 for unlimited */
+
+  /* also protected by the object lock */
+  gchar *content_type;
+
+  /* only used from start() & stop() */
+  IcstrHttpServer *server;
+  gchar *server_mount;
+
+  /* the ring & the listeners, protected by lock */
+  GMutex lock;
+  IcstrHttpPacket *ring;        /* RING_SLOTS entries */
+  guint64 tail_seq;             /* the oldest buffer in the ring */
+  guint64 head_seq;             /* the next buffer to be added */
+  gsize ring_bytes;
+  GBytes *headers;
+  gboolean caps_headers;        /* the headers came from the caps */
+  GList *listeners;
+  guint n_listeners;
+  gboolean kick_pending;
+  guint64 bytes_sent;
+};
+
+struct _IcstrHttpSinkClass
+{
+  GstBaseSinkClass parent_class;
+};
+
+static GType icstr_http_sink_get_type (void);
+
+G_DEFINE_TYPE (IcstrHttpSink, icstr_http_sink, GST_TYPE_BASE_SINK);
+
+static GstStaticPadTemplate sink_template = GST_STATIC_PAD_TEMPLATE ("sink",
+    GST_PAD_SINK,
+    GST_PAD_ALWAYS,
+    GST_STATIC_CAPS ("application/ogg; audio/ogg; audio/webm; video/webm; "
+        "audio/mpeg"));
+
+static GMutex servers_lock;
+static GHashTable *servers = NULL;      /* "address:port" -> IcstrHttpServer */
+
+static gboolean icstr_http_sink_add_listener (IcstrHttpSink *sink,
+    GSocket *socket);
+
+/* listeners */
+
+static IcstrHttpListener *
+icstr_http_listener_ref (IcstrHttpListener *l)
+{
+  g_atomic_int_inc (&l->refcount);
+  return l;
+}
+
+static void
+icstr_http_listener_unref (IcstrHttpListener *l)
+{
+  if (!g_atomic_int_dec_and_test (&l->refcount))
+    return;
+
+  g_clear_pointer (&l->prefix, g_bytes_unref);
+  g_object_unref (l->socket);
+  gst_object_unref (l->sink);
+  g_free (l->peer);
+  g_free (l);
+}
+
+static void
+icstr_http_sink_remove_listener_locked (IcstrHttpSink *sink,
+    IcstrHttpListener *l)
+{
+  if (l->source) {
+    g_source_destroy (l->source);
+    g_clear_pointer (&l->source, g_source_unref);
+  }
+
+  g_socket_close (l->socket, NULL);
+  sink->listeners = g_list_delete_link (sink->listeners, l->link);
+  sink->n_listeners--;
+
+  GST_INFO_OBJECT (sink, "Listener %s left, %u remaining", l->peer,
+                   sink->n_listeners);
+
+  icstr_http_listener_unref (l);
+}
+
+static gboolean icstr_http_listener_writable (GSocket *socket,
+    GIOCondition condition, gpointer data);
+
+/* sends as much as the socket takes; returns FALSE if the listener is gone */
+static gboolean
+icstr_http_listener_send_locked (IcstrHttpListener *l)
+{
+  IcstrHttpSink *sink = l->sink;
+  GOutputVector vectors[MAX_VECTORS];
+  g_autoptr (GError) error = NULL;
+  IcstrHttpPacket *packet;
+  const guint8 *prefix_data = NULL;
+  gsize prefix_size = 0, left;
+  gssize written;
+  guint64 seq;
+  gint n;
+
+  /* waiting for the socket to become writable */
+  if (l->source)
+    return TRUE;
+
+  for (;;) {
+    if (l->seq < sink->tail_seq) {
+      GST_INFO_OBJECT (sink, "Listener %s is too slow", l->peer);
+      return FALSE;
+    }
+
+    n = 0;
+    if (l->prefix) {
+      prefix_data = g_bytes_get_data (l->prefix, &prefix_size);
+      vectors[n].buffer = prefix_data + l->prefix_offset;
+      vectors[n].size = prefix_size - l->prefix_offset;
+      n++;
+    }
+    for (seq = l->seq; seq < sink->head_seq && n < MAX_VECTORS; seq++, n++) {
+      packet = RING_SLOT (sink, seq);
+      left = (seq == l->seq) ? l->offset : 0;
+      vectors[n].buffer = packet->map.data + left;
+      vectors[n].size = packet->map.size - left;
+    }
+
+    /* caught up with the stream */
+    if (n == 0)
+      return TRUE;
+
+    written = g_socket_send_message (l->socket, NULL, vectors, n, NULL, 0, 0,
+                                     NULL, &error);
+    if (written < 0) {
+      if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK)) {
+        GST_DEBUG_OBJECT (sink, "Failed to send to %s: %s", l->peer,
+                          error->message);
+        return FALSE;
+      }
+
+      l->source = g_socket_create_source (l->socket, G_IO_OUT, NULL);
+      g_source_set_callback (l->source,
+          (GSourceFunc) icstr_http_listener_writable,
+          icstr_http_listener_ref (l),
+          (GDestroyNotify) icstr_http_listener_unref);
+      g_source_attach (l->source, icstr_io_context ());
+      return TRUE;
+    }
+
+    sink->bytes_sent += written;
+
+    if (l->prefix) {
+      left = prefix_size - l->prefix_offset;
+      if ((gsize) written < left) {
+        l->prefix_offset += written;
+        continue;
+      }
+      written -= left;
+      g_clear_pointer (&l->prefix, g_bytes_unref);
+    }
+
+    while (written > 0) {
+      packet = RING_SLOT (sink, l->seq);
+      left = packet->map.size - l->offset;
+      if ((gsize) written < left) {
+        l->offset += written;
+        break;
+      }
+      written -= left;
+      l->seq++;
+      l->offset = 0;
+    }
+  }
+}
+
+static gboolean
+icstr_http_listener_writable (GSocket *socket, GIOCondition condition,
+    gpointer data)
+{
+  IcstrHttpListener *l = data;
+  IcstrHttpSink *sink = l->sink;
+
+  g_mutex_lock (&sink->lock);
+  /* the listener may have been removed while we were waiting for the lock */
+  if (!g_source_is_destroyed (g_main_current_source ())) {
+    g_clear_pointer (&l->source, g_source_unref);
+    if (!icstr_http_listener_send_locked (l))
+      icstr_http_sink_remove_listener_locked (sink, l);
+  }
+  g_mutex_unlock (&sink->lock);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* sends the new data to all listeners that are not waiting on their socket */
+static gboolean
+icstr_http_sink_kick (gpointer data)
+{
+  IcstrHttpSink *sink = data;
+  GList *curr, *next;
+
+  g_mutex_lock (&sink->lock);
+  sink->kick_pending = FALSE;
+  for (curr = sink->listeners; curr != NULL; curr = next) {
+    IcstrHttpListener *l = curr->data;
+    next = g_list_next (curr);
+
+    if (!icstr_http_listener_send_locked (l))
+      icstr_http_sink_remove_listener_locked (sink, l);
+  }
+  g_mutex_unlock (&sink->lock);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* the ring */
+
+static void
+icstr_http_sink_ring_pop_locked (IcstrHttpSink *sink)
+{
+  IcstrHttpPacket *packet = RING_SLOT (sink, sink->tail_seq);
+
+  sink->ring_bytes -= packet->map.size;
+  gst_buffer_unmap (packet->buffer, &packet->map);
+  g_clear_pointer (&packet->buffer, gst_buffer_unref);
+  sink->tail_seq++;
+}
+
+static void
+icstr_http_sink_ring_push_locked (IcstrHttpSink *sink, GstBuffer *buffer,
+    gsize max_bytes)
+{
+  IcstrHttpPacket *packet;
+  gsize size = gst_buffer_get_size (buffer);
+
+  while (sink->tail_seq < sink->head_seq &&
+      (sink->head_seq - sink->tail_seq >= RING_SLOTS ||
+       sink->ring_bytes + size > max_bytes))
+    icstr_http_sink_ring_pop_locked (sink);
+
+  packet = RING_SLOT (sink, sink->head_seq);
+  packet->buffer = gst_buffer_ref (buffer);
+  gst_buffer_map (buffer, &packet->map, GST_MAP_READ);
+  sink->ring_bytes += packet->map.size;
+  sink->head_seq++;
+}
+
+static void
+icstr_http_sink_ring_clear_locked (IcstrHttpSink *sink)
+{
+  while (sink->tail_seq < sink->head_seq)
+    icstr_http_sink_ring_pop_locked (sink);
+}
+
+/*
+ * Finds where a new listener starts: far enough back to fill the burst,
+ * on a buffer that the stream can be picked up from.
+ */
+static guint64
+icstr_http_sink_burst_start_locked (IcstrHttpSink *sink, gsize burst)
+{
+  guint64 seq = sink->head_seq;
+  guint64 start = sink->head_seq;
+  gsize bytes = 0;
+  IcstrHttpPacket *packet;
+
+  while (seq > sink->tail_seq && bytes < burst) {
+    seq--;
+    packet = RING_SLOT (sink, seq);
+    bytes += packet->map.size;
+
+    if (!GST_BUFFER_FLAG_IS_SET (packet->buffer, GST_BUFFER_FLAG_DELTA_UNIT))
+      start = seq;
+  }
+
+  return start;
+}
+
+/* the listening socket */
+
+static void
+icstr_http_client_free (IcstrHttpClient *client)
+{
+  if (client->source) {
+    g_source_destroy (client->source);
+    g_source_unref (client->source);
+  }
+  if (client->socket) {
+    g_socket_close (client->socket, NULL);
+    g_object_unref (client->socket);
+  }
+  g_string_free (client->request, TRUE);
+  g_free (client);
+}
+
+/* must be called with servers_lock held */
+static void
+icstr_http_server_drop_client (IcstrHttpClient *client)
+{
+  client->server->clients = g_list_remove (client->server->clients, client);
+  icstr_http_client_free (client);
+}
+
+static void
+icstr_http_client_respond (IcstrHttpClient *client, const gchar *status)
+{
+  g_autofree gchar *response = g_strdup_printf ("HTTP/1.0 %s\r\n"
+      "Content-Type: text/plain\r\n"
+      "Connection: close\r\n\r\n"
+      "%s\n", status, status);
+
+  /* best effort, the socket is closed right after */
+  g_socket_send (client->socket, response, strlen (response), NULL, NULL);
+}
+
+/* must be called with servers_lock held; consumes the client */
+static void
+icstr_http_server_handle_request (IcstrHttpClient *client)
+{
+  g_auto (GStrv) request_line = NULL;
+  IcstrHttpSink *sink = NULL;
+  gchar *path;
+
+  request_line = g_strsplit_set (client->request->str, " \r\n", 4);
+  if (g_strv_length (request_line) < 3 ||
+      !g_str_has_prefix (request_line[2], "HTTP/")) {
+    icstr_http_client_respond (client, "400 Bad Request");
+    goto out;
+  }
+
+  if (!g_str_equal (request_line[0], "GET")) {
+    icstr_http_client_respond (client, "405 Method Not Allowed");
+    goto out;
+  }
+
+  /* ignore any query string */
+  path = request_line[1];
+  path[strcspn (path, "?")] = '\0';
+
+  sink = g_hash_table_lookup (client->server->mounts, path);
+  if (!sink) {
+    icstr_http_client_respond (client, "404 Not Found");
+    goto out;
+  }
+
+  if (icstr_http_sink_add_listener (sink, client->socket))
+    g_clear_object (&client->socket);   /* now owned by the listener */
+  else
+    icstr_http_client_respond (client, "503 Service Unavailable");
+
+out:
+  icstr_http_server_drop_client (client);
+}
+
+static gboolean
+icstr_http_client_readable (GSocket *socket, GIOCondition condition,
+    gpointer data)
+{
+  IcstrHttpClient *client = data;
+  g_autoptr (GError) error = NULL;
+  gchar buf[1024];
+  gssize n_read;
+
+  g_mutex_lock (&servers_lock);
+  /* the server may have been closed while we were waiting for the lock */
+  if (g_source_is_destroyed (g_main_current_source ()))
+    goto out;
+
+  n_read = g_socket_receive (socket, buf, sizeof (buf), NULL, &error);
+  if (n_read < 0 &&
+      g_error_matches (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK))
+    goto out;
+
+  if (n_read <= 0) {
+    icstr_http_server_drop_client (client);
+    goto out;
+  }
+
+  g_string_append_len (client->request, buf, n_read);
+
+  if (strstr (client->request->str, "\r\n\r\n") ||
+      strstr (client->request->str, "\n\n")) {
+    icstr_http_server_handle_request (client);
+  } else if (client->request->len > MAX_REQUEST_SIZE) {
+    icstr_http_client_respond (client, "400 Bad Request");
+    icstr_http_server_drop_client (client);
+  }
+
+out:
+  g_mutex_unlock (&servers_lock);
+  return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+icstr_http_server_accept (GSocket *socket, GIOCondition condition,
+    gpointer data)
+{
+  IcstrHttpServer *server = data;
+  IcstrHttpClient *client;
+  GSocket *client_socket;
+
+  g_mutex_lock (&servers_lock);
+  if (g_source_is_destroyed (g_main_current_source ()))
+    goto out;
+
+  while ((client_socket = g_socket_accept (socket, NULL, NULL))) {
+    g_socket_set_blocking (client_socket, FALSE);
+
+    client = g_new0 (IcstrHttpClient, 1);
+    client->server = server;
+    client->socket = client_socket;
+    client->request = g_string_new (NULL);
+    client->since = g_get_monotonic_time ();
+
+    client->source = g_socket_create_source (client_socket, G_IO_IN, NULL);
+    g_source_set_callback (client->source,
+        (GSourceFunc) icstr_http_client_readable, client, NULL);
+    g_source_attach (client->source, icstr_io_context ());
+
+    server->clients = g_list_prepend (server->clients, client);
+  }
+
+out:
+  g_mutex_unlock (&servers_lock);
+  return G_SOURCE_CONTINUE;
+}
+
+/* drops the connections that never sent a complete request */
+static gboolean
+icstr_http_server_sweep (gpointer data)
+{
+  IcstrHttpServer *server = data;
+  gint64 deadline = g_get_monotonic_time () -
+      REQUEST_TIMEOUT * G_TIME_SPAN_SECOND;
+  GList *curr, *next;
+
+  g_mutex_lock (&servers_lock);
+  if (!g_source_is_destroyed (g_main_current_source ())) {
+    for (curr = server->clients; curr != NULL; curr = next) {
+      IcstrHttpClient *client = curr->data;
+      next = g_list_next (curr);
+
+      if (client->since < deadline)
+        icstr_http_server_drop_client (client);
+    }
+  }
+  g_mutex_unlock (&servers_lock);
+
+  return G_SOURCE_CONTINUE;
+}
+
+/* must be called with servers_lock held */
+static void
+icstr_http_server_free (IcstrHttpServer *server)
+{
+  g_source_destroy (server->accept_source);
+  g_source_unref (server->accept_source);
+  g_source_destroy (server->sweep_source);
+  g_source_unref (server->sweep_source);
+
+  g_list_free_full (server->clients, (GDestroyNotify) icstr_http_client_free);
+  g_hash_table_unref (server->mounts);
+
+  g_socket_close (server->socket, NULL);
+  g_object_unref (server->socket);
+  g_free (server->key);
+  g_free (server);
+}
+
+static IcstrHttpServer *
+icstr_http_server_new (const gchar *address, gint port, GError **error)
+{
+  g_autoptr (GSocketAddress) addr = NULL;
+  g_autoptr (GSocket) socket = NULL;
+  IcstrHttpServer *server = NULL;
+
+  addr = g_inet_socket_address_new_from_string (address, port);
+  if (!addr) {
+    g_set_error (error, ICSTR_ERROR, 0, "Invalid address: %s", address);
+    return NULL;
+  }
+
+  socket = g_socket_new (g_socket_address_get_family (addr),
+      G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_TCP, error);
+  if (!socket)
+    return NULL;
+
+  g_socket_set_blocking (socket, FALSE);
+  g_socket_set_listen_backlog (socket, LISTEN_BACKLOG);
+  if (!g_socket_bind (socket, addr, TRUE, error) ||
+      !g_socket_listen (socket, error))
+    return NULL;
+
+  server = g_new0 (IcstrHttpServer, 1);
+  server->key = g_strdup_printf ("%s:%d", address, port);
+  server->socket = g_steal_pointer (&socket);
+  server->mounts = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                          NULL);
+
+  server->accept_source = g_socket_create_source (server->socket, G_IO_IN,
+                                                  NULL);
+  g_source_set_callback (server->accept_source,
+      (GSourceFunc) icstr_http_server_accept, server, NULL);
+  g_source_attach (server->accept_source, icstr_io_context ());
+
+  server->sweep_source = g_timeout_source_new_seconds (REQUEST_TIMEOUT);
+  g_source_set_callback (server->sweep_source, icstr_http_server_sweep,
+                         server, NULL);
+  g_source_attach (server->sweep_source, icstr_io_context ());
+
+  return server;
+}
+
+static IcstrHttpServer *
+icstr_http_server_attach (const gchar *address, gint port,
+    const gchar *mount, IcstrHttpSink *sink, GError **error)
+{
+  g_autofree gchar *key = g_strdup_printf ("%s:%d", address, port);
+  IcstrHttpServer *server = NULL;
+
+  g_mutex_lock (&servers_lock);
+
+  if (!servers)
+    servers = g_hash_table_new (g_str_hash, g_str_equal);
+
+  server = g_hash_table_lookup (servers, key);
+  if (!server) {
+    server = icstr_http_server_new (address, port, error);
+    if (!server)
+      goto out;
+    g_hash_table_insert (servers, server->key, server);
+  }
+
+  if (g_hash_table_contains (server->mounts, mount)) {
+    g_set_error (error, ICSTR_ERROR, 0, "Mount %s is already served on %s",
+                 mount, key);
+    if (server->refcount == 0) {
+      g_hash_table_remove (servers, server->key);
+      icstr_http_server_free (server);
+    }
+    server = NULL;
+    goto out;
+  }
+
+  g_hash_table_insert (server->mounts, g_strdup (mount), sink);
+  server->refcount++;
+
+out:
+  g_mutex_unlock (&servers_lock);
+  return server;
+}
+
+static void
+icstr_http_server_detach (IcstrHttpServer *server, const gchar *mount)
+{
+  g_mutex_lock (&servers_lock);
+
+  g_hash_table_remove (server->mounts, mount);
+  if (--server->refcount == 0) {
+    g_hash_table_remove (servers, server->key);
+    icstr_http_server_free (server);
+  }
+
+  g_mutex_unlock (&servers_lock);
+}
+
+/* the sink */
+
+static gchar *
+icstr_http_sink_build_response (IcstrHttpSink *sink)
+{
+  g_autoptr (GString) response = g_string_new ("HTTP/1.0 200 OK\r\n");
+
+  GST_OBJECT_LOCK (sink);
+  g_string_append_printf (response, "Content-Type: %s\r\n",
+                          sink->content_type);
+  g_string_append (response, "Cache-Control: no-cache, no-store\r\n");
+  g_string_append (response, "Connection: close\r\n");
+  g_string_append_printf (response, "Server: %s/%s\r\n", PACKAGE_NAME,
+                          PACKAGE_VERSION);
+  if (sink->streamname && *sink->streamname)
+    g_string_append_printf (response, "icy-name: %s\r\n", sink->streamname);
+  if (sink->description && *sink->description)
+    g_string_append_printf (response, "icy-description: %s\r\n",
+                            sink->description);
+  if (sink->genre && *sink->genre)
+    g_string_append_printf (response, "icy-genre: %s\r\n", sink->genre);
+  if (sink->url && *sink->url)
+    g_string_append_printf (response, "icy-url: %s\r\n", sink->url);
+  g_string_append (response, "\r\n");
+  GST_OBJECT_UNLOCK (sink);
+
+  return g_string_free (g_steal_pointer (&response), FALSE);
+}
+
+/* called from the I/O thread, with servers_lock held */
+static gboolean
+icstr_http_sink_add_listener (IcstrHttpSink *sink, GSocket *socket)
+{
+  g_autoptr (GSocketAddress) addr = NULL;
+  g_autoptr (GByteArray) prefix = NULL;
+  g_autofree gchar *response = NULL;
+  IcstrHttpListener *l = NULL;
+  guint max_listeners;
+  gsize burst_size;
+  gboolean ready;
+
+  GST_OBJECT_LOCK (sink);
+  max_listeners = sink->max_listeners;
+  burst_size = sink->burst_size;
+  ready = (sink->content_type != NULL);
+  GST_OBJECT_UNLOCK (sink);
+
+  /* without caps, we do not know what to tell the listener yet */
+  if (!ready)
+    return FALSE;
+
+  response = icstr_http_sink_build_response (sink);
+  prefix = g_byte_array_new ();
+  g_byte_array_append (prefix, (const guint8 *) response, strlen (response));
+
+  l = g_new0 (IcstrHttpListener, 1);
+  l->refcount = 1;
+  l->sink = gst_object_ref (sink);
+  l->socket = g_object_ref (socket);
+
+  addr = g_socket_get_remote_address (socket, NULL);
+  if (addr && G_IS_INET_SOCKET_ADDRESS (addr)) {
+    g_autofree gchar *ip = g_inet_address_to_string (
+        g_inet_socket_address_get_address (G_INET_SOCKET_ADDRESS (addr)));
+    l->peer = g_strdup_printf ("%s:%u", ip,
+        g_inet_socket_address_get_port (G_INET_SOCKET_ADDRESS (addr)));
+  } else {
+    l->peer = g_strdup ("unknown");
+  }
+
+  g_mutex_lock (&sink->lock);
+
+  if (max_listeners > 0 && sink->n_listeners >= max_listeners) {
+    g_mutex_unlock (&sink->lock);
+    GST_INFO_OBJECT (sink, "Refusing listener %s, already serving %u",
+                     l->peer, max_listeners);
+    icstr_http_listener_unref (l);
+    return FALSE;
+  }
+
+  if (sink->headers)
+    g_byte_array_append (prefix, g_bytes_get_data (sink->headers, NULL),
+                         g_bytes_get_size (sink->headers));
+  l->prefix = g_byte_array_free_to_bytes (g_steal_pointer (&prefix));
+  l->seq = icstr_http_sink_burst_start_locked (sink, burst_size);
+
+  sink->listeners = g_list_prepend (sink->listeners, l);
+  l->link = sink->listeners;
+  sink->n_listeners++;
+
+  GST_INFO_OBJECT (sink, "Listener %s joined, %u in total", l->peer,
+                   sink->n_listeners);
+
+  if (!icstr_http_listener_send_locked (l))
+    icstr_http_sink_remove_listener_locked (sink, l);
+
+  g_mutex_unlock (&sink->lock);
+
+  return TRUE;
+}
+
+/* GstBaseSink vfuncs */
+
+static gboolean
+icstr_http_sink_start (GstBaseSink *bsink)
+{
+  IcstrHttpSink *sink = ICSTR_HTTP_SINK (bsink);
+  g_autoptr (GError) error = NULL;
+  g_autofree gchar *address = NULL;
+  gint port;
+
+  GST_OBJECT_LOCK (sink);
+  address = g_strdup (sink->address);
+  port = sink->port;
+  if (sink->mount && sink->mount[0] == '/')
+    sink->server_mount = g_strdup (sink->mount);
+  else
+    sink->server_mount = g_strconcat ("/", sink->mount ? sink->mount : "",
+                                      NULL);
+  GST_OBJECT_UNLOCK (sink);
+
+  sink->server = icstr_http_server_attach (address, port, sink->server_mount,
+                                           sink, &error);
+  if (!sink->server) {
+    GST_ELEMENT_ERROR (sink, RESOURCE, OPEN_READ_WRITE,
+        ("Could not serve http://%s:%d%s", address, port, sink->server_mount),
+        ("%s", error->message));
+    g_clear_pointer (&sink->server_mount, g_free);
+    return FALSE;
+  }
+
+  GST_INFO_OBJECT (sink, "Serving http://%s:%d%s", address, port,
+                   sink->server_mount);
+  return TRUE;
+}
+
+static gboolean
+icstr_http_sink_stop (GstBaseSink *bsink)
+{
+  IcstrHttpSink *sink = ICSTR_HTTP_SINK (bsink);
+
+  /* no new listeners after this */
+  if (sink->server) {
+    icstr_http_server_detach (sink->server, sink->server_mount);
+    sink->server = NULL;
+  }
+  g_clear_pointer (&sink->server_mount, g_free);
+
+  g_mutex_lock (&sink->lock);
+  while (sink->listeners)
+    icstr_http_sink_remove_listener_locked (sink, sink->listeners->data);
+  icstr_http_sink_ring_clear_locked (sink);
+  g_clear_pointer (&sink->headers, g_bytes_unref);
+  sink->caps_headers = FALSE;
+  g_mutex_unlock (&sink->lock);
+
+  GST_OBJECT_LOCK (sink);
+  g_clear_pointer (&sink->content_type, g_free);
+  GST_OBJECT_UNLOCK (sink);
+
+  return TRUE;
+}
+
+static gboolean
+icstr_http_sink_set_caps (GstBaseSink *bsink, GstCaps *caps)
+{
+  IcstrHttpSink *sink = ICSTR_HTTP_SINK (bsink);
+  GstStructure *s = gst_caps_get_structure (caps, 0);
+  g_autoptr (GByteArray) headers = NULL;
+  const gchar *content_type = NULL;
+  const GValue *streamheader = NULL;
+  gint mpegversion = 1;
+  guint i;
+
+  if (gst_structure_has_name (s, "application/ogg") ||
+      gst_structure_has_name (s, "audio/ogg")) {
+    content_type = "application/ogg";
+  } else if (gst_structure_has_name (s, "audio/webm") ||
+      gst_structure_has_name (s, "video/webm")) {
+    content_type = "audio/webm";
+  } else if (gst_structure_has_name (s, "audio/mpeg")) {
+    gst_structure_get_int (s, "mpegversion", &mpegversion);
+    content_type = (mpegversion == 1) ? "audio/mpeg" : "audio/aac";
+  } else {
+    GST_ERROR_OBJECT (sink, "Unsupported caps %" GST_PTR_FORMAT, caps);
+    return FALSE;
+  }
+
+  /* what every listener needs to receive first */
+  streamheader = gst_structure_get_value (s, "streamheader");
+  if (streamheader && GST_VALUE_HOLDS_ARRAY (streamheader)) {
+    headers = g_byte_array_new ();
+    for (i = 0; i < gst_value_array_get_size (streamheader); i++) {
+      GstBuffer *buf = gst_value_get_buffer (
+          gst_value_array_get_value (streamheader, i));
+      GstMapInfo map;
+
+      if (gst_buffer_map (buf, &map, GST_MAP_READ)) {
+        g_byte_array_append (headers, map.data, map.size);
+        gst_buffer_unmap (buf, &map);
+      }
+    }
+  }
+
+  GST_OBJECT_LOCK (sink);
+  g_free (sink->content_type);
+  sink->content_type = g_strdup (content_type);
+  GST_OBJECT_UNLOCK (sink);
+
+  g_mutex_lock (&sink->lock);
+  g_clear_pointer (&sink->headers, g_bytes_unref);
+  if (headers)
+    sink->headers = g_byte_array_free_to_bytes (g_steal_pointer (&headers));
+  sink->caps_headers = (sink->headers != NULL);
+  g_mutex_unlock (&sink->lock);
+
+  return TRUE;
+}
+
+static GstFlowReturn
+icstr_http_sink_render (GstBaseSink *bsink, GstBuffer *buffer)
+{
+  IcstrHttpSink *sink = ICSTR_HTTP_SINK (bsink);
+  gsize buffer_size;
+
+  if (gst_buffer_get_size (buffer) == 0)
+    return GST_FLOW_OK;
+
+  GST_OBJECT_LOCK (sink);
+  buffer_size = sink->buffer_size;
+  GST_OBJECT_UNLOCK (sink);
+
+  g_mutex_lock (&sink->lock);
+
+  if (GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_HEADER)) {
+    /* headers are sent to each listener on its own, not through the ring */
+    if (!sink->caps_headers) {
+      g_autoptr (GByteArray) headers = g_byte_array_new ();
+      GstMapInfo map;
+
+      if (sink->headers)
+        g_byte_array_append (headers, g_bytes_get_data (sink->headers, NULL),
+                             g_bytes_get_size (sink->headers));
+      if (gst_buffer_map (buffer, &map, GST_MAP_READ)) {
+        g_byte_array_append (headers, map.data, map.size);
+        gst_buffer_unmap (buffer, &map);
+      }
+      g_clear_pointer (&sink->headers, g_bytes_unref);
+      sink->headers = g_byte_array_free_to_bytes (g_steal_pointer (&headers));
+    }
+    g_mutex_unlock (&sink->lock);
+    return GST_FLOW_OK;
+  }
+
+  icstr_http_sink_ring_push_locked (sink, buffer, buffer_size);
+
+  /* one wake-up of the I/O thread serves all the listeners */
+  if (sink->listeners && !sink->kick_pending) {
+    sink->kick_pending = TRUE;
+    g_main_context_invoke_full (icstr_io_context (), G_PRIORITY_DEFAULT,
+        icstr_http_sink_kick, gst_object_ref (sink), gst_object_unref);
+  }
+
+  g_mutex_unlock (&sink->lock);
+
+  return GST_FLOW_OK;
+}
+
+/* GObject */
+
+static void
+icstr_http_sink_set_property (GObject *object, guint prop_id,
+    const GValue *value, GParamSpec *pspec)
+{
+  IcstrHttpSink *sink = ICSTR_HTTP_SINK (object);
+
+  GST_OBJECT_LOCK (sink);
+  switch (prop_id) {
+    case PROP_ADDRESS:
+      g_free (sink->address);
+      sink->address = g_value_dup_string (value);
+      break;
+    case PROP_PORT:
+      sink->port = g_value_get_int (value);
+      break;
+    case PROP_MOUNT:
+      g_free (sink->mount);
+      sink->mount = g_value_dup_string (value);
+      break;
+    case PROP_STREAMNAME:
+      g_free (sink->streamname);
+      sink->streamname = g_value_dup_string (value);
+      break;
+    case PROP_DESCRIPTION:
+      g_free (sink->description);
+      sink->description = g_value_dup_string (value);
+      break;
+    case PROP_GENRE:
+      g_free (sink->genre);
+      sink->genre = g_value_dup_string (value);
+      break;
+    case PROP_URL:
+      g_free (sink->url);
+      sink->url = g_value_dup_string (value);
+      break;
+    case PROP_BURST_SIZE:
+      sink->burst_size = g_value_get_uint (value);
+      break;
+    case PROP_BUFFER_SIZE:
+      sink->buffer_size = g_value_get_uint (value);
+      break;
+    case PROP_MAX_LISTENERS:
+      sink->max_listeners = g_value_get_uint (value);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+  GST_OBJECT_UNLOCK (sink);
+}
+
+static void
+icstr_http_sink_get_property (GObject *object, guint prop_id,
+    GValue *value, GParamSpec *pspec)
+{
+  IcstrHttpSink *sink = ICSTR_HTTP_SINK (object);
+
+  if (prop_id == PROP_LISTENERS) {
+    g_mutex_lock (&sink->lock);
+    g_value_set_uint (value, sink->n_listeners);
+    g_mutex_unlock (&sink->lock);
+    return;
+  }
+
+  GST_OBJECT_LOCK (sink);
+  switch (prop_id) {
+    case PROP_ADDRESS:
+      g_value_set_string (value, sink->address);
+      break;
+    case PROP_PORT:
+      g_value_set_int (value, sink->port);
+      break;
+    case PROP_MOUNT:
+      g_value_set_string (value, sink->mount);
+      break;
+    case PROP_STREAMNAME:
+      g_value_set_string (value, sink->streamname);
+      break;
+    case PROP_DESCRIPTION:
+      g_value_set_string (value, sink->description);
+      break;
+    case PROP_GENRE:
+      g_value_set_string (value, sink->genre);
+      break;
+    case PROP_URL:
+      g_value_set_string (value, sink->url);
+      break;
+    case PROP_BURST_SIZE:
+      g_value_set_uint (value, sink->burst_size);
+      break;
+    case PROP_BUFFER_SIZE:
+      g_value_set_uint (value, sink->buffer_size);
+      break;
+    case PROP_MAX_LISTENERS:
+      g_value_set_uint (value, sink->max_listeners);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+  GST_OBJECT_UNLOCK (sink);
+}
+
+static void
+icstr_http_sink_finalize (GObject *object)
+{
+  IcstrHttpSink *sink = ICSTR_HTTP_SINK (object);
+
+  g_free (sink->address);
+  g_free (sink->mount);
+  g_free (sink->streamname);
+  g_free (sink->description);
+  g_free (sink->genre);
+  g_free (sink->url);
+  g_free (sink->content_type);
+  g_free (sink->ring);
+  g_mutex_clear (&sink->lock);
+
+  G_OBJECT_CLASS (icstr_http_sink_parent_class)->finalize (object);
+}
+
+static void
+icstr_http_sink_init (IcstrHttpSink *sink)
+{
+  sink->address = g_strdup (DEFAULT_ADDRESS);
+  sink->port = DEFAULT_PORT;
+  sink->mount = g_strdup ("");
+  sink->burst_size = DEFAULT_BURST_SIZE;
+  sink->buffer_size = DEFAULT_BUFFER_SIZE;
+  sink->max_listeners = DEFAULT_MAX_LISTENERS;
+
+  sink->ring = g_new0 (IcstrHttpPacket, RING_SLOTS);
+  g_mutex_init (&sink->lock);
+
+  /* this is a live stream, send it as soon as it arrives */
+  gst_base_sink_set_sync (GST_BASE_SINK (sink), FALSE);
+}
+
+static void
+icstr_http_sink_class_init (IcstrHttpSinkClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+  GstElementClass *element_class = GST_ELEMENT_CLASS (klass);
+  GstBaseSinkClass *basesink_class = GST_BASE_SINK_CLASS (klass);
+  const GParamFlags flags = G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS;
+
+  gobject_class->set_property = icstr_http_sink_set_property;
+  gobject_class->get_property = icstr_http_sink_get_property;
+  gobject_class->finalize = icstr_http_sink_finalize;
+
+  g_object_class_install_property (gobject_class, PROP_ADDRESS,
+      g_param_spec_string ("address", "address", "Address to listen on",
+          DEFAULT_ADDRESS, flags));
+  g_object_class_install_property (gobject_class, PROP_PORT,
+      g_param_spec_int ("port", "port", "Port to listen on",
+          1, G_MAXUINT16, DEFAULT_PORT, flags));
+  g_object_class_install_property (gobject_class, PROP_MOUNT,
+      g_param_spec_string ("mount", "mount", "Path of the stream", "",
+          flags));
+  g_object_class_install_property (gobject_class, PROP_STREAMNAME,
+      g_param_spec_string ("streamname", "streamname", "Name of the stream",
+          NULL, flags));
+  g_object_class_install_property (gobject_class, PROP_DESCRIPTION,
+      g_param_spec_string ("description", "description",
+          "Description of the stream", NULL, flags));
+  g_object_class_install_property (gobject_class, PROP_GENRE,
+      g_param_spec_string ("genre", "genre", "Genre of the stream", NULL,
+          flags));
+  g_object_class_install_property (gobject_class, PROP_URL,
+      g_param_spec_string ("url", "url", "URL of the stream's website", NULL,
+          flags));
+  g_object_class_install_property (gobject_class, PROP_BURST_SIZE,
+      g_param_spec_uint ("burst-size", "burst-size",
+          "Bytes of recent data sent to new listeners at once",
+          0, G_MAXUINT, DEFAULT_BURST_SIZE, flags));
+  g_object_class_install_property (gobject_class, PROP_BUFFER_SIZE,
+      g_param_spec_uint ("buffer-size", "buffer-size",
+          "Bytes kept for listeners that are behind",
+          1, G_MAXUINT, DEFAULT_BUFFER_SIZE, flags));
+  g_object_class_install_property (gobject_class, PROP_MAX_LISTENERS,
+      g_param_spec_uint ("max-listeners", "max-listeners",
+          "Maximum number of listeners (0 = unlimited)",
+          0, G_MAXUINT, DEFAULT_MAX_LISTENERS, flags));
+  g_object_class_install_property (gobject_class, PROP_LISTENERS,
+      g_param_spec_uint ("listeners", "listeners",
+          "Number of connected listeners", 0, G_MAXUINT, 0,
+          G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  gst_element_class_add_static_pad_template (element_class, &sink_template);
+  gst_element_class_set_static_metadata (element_class,
+      "HTTP stream server", "Sink/Network",
+      "Serves the stream to HTTP listeners",
+      "George Kiagiadakis <gkiagia@tolabaki.gr>");
+
+  basesink_class->start = GST_DEBUG_FUNCPTR (icstr_http_sink_start);
+  basesink_class->stop = GST_DEBUG_FUNCPTR (icstr_http_sink_stop);
+  basesink_class->set_caps = GST_DEBUG_FUNCPTR (icstr_http_sink_set_caps);
+  basesink_class->render = GST_DEBUG_FUNCPTR (icstr_http_sink_render);
+}
+
+gboolean
+icstr_http_sink_register (void)
+{
+  return gst_element_register (NULL, "icstrhttpsink", GST_RANK_NONE,
+                               ICSTR_TYPE_HTTP_SINK);
+}
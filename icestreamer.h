@@ -16,13 +16,32 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
+#include "config.h"
 #include <glib-unix.h>
 #include <gst/gst.h>
 #include <gio/gio.h>
-#include "config.h"
 
-/* ammount of seconds to wait before attempting to reconnect a stream */
-#define RECONNECT_TIMEOUT 5
+/* reconnection delays in milliseconds; the first retry happens within
+ * RECONNECT_FAST_DELAY, then the delay doubles after every failed attempt,
+ * starting from RECONNECT_DELAY and up to RECONNECT_MAX_DELAY */
+#define RECONNECT_FAST_DELAY 500
+#define RECONNECT_DELAY 2000
+#define RECONNECT_MAX_DELAY 60000
+
+/* seconds a destination must stay connected to reset its backoff */
+#define RECONNECT_STABLE_TIME 30
+
+/* default limits of the outage backlog of a destination */
+#define BACKLOG_MAX_BYTES (16 * 1024 * 1024)
+#define BACKLOG_BURST 2.0
+
+/* channels that the level meter can measure, and the level of silence */
+#define ICSTR_METER_MAX_CHANNELS 64
+#define ICSTR_METER_FLOOR -100.0
+
+/* default limits of the leaky queues of streams and destinations */
+#define QUEUE_TIME 1000
+#define QUEUE_BYTES (10 * 1024 * 1024)
 
 GST_DEBUG_CATEGORY_EXTERN (icestreamer_debug);
 #define GST_CAT_DEFAULT icestreamer_debug
@@ -50,9 +69,87 @@ struct icsr_gui {
   guint      max_height;
   guint      base_height;
   guint      height_inc;
+  guint      meter_source;
 };
 #endif
 
+typedef struct _IcstrBacklog IcstrBacklog;
+typedef struct _IcstrMeter IcstrMeter;
+typedef struct _IcstrMetrics IcstrMetrics;
+typedef struct _IcstrCpu IcstrCpu;
+typedef struct _IcstrLatency IcstrLatency;
+typedef struct _IcstrSilence IcstrSilence;
+typedef struct _IcstrFailover IcstrFailover;
+typedef struct _IcstrControl IcstrControl;
+typedef struct _IcstrMetadata IcstrMetadata;
+typedef struct _IcstrMetadataTarget IcstrMetadataTarget;
+typedef struct _IcstrQueue IcstrQueue;
+typedef struct _IcstrQueueStats IcstrQueueStats;
+typedef struct _IcstrConversion IcstrConversion;
+typedef struct _IcstrStream IcstrStream;
+typedef struct _IcstrDestination IcstrDestination;
+
+/* The state of a leaky queue, as reported */
+struct _IcstrQueueStats
+{
+  guint level_buffers;
+  guint level_bytes;
+  GstClockTime level_time;
+  guint overruns;
+  guint64 dropped;              /* buffers */
+};
+
+/* A format conversion shared by all streams that need the same raw caps */
+struct _IcstrConversion
+{
+  GstCaps *caps;                /* the target raw caps */
+  GstElement *bin;              /* owned by the pipeline */
+  GstElement *tee;              /* owned by bin */
+  GList *streams;               /* weak pointers to the streams it feeds */
+};
+
+/* A server that receives the encoded output of a stream */
+struct _IcstrDestination
+{
+  gchar *name;                  /* the keyfile group of the destination */
+  IcstrStream *stream;          /* weak pointer to the stream that feeds us */
+  GstElement *bin;              /* owned by the stream bin */
+  IcstrQueue *queue;
+  GstElement *sink;             /* owned by bin */
+  IcstrMetadataTarget *metadata;
+
+  /* reconnection state */
+  guint reconnect_delay;        /* ms */
+  guint reconnect_max_delay;    /* ms */
+  guint reconnect_source;       /* pending reconnection timer, 0 if none */
+  guint failures;               /* consecutive failed connection attempts */
+  gint64 connected_since;       /* monotonic time of the last attempt */
+  gint needs_headers;           /* atomic, replay the stream headers */
+  guint reconnects;             /* reconnection attempts, for the metrics */
+  gint64 last_error;            /* monotonic time of the last error, or 0 */
+
+  /* outage handling */
+  GstPad *tee_pad;              /* the request pad of the stream's tee */
+  gint connected;               /* atomic, linked to tee_pad */
+  IcstrBacklog *backlog;        /* NULL if disabled */
+  gdouble backlog_burst;        /* catch-up rate, relative to real time */
+  gboolean draining;            /* only used from the streaming thread */
+};
+
+/* An encoder whose output is sent to one or more destinations */
+struct _IcstrStream
+{
+  gchar *name;                  /* the keyfile group of the stream */
+  GstElement *bin;
+  IcstrQueue *queue;
+  GstElement *encoder;          /* owned by bin */
+  GstElement *tee;              /* owned by bin */
+  GstElement *upstream_tee;     /* the tee that feeds us, owned by the pipeline */
+  IcstrConversion *conversion;  /* weak pointer, NULL if fed from the input */
+  GList *destinations;
+  gboolean stopped;             /* on request, see icstr_stream_stop() */
+};
+
 typedef struct _IceStreamer IceStreamer;
 struct _IceStreamer
 {
@@ -60,11 +157,18 @@ struct _IceStreamer
   GstElement *tee;              /* owned by the pipeline */
   GMainLoop *loop;              /* weak pointer, not owned by us */
   GList *streams;
-  GList *disconnected_streams;
-  guint timeout_source;
-  GFile *mtdat_file;
-  GFileMonitor *mtdat_file_monitor;
-  GstTagList   *tags;
+  GList *conversions;
+  IcstrMetadata *metadata;
+  IcstrMeter *meter;            /* NULL if nothing needs it */
+  IcstrMetrics *metrics;        /* NULL if disabled */
+  IcstrCpu *cpu;
+  IcstrLatency *latency;        /* NULL if disabled */
+  IcstrSilence *silence;        /* NULL if disabled */
+  IcstrFailover *failover;      /* NULL without a backup input */
+  IcstrControl *control;        /* NULL if disabled */
+  gchar *relay_codec;           /* of the input, NULL if it is raw */
+  GKeyFile *keyfile;            /* the configuration that is running */
+  gchar *conf_file;
   GThread      *gui_thread;
 #ifndef DISABLE_GUI
   struct icsr_gui gui;
@@ -77,6 +181,12 @@ struct _IceStreamer
 gchar* icstr_keyfile_get_string_with_fallback (GKeyFile *keyfile,
     const gchar *group, const gchar *key, const gchar *fallback);
 
+gint icstr_keyfile_get_integer_with_fallback (GKeyFile *keyfile,
+    const gchar *group, const gchar *key, gint fallback);
+
+gdouble icstr_keyfile_get_double_with_fallback (GKeyFile *keyfile,
+    const gchar *group, const gchar *key, gdouble fallback);
+
 gboolean
 icstr_object_set_properties_from_keyfile (gpointer object,
     GKeyFile *keyfile, const gchar *group, GError **error);
@@ -84,27 +194,183 @@ icstr_object_set_properties_from_keyfile (gpointer object,
 GstElement* icstr_element_factory_make_with_group_name (const gchar *factory,
     const gchar *group);
 
+gboolean icstr_keyfile_is_reserved_group (const gchar *group);
+gchar** icstr_keyfile_get_destinations (GKeyFile *keyfile, const gchar *group);
+gchar** icstr_keyfile_get_stream_groups (GKeyFile *keyfile);
+
 /* source.c */
+GstCaps* icstr_source_get_caps (GKeyFile *keyfile);
+gchar* icstr_source_get_relay_codec (GKeyFile *keyfile);
+const gchar* icstr_source_get_relay_decoder (const gchar *codec);
+
 GstElement* icstr_construct_source (IceStreamer *self,
-    GKeyFile *keyfile, GError **error);
+    GKeyFile *keyfile, const gchar *group, GError **error);
 
 /* stream.c */
-GstElement* icstr_construct_stream (IceStreamer *self,
+IcstrStream* icstr_construct_stream (IceStreamer *self,
     GKeyFile *keyfile, const gchar *group, GError **error);
 
+void icstr_stream_free (IcstrStream *stream);
+void icstr_stream_stop (IceStreamer *self, IcstrStream *stream);
+gboolean icstr_stream_start (IceStreamer *self, IcstrStream *stream,
+    GError **error);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (IcstrStream, icstr_stream_free);
+
+IcstrDestination* icstr_lookup_destination (IceStreamer *self,
+    GstObject *sink);
+
+void icstr_destination_disconnect (IcstrDestination *dest);
+
+IcstrDestination* icstr_stream_add_destination (IcstrStream *stream,
+    GKeyFile *keyfile, const gchar *group, GError **error);
+
+void icstr_stream_remove_destination (IcstrStream *stream,
+    IcstrDestination *dest);
+
+/* backlog.c */
+IcstrBacklog* icstr_backlog_new (gsize max_bytes, GstClockTime max_time);
+void icstr_backlog_free (IcstrBacklog *backlog);
+void icstr_backlog_clear (IcstrBacklog *backlog);
+gboolean icstr_backlog_is_empty (IcstrBacklog *backlog);
+void icstr_backlog_push (IcstrBacklog *backlog, GstBuffer *buffer);
+GstBuffer* icstr_backlog_pop (IcstrBacklog *backlog);
+
+/* queue.c */
+IcstrQueue* icstr_queue_new (GKeyFile *keyfile, const gchar *group,
+    const gchar *parent_group, const gchar *name);
+void icstr_queue_free (IcstrQueue *queue);
+void icstr_queue_get_stats (IcstrQueue *queue, IcstrQueueStats *stats);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (IcstrQueue, icstr_queue_free);
+
+/* convert.c */
+gboolean icstr_link_stream (IceStreamer *self, GKeyFile *keyfile,
+    IcstrStream *stream, GError **error);
+
+void icstr_unlink_stream (IceStreamer *self, IcstrStream *stream);
+
+void icstr_log_conversions (IceStreamer *self);
+
+void icstr_conversion_free (IcstrConversion *conv);
+
+/* shoutsink.c */
+gboolean icstr_shout_sink_register (void);
+
+/* httpsink.c */
+gboolean icstr_http_sink_register (void);
+
+/* filesink.c */
+gboolean icstr_file_sink_register (void);
+
+/* hlssink.c */
+gboolean icstr_hls_sink_register (void);
+
+/* iothread.c */
+GMainContext* icstr_io_context (void);
+
+/* meter.c */
+typedef void (*IcstrMeterFunc) (const gdouble *rms, guint channels,
+    GstClockTime duration, gpointer data);
+
+IcstrMeter* icstr_meter_new (GstPad *pad);
+void icstr_meter_free (IcstrMeter *meter);
+void icstr_meter_add_watch (IcstrMeter *meter, IcstrMeterFunc func,
+    gpointer data);
+guint icstr_meter_get_levels (IcstrMeter *meter, gdouble *rms, gdouble *peak,
+    guint n_channels);
+GstClockTime icstr_meter_get_running_time (IcstrMeter *meter);
+
+/* metrics.c */
+gboolean icstr_metrics_setup (IceStreamer *self, GKeyFile *keyfile,
+    GError **error);
+
+void icstr_metrics_free (IcstrMetrics *metrics);
+gchar* icstr_metrics_format_json (IcstrMetrics *metrics);
+void icstr_metrics_add_stream (IcstrMetrics *metrics, IcstrStream *stream);
+void icstr_metrics_remove_stream (IcstrMetrics *metrics, IcstrStream *stream);
+void icstr_metrics_add_destination (IcstrMetrics *metrics,
+    IcstrDestination *dest);
+void icstr_metrics_remove_destination (IcstrMetrics *metrics,
+    IcstrDestination *dest);
+
+/* latency.c */
+gboolean icstr_latency_setup (IceStreamer *self, GKeyFile *keyfile,
+    GError **error);
+
+void icstr_latency_free (IcstrLatency *latency);
+
+/* silence.c */
+gboolean icstr_silence_setup (IceStreamer *self, GKeyFile *keyfile,
+    GError **error);
+void icstr_silence_free (IcstrSilence *silence);
+gboolean icstr_silence_get_state (IcstrSilence *silence, guint *events);
+
+/* failover.c */
+IcstrFailover* icstr_failover_new (IceStreamer *self, GKeyFile *keyfile,
+    GstElement *primary, GstElement *backup, GError **error);
+void icstr_failover_free (IcstrFailover *failover);
+gboolean icstr_failover_handle_error (IcstrFailover *failover, GstObject *src,
+    const GError *error);
+void icstr_failover_set_silent (IcstrFailover *failover, gboolean silent);
+IcstrMeter* icstr_failover_get_primary_meter (IcstrFailover *failover);
+gboolean icstr_failover_get_state (IcstrFailover *failover, guint *switches);
+void icstr_failover_force (IcstrFailover *failover, gboolean backup);
+
+/* control.c */
+gboolean icstr_control_setup (IceStreamer *self, GKeyFile *keyfile,
+    GError **error);
+void icstr_control_free (IcstrControl *control);
+
+/* calibrate.c */
+gboolean icstr_calibrate (const gchar *conf_file, GError **error);
+
+/* startup.c */
+void icstr_startup_begin (void);
+void icstr_startup_mark (const gchar *format, ...) G_GNUC_PRINTF (1, 2);
+void icstr_startup_watch (IceStreamer *self);
+void icstr_startup_handle_connected (GstMessage *msg);
+
+/* bench.c */
+void icstr_bench_start (IceStreamer *self);
+void icstr_bench_stop (void);
+void icstr_bench_handle_stream_status (GstMessage *msg);
+gboolean icstr_bench_write_results (IceStreamer *self, const gchar *file,
+    GError **error);
+
+/* cpu.c */
+IcstrCpu *icstr_cpu_new (IceStreamer *self);
+void icstr_cpu_free (IcstrCpu *cpu);
+void icstr_cpu_handle_stream_status (IcstrCpu *cpu, GstMessage *msg);
+gdouble icstr_cpu_get_stream (IcstrCpu *cpu, IcstrStream *stream);
+gdouble icstr_cpu_get_input (IcstrCpu *cpu);
+
+/* sched.c */
+gboolean icstr_sched_attach (GstElement *bin, GKeyFile *keyfile,
+    const gchar *group, GError **error);
+
+void icstr_sched_handle_stream_status (GstMessage *msg);
+
+/* reload.c */
+void icstr_reload (IceStreamer *self);
+
 /* metadata.c */
-gboolean
-icstr_setup_metadata_handler (IceStreamer *self, GKeyFile *keyfile,
+IcstrMetadata* icstr_metadata_new (IceStreamer *self);
+gboolean icstr_metadata_setup (IcstrMetadata *md, GKeyFile *keyfile,
     GError **error);
+void icstr_metadata_stop (IcstrMetadata *md);
+void icstr_metadata_free (IcstrMetadata *md);
+void icstr_metadata_set (IcstrMetadata *md, const gchar *artist,
+    const gchar *title);
+void icstr_metadata_apply (IcstrMetadata *md, IcstrDestination *dest);
+IcstrMetadataTarget* icstr_metadata_target_new (GstElement *sink,
+    GstClockTimeDiff offset);
+void icstr_metadata_target_free (IcstrMetadataTarget *target);
 
 #ifndef DISABLE_GUI
 /* gui.c */
 void
 icstr_init_gui(IceStreamer *self);
 void
-icstr_gui_update_levels(IceStreamer *self, double rms_l, double rms_r);
-void
-icstr_gui_update_time_label(IceStreamer *self, GstClockTime tstamp);
-void
 icstr_gui_destroy (IceStreamer *self);
 #endif
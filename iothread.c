@@ -0,0 +1,54 @@
+/*
+ * IceStreamer - A simple live audio streamer
+ *
+ * Copyright (C) 2017 George Kiagiadakis <gkiagia@tolabaki.gr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "icestreamer.h"
+
+/*
+ * A single thread that runs the socket I/O of all our network elements,
+ * so that they do not need a thread each. It is started on first use
+ * and lives as long as the process.
+ */
+
+static gpointer
+icstr_io_thread_func (gpointer data)
+{
+  GMainContext *context = data;
+  g_autoptr (GMainLoop) loop = g_main_loop_new (context, FALSE);
+
+  g_main_context_push_thread_default (context);
+  g_main_loop_run (loop);
+  g_main_context_pop_thread_default (context);
+
+  return NULL;
+}
+
+GMainContext *
+icstr_io_context (void)
+{
+  static GMainContext *context = NULL;
+
+  if (g_once_init_enter (&context)) {
+    GMainContext *new_context = g_main_context_new ();
+
+    g_thread_unref (g_thread_new ("icstr-io", icstr_io_thread_func,
+                                  new_context));
+    g_once_init_leave (&context, new_context);
+  }
+
+  return context;
+}
@@ -0,0 +1,417 @@
+/*
+ * IceStreamer - A simple live audio streamer
+ *
+ * Copyright (C) 2017 George Kiagiadakis <gkiagia@tolabaki.gr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "icestreamer.h"
+#include <stdatomic.h>
+
+/*
+ * Latency tracing. A buffer's timestamp is the time it was captured at,
+ * and it is carried through the conversion, the encoder and the muxer,
+ * so at any point of the pipeline, the clock's running time minus the
+ * running time of the buffer is how long ago it was captured.
+ *
+ * That age is measured at the source, after the queue of each stream,
+ * after its encoder and muxer, and at the sink of each destination, into
+ * histograms that are reported periodically. The latency added by each
+ * stage is the difference of the median ages of consecutive points.
+ *
+ * Only the streaming thread of a point writes its histogram, which only
+ * ever grows, with relaxed atomic operations, so that tracing takes no
+ * lock on the way of the buffers. The main thread reports the difference
+ * from what it saw the last time.
+ *
+ * Nothing of this is installed unless tracing is enabled.
+ */
+
+#define DEFAULT_LATENCY_INTERVAL 10
+
+/* logarithmic buckets of microseconds with 8 sub-buckets per power of two,
+ * i.e. within 12.5%; 320 buckets go beyond anything we could measure */
+#define HISTOGRAM_SUB_BUCKETS 8
+#define HISTOGRAM_BUCKETS 320
+
+typedef struct _IcstrLatencyPoint IcstrLatencyPoint;
+struct _IcstrLatencyPoint
+{
+  gchar *name;
+  GstElement *pipeline;         /* weak pointer */
+  GstPad *pad;
+  gulong probe;
+  gint refcount;                /* one for the probe, one for us */
+  GstSegment segment;           /* only used from the streaming thread */
+
+  /* written by the streaming thread; max is reset by the main thread */
+  atomic_uint_fast64_t max;     /* us */
+  atomic_uint_fast64_t buckets[HISTOGRAM_BUCKETS];
+
+  /* only used from the main thread, as of the last report */
+  guint64 last_buckets[HISTOGRAM_BUCKETS];
+};
+
+typedef struct _IcstrLatencyStream IcstrLatencyStream;
+struct _IcstrLatencyStream
+{
+  gchar *name;
+  GPtrArray *points;            /* the points of the stream, in order */
+  GPtrArray *destinations;      /* the points of the destinations */
+};
+
+struct _IcstrLatency
+{
+  IcstrLatencyPoint *source;
+  GPtrArray *points;            /* all the points, owned */
+  GList *streams;
+  guint report_source;
+};
+
+static guint
+icstr_latency_bucket (guint64 us)
+{
+  guint shift;
+
+  if (us < HISTOGRAM_SUB_BUCKETS)
+    return us;
+
+  shift = g_bit_storage (us) - 4;
+  return MIN (HISTOGRAM_SUB_BUCKETS * (shift + 1) +
+      ((us >> shift) & (HISTOGRAM_SUB_BUCKETS - 1)), HISTOGRAM_BUCKETS - 1);
+}
+
+/* the lower bound of a bucket */
+static guint64
+icstr_latency_bucket_value (guint bucket)
+{
+  guint shift;
+
+  if (bucket < HISTOGRAM_SUB_BUCKETS)
+    return bucket;
+
+  shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+  return (guint64) (HISTOGRAM_SUB_BUCKETS + bucket % HISTOGRAM_SUB_BUCKETS)
+      << shift;
+}
+
+static GstPadProbeReturn
+icstr_latency_probe (GstPad *pad, GstPadProbeInfo *info, gpointer data)
+{
+  IcstrLatencyPoint *point = data;
+  g_autoptr (GstClock) clock = NULL;
+  GstClockTime now, running_time, pts;
+  GstBuffer *buffer;
+  GstEvent *event;
+  guint64 age, max;
+
+  if (info->type & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM) {
+    event = GST_PAD_PROBE_INFO_EVENT (info);
+    if (GST_EVENT_TYPE (event) == GST_EVENT_SEGMENT)
+      gst_event_copy_segment (event, &point->segment);
+    return GST_PAD_PROBE_OK;
+  }
+
+  /* stream headers and the like have no timestamp */
+  buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+  pts = GST_BUFFER_PTS (buffer);
+  if (!GST_CLOCK_TIME_IS_VALID (pts) ||
+      point->segment.format != GST_FORMAT_TIME)
+    return GST_PAD_PROBE_OK;
+
+  running_time = gst_segment_to_running_time (&point->segment,
+      GST_FORMAT_TIME, pts);
+  clock = gst_element_get_clock (point->pipeline);
+  if (!clock || !GST_CLOCK_TIME_IS_VALID (running_time))
+    return GST_PAD_PROBE_OK;
+
+  now = gst_clock_get_time (clock) -
+      gst_element_get_base_time (point->pipeline);
+  age = (now > running_time) ? (now - running_time) / GST_USECOND : 0;
+
+  atomic_fetch_add_explicit (&point->buckets[icstr_latency_bucket (age)], 1,
+                             memory_order_relaxed);
+
+  /* only contended when the report resets it; a failed exchange reloads
+   * max, so this ends as soon as it is at least age */
+  max = atomic_load_explicit (&point->max, memory_order_relaxed);
+  while (age > max) {
+    if (atomic_compare_exchange_weak_explicit (&point->max, &max, age,
+            memory_order_relaxed, memory_order_relaxed))
+      break;
+  }
+
+  return GST_PAD_PROBE_OK;
+}
+
+static void
+icstr_latency_point_unref (IcstrLatencyPoint *point)
+{
+  if (!g_atomic_int_dec_and_test (&point->refcount))
+    return;
+
+  gst_object_unref (point->pad);
+  g_free (point->name);
+  g_free (point);
+}
+
+static IcstrLatencyPoint *
+icstr_latency_add_point (IcstrLatency *latency, GstElement *pipeline,
+    GstPad *pad, const gchar *name)
+{
+  IcstrLatencyPoint *point = g_new0 (IcstrLatencyPoint, 1);
+
+  point->name = g_strdup (name);
+  point->pipeline = pipeline;
+  gst_segment_init (&point->segment, GST_FORMAT_UNDEFINED);
+  g_ptr_array_add (latency->points, point);
+
+  /* the probe may still be running when it is removed, so it is GStreamer
+   * that drops its reference, once it is done with it */
+  point->refcount = 2;
+  point->pad = gst_object_ref (pad);
+  point->probe = gst_pad_add_probe (pad,
+      GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+      icstr_latency_probe, point,
+      (GDestroyNotify) icstr_latency_point_unref);
+
+  return point;
+}
+
+static IcstrLatencyPoint *
+icstr_latency_add_element_point (IcstrLatency *latency, GstElement *pipeline,
+    GstElement *element, const gchar *pad_name, const gchar *name)
+{
+  g_autoptr (GstPad) pad = gst_element_get_static_pad (element, pad_name);
+
+  return icstr_latency_add_point (latency, pipeline, pad, name);
+}
+
+static void
+icstr_latency_point_free (IcstrLatencyPoint *point)
+{
+  gst_pad_remove_probe (point->pad, point->probe);
+  icstr_latency_point_unref (point);
+}
+
+static void
+icstr_latency_stream_free (IcstrLatencyStream *ls)
+{
+  g_ptr_array_unref (ls->points);
+  g_ptr_array_unref (ls->destinations);
+  g_free (ls->name);
+  g_free (ls);
+}
+
+typedef struct _IcstrLatencySummary IcstrLatencySummary;
+struct _IcstrLatencySummary
+{
+  guint64 count;
+  gdouble p50;                  /* ms */
+  gdouble p99;                  /* ms */
+  gdouble max;                  /* ms */
+};
+
+static guint64
+icstr_latency_quantile (const guint64 *buckets, guint64 count, gdouble q)
+{
+  guint64 rank = (guint64) (q * (count - 1)) + 1;
+  guint64 seen = 0;
+  guint i;
+
+  for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    seen += buckets[i];
+    if (seen >= rank)
+      return icstr_latency_bucket_value (i);
+  }
+
+  return icstr_latency_bucket_value (HISTOGRAM_BUCKETS - 1);
+}
+
+/* summarizes what the histogram has gained since the last interval; a
+ * buffer that is being counted meanwhile may only show up in the next */
+static void
+icstr_latency_point_collect (IcstrLatencyPoint *point,
+    IcstrLatencySummary *summary)
+{
+  guint64 buckets[HISTOGRAM_BUCKETS];
+  guint64 value;
+  guint i;
+
+  summary->count = 0;
+  for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    value = atomic_load_explicit (&point->buckets[i], memory_order_relaxed);
+    buckets[i] = value - point->last_buckets[i];
+    point->last_buckets[i] = value;
+    summary->count += buckets[i];
+  }
+  summary->max = atomic_exchange_explicit (&point->max, 0,
+      memory_order_relaxed) / 1000.0;
+
+  if (summary->count == 0)
+    return;
+
+  summary->p50 = icstr_latency_quantile (buckets, summary->count, 0.5) / 1e3;
+  summary->p99 = icstr_latency_quantile (buckets, summary->count, 0.99) / 1e3;
+}
+
+static void
+icstr_latency_log (const gchar *stream, const IcstrLatencyPoint *point,
+    const IcstrLatencySummary *summary, gdouble previous)
+{
+  if (summary->count == 0) {
+    GST_INFO ("Latency of %s at %s: no data", stream, point->name);
+    return;
+  }
+
+  GST_INFO ("Latency of %s at %s: +%.1f ms "
+      "(since capture p50 %.1f, p99 %.1f, max %.1f ms)", stream, point->name,
+      MAX (summary->p50 - previous, 0), summary->p50, summary->p99,
+      summary->max);
+}
+
+static gboolean
+icstr_latency_report (gpointer data)
+{
+  IcstrLatency *latency = data;
+  g_autoptr (GHashTable) summaries = NULL;
+  IcstrLatencySummary *summary, *last;
+  GList *curr;
+  guint i, j;
+
+  /* the source point is shared by all streams, so collect everything first */
+  summaries = g_hash_table_new_full (NULL, NULL, NULL, g_free);
+  for (i = 0; i < latency->points->len; i++) {
+    IcstrLatencyPoint *point = g_ptr_array_index (latency->points, i);
+
+    summary = g_new0 (IcstrLatencySummary, 1);
+    icstr_latency_point_collect (point, summary);
+    g_hash_table_insert (summaries, point, summary);
+  }
+
+  for (curr = latency->streams; curr != NULL; curr = g_list_next (curr)) {
+    IcstrLatencyStream *ls = curr->data;
+    gdouble previous = 0;
+
+    for (i = 0; i < ls->points->len; i++) {
+      IcstrLatencyPoint *point = g_ptr_array_index (ls->points, i);
+
+      summary = g_hash_table_lookup (summaries, point);
+      icstr_latency_log (ls->name, point, summary, previous);
+      if (summary->count > 0)
+        previous = summary->p50;
+    }
+
+    /* the destination sinks are the end of the line */
+    last = g_hash_table_lookup (summaries,
+        g_ptr_array_index (ls->points, ls->points->len - 1));
+    for (j = 0; j < ls->destinations->len; j++) {
+      IcstrLatencyPoint *point = g_ptr_array_index (ls->destinations, j);
+
+      summary = g_hash_table_lookup (summaries, point);
+      icstr_latency_log (ls->name, point, summary,
+                         last->count > 0 ? last->p50 : previous);
+    }
+  }
+
+  return G_SOURCE_CONTINUE;
+}
+
+gboolean
+icstr_latency_setup (IceStreamer *self, GKeyFile *keyfile, GError **error)
+{
+  IcstrLatency *latency = g_new0 (IcstrLatency, 1);
+  g_autoptr (GstPad) tee_sinkpad = NULL;
+  g_autoptr (GstPad) source_pad = NULL;
+  GList *curr, *dcurr;
+  gint interval;
+
+  self->latency = latency;
+  latency->points = g_ptr_array_new_with_free_func (
+      (GDestroyNotify) icstr_latency_point_free);
+
+  /* the ghost pad of the source bin, after its capsfilter */
+  tee_sinkpad = gst_element_get_static_pad (self->tee, "sink");
+  source_pad = gst_pad_get_peer (tee_sinkpad);
+  if (!source_pad) {
+    g_set_error (error, ICSTR_ERROR, 0,
+        "Failed to trace latency: the source is not linked");
+    return FALSE;
+  }
+  latency->source = icstr_latency_add_point (latency, self->pipeline,
+      source_pad, "source");
+
+  for (curr = self->streams; curr != NULL; curr = g_list_next (curr)) {
+    IcstrStream *stream = curr->data;
+    IcstrLatencyStream *ls = g_new0 (IcstrLatencyStream, 1);
+    g_autoptr (GstPad) tee_pad = NULL;
+    g_autoptr (GstPad) peer = NULL;
+    g_autoptr (GstElement) muxer = NULL;
+    IcstrLatencyPoint *point;
+
+    ls->name = g_strdup (stream->name);
+    ls->points = g_ptr_array_new ();
+    ls->destinations = g_ptr_array_new ();
+    g_ptr_array_add (ls->points, latency->source);
+
+    point = icstr_latency_add_element_point (latency, self->pipeline,
+        stream->queue->element, "src", "queue");
+    g_ptr_array_add (ls->points, point);
+    point = icstr_latency_add_element_point (latency, self->pipeline,
+        stream->encoder, "src", "encoder");
+    g_ptr_array_add (ls->points, point);
+
+    /* whatever feeds the tee, if not the encoder itself, is the muxer */
+    tee_pad = gst_element_get_static_pad (stream->tee, "sink");
+    peer = gst_pad_get_peer (tee_pad);
+    muxer = peer ? gst_pad_get_parent_element (peer) : NULL;
+    if (muxer && muxer != stream->encoder) {
+      point = icstr_latency_add_point (latency, self->pipeline, peer, "muxer");
+      g_ptr_array_add (ls->points, point);
+    }
+
+    for (dcurr = stream->destinations; dcurr != NULL;
+        dcurr = g_list_next (dcurr)) {
+      IcstrDestination *dest = dcurr->data;
+      g_autofree gchar *name = g_strdup_printf ("destination %s", dest->name);
+
+      point = icstr_latency_add_element_point (latency, self->pipeline,
+          dest->sink, "sink", name);
+      g_ptr_array_add (ls->destinations, point);
+    }
+
+    latency->streams = g_list_append (latency->streams, ls);
+  }
+
+  interval = icstr_keyfile_get_integer_with_fallback (keyfile, "latency",
+      "interval", DEFAULT_LATENCY_INTERVAL);
+  latency->report_source = g_timeout_add_seconds (MAX (interval, 1),
+      icstr_latency_report, latency);
+
+  return TRUE;
+}
+
+void
+icstr_latency_free (IcstrLatency *latency)
+{
+  if (latency->report_source)
+    g_source_remove (latency->report_source);
+
+  /* also removes the probes, so that tracing can be set up again after
+   * the streams change */
+  g_list_free_full (latency->streams,
+                    (GDestroyNotify) icstr_latency_stream_free);
+  g_ptr_array_unref (latency->points);
+  g_free (latency);
+}
@@ -24,20 +24,37 @@ G_DEFINE_QUARK (icestreamer-error-domain, icstr_error_domain);
 static void
 ice_streamer_free (IceStreamer * streamer)
 {
+  g_list_free_full (streamer->streams, (GDestroyNotify) icstr_stream_free);
+  g_list_free_full (streamer->conversions,
+                    (GDestroyNotify) icstr_conversion_free);
+  /* the input may be open even if the pipeline never started */
+  if (streamer->pipeline)
+    gst_element_set_state (streamer->pipeline, GST_STATE_NULL);
   g_clear_object (&streamer->pipeline);
+  g_clear_pointer (&streamer->cpu, icstr_cpu_free);
+  g_clear_pointer (&streamer->metrics, icstr_metrics_free);
+  g_clear_pointer (&streamer->meter, icstr_meter_free);
+  g_clear_pointer (&streamer->latency, icstr_latency_free);
+  g_clear_pointer (&streamer->silence, icstr_silence_free);
+  g_clear_pointer (&streamer->failover, icstr_failover_free);
+  g_clear_pointer (&streamer->control, icstr_control_free);
+  g_clear_pointer (&streamer->metadata, icstr_metadata_free);
+  g_clear_pointer (&streamer->keyfile, g_key_file_unref);
+  g_free (streamer->conf_file);
+  g_free (streamer->relay_codec);
   g_free (streamer);
 }
 
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (IceStreamer, ice_streamer_free);
 
-
 static gboolean
-icstr_load (IceStreamer *self, const gchar *conf_file, gboolean show_gui)
+icstr_load (IceStreamer *self, const gchar *conf_file, gboolean show_gui,
+    gboolean trace_latency)
 {
   g_autoptr (GKeyFile) keyfile = NULL;
   g_autoptr (GstElement) source = NULL;
+  g_autoptr (GstElement) backup = NULL;
   g_autoptr (GError) error = NULL;
-  g_autoptr (GstCaps) caps = NULL;
   gchar **groups;
   gchar **group;
   guint streams_linked = 0;
@@ -51,72 +68,62 @@ icstr_load (IceStreamer *self, const gchar *conf_file, gboolean show_gui)
     return FALSE;
   }
 
-  source = icstr_construct_source (self, keyfile, &error);
+  icstr_startup_mark ("configuration parsed");
+
+  source = icstr_construct_source (self, keyfile, "input", &error);
   if (!source) {
     GST_ERROR ("%s", error->message);
     return FALSE;
   }
 
+  icstr_startup_mark ("input ready");
+
+  /* the streams pass an encoded input through, or decode it themselves */
+  self->relay_codec = icstr_source_get_relay_codec (keyfile);
+
+  /* the backup input is optional; run without it if it does not work */
+  if (self->relay_codec && g_key_file_has_group (keyfile, "input.backup")) {
+    GST_WARNING ("No input failover: a relayed input cannot be switched");
+  } else if (g_key_file_has_group (keyfile, "input.backup")) {
+    backup = icstr_construct_source (self, keyfile, "input.backup", &error);
+    if (!backup) {
+      GST_WARNING ("No input failover: %s", error->message);
+      g_clear_error (&error);
+    }
+  }
+
   self->pipeline = gst_pipeline_new (NULL);
   self->tee = gst_element_factory_make ("tee", NULL);
   g_object_set (self->tee, "allow-not-linked", TRUE, NULL);
 
   gst_bin_add_many (GST_BIN (self->pipeline), source, self->tee, NULL);
 
-  if (!gst_element_link (source, self->tee)) {
+  if (backup) {
+    self->failover = icstr_failover_new (self, keyfile, source, backup,
+                                         &error);
+    if (!self->failover) {
+      GST_ERROR ("%s", error->message);
+      return FALSE;
+    }
+  } else if (!gst_element_link (source, self->tee)) {
     GST_ERROR ("Failed to link source with tee");
     return FALSE;
   }
 
-#ifndef DISABLE_GUI
-  if (show_gui) {
-    GstElement *audioconvert, *level, *fakesink;
-
-    audioconvert = gst_element_factory_make ("audioconvert", NULL);
-    level = gst_element_factory_make ("level", NULL);
-    g_object_set (G_OBJECT (level),
-        "post-messages", TRUE,
-        "interval", 85000000,
-        NULL);
-    fakesink = gst_element_factory_make ("fakesink", NULL);
-    g_object_set (G_OBJECT (fakesink),
-        "sync", TRUE,
-        "enable-last-sample", FALSE,
-        NULL);
-
-    gst_bin_add_many (GST_BIN (self->pipeline), audioconvert, level, fakesink, NULL);
-
-    if (!gst_element_link (self->tee, audioconvert)) {
-      GST_ERROR ("Failed to link tee with audioconvert");
-      return FALSE;
-    }
-
-    caps = gst_caps_from_string ("audio/x-raw,channels=2");
-    if (!gst_element_link_filtered (audioconvert, level, caps)) {
-      GST_ERROR ("Failed to link source with level");
-      return FALSE;
-    }
-
-    if (!gst_element_link (level, fakesink)) {
-      GST_ERROR ("Failed to link level with fakesink");
-      return FALSE;
-    }
+  /* the levels of the input, for the GUI, the metrics and the detection
+   * of silence */
+  if (show_gui || g_key_file_has_group (keyfile, "metrics") ||
+      g_key_file_has_group (keyfile, "silence")) {
+    g_autoptr (GstPad) tee_sinkpad = gst_element_get_static_pad (self->tee,
+                                                                 "sink");
+    self->meter = icstr_meter_new (tee_sinkpad);
   }
-#endif
-
-  /* parse all remaining groups as streams */
 
-  groups = g_key_file_get_groups (keyfile, NULL);
+  /* parse all remaining groups as streams; the destination groups
+   * are parsed by icstr_construct_stream() */
+  groups = icstr_keyfile_get_stream_groups (keyfile);
   for (group = groups; *group; group++) {
-    GstElement *stream;
-
-    /* skip the input group, this is parsed by icstr_construct_source() */
-    if (g_str_equal (*group, "input"))
-      continue;
-
-    /* skip the metadata group, this is parsed by icstr_setup_metadata_handler() */
-    if (g_str_equal (*group, "metadata"))
-      continue;
+    IcstrStream *stream;
 
     GST_DEBUG ("Constructing stream '%s'", *group);
 
@@ -128,59 +135,81 @@ icstr_load (IceStreamer *self, const gchar *conf_file, gboolean show_gui)
       continue;
     }
 
-    gst_bin_add (GST_BIN (self->pipeline), stream);
-    gst_element_link_pads (self->tee, "src_%u", stream, "sink");
+    gst_bin_add (GST_BIN (self->pipeline), stream->bin);
+    if (!icstr_link_stream (self, keyfile, stream, &error)) {
+      GST_WARNING ("Failed to link stream: %s", error->message);
+      g_clear_error (&error);
+      gst_bin_remove (GST_BIN (self->pipeline), stream->bin);
+      icstr_stream_free (stream);
+      continue;
+    }
+
     self->streams = g_list_prepend (self->streams, stream);
     streams_linked++;
+
+    icstr_startup_mark ("stream %s constructed", stream->name);
   }
 
   self->streams = g_list_reverse (self->streams);
   g_strfreev (groups);
 
+  icstr_log_conversions (self);
+
+  /* kept for reloading */
+  self->keyfile = g_key_file_ref (keyfile);
+  self->conf_file = g_strdup (conf_file);
+
   if (streams_linked == 0) {
     GST_ERROR ("No streams specified in the configuration file");
     return FALSE;
   }
 
-  icstr_setup_metadata_handler (self, keyfile, &error);
-  if (error)
+  self->metadata = icstr_metadata_new (self);
+  if (g_key_file_has_group (keyfile, "metadata") &&
+      !icstr_metadata_setup (self->metadata, keyfile, &error)) {
     GST_WARNING ("%s", error->message);
+    g_clear_error (&error);
+  }
 
-  return TRUE;
-}
+  /* the meter only measures raw audio */
+  if (self->relay_codec && g_key_file_has_group (keyfile, "silence")) {
+    GST_WARNING ("No silence detection: the input is relayed");
+  } else if (g_key_file_has_group (keyfile, "silence") &&
+      !icstr_silence_setup (self, keyfile, &error)) {
+    GST_WARNING ("%s", error->message);
+    g_clear_error (&error);
+  }
 
-static gboolean
-icstr_reconnect_timeout_callback (gpointer data)
-{
-  IceStreamer *self = data;
-  GList *curr = NULL;
-
-  for (curr = self->disconnected_streams; curr != NULL;
-      curr = g_list_next (curr)) {
-    GstElement *stream = curr->data;
-    GST_INFO ("Reconnecting %s", GST_OBJECT_NAME (stream));
-    gst_element_set_state (stream, GST_STATE_PLAYING);
-    gst_element_link_pads (self->tee, "src_%u", stream, "sink");
+  /* for the log, the GUI and the metrics */
+  self->cpu = icstr_cpu_new (self);
+
+  if (g_key_file_has_group (keyfile, "metrics") &&
+      !icstr_metrics_setup (self, keyfile, &error)) {
+    GST_WARNING ("Failed to set up metrics: %s", error->message);
+    g_clear_error (&error);
+  }
+
+  if ((trace_latency || g_key_file_has_group (keyfile, "latency")) &&
+      !icstr_latency_setup (self, keyfile, &error)) {
+    GST_WARNING ("%s", error->message);
+    g_clear_error (&error);
   }
 
-  for (curr = self->streams; curr != NULL; curr = g_list_next (curr)) {
-    GstElement *stream = curr->data;
-    self->disconnected_streams =
-        g_list_remove (self->disconnected_streams, curr->data);
+  if (g_key_file_has_group (keyfile, "control") &&
+      !icstr_control_setup (self, keyfile, &error)) {
+    GST_WARNING ("Failed to set up the control socket: %s", error->message);
+    g_clear_error (&error);
   }
 
-  self->timeout_source = 0;
-  return G_SOURCE_REMOVE;
+  return TRUE;
 }
 
 static gboolean
 icstr_exit_handler (gpointer data)
 {
   IceStreamer *self = data;
-  g_file_monitor_cancel (self->mtdat_file_monitor);
-  g_clear_object (&self->mtdat_file_monitor);
-  g_clear_object (&self->mtdat_file);
-  g_clear_pointer (&self->tags, gst_tag_list_unref);
+  if (self->metadata)
+    icstr_metadata_stop (self->metadata);
 #ifndef DISABLE_GUI
   icstr_gui_destroy (self);
 #endif
@@ -188,12 +217,36 @@ icstr_exit_handler (gpointer data)
   return G_SOURCE_REMOVE;
 }
 
+static GstBusSyncReply
+icstr_bus_sync_callback (GstBus *bus, GstMessage *msg, gpointer data)
+{
+  IceStreamer *self = data;
+
+  switch (GST_MESSAGE_TYPE (msg)) {
+    case GST_MESSAGE_STREAM_STATUS:
+      icstr_sched_handle_stream_status (msg);
+      icstr_bench_handle_stream_status (msg);
+      icstr_cpu_handle_stream_status (self->cpu, msg);
+      break;
+    default:
+      break;
+  }
+
+  return GST_BUS_PASS;
+}
+
 static gboolean
 icstr_bus_callback (GstBus *bus, GstMessage *msg, gpointer data)
 {
   IceStreamer *self = data;
 
   switch (GST_MESSAGE_TYPE (msg)) {
+    case GST_MESSAGE_EOS:
+      /* only a source that is not live ends, e.g. when benchmarking */
+      GST_INFO ("End of input");
+      icstr_bench_stop ();
+      icstr_exit_handler (self);
+      break;
     case GST_MESSAGE_WARNING:
     {
       g_autoptr (GError) error = NULL;
@@ -208,34 +261,26 @@ icstr_bus_callback (GstBus *bus, GstMessage *msg, gpointer data)
     {
       g_autoptr (GError) error = NULL;
       g_autofree gchar *debug = NULL;
+      IcstrDestination *dest = NULL;
 
       gst_message_parse_error (msg, &error, &debug);
+      dest = icstr_lookup_destination (self, GST_MESSAGE_SRC (msg));
 
-      if (g_str_has_prefix (GST_MESSAGE_SRC_NAME (msg), "shout2send")
-          && error->domain == GST_RESOURCE_ERROR) {
+      if (dest && error->domain == GST_RESOURCE_ERROR) {
         /*
-         * Network error - disconnect stream bin from the pipeline and reconnect it later
+         * Network error - disconnect the destination from its stream and reconnect it later
          */
-        g_autoptr (GstElement) stream_bin = NULL;
-        g_autoptr (GstPad) bin_sinkpad = NULL, tee_srcpad = NULL;
-
-        GST_WARNING ("Network error for %s: %s (%s)", GST_MESSAGE_SRC_NAME (msg),
+        GST_WARNING ("Network error for %s: %s (%s)", dest->name,
                    error->message, debug);
 
-        stream_bin = GST_ELEMENT (gst_object_get_parent (GST_MESSAGE_SRC (msg)));
-        bin_sinkpad = gst_element_get_static_pad (stream_bin, "sink");
-        tee_srcpad = gst_pad_get_peer (bin_sinkpad);
-        gst_pad_unlink (tee_srcpad, bin_sinkpad);
-        gst_element_release_request_pad (self->tee, tee_srcpad);
-        gst_element_set_state (stream_bin, GST_STATE_NULL);
-        self->disconnected_streams =
-            g_list_prepend (self->disconnected_streams, stream_bin);
-
-        if (self->timeout_source == 0) {
-          GST_INFO ("Starting reconnection timer");
-          self->timeout_source = g_timeout_add_seconds (RECONNECT_TIMEOUT,
-                                 icstr_reconnect_timeout_callback, self);
-        }
+        icstr_destination_disconnect (dest);
+      } else if (self->failover &&
+          icstr_failover_handle_error (self->failover, GST_MESSAGE_SRC (msg),
+                                       error)) {
+        /*
+         * Input error - the other input takes over while this one restarts
+         */
+        GST_DEBUG ("Input error details: %s", debug);
       } else {
         /*
          * Any other error is fatal - report & exit
@@ -247,45 +292,10 @@ icstr_bus_callback (GstBus *bus, GstMessage *msg, gpointer data)
 
       break;
     }
-#ifndef DISABLE_GUI
     case GST_MESSAGE_ELEMENT:
-    {
-      GstClockTime running_time;
-      gdouble rms_l = 0;
-      gdouble rms_r = 0;
-      const GValue *array_val = NULL;
-      const GValue *value = NULL;
-      GValueArray *rms_arr = NULL;
-      const GstStructure *s = gst_message_get_structure (msg);
-      const gchar *name = gst_structure_get_name (s);
-
-      if (strcmp (name, "level") != 0)
-        break;
-
-      if (!gst_structure_get_clock_time (s, "running-time", &running_time))
-        GST_WARNING ("Could not parse running-time");
-
-      icstr_gui_update_time_label(self, running_time);
-
-      /* the values are packed into GValueArrays with the value per channel */
-      array_val = gst_structure_get_value (s, "rms");
-      rms_arr = (GValueArray *) g_value_get_boxed (array_val);
-
-      /* we can get the number of channels as the length of any of the value
-       * arrays */
-      if (rms_arr->n_values != 2) {
-        GST_ERROR ("Got wrong number of channels while updating levels on gui, terminating");
-        icstr_exit_handler (self);
-        break;
-      }
-
-      rms_l = g_value_get_double(rms_arr->values + 0);
-      rms_r = g_value_get_double(rms_arr->values + 1);
-
-      icstr_gui_update_levels(self, rms_l, rms_r);
+      if (gst_message_has_name (msg, "icestreamer-connected"))
+        icstr_startup_handle_connected (msg);
       break;
-    }
-#endif
     default:
       break;
   }
@@ -293,8 +303,15 @@ icstr_bus_callback (GstBus *bus, GstMessage *msg, gpointer data)
   return G_SOURCE_CONTINUE;
 }
 
+static gboolean
+icstr_reload_handler (gpointer data)
+{
+  icstr_reload (data);
+  return G_SOURCE_CONTINUE;
+}
+
 static void
-icstr_run (IceStreamer *self)
+icstr_run (IceStreamer *self, gboolean reload)
 {
   g_autoptr (GMainLoop) loop = g_main_loop_new (NULL, FALSE);
   g_autoptr (GstBus) bus = NULL;
@@ -302,13 +319,18 @@ icstr_run (IceStreamer *self)
   self->loop = loop;
 
   g_unix_signal_add (SIGINT, icstr_exit_handler, self);
-  g_unix_signal_add (SIGHUP, icstr_exit_handler, self);
+  /* the GUI does not follow changes of the streams */
+  g_unix_signal_add (SIGHUP, reload ? icstr_reload_handler :
+                     icstr_exit_handler, self);
   g_unix_signal_add (SIGTERM, icstr_exit_handler, self);
 
   bus = gst_pipeline_get_bus (GST_PIPELINE (self->pipeline));
+  gst_bus_set_sync_handler (bus, icstr_bus_sync_callback, self, NULL);
   gst_bus_add_watch (bus, icstr_bus_callback, self);
 
+  icstr_startup_watch (self);
   gst_element_set_state (self->pipeline, GST_STATE_PLAYING);
+  icstr_startup_mark ("pipeline started");
 
   GST_DEBUG ("Entering main loop");
   g_main_loop_run (loop);
@@ -325,11 +347,21 @@ main (gint argc, gchar **argv)
   g_autoptr (IceStreamer) self = NULL;
   g_autoptr (GError) error = NULL;
   gboolean show_gui = FALSE;
+  gboolean trace_latency = FALSE;
+  gboolean calibrate = FALSE;
+  gchar *benchmark_file = NULL;
 
   gchar *conf_file = "/etc/icestreamer.conf";
   const GOptionEntry entries[] = {
     {"config", 'c', 0, G_OPTION_ARG_FILENAME, &conf_file,
      "Configuration file", "icestreamer.conf"},
+    {"trace-latency", 'l', 0, G_OPTION_ARG_NONE, &trace_latency,
+     "Report the latency of each stream periodically", NULL},
+    {"benchmark", 'b', 0, G_OPTION_ARG_FILENAME, &benchmark_file,
+     "Run until the end of the input and write performance figures "
+     "as JSON ('-' for stdout)", "results.json"},
+    {"calibrate", 0, 0, G_OPTION_ARG_NONE, &calibrate,
+     "Measure what each stream costs to encode, print it and exit", NULL},
 #ifndef DISABLE_GUI
     {"gui", 'g', 0, G_OPTION_ARG_NONE, &show_gui,
      "Show gui", NULL},
@@ -340,6 +372,8 @@ main (gint argc, gchar **argv)
   GST_DEBUG_CATEGORY_INIT (icestreamer_debug, "icestreamer", 0, "IceStreamer");
   gst_debug_set_threshold_from_string ("icestreamer:INFO", FALSE);
 
+  icstr_startup_begin ();
+
   /* cmd line option parsing */
 
   context = g_option_context_new (NULL);
@@ -361,9 +395,23 @@ main (gint argc, gchar **argv)
 
   g_clear_pointer (&context, g_option_context_free);
 
+  if (!icstr_shout_sink_register () || !icstr_http_sink_register () ||
+      !icstr_file_sink_register () || !icstr_hls_sink_register ()) {
+    g_printerr ("Failed to register our own elements\n");
+    return 1;
+  }
+
+  if (calibrate) {
+    if (!icstr_calibrate (conf_file, &error)) {
+      g_printerr ("Calibration failed: %s\n", error->message);
+      return 1;
+    }
+    return 0;
+  }
+
   /* initialization */
   self = g_new0 (IceStreamer, 1);
-  if (!icstr_load (self, conf_file, show_gui))
+  if (!icstr_load (self, conf_file, show_gui, trace_latency))
     return 1;
 
 #ifndef DISABLE_GUI
@@ -373,8 +421,17 @@ main (gint argc, gchar **argv)
   }
 #endif
 
+  if (benchmark_file)
+    icstr_bench_start (self);
+
   /* enter main loop */
-  icstr_run (self);
+  icstr_run (self, !show_gui);
+
+  if (benchmark_file &&
+      !icstr_bench_write_results (self, benchmark_file, &error)) {
+    g_printerr ("Benchmark failed: %s\n", error->message);
+    return 1;
+  }
 
   return 0;
 }
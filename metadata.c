@@ -18,131 +18,523 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include "icestreamer.h"
+#include <gio/gunixinputstream.h>
+#include <glib/gstdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/*
+ * The metadata of the streams (artist and title) comes from a file that is
+ * read again whenever it changes, from a FIFO that is read line by line,
+ * or from the control socket, and only goes further when it actually
+ * changes.
+ *
+ * It is not applied right away, as the audio that is captured at the same
+ * time reaches the servers only after the queues, the lookahead of the
+ * encoder and the pages of the muxer. Instead, the running time of its
+ * arrival is noted, and each destination sends it to its sink as a tag
+ * event, in-band, right before the first buffer captured after it, give or
+ * take the metadata-offset of the destination.
+ *
+ * The directory of the file is watched rather than the file itself, so
+ * that writers that replace it with a rename are followed, and bursts of
+ * events, e.g. CHANGED followed by CHANGES_DONE_HINT, are coalesced into
+ * a single read.
+ */
+
+/* ms to wait for the events of a write to settle before reading the file */
+#define METADATA_DEBOUNCE 100
+
+/* seconds after which an update is applied even if no audio has caught up
+ * with it, e.g. when the muxer timestamps its output on its own */
+#define METADATA_MAX_DELAY 60
+
+/* updates that a destination keeps at most while waiting for its audio */
+#define METADATA_MAX_PENDING 16
+
+struct _IcstrMetadata
+{
+  IceStreamer *self;
+  gchar *artist;                /* the current metadata, NULL until set */
+  gchar *title;
+
+  /* the file */
+  GFile *file;
+  GFileMonitor *monitor;        /* of its directory */
+  guint debounce;               /* ms */
+  guint debounce_source;
+
+  /* the FIFO */
+  GDataInputStream *fifo;
+  GCancellable *cancellable;
+  gchar *fifo_artist;           /* the first line of a pair */
+};
+
+/* An update that waits for its audio to reach a sink */
+typedef struct _IcstrMetadataUpdate IcstrMetadataUpdate;
+struct _IcstrMetadataUpdate
+{
+  GstClockTime running_time;
+  gint64 queued;                /* monotonic time */
+  GstTagList *tags;
+};
+
+struct _IcstrMetadataTarget
+{
+  GstPad *pad;                  /* the sink pad of the sink */
+  gulong probe;
+  GstClockTimeDiff offset;
+  GstSegment segment;           /* only used from the streaming thread */
+
+  GMutex lock;
+  GQueue pending;
+  gint n_pending;               /* atomic, to skip the lock while empty */
+};
 
 static void
-icstr_update_metadata_callback (GFileMonitor *monitor,
-    GFile *file, GFile *other_file, GFileMonitorEvent event_type, gpointer data)
+icstr_metadata_update_free (IcstrMetadataUpdate *update)
 {
-  IceStreamer *self = data;
-  g_autoptr (GError) error = NULL;
-  GBytes *file_bytes = NULL;
-  g_autofree gchar *file_contents = NULL;
-  gchar *sanitized_contents = NULL;
-  g_auto(GStrv) metadata = NULL;
-  g_autofree gchar *artist = NULL;
-  g_autofree gchar *title = NULL;
-  GstEvent *tag_event = NULL;
-  gsize file_len = 0;
-
-  if (event_type != G_FILE_MONITOR_EVENT_CHANGED &&
-      event_type != G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT) {
-    GST_WARNING ("Something weird happened to the metadata file (%u),",
-             event_type);
-    GST_WARNING ("  disabling metadata monitor.");
-    g_file_monitor_cancel (monitor);
-    return;
+  gst_tag_list_unref (update->tags);
+  g_free (update);
+}
+
+/* streaming thread */
+static GstPadProbeReturn
+icstr_metadata_target_probe (GstPad *pad, GstPadProbeInfo *info,
+    gpointer data)
+{
+  IcstrMetadataTarget *target = data;
+  IcstrMetadataUpdate *update;
+  GstTagList *tags = NULL;
+  GstClockTime running_time = GST_CLOCK_TIME_NONE;
+  GstBuffer *buffer;
+  GstEvent *event;
+  gint64 now;
+
+  if (info->type & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM) {
+    event = GST_PAD_PROBE_INFO_EVENT (info);
+    if (GST_EVENT_TYPE (event) == GST_EVENT_SEGMENT)
+      gst_event_copy_segment (event, &target->segment);
+    return GST_PAD_PROBE_OK;
   }
 
-  file_bytes = g_file_load_bytes (file, NULL, NULL, &error);
-  if (error) {
-    GST_WARNING ("Couldn't read metadata file: %s,", error->message);
-    GST_WARNING ("  disabling metadata monitor.");
-    g_file_monitor_cancel (monitor);
-    return;
+  if (!g_atomic_int_get (&target->n_pending))
+    return GST_PAD_PROBE_OK;
+
+  /* installed after the segment went by, on a destination that was added
+   * to a running stream */
+  if (target->segment.format == GST_FORMAT_UNDEFINED) {
+    event = gst_pad_get_sticky_event (pad, GST_EVENT_SEGMENT, 0);
+    if (event) {
+      gst_event_copy_segment (event, &target->segment);
+      gst_event_unref (event);
+    }
   }
 
-  file_contents = (gchar *) g_bytes_unref_to_data (file_bytes, &file_len);
+  /* stream headers and the like have no timestamp */
+  buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+  if (GST_BUFFER_PTS_IS_VALID (buffer))
+    running_time = gst_segment_to_running_time (&target->segment,
+        GST_FORMAT_TIME, GST_BUFFER_PTS (buffer));
+  now = g_get_monotonic_time ();
 
-  if (!strnlen (file_contents, file_len)) {
-    GST_WARNING ("Got malformed metadata");
-    return;
+  /* only the last of the updates that are due is sent */
+  g_mutex_lock (&target->lock);
+  while ((update = g_queue_peek_head (&target->pending))) {
+    gboolean due = now - update->queued >
+        METADATA_MAX_DELAY * G_TIME_SPAN_SECOND;
+
+    if (GST_CLOCK_TIME_IS_VALID (running_time))
+      due |= (GstClockTimeDiff) running_time >=
+          (GstClockTimeDiff) update->running_time + target->offset;
+    if (!due)
+      break;
+
+    g_queue_pop_head (&target->pending);
+    g_atomic_int_add (&target->n_pending, -1);
+    if (tags)
+      gst_tag_list_unref (tags);
+    tags = g_steal_pointer (&update->tags);
+    g_free (update);
   }
+  g_mutex_unlock (&target->lock);
 
-  if (!g_utf8_validate_len (file_contents, file_len, NULL)) {
-    GST_WARNING ("Got malformed metadata");
+  /* ahead of the buffer, from within its chain call */
+  if (tags)
+    gst_pad_send_event (pad, gst_event_new_tag (tags));
+
+  return GST_PAD_PROBE_OK;
+}
+
+/* offset is how much later than its audio an update is sent, or earlier
+ * if negative, e.g. to account for the buffering of the listeners */
+IcstrMetadataTarget *
+icstr_metadata_target_new (GstElement *sink, GstClockTimeDiff offset)
+{
+  IcstrMetadataTarget *target = g_new0 (IcstrMetadataTarget, 1);
+
+  target->pad = gst_element_get_static_pad (sink, "sink");
+  target->offset = offset;
+  gst_segment_init (&target->segment, GST_FORMAT_UNDEFINED);
+  g_mutex_init (&target->lock);
+  g_queue_init (&target->pending);
+
+  target->probe = gst_pad_add_probe (target->pad,
+      GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+      icstr_metadata_target_probe, target, NULL);
+
+  return target;
+}
+
+void
+icstr_metadata_target_free (IcstrMetadataTarget *target)
+{
+  gst_pad_remove_probe (target->pad, target->probe);
+  gst_object_unref (target->pad);
+  g_queue_clear_full (&target->pending,
+                      (GDestroyNotify) icstr_metadata_update_free);
+  g_mutex_clear (&target->lock);
+  g_free (target);
+}
+
+static void
+icstr_metadata_target_push (IcstrMetadataTarget *target,
+    GstClockTime running_time, const gchar *artist, const gchar *title)
+{
+  IcstrMetadataUpdate *update = g_new0 (IcstrMetadataUpdate, 1);
+
+  update->running_time = running_time;
+  update->queued = g_get_monotonic_time ();
+  update->tags = gst_tag_list_new_empty ();
+  if (artist)
+    gst_tag_list_add (update->tags, GST_TAG_MERGE_REPLACE, GST_TAG_ARTIST,
+                      artist, NULL);
+  if (title)
+    gst_tag_list_add (update->tags, GST_TAG_MERGE_REPLACE, GST_TAG_TITLE,
+                      title, NULL);
+  gst_tag_list_set_scope (update->tags, GST_TAG_SCOPE_GLOBAL);
+
+  g_mutex_lock (&target->lock);
+  g_queue_push_tail (&target->pending, update);
+  g_atomic_int_add (&target->n_pending, 1);
+  if (g_queue_get_length (&target->pending) > METADATA_MAX_PENDING) {
+    icstr_metadata_update_free (g_queue_pop_head (&target->pending));
+    g_atomic_int_add (&target->n_pending, -1);
+  }
+  g_mutex_unlock (&target->lock);
+}
+
+/* now, in the running time of the pipeline, which is also the one of the
+ * buffers captured now; 0 before it starts, so that it is applied with
+ * the first buffer */
+static GstClockTime
+icstr_metadata_running_time (IceStreamer *self)
+{
+  g_autoptr (GstClock) clock = gst_element_get_clock (self->pipeline);
+  GstClockTime base_time = gst_element_get_base_time (self->pipeline);
+  GstClockTime now;
+
+  if (!clock)
+    return 0;
+
+  now = gst_clock_get_time (clock);
+  return now > base_time ? now - base_time : 0;
+}
+
+/* sets the metadata of all the streams, from any of its sources */
+void
+icstr_metadata_set (IcstrMetadata *md, const gchar *artist_utf8,
+    const gchar *title_utf8)
+{
+  g_autofree gchar *artist = g_str_to_ascii (artist_utf8, NULL);
+  g_autofree gchar *title = g_str_to_ascii (title_utf8, NULL);
+  GstClockTime running_time;
+  GList *curr, *dcurr;
+
+  if (g_strcmp0 (artist, md->artist) == 0 &&
+      g_strcmp0 (title, md->title) == 0) {
+    GST_DEBUG ("Metadata unchanged");
     return;
   }
 
-  sanitized_contents = g_strstrip (file_contents);
+  running_time = icstr_metadata_running_time (md->self);
+
+  GST_DEBUG ("Got metadata: a: %s t: %s at %" GST_TIME_FORMAT, artist, title,
+             GST_TIME_ARGS (running_time));
+
+  g_free (md->artist);
+  g_free (md->title);
+  md->artist = g_steal_pointer (&artist);
+  md->title = g_steal_pointer (&title);
+
+  for (curr = md->self->streams; curr != NULL; curr = g_list_next (curr)) {
+    IcstrStream *stream = curr->data;
+
+    for (dcurr = stream->destinations; dcurr != NULL;
+        dcurr = g_list_next (dcurr)) {
+      IcstrDestination *dest = dcurr->data;
+      icstr_metadata_target_push (dest->metadata, running_time, md->artist,
+                                  md->title);
+    }
+  }
+}
+
+/* sends the current metadata, if any, to a destination that was added
+ * after it was set, with its first buffer */
+void
+icstr_metadata_apply (IcstrMetadata *md, IcstrDestination *dest)
+{
+  if (md->artist || md->title)
+    icstr_metadata_target_push (dest->metadata, 0, md->artist, md->title);
+}
+
+/* the file */
+
+/* the artist on the first line and the title on the second */
+static void
+icstr_metadata_parse (IcstrMetadata *md, gchar *contents, gsize len)
+{
+  gchar *stripped, *newline;
 
-  if (!g_strrstr (sanitized_contents, "\n")) {
+  if (!strnlen (contents, len) || !g_utf8_validate_len (contents, len, NULL)) {
     GST_WARNING ("Got malformed metadata");
     return;
   }
 
-  metadata = g_strsplit (sanitized_contents, "\n", 3);
-  if (g_strv_length (metadata) != 2) {
+  stripped = g_strstrip (contents);
+  newline = strchr (stripped, '\n');
+  if (!newline || strchr (newline + 1, '\n')) {
     GST_WARNING ("Got malformed metadata");
     return;
   }
 
-  artist = g_str_to_ascii (metadata[0], NULL);
-  title = g_str_to_ascii (metadata[1], NULL);
+  *newline = '\0';
+  icstr_metadata_set (md, stripped, newline + 1);
+}
 
-  GST_DEBUG ("Got metadata: a: %s t: %s", artist, title);
+static gboolean
+icstr_metadata_read_file (gpointer data)
+{
+  IcstrMetadata *md = data;
+  g_autoptr (GError) error = NULL;
+  g_autofree gchar *contents = NULL;
+  gsize len = 0;
 
-  if (!self->tags)
-    self->tags = gst_tag_list_new_empty ();
+  md->debounce_source = 0;
 
-  gst_tag_list_add (self->tags, GST_TAG_MERGE_REPLACE, GST_TAG_ARTIST, artist,
-                    NULL);
-  gst_tag_list_add (self->tags, GST_TAG_MERGE_REPLACE, GST_TAG_TITLE, title,
-                    NULL);
-  gst_tag_list_set_scope (self->tags, GST_TAG_SCOPE_GLOBAL);
+  /* e.g. in between the steps of a rename; the next event brings it back */
+  if (!g_file_load_contents (md->file, NULL, &contents, &len, NULL, &error)) {
+    GST_WARNING ("Couldn't read metadata file: %s", error->message);
+    return G_SOURCE_REMOVE;
+  }
+
+  icstr_metadata_parse (md, contents, len);
+  return G_SOURCE_REMOVE;
+}
+
+static void
+icstr_metadata_file_changed (GFileMonitor *monitor, GFile *file,
+    GFile *other_file, GFileMonitorEvent event_type, gpointer data)
+{
+  IcstrMetadata *md = data;
 
-  tag_event = gst_event_new_tag (self->tags);
-  if (!gst_element_send_event (self->pipeline, tag_event))
-    GST_WARNING ("Failed to send tag event");
+  switch (event_type) {
+    case G_FILE_MONITOR_EVENT_CHANGED:
+    case G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT:
+    case G_FILE_MONITOR_EVENT_CREATED:
+    case G_FILE_MONITOR_EVENT_MOVED_IN:
+      if (!g_file_equal (file, md->file))
+        return;
+      break;
+    case G_FILE_MONITOR_EVENT_RENAMED:
+      /* written elsewhere in the directory, then renamed over it */
+      if (!other_file || !g_file_equal (other_file, md->file))
+        return;
+      break;
+    default:
+      /* deleted or moved away: keep the current metadata until it is back */
+      return;
+  }
 
-  return;
+  if (md->debounce_source)
+    g_source_remove (md->debounce_source);
+  md->debounce_source = g_timeout_add (md->debounce, icstr_metadata_read_file,
+                                       md);
 }
 
-gboolean
-icstr_setup_metadata_handler (IceStreamer * self, GKeyFile * keyfile,
-    GError ** error)
+static gboolean
+icstr_metadata_watch_file (IcstrMetadata *md, const gchar *filename,
+    GError **error)
 {
-  g_autofree gchar *filename = NULL;
+  g_autoptr (GFile) dir = NULL;
   g_autoptr (GError) internal_error = NULL;
-  g_autoptr (GFile) mtdat_file = NULL;
-  g_autoptr (GFileMonitor) mtdat_file_monitor = NULL;
-  guint ret = 0;
-
-  filename =
-      g_key_file_get_string (keyfile, "metadata", "file", &internal_error);
-  if (!filename) {
-    g_propagate_prefixed_error (error, internal_error,
-        "No metadata file provided:");
+
+  md->file = g_file_new_for_path (filename);
+  dir = g_file_get_parent (md->file);
+
+  md->monitor = g_file_monitor_directory (dir, G_FILE_MONITOR_WATCH_MOVES,
+                                          NULL, &internal_error);
+  if (!md->monitor) {
+    g_propagate_prefixed_error (error, g_steal_pointer (&internal_error),
+        "Could not initialize metadata file monitor:");
     return FALSE;
   }
 
-  mtdat_file = g_file_new_for_path (filename);
-  if (!g_file_query_exists (mtdat_file, NULL)) {
-    g_set_error (error, ICSTR_ERROR, 0, "Provided metadata file doesn't exist");
+  g_signal_connect (md->monitor, "changed",
+                    G_CALLBACK (icstr_metadata_file_changed), md);
+
+  if (g_file_query_exists (md->file, NULL))
+    icstr_metadata_read_file (md);
+  else
+    GST_WARNING ("Metadata file %s does not exist yet", filename);
+
+  return TRUE;
+}
+
+/* the FIFO */
+
+static void icstr_metadata_read_fifo (IcstrMetadata *md);
+
+static void
+icstr_metadata_fifo_line (GObject *stream, GAsyncResult *res, gpointer data)
+{
+  g_autoptr (GError) error = NULL;
+  g_autofree gchar *line = NULL;
+  IcstrMetadata *md;
+
+  line = g_data_input_stream_read_line_finish_utf8 (
+      G_DATA_INPUT_STREAM (stream), res, NULL, &error);
+
+  /* stopped, and maybe freed already */
+  if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    return;
+
+  md = data;
+
+  if (error) {
+    /* e.g. not valid UTF-8; start over with the next pair */
+    GST_WARNING ("Got malformed metadata: %s", error->message);
+    g_clear_pointer (&md->fifo_artist, g_free);
+  } else if (!line) {
+    GST_WARNING ("The metadata FIFO was closed");
+    return;
+  } else if (g_strstrip (line)[0] == '\0') {
+    /* a blank line starts over with the next pair */
+    g_clear_pointer (&md->fifo_artist, g_free);
+  } else if (!md->fifo_artist) {
+    md->fifo_artist = g_steal_pointer (&line);
+  } else {
+    icstr_metadata_set (md, md->fifo_artist, line);
+    g_clear_pointer (&md->fifo_artist, g_free);
+  }
+
+  icstr_metadata_read_fifo (md);
+}
+
+static void
+icstr_metadata_read_fifo (IcstrMetadata *md)
+{
+  g_data_input_stream_read_line_async (md->fifo, G_PRIORITY_DEFAULT,
+      md->cancellable, icstr_metadata_fifo_line, md);
+}
+
+static gboolean
+icstr_metadata_open_fifo (IcstrMetadata *md, const gchar *path,
+    GError **error)
+{
+  g_autoptr (GInputStream) input = NULL;
+  gint fd;
+
+  if (!g_file_test (path, G_FILE_TEST_EXISTS) && mkfifo (path, 0660) < 0) {
+    g_set_error (error, ICSTR_ERROR, 0, "Failed to create FIFO %s: %s",
+                 path, g_strerror (errno));
     return FALSE;
   }
 
-  mtdat_file_monitor = g_file_monitor_file (mtdat_file, G_FILE_MONITOR_NONE,
-                                            NULL, &internal_error);
-  if (!mtdat_file_monitor) {
-    g_propagate_prefixed_error (error, internal_error,
-        "Could not initialize metadata file monitor:");
+  /* also open for writing, so that it does not end when a writer closes */
+  fd = g_open (path, O_RDWR | O_NONBLOCK | O_CLOEXEC, 0);
+  if (fd < 0) {
+    g_set_error (error, ICSTR_ERROR, 0, "Failed to open FIFO %s: %s",
+                 path, g_strerror (errno));
     return FALSE;
   }
 
-  ret = g_signal_connect (mtdat_file_monitor, "changed",
-                          G_CALLBACK (icstr_update_metadata_callback), self);
-  if (ret <= 0) {
-    g_set_error (error, ICSTR_ERROR, 0,
-        "Could not connect to metadata file monitor");
+  input = g_unix_input_stream_new (fd, TRUE);
+  md->fifo = g_data_input_stream_new (input);
+  md->cancellable = g_cancellable_new ();
+
+  icstr_metadata_read_fifo (md);
+
+  return TRUE;
+}
+
+IcstrMetadata *
+icstr_metadata_new (IceStreamer *self)
+{
+  IcstrMetadata *md = g_new0 (IcstrMetadata, 1);
+
+  md->self = self;
+  return md;
+}
+
+/* stops following the file and the FIFO; the current metadata stays */
+void
+icstr_metadata_stop (IcstrMetadata *md)
+{
+  if (md->debounce_source)
+    g_source_remove (md->debounce_source);
+  md->debounce_source = 0;
+
+  if (md->monitor)
+    g_file_monitor_cancel (md->monitor);
+  g_clear_object (&md->monitor);
+  g_clear_object (&md->file);
+
+  if (md->cancellable)
+    g_cancellable_cancel (md->cancellable);
+  g_clear_object (&md->cancellable);
+  g_clear_object (&md->fifo);
+  g_clear_pointer (&md->fifo_artist, g_free);
+}
+
+void
+icstr_metadata_free (IcstrMetadata *md)
+{
+  icstr_metadata_stop (md);
+  g_free (md->artist);
+  g_free (md->title);
+  g_free (md);
+}
+
+gboolean
+icstr_metadata_setup (IcstrMetadata *md, GKeyFile *keyfile, GError **error)
+{
+  g_autofree gchar *filename = NULL;
+  g_autofree gchar *fifo = NULL;
+  gint debounce;
+
+  filename = g_key_file_get_string (keyfile, "metadata", "file", NULL);
+  fifo = g_key_file_get_string (keyfile, "metadata", "fifo", NULL);
+  if (!filename && !fifo) {
+    g_set_error (error, ICSTR_ERROR, 0, "No metadata file provided");
     return FALSE;
   }
 
-  self->mtdat_file = g_steal_pointer (&mtdat_file);
-  self->mtdat_file_monitor = g_steal_pointer (&mtdat_file_monitor);
+  debounce = icstr_keyfile_get_integer_with_fallback (keyfile,
+      "metadata", "debounce", METADATA_DEBOUNCE);
+  if (debounce < 0) {
+    GST_WARNING ("Invalid metadata debounce %d ms, using 0", debounce);
+    debounce = 0;
+  }
+  md->debounce = debounce;
+
+  if (filename && !icstr_metadata_watch_file (md, filename, error))
+    return FALSE;
 
-  /* force an update */
-  icstr_update_metadata_callback (self->mtdat_file_monitor, self->mtdat_file,
-                                  NULL, G_FILE_MONITOR_EVENT_CHANGED, self);
+  if (fifo && !icstr_metadata_open_fifo (md, fifo, error))
+    return FALSE;
 
   return TRUE;
 }
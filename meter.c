@@ -0,0 +1,333 @@
+/*
+ * IceStreamer - A simple live audio streamer
+ *
+ * Copyright (C) 2017 George Kiagiadakis <gkiagia@tolabaki.gr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "icestreamer.h"
+#include <gst/audio/audio.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <string.h>
+
+/*
+ * Level metering of the input, in a pad probe. The RMS and the peak of
+ * each channel are computed over windows of METER_WINDOW of audio and
+ * published with atomic stores, for the GUI and the metrics to poll.
+ */
+
+/* the duration of a measurement window */
+#define METER_WINDOW (50 * GST_MSECOND)
+
+/*
+ * The kernels accumulate interleaved samples into METER_LANES independent
+ * lanes, a whole number of frames wide, so that the inner loop has no
+ * dependency between iterations and the compiler can vectorize it. The
+ * lanes are folded into their channels at the end.
+ */
+#define METER_LANES ICSTR_METER_MAX_CHANNELS
+
+typedef struct _IcstrMeterWatch IcstrMeterWatch;
+struct _IcstrMeterWatch
+{
+  IcstrMeterFunc func;
+  gpointer data;
+};
+
+struct _IcstrMeter
+{
+  GstPad *pad;
+  gulong probe;
+  GArray *watches;              /* only changed before streaming starts */
+
+  /* only used from the streaming thread */
+  GstAudioInfo info;
+  GstSegment segment;
+  guint64 window_frames;
+  guint64 frames;
+  gdouble sumsq[ICSTR_METER_MAX_CHANNELS];
+  gdouble peak[ICSTR_METER_MAX_CHANNELS];
+
+  /* published */
+  atomic_uint channels;
+  atomic_uint_fast64_t running_time;
+  _Atomic gfloat rms_db[ICSTR_METER_MAX_CHANNELS];
+  _Atomic gfloat peak_db[ICSTR_METER_MAX_CHANNELS];
+};
+
+#define ICSTR_METER_KERNEL(name, type, scale) \
+static void \
+name (const type *data, gsize n_samples, guint channels, gdouble *sumsq, \
+    gdouble *peak) \
+{ \
+  gfloat sq[METER_LANES] = { 0, }; \
+  gfloat pk[METER_LANES] = { 0, }; \
+  guint lanes = channels * (METER_LANES / channels); \
+  gsize i = 0; \
+  guint k; \
+  \
+  for (; i + lanes <= n_samples; i += lanes) { \
+    for (k = 0; k < lanes; k++) { \
+      gfloat v = fabsf (data[i + k] * (scale)); \
+      sq[k] += v * v; \
+      pk[k] = pk[k] > v ? pk[k] : v; \
+    } \
+  } \
+  \
+  /* the rest starts on a frame and is shorter than the lanes */ \
+  for (k = 0; i < n_samples; i++, k++) { \
+    gfloat v = fabsf (data[i] * (scale)); \
+    sq[k] += v * v; \
+    pk[k] = pk[k] > v ? pk[k] : v; \
+  } \
+  \
+  for (k = 0; k < lanes; k++) { \
+    sumsq[k % channels] += sq[k]; \
+    peak[k % channels] = MAX (peak[k % channels], pk[k]); \
+  } \
+}
+
+ICSTR_METER_KERNEL (icstr_meter_process_s16, gint16, 1.0f / 32768.0f)
+ICSTR_METER_KERNEL (icstr_meter_process_s32, gint32, 1.0f / 2147483648.0f)
+ICSTR_METER_KERNEL (icstr_meter_process_f32, gfloat, 1.0f)
+ICSTR_METER_KERNEL (icstr_meter_process_f64, gdouble, 1.0f)
+
+static gfloat
+icstr_meter_to_db (gdouble power)
+{
+  return (power > 0) ? MAX (10 * log10 (power), ICSTR_METER_FLOOR) :
+      ICSTR_METER_FLOOR;
+}
+
+static void
+icstr_meter_publish (IcstrMeter *meter, guint channels,
+    GstClockTime running_time)
+{
+  gdouble rms[ICSTR_METER_MAX_CHANNELS];
+  GstClockTime duration;
+  guint c;
+
+  for (c = 0; c < channels; c++) {
+    rms[c] = icstr_meter_to_db (meter->sumsq[c] / meter->frames);
+    atomic_store_explicit (&meter->rms_db[c], rms[c], memory_order_relaxed);
+    atomic_store_explicit (&meter->peak_db[c],
+        icstr_meter_to_db (meter->peak[c] * meter->peak[c]),
+        memory_order_relaxed);
+    meter->sumsq[c] = 0;
+    meter->peak[c] = 0;
+  }
+
+  atomic_store_explicit (&meter->channels, channels, memory_order_relaxed);
+  if (GST_CLOCK_TIME_IS_VALID (running_time))
+    atomic_store_explicit (&meter->running_time, running_time,
+                           memory_order_relaxed);
+
+  /* the watches get the window right away, from the streaming thread */
+  duration = gst_util_uint64_scale (meter->frames, GST_SECOND,
+      GST_AUDIO_INFO_RATE (&meter->info));
+  for (c = 0; c < meter->watches->len; c++) {
+    IcstrMeterWatch *watch = &g_array_index (meter->watches,
+                                             IcstrMeterWatch, c);
+    watch->func (rms, channels, duration, watch->data);
+  }
+
+  meter->frames = 0;
+}
+
+static void
+icstr_meter_process (IcstrMeter *meter, GstBuffer *buffer)
+{
+  guint channels = GST_AUDIO_INFO_CHANNELS (&meter->info);
+  GstClockTime end = GST_CLOCK_TIME_NONE;
+  GstMapInfo map;
+  gsize n_samples;
+
+  if (channels == 0 || !gst_buffer_map (buffer, &map, GST_MAP_READ))
+    return;
+
+  n_samples = map.size / GST_AUDIO_INFO_BPS (&meter->info);
+
+  switch (GST_AUDIO_INFO_FORMAT (&meter->info)) {
+    case GST_AUDIO_FORMAT_S16:
+      icstr_meter_process_s16 ((const gint16 *) map.data, n_samples,
+          channels, meter->sumsq, meter->peak);
+      break;
+    case GST_AUDIO_FORMAT_S32:
+      icstr_meter_process_s32 ((const gint32 *) map.data, n_samples,
+          channels, meter->sumsq, meter->peak);
+      break;
+    case GST_AUDIO_FORMAT_F32:
+      icstr_meter_process_f32 ((const gfloat *) map.data, n_samples,
+          channels, meter->sumsq, meter->peak);
+      break;
+    case GST_AUDIO_FORMAT_F64:
+      icstr_meter_process_f64 ((const gdouble *) map.data, n_samples,
+          channels, meter->sumsq, meter->peak);
+      break;
+    default:
+      g_assert_not_reached ();
+  }
+
+  gst_buffer_unmap (buffer, &map);
+
+  meter->frames += n_samples / channels;
+  if (meter->frames < meter->window_frames)
+    return;
+
+  if (GST_BUFFER_PTS_IS_VALID (buffer) &&
+      meter->segment.format == GST_FORMAT_TIME) {
+    end = gst_segment_to_running_time (&meter->segment, GST_FORMAT_TIME,
+        GST_BUFFER_PTS (buffer));
+    if (GST_CLOCK_TIME_IS_VALID (end) &&
+        GST_BUFFER_DURATION_IS_VALID (buffer))
+      end += GST_BUFFER_DURATION (buffer);
+  }
+
+  icstr_meter_publish (meter, channels, end);
+}
+
+static void
+icstr_meter_set_caps (IcstrMeter *meter, GstCaps *caps)
+{
+  gst_audio_info_init (&meter->info);
+  meter->frames = 0;
+  memset (meter->sumsq, 0, sizeof (meter->sumsq));
+  memset (meter->peak, 0, sizeof (meter->peak));
+
+  if (!gst_audio_info_from_caps (&meter->info, caps))
+    return;
+
+  switch (GST_AUDIO_INFO_FORMAT (&meter->info)) {
+    case GST_AUDIO_FORMAT_S16:
+    case GST_AUDIO_FORMAT_S32:
+    case GST_AUDIO_FORMAT_F32:
+    case GST_AUDIO_FORMAT_F64:
+      break;
+    default:
+      GST_WARNING ("Cannot meter %s audio",
+          GST_AUDIO_INFO_NAME (&meter->info));
+      gst_audio_info_init (&meter->info);
+      return;
+  }
+
+  if (GST_AUDIO_INFO_LAYOUT (&meter->info) != GST_AUDIO_LAYOUT_INTERLEAVED) {
+    GST_WARNING ("Cannot meter non-interleaved audio");
+    gst_audio_info_init (&meter->info);
+    return;
+  }
+
+  if (GST_AUDIO_INFO_CHANNELS (&meter->info) > ICSTR_METER_MAX_CHANNELS) {
+    GST_WARNING ("Cannot meter more than %d channels",
+        ICSTR_METER_MAX_CHANNELS);
+    gst_audio_info_init (&meter->info);
+    return;
+  }
+
+  meter->window_frames = MAX (gst_util_uint64_scale (METER_WINDOW,
+          GST_AUDIO_INFO_RATE (&meter->info), GST_SECOND), 1);
+}
+
+static GstPadProbeReturn
+icstr_meter_probe (GstPad *pad, GstPadProbeInfo *info, gpointer data)
+{
+  IcstrMeter *meter = data;
+  GstEvent *event;
+  GstCaps *caps;
+
+  if (info->type & GST_PAD_PROBE_TYPE_BUFFER) {
+    icstr_meter_process (meter, GST_PAD_PROBE_INFO_BUFFER (info));
+  } else if (info->type & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM) {
+    event = GST_PAD_PROBE_INFO_EVENT (info);
+    if (GST_EVENT_TYPE (event) == GST_EVENT_CAPS) {
+      gst_event_parse_caps (event, &caps);
+      icstr_meter_set_caps (meter, caps);
+    } else if (GST_EVENT_TYPE (event) == GST_EVENT_SEGMENT) {
+      gst_event_copy_segment (event, &meter->segment);
+    }
+  }
+
+  return GST_PAD_PROBE_OK;
+}
+
+IcstrMeter *
+icstr_meter_new (GstPad *pad)
+{
+  IcstrMeter *meter = g_new0 (IcstrMeter, 1);
+  guint c;
+
+  gst_audio_info_init (&meter->info);
+  gst_segment_init (&meter->segment, GST_FORMAT_UNDEFINED);
+  atomic_init (&meter->running_time, GST_CLOCK_TIME_NONE);
+  for (c = 0; c < ICSTR_METER_MAX_CHANNELS; c++) {
+    atomic_init (&meter->rms_db[c], ICSTR_METER_FLOOR);
+    atomic_init (&meter->peak_db[c], ICSTR_METER_FLOOR);
+  }
+
+  meter->watches = g_array_new (FALSE, FALSE, sizeof (IcstrMeterWatch));
+  meter->pad = gst_object_ref (pad);
+  meter->probe = gst_pad_add_probe (pad,
+      GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+      icstr_meter_probe, meter, NULL);
+
+  return meter;
+}
+
+void
+icstr_meter_free (IcstrMeter *meter)
+{
+  gst_pad_remove_probe (meter->pad, meter->probe);
+  gst_object_unref (meter->pad);
+  g_array_unref (meter->watches);
+  g_free (meter);
+}
+
+/* calls func with the RMS levels of every window, from the streaming
+ * thread; to be used before the pipeline starts */
+void
+icstr_meter_add_watch (IcstrMeter *meter, IcstrMeterFunc func, gpointer data)
+{
+  IcstrMeterWatch watch = { func, data };
+
+  g_array_append_val (meter->watches, watch);
+}
+
+/* returns the number of channels, whose levels are stored up to n_channels,
+ * or 0 if nothing has been measured yet */
+guint
+icstr_meter_get_levels (IcstrMeter *meter, gdouble *rms, gdouble *peak,
+    guint n_channels)
+{
+  guint channels = atomic_load_explicit (&meter->channels,
+                                         memory_order_relaxed);
+  guint c;
+
+  for (c = 0; c < MIN (channels, n_channels); c++) {
+    if (rms)
+      rms[c] = atomic_load_explicit (&meter->rms_db[c], memory_order_relaxed);
+    if (peak)
+      peak[c] = atomic_load_explicit (&meter->peak_db[c],
+                                      memory_order_relaxed);
+  }
+
+  return channels;
+}
+
+/* the running time at the end of the last measurement, or
+ * GST_CLOCK_TIME_NONE */
+GstClockTime
+icstr_meter_get_running_time (IcstrMeter *meter)
+{
+  return atomic_load_explicit (&meter->running_time, memory_order_relaxed);
+}
@@ -0,0 +1,842 @@
+/*
+ * IceStreamer - A simple live audio streamer
+ *
+ * Copyright (C) 2017 George Kiagiadakis <gkiagia@tolabaki.gr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "icestreamer.h"
+#include <gio/gunixsocketaddress.h>
+#include <glib/gstdio.h>
+#include <stdatomic.h>
+#include <string.h>
+
+/*
+ * The counters are updated with relaxed atomic operations from pad probes,
+ * in the streaming threads. Everything else (rates, queue levels, the
+ * endpoint and the JSON dump) happens in the main thread.
+ */
+
+/* seconds between the samples that the rates are calculated from */
+#define METRICS_SAMPLE_INTERVAL 1
+#define DEFAULT_JSON_INTERVAL 10
+
+typedef struct _IcstrCounter IcstrCounter;
+struct _IcstrCounter
+{
+  atomic_uint_fast64_t buffers;
+  atomic_uint_fast64_t bytes;
+  atomic_int refcount;          /* if shared with a probe */
+};
+
+typedef struct _IcstrSourceMetrics IcstrSourceMetrics;
+struct _IcstrSourceMetrics
+{
+  IcstrCounter captured;
+  atomic_uint_fast64_t discont;
+};
+
+typedef struct _IcstrDestinationMetrics IcstrDestinationMetrics;
+struct _IcstrDestinationMetrics
+{
+  IcstrDestination *dest;
+  IcstrCounter *accepted;       /* shared with the probe */
+  gulong probe;
+  guint64 last_accepted;
+  gdouble bitrate;
+};
+
+typedef struct _IcstrStreamMetrics IcstrStreamMetrics;
+struct _IcstrStreamMetrics
+{
+  IcstrStream *stream;
+  IcstrCounter *encoded;        /* shared with the probe */
+  gulong probe;
+  guint64 last_encoded;
+  gdouble bitrate;
+  GList *destinations;
+};
+
+struct _IcstrMetrics
+{
+  IcstrSourceMetrics source;
+  IcstrMeter *meter;            /* weak pointer */
+  IcstrSilence *silence;        /* weak pointer, NULL if disabled */
+  IcstrFailover *failover;      /* weak pointer, NULL without a backup */
+  IcstrCpu *cpu;                /* weak pointer */
+  GList *streams;
+  gint64 last_sample;           /* monotonic time */
+  guint sample_source;
+  GSocketService *service;
+  gchar *socket_path;
+  gchar *json_file;
+  guint json_source;
+};
+
+/* A snapshot of a stream or destination, as reported */
+typedef struct _IcstrMetricsRow IcstrMetricsRow;
+struct _IcstrMetricsRow
+{
+  const gchar *stream;
+  const gchar *destination;     /* NULL for the stream itself */
+  guint64 buffers;              /* encoded or accepted */
+  guint64 bytes;                /* encoded or accepted */
+  gdouble bitrate;              /* bits per second */
+  guint level_bytes;
+  gdouble level_time;           /* seconds */
+  guint64 dropped;
+  guint reconnects;
+  gdouble since_error;          /* seconds, < 0 if there was none */
+  gboolean connected;
+  gdouble cpu;                  /* percent of a core, for the stream itself */
+};
+
+/* streaming thread */
+
+static void
+icstr_counter_add (IcstrCounter *counter, guint64 buffers, guint64 bytes)
+{
+  atomic_fetch_add_explicit (&counter->buffers, buffers, memory_order_relaxed);
+  atomic_fetch_add_explicit (&counter->bytes, bytes, memory_order_relaxed);
+}
+
+static GstPadProbeReturn
+icstr_metrics_count_probe (GstPad *pad, GstPadProbeInfo *info, gpointer data)
+{
+  IcstrCounter *counter = data;
+
+  if (info->type & GST_PAD_PROBE_TYPE_BUFFER) {
+    icstr_counter_add (counter, 1,
+        gst_buffer_get_size (GST_PAD_PROBE_INFO_BUFFER (info)));
+  } else if (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
+    GstBufferList *list = GST_PAD_PROBE_INFO_BUFFER_LIST (info);
+    icstr_counter_add (counter, gst_buffer_list_length (list),
+        gst_buffer_list_calculate_size (list));
+  }
+
+  return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn
+icstr_metrics_source_probe (GstPad *pad, GstPadProbeInfo *info,
+    gpointer data)
+{
+  IcstrSourceMetrics *m = data;
+  GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+
+  icstr_counter_add (&m->captured, 1, gst_buffer_get_size (buffer));
+  if (GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DISCONT))
+    atomic_fetch_add_explicit (&m->discont, 1, memory_order_relaxed);
+
+  return GST_PAD_PROBE_OK;
+}
+
+static void
+icstr_counter_unref (IcstrCounter *counter)
+{
+  if (atomic_fetch_sub (&counter->refcount, 1) == 1)
+    g_free (counter);
+}
+
+/* the probe keeps its own reference to the counter, which is dropped by
+ * GStreamer once the probe has been removed and is no longer running */
+static gulong
+icstr_metrics_watch_pad (GstElement *element, const gchar *pad_name,
+    IcstrCounter **counter)
+{
+  g_autoptr (GstPad) pad = gst_element_get_static_pad (element, pad_name);
+
+  *counter = g_new0 (IcstrCounter, 1);
+  atomic_init (&(*counter)->refcount, 2);
+
+  return gst_pad_add_probe (pad,
+      GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST,
+      icstr_metrics_count_probe, *counter,
+      (GDestroyNotify) icstr_counter_unref);
+}
+
+static void
+icstr_metrics_unwatch_pad (GstElement *element, const gchar *pad_name,
+    gulong probe)
+{
+  g_autoptr (GstPad) pad = gst_element_get_static_pad (element, pad_name);
+
+  gst_pad_remove_probe (pad, probe);
+}
+
+/* main thread */
+
+static guint64
+icstr_counter_get_bytes (IcstrCounter *counter)
+{
+  return atomic_load_explicit (&counter->bytes, memory_order_relaxed);
+}
+
+static guint64
+icstr_counter_get_buffers (IcstrCounter *counter)
+{
+  return atomic_load_explicit (&counter->buffers, memory_order_relaxed);
+}
+
+static gboolean
+icstr_metrics_sample (gpointer data)
+{
+  IcstrMetrics *metrics = data;
+  gint64 now = g_get_monotonic_time ();
+  gdouble elapsed;
+  GList *curr, *dcurr;
+  guint64 bytes;
+
+  elapsed = (gdouble) (now - metrics->last_sample) / G_TIME_SPAN_SECOND;
+  metrics->last_sample = now;
+  if (elapsed <= 0)
+    return G_SOURCE_CONTINUE;
+
+  for (curr = metrics->streams; curr != NULL; curr = g_list_next (curr)) {
+    IcstrStreamMetrics *sm = curr->data;
+
+    bytes = icstr_counter_get_bytes (sm->encoded);
+    sm->bitrate = (bytes - sm->last_encoded) * 8 / elapsed;
+    sm->last_encoded = bytes;
+
+    for (dcurr = sm->destinations; dcurr != NULL; dcurr = g_list_next (dcurr)) {
+      IcstrDestinationMetrics *dm = dcurr->data;
+
+      bytes = icstr_counter_get_bytes (dm->accepted);
+      dm->bitrate = (bytes - dm->last_accepted) * 8 / elapsed;
+      dm->last_accepted = bytes;
+    }
+  }
+
+  return G_SOURCE_CONTINUE;
+}
+
+static void
+icstr_metrics_fill_queue (IcstrMetricsRow *row, IcstrQueue *queue)
+{
+  IcstrQueueStats stats;
+
+  icstr_queue_get_stats (queue, &stats);
+  row->level_bytes = stats.level_bytes;
+  row->level_time = (gdouble) stats.level_time / GST_SECOND;
+  row->dropped = stats.dropped;
+}
+
+static GArray *
+icstr_metrics_collect (IcstrMetrics *metrics)
+{
+  GArray *rows = g_array_new (FALSE, TRUE, sizeof (IcstrMetricsRow));
+  gint64 now = g_get_monotonic_time ();
+  GList *curr, *dcurr;
+  IcstrMetricsRow row;
+
+  for (curr = metrics->streams; curr != NULL; curr = g_list_next (curr)) {
+    IcstrStreamMetrics *sm = curr->data;
+
+    memset (&row, 0, sizeof (row));
+    row.stream = sm->stream->name;
+    row.buffers = icstr_counter_get_buffers (sm->encoded);
+    row.bytes = icstr_counter_get_bytes (sm->encoded);
+    row.bitrate = sm->bitrate;
+    row.cpu = icstr_cpu_get_stream (metrics->cpu, sm->stream);
+    icstr_metrics_fill_queue (&row, sm->stream->queue);
+    g_array_append_val (rows, row);
+
+    for (dcurr = sm->destinations; dcurr != NULL; dcurr = g_list_next (dcurr)) {
+      IcstrDestinationMetrics *dm = dcurr->data;
+
+      memset (&row, 0, sizeof (row));
+      row.stream = sm->stream->name;
+      row.destination = dm->dest->name;
+      row.buffers = icstr_counter_get_buffers (dm->accepted);
+      row.bytes = icstr_counter_get_bytes (dm->accepted);
+      row.bitrate = dm->bitrate;
+      icstr_metrics_fill_queue (&row, dm->dest->queue);
+      row.reconnects = dm->dest->reconnects;
+      row.connected = g_atomic_int_get (&dm->dest->connected);
+      row.since_error = dm->dest->last_error ?
+          (gdouble) (now - dm->dest->last_error) / G_TIME_SPAN_SECOND : -1;
+      g_array_append_val (rows, row);
+    }
+  }
+
+  return rows;
+}
+
+/* label values and JSON strings share the same escaping for our names */
+static void
+icstr_metrics_append_escaped (GString *out, const gchar *str)
+{
+  for (; *str; str++) {
+    if (*str == '"' || *str == '\\')
+      g_string_append_c (out, '\\');
+    g_string_append_c (out, *str);
+  }
+}
+
+static void
+icstr_metrics_append_family (GString *out, const gchar *name,
+    const gchar *type, const gchar *help)
+{
+  g_string_append_printf (out, "# HELP icestreamer_%s %s\n", name, help);
+  g_string_append_printf (out, "# TYPE icestreamer_%s %s\n", name, type);
+}
+
+static void
+icstr_metrics_append_labels (GString *out, const gchar *name,
+    const IcstrMetricsRow *row)
+{
+  g_string_append_printf (out, "icestreamer_%s{stream=\"", name);
+  icstr_metrics_append_escaped (out, row->stream);
+  if (row->destination) {
+    g_string_append (out, "\",destination=\"");
+    icstr_metrics_append_escaped (out, row->destination);
+  }
+  g_string_append (out, "\"} ");
+}
+
+#define ICSTR_METRICS_FAMILY(out, rows, for_dest, name, type, help, fmt, val) \
+  G_STMT_START { \
+    guint i_; \
+    icstr_metrics_append_family (out, name, type, help); \
+    for (i_ = 0; i_ < (rows)->len; i_++) { \
+      const IcstrMetricsRow *row = &g_array_index (rows, IcstrMetricsRow, i_); \
+      if (!row->destination == !!(for_dest)) \
+        continue; \
+      icstr_metrics_append_labels (out, name, row); \
+      g_string_append_printf (out, fmt "\n", val); \
+    } \
+  } G_STMT_END
+
+static gchar *
+icstr_metrics_format_prometheus (IcstrMetrics *metrics)
+{
+  g_autoptr (GArray) rows = icstr_metrics_collect (metrics);
+  GString *out = g_string_new (NULL);
+  IcstrSourceMetrics *src = &metrics->source;
+  gdouble rms[ICSTR_METER_MAX_CHANNELS], peak[ICSTR_METER_MAX_CHANNELS];
+  guint i, channels;
+
+  icstr_metrics_append_family (out, "source_buffers_total", "counter",
+      "Buffers captured from the input");
+  g_string_append_printf (out, "icestreamer_source_buffers_total %"
+      G_GUINT64_FORMAT "\n", icstr_counter_get_buffers (&src->captured));
+  icstr_metrics_append_family (out, "source_discontinuities_total", "counter",
+      "Discontinuities in the captured audio");
+  g_string_append_printf (out, "icestreamer_source_discontinuities_total %"
+      G_GUINT64_FORMAT "\n",
+      (guint64) atomic_load_explicit (&src->discont, memory_order_relaxed));
+
+  channels = MIN (icstr_meter_get_levels (metrics->meter, rms, peak,
+          ICSTR_METER_MAX_CHANNELS), ICSTR_METER_MAX_CHANNELS);
+  icstr_metrics_append_family (out, "source_rms_dbfs", "gauge",
+      "RMS level of each channel of the input");
+  for (i = 0; i < channels; i++)
+    g_string_append_printf (out,
+        "icestreamer_source_rms_dbfs{channel=\"%u\"} %.2f\n", i, rms[i]);
+  icstr_metrics_append_family (out, "source_peak_dbfs", "gauge",
+      "Peak level of each channel of the input");
+  for (i = 0; i < channels; i++)
+    g_string_append_printf (out,
+        "icestreamer_source_peak_dbfs{channel=\"%u\"} %.2f\n", i, peak[i]);
+
+  icstr_metrics_append_family (out, "source_cpu_percent", "gauge",
+      "CPU used by the input and the conversions, in percent of a core");
+  g_string_append_printf (out, "icestreamer_source_cpu_percent %.1f\n",
+                          icstr_cpu_get_input (metrics->cpu));
+
+  if (metrics->silence) {
+    guint events;
+    gboolean silent = icstr_silence_get_state (metrics->silence, &events);
+
+    icstr_metrics_append_family (out, "source_silent", "gauge",
+        "Whether the input is silent (dead air)");
+    g_string_append_printf (out, "icestreamer_source_silent %d\n", silent);
+    icstr_metrics_append_family (out, "source_silences_total", "counter",
+        "Times the input has gone silent");
+    g_string_append_printf (out, "icestreamer_source_silences_total %u\n",
+                            events);
+  }
+
+  if (metrics->failover) {
+    guint switches;
+    gboolean backup = icstr_failover_get_state (metrics->failover, &switches);
+
+    icstr_metrics_append_family (out, "source_backup_active", "gauge",
+        "Whether the backup input is on air");
+    g_string_append_printf (out, "icestreamer_source_backup_active %d\n",
+                            backup);
+    icstr_metrics_append_family (out, "source_switches_total", "counter",
+        "Switches between the primary and the backup input");
+    g_string_append_printf (out, "icestreamer_source_switches_total %u\n",
+                            switches);
+  }
+
+  ICSTR_METRICS_FAMILY (out, rows, FALSE, "stream_encoded_buffers_total",
+      "counter", "Buffers produced by the encoder",
+      "%" G_GUINT64_FORMAT, row->buffers);
+  ICSTR_METRICS_FAMILY (out, rows, FALSE, "stream_encoded_bytes_total",
+      "counter", "Bytes produced by the encoder",
+      "%" G_GUINT64_FORMAT, row->bytes);
+  ICSTR_METRICS_FAMILY (out, rows, FALSE, "stream_encoded_bitrate",
+      "gauge", "Output rate of the encoder in bits per second",
+      "%.0f", row->bitrate);
+  ICSTR_METRICS_FAMILY (out, rows, FALSE, "stream_queue_level_bytes",
+      "gauge", "Bytes waiting in the queue of the encoder",
+      "%u", row->level_bytes);
+  ICSTR_METRICS_FAMILY (out, rows, FALSE, "stream_queue_level_seconds",
+      "gauge", "Time waiting in the queue of the encoder",
+      "%.3f", row->level_time);
+  ICSTR_METRICS_FAMILY (out, rows, FALSE, "stream_queue_dropped_total",
+      "counter", "Buffers dropped by the queue of the encoder",
+      "%" G_GUINT64_FORMAT, row->dropped);
+  ICSTR_METRICS_FAMILY (out, rows, FALSE, "stream_cpu_percent",
+      "gauge", "CPU used by the stream and its destinations, in percent "
+      "of a core", "%.1f", row->cpu);
+
+  /* what the sink was handed, which it may still be holding or drop */
+  ICSTR_METRICS_FAMILY (out, rows, TRUE, "destination_accepted_bytes_total",
+      "counter", "Bytes handed to the sink of the destination",
+      "%" G_GUINT64_FORMAT, row->bytes);
+  ICSTR_METRICS_FAMILY (out, rows, TRUE, "destination_bitrate",
+      "gauge", "Rate handed to the sink of the destination in bits per second",
+      "%.0f", row->bitrate);
+  ICSTR_METRICS_FAMILY (out, rows, TRUE, "destination_queue_level_bytes",
+      "gauge", "Bytes waiting in the queue of the destination",
+      "%u", row->level_bytes);
+  ICSTR_METRICS_FAMILY (out, rows, TRUE, "destination_queue_level_seconds",
+      "gauge", "Time waiting in the queue of the destination",
+      "%.3f", row->level_time);
+  ICSTR_METRICS_FAMILY (out, rows, TRUE, "destination_queue_dropped_total",
+      "counter", "Buffers dropped by the queue of the destination",
+      "%" G_GUINT64_FORMAT, row->dropped);
+  ICSTR_METRICS_FAMILY (out, rows, TRUE, "destination_reconnects_total",
+      "counter", "Reconnection attempts", "%u", row->reconnects);
+  ICSTR_METRICS_FAMILY (out, rows, TRUE, "destination_connected",
+      "gauge", "Whether the destination is connected", "%d", row->connected);
+
+  icstr_metrics_append_family (out, "destination_seconds_since_error",
+      "gauge", "Time since the last error of the destination");
+  for (i = 0; i < rows->len; i++) {
+    const IcstrMetricsRow *row = &g_array_index (rows, IcstrMetricsRow, i);
+    if (!row->destination || row->since_error < 0)
+      continue;
+    icstr_metrics_append_labels (out, "destination_seconds_since_error", row);
+    g_string_append_printf (out, "%.0f\n", row->since_error);
+  }
+
+  return g_string_free (out, FALSE);
+}
+
+static void
+icstr_metrics_append_json_row (GString *out, const IcstrMetricsRow *row)
+{
+  g_string_append (out, "{\"name\": \"");
+  icstr_metrics_append_escaped (out,
+      row->destination ? row->destination : row->stream);
+  g_string_append_printf (out, "\", \"%s_buffers\": %" G_GUINT64_FORMAT
+      ", \"%s_bytes\": %" G_GUINT64_FORMAT ", \"bitrate\": %.0f"
+      ", \"queue_level_bytes\": %u, \"queue_level_seconds\": %.3f"
+      ", \"queue_dropped\": %" G_GUINT64_FORMAT,
+      row->destination ? "accepted" : "encoded", row->buffers,
+      row->destination ? "accepted" : "encoded", row->bytes, row->bitrate,
+      row->level_bytes, row->level_time, row->dropped);
+
+  if (!row->destination) {
+    g_string_append_printf (out, ", \"cpu_percent\": %.1f", row->cpu);
+  } else {
+    g_string_append_printf (out, ", \"reconnects\": %u, \"connected\": %s",
+        row->reconnects, row->connected ? "true" : "false");
+    if (row->since_error < 0)
+      g_string_append (out, ", \"seconds_since_error\": null");
+    else
+      g_string_append_printf (out, ", \"seconds_since_error\": %.0f",
+                              row->since_error);
+  }
+}
+
+gchar *
+icstr_metrics_format_json (IcstrMetrics *metrics)
+{
+  g_autoptr (GArray) rows = icstr_metrics_collect (metrics);
+  GString *out = g_string_new (NULL);
+  IcstrSourceMetrics *src = &metrics->source;
+  gdouble rms[ICSTR_METER_MAX_CHANNELS], peak[ICSTR_METER_MAX_CHANNELS];
+  gboolean first_dest = TRUE;
+  guint i, channels;
+
+  g_string_append_printf (out, "{\"time\": %" G_GINT64_FORMAT
+      ", \"source\": {\"buffers\": %" G_GUINT64_FORMAT
+      ", \"discontinuities\": %" G_GUINT64_FORMAT,
+      g_get_real_time () / G_USEC_PER_SEC,
+      icstr_counter_get_buffers (&src->captured),
+      (guint64) atomic_load_explicit (&src->discont, memory_order_relaxed));
+
+  /* one value per channel */
+  channels = MIN (icstr_meter_get_levels (metrics->meter, rms, peak,
+          ICSTR_METER_MAX_CHANNELS), ICSTR_METER_MAX_CHANNELS);
+  g_string_append (out, ", \"rms_dbfs\": [");
+  for (i = 0; i < channels; i++)
+    g_string_append_printf (out, "%s%.2f", i > 0 ? ", " : "", rms[i]);
+  g_string_append (out, "], \"peak_dbfs\": [");
+  for (i = 0; i < channels; i++)
+    g_string_append_printf (out, "%s%.2f", i > 0 ? ", " : "", peak[i]);
+  g_string_append_printf (out, "], \"cpu_percent\": %.1f",
+                          icstr_cpu_get_input (metrics->cpu));
+
+  if (metrics->silence) {
+    guint events;
+    gboolean silent = icstr_silence_get_state (metrics->silence, &events);
+
+    g_string_append_printf (out, ", \"silent\": %s, \"silences\": %u",
+                            silent ? "true" : "false", events);
+  }
+
+  if (metrics->failover) {
+    guint switches;
+    gboolean backup = icstr_failover_get_state (metrics->failover, &switches);
+
+    g_string_append_printf (out, ", \"backup_active\": %s, \"switches\": %u",
+                            backup ? "true" : "false", switches);
+  }
+  g_string_append (out, "}, \"streams\": [");
+
+  /* each stream row is followed by the rows of its destinations */
+  for (i = 0; i < rows->len; i++) {
+    const IcstrMetricsRow *row = &g_array_index (rows, IcstrMetricsRow, i);
+
+    if (!row->destination) {
+      if (i > 0)
+        g_string_append (out, "]}, ");
+      icstr_metrics_append_json_row (out, row);
+      g_string_append (out, ", \"destinations\": [");
+      first_dest = TRUE;
+    } else {
+      if (!first_dest)
+        g_string_append (out, ", ");
+      icstr_metrics_append_json_row (out, row);
+      g_string_append (out, "}");
+      first_dest = FALSE;
+    }
+  }
+  if (rows->len > 0)
+    g_string_append (out, "]}");
+  g_string_append (out, "]}\n");
+
+  return g_string_free (out, FALSE);
+}
+
+static gboolean
+icstr_metrics_dump_json (gpointer data)
+{
+  IcstrMetrics *metrics = data;
+  g_autoptr (GError) error = NULL;
+  g_autofree gchar *json = icstr_metrics_format_json (metrics);
+
+  if (!g_file_set_contents (metrics->json_file, json, -1, &error))
+    GST_WARNING ("Failed to write metrics: %s", error->message);
+
+  return G_SOURCE_CONTINUE;
+}
+
+/* the endpoint */
+
+typedef struct _IcstrMetricsRequest IcstrMetricsRequest;
+struct _IcstrMetricsRequest
+{
+  IcstrMetrics *metrics;
+  GSocketConnection *connection;
+  gchar request[1024];
+  gchar *response;
+};
+
+static void
+icstr_metrics_request_free (IcstrMetricsRequest *req)
+{
+  g_object_unref (req->connection);
+  g_free (req->response);
+  g_free (req);
+}
+
+static void
+icstr_metrics_response_written (GObject *stream, GAsyncResult *res,
+    gpointer data)
+{
+  g_output_stream_write_all_finish (G_OUTPUT_STREAM (stream), res, NULL, NULL);
+  icstr_metrics_request_free (data);
+}
+
+static void
+icstr_metrics_request_read (GObject *stream, GAsyncResult *res,
+    gpointer data)
+{
+  IcstrMetricsRequest *req = data;
+  g_autofree gchar *body = NULL;
+  const gchar *content_type;
+  GOutputStream *output;
+  gssize n_read;
+
+  n_read = g_input_stream_read_finish (G_INPUT_STREAM (stream), res, NULL);
+  if (n_read <= 0) {
+    icstr_metrics_request_free (req);
+    return;
+  }
+  req->request[n_read] = '\0';
+
+  /* the JSON document is also available at /json, anything else is
+   * answered with the Prometheus text format */
+  if (g_str_has_prefix (req->request, "GET /json")) {
+    body = icstr_metrics_format_json (req->metrics);
+    content_type = "application/json";
+  } else {
+    body = icstr_metrics_format_prometheus (req->metrics);
+    content_type = "text/plain; version=0.0.4";
+  }
+
+  req->response = g_strdup_printf ("HTTP/1.0 200 OK\r\n"
+      "Content-Type: %s\r\n"
+      "Content-Length: %" G_GSIZE_FORMAT "\r\n"
+      "Connection: close\r\n\r\n%s", content_type, strlen (body), body);
+
+  output = g_io_stream_get_output_stream (G_IO_STREAM (req->connection));
+  g_output_stream_write_all_async (output, req->response,
+      strlen (req->response), G_PRIORITY_DEFAULT, NULL,
+      icstr_metrics_response_written, req);
+}
+
+static gboolean
+icstr_metrics_incoming (GSocketService *service,
+    GSocketConnection *connection, GObject *source, gpointer data)
+{
+  IcstrMetricsRequest *req = g_new0 (IcstrMetricsRequest, 1);
+  GInputStream *input;
+
+  req->metrics = data;
+  req->connection = g_object_ref (connection);
+
+  input = g_io_stream_get_input_stream (G_IO_STREAM (connection));
+  g_input_stream_read_async (input, req->request, sizeof (req->request) - 1,
+      G_PRIORITY_DEFAULT, NULL, icstr_metrics_request_read, req);
+
+  return TRUE;
+}
+
+static gboolean
+icstr_metrics_listen (IcstrMetrics *metrics, GKeyFile *keyfile,
+    GError **error)
+{
+  g_autoptr (GSocketAddress) addr = NULL;
+  g_autofree gchar *address = NULL;
+  gint port;
+
+  metrics->socket_path = g_key_file_get_string (keyfile, "metrics", "socket",
+                                                NULL);
+  port = icstr_keyfile_get_integer_with_fallback (keyfile, "metrics", "port",
+                                                  0);
+
+  if (metrics->socket_path) {
+    /* a stale socket from a previous run */
+    g_unlink (metrics->socket_path);
+    addr = g_unix_socket_address_new (metrics->socket_path);
+  } else if (port > 0) {
+    address = icstr_keyfile_get_string_with_fallback (keyfile, "metrics",
+        "address", "127.0.0.1");
+    addr = g_inet_socket_address_new_from_string (address, port);
+    if (!addr) {
+      g_set_error (error, ICSTR_ERROR, 0, "Invalid metrics address: %s",
+                   address);
+      return FALSE;
+    }
+  } else {
+    /* no endpoint, maybe only the JSON dump */
+    return TRUE;
+  }
+
+  metrics->service = g_socket_service_new ();
+  if (!g_socket_listener_add_address (G_SOCKET_LISTENER (metrics->service),
+          addr, G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_DEFAULT, NULL, NULL,
+          error))
+    return FALSE;
+
+  g_signal_connect (metrics->service, "incoming",
+                    G_CALLBACK (icstr_metrics_incoming), metrics);
+  g_socket_service_start (metrics->service);
+
+  return TRUE;
+}
+
+static void
+icstr_destination_metrics_free (IcstrDestinationMetrics *dm)
+{
+  icstr_counter_unref (dm->accepted);
+  g_free (dm);
+}
+
+static void
+icstr_stream_metrics_free (IcstrStreamMetrics *sm)
+{
+  g_list_free_full (sm->destinations,
+                    (GDestroyNotify) icstr_destination_metrics_free);
+  icstr_counter_unref (sm->encoded);
+  g_free (sm);
+}
+
+static IcstrStreamMetrics *
+icstr_metrics_find_stream (IcstrMetrics *metrics, IcstrStream *stream)
+{
+  GList *curr;
+
+  for (curr = metrics->streams; curr != NULL; curr = g_list_next (curr)) {
+    IcstrStreamMetrics *sm = curr->data;
+    if (sm->stream == stream)
+      return sm;
+  }
+
+  return NULL;
+}
+
+void
+icstr_metrics_add_destination (IcstrMetrics *metrics, IcstrDestination *dest)
+{
+  IcstrStreamMetrics *sm = icstr_metrics_find_stream (metrics, dest->stream);
+  IcstrDestinationMetrics *dm;
+
+  if (!sm)
+    return;
+
+  dm = g_new0 (IcstrDestinationMetrics, 1);
+  dm->dest = dest;
+  dm->probe = icstr_metrics_watch_pad (dest->sink, "sink", &dm->accepted);
+  sm->destinations = g_list_append (sm->destinations, dm);
+}
+
+/* to be called before the destination is freed */
+void
+icstr_metrics_remove_destination (IcstrMetrics *metrics,
+    IcstrDestination *dest)
+{
+  IcstrStreamMetrics *sm = icstr_metrics_find_stream (metrics, dest->stream);
+  GList *curr;
+
+  if (!sm)
+    return;
+
+  for (curr = sm->destinations; curr != NULL; curr = g_list_next (curr)) {
+    IcstrDestinationMetrics *dm = curr->data;
+
+    if (dm->dest == dest) {
+      icstr_metrics_unwatch_pad (dest->sink, "sink", dm->probe);
+      sm->destinations = g_list_delete_link (sm->destinations, curr);
+      icstr_destination_metrics_free (dm);
+      return;
+    }
+  }
+}
+
+void
+icstr_metrics_add_stream (IcstrMetrics *metrics, IcstrStream *stream)
+{
+  IcstrStreamMetrics *sm = g_new0 (IcstrStreamMetrics, 1);
+  GList *curr;
+
+  sm->stream = stream;
+  sm->probe = icstr_metrics_watch_pad (stream->encoder, "src", &sm->encoded);
+  metrics->streams = g_list_append (metrics->streams, sm);
+
+  for (curr = stream->destinations; curr != NULL; curr = g_list_next (curr))
+    icstr_metrics_add_destination (metrics, curr->data);
+}
+
+/* to be called before the stream is freed */
+void
+icstr_metrics_remove_stream (IcstrMetrics *metrics, IcstrStream *stream)
+{
+  IcstrStreamMetrics *sm = icstr_metrics_find_stream (metrics, stream);
+
+  if (!sm)
+    return;
+
+  while (sm->destinations) {
+    IcstrDestinationMetrics *dm = sm->destinations->data;
+    icstr_metrics_remove_destination (metrics, dm->dest);
+  }
+
+  icstr_metrics_unwatch_pad (stream->encoder, "src", sm->probe);
+  metrics->streams = g_list_remove (metrics->streams, sm);
+  icstr_stream_metrics_free (sm);
+}
+
+void
+icstr_metrics_free (IcstrMetrics *metrics)
+{
+  if (metrics->sample_source)
+    g_source_remove (metrics->sample_source);
+  if (metrics->json_source)
+    g_source_remove (metrics->json_source);
+
+  if (metrics->service) {
+    g_socket_service_stop (metrics->service);
+    g_socket_listener_close (G_SOCKET_LISTENER (metrics->service));
+    g_object_unref (metrics->service);
+  }
+  if (metrics->socket_path)
+    g_unlink (metrics->socket_path);
+
+  /* the probes are gone with the pipeline, which is freed before us */
+  g_list_free_full (metrics->streams,
+                    (GDestroyNotify) icstr_stream_metrics_free);
+  g_free (metrics->socket_path);
+  g_free (metrics->json_file);
+  g_free (metrics);
+}
+
+gboolean
+icstr_metrics_setup (IceStreamer *self, GKeyFile *keyfile, GError **error)
+{
+  IcstrMetrics *metrics = g_new0 (IcstrMetrics, 1);
+  g_autoptr (GstPad) pad = NULL;
+  GList *curr;
+  gint json_interval;
+
+  /* keep it before anything fails, so that it is always freed */
+  self->metrics = metrics;
+
+  /* the levels are measured by the meter of the input */
+  metrics->meter = self->meter;
+  metrics->silence = self->silence;
+  metrics->failover = self->failover;
+  metrics->cpu = self->cpu;
+
+  pad = gst_element_get_static_pad (self->tee, "sink");
+  gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER,
+      icstr_metrics_source_probe, &metrics->source, NULL);
+
+  for (curr = self->streams; curr != NULL; curr = g_list_next (curr))
+    icstr_metrics_add_stream (metrics, curr->data);
+
+  metrics->last_sample = g_get_monotonic_time ();
+  metrics->sample_source = g_timeout_add_seconds (METRICS_SAMPLE_INTERVAL,
+      icstr_metrics_sample, metrics);
+
+  metrics->json_file = g_key_file_get_string (keyfile, "metrics", "json-file",
+                                              NULL);
+  if (metrics->json_file) {
+    json_interval = icstr_keyfile_get_integer_with_fallback (keyfile,
+        "metrics", "json-interval", DEFAULT_JSON_INTERVAL);
+    metrics->json_source = g_timeout_add_seconds (MAX (json_interval, 1),
+        icstr_metrics_dump_json, metrics);
+  }
+
+  return icstr_metrics_listen (metrics, keyfile, error);
+}
@@ -0,0 +1,275 @@
+/*
+ * IceStreamer - A simple live audio streamer
+ *
+ * Copyright (C) 2017 George Kiagiadakis <gkiagia@tolabaki.gr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "icestreamer.h"
+#include <stdatomic.h>
+
+/*
+ * The leaky queues in front of the encoders and the sinks. When one of them
+ * is full, the oldest buffers are silently dropped, so we count the buffers
+ * going in and out of it and the overruns, and report the drops.
+ *
+ * The counters are updated from the streaming threads; everything else
+ * happens in the main thread, once every QUEUE_CHECK_INTERVAL.
+ */
+
+/* seconds between checks of the queue */
+#define QUEUE_CHECK_INTERVAL 1
+
+/* seconds between two reports of dropped buffers from the same queue */
+#define QUEUE_REPORT_INTERVAL 10
+
+/* seconds without overruns before an adaptive queue shrinks */
+#define QUEUE_SHRINK_TIME 30
+
+struct _IcstrQueue
+{
+  gchar *name;                  /* for reporting, e.g. "stream1/primary" */
+  GstElement *element;
+
+  /* updated from the streaming threads */
+  atomic_uint_fast64_t in;      /* buffers */
+  atomic_uint_fast64_t out;     /* buffers */
+  atomic_uint overruns;
+
+  guint64 dropped;              /* never decreases */
+  guint64 reported;             /* dropped, at the last report */
+  gint64 last_report;           /* monotonic time */
+  guint last_overruns;
+  gint64 last_overrun;          /* monotonic time */
+
+  /* adaptive mode; max-size-time moves between min_time and max_time */
+  gboolean adaptive;
+  GstClockTime time;
+  GstClockTime min_time;
+  GstClockTime max_time;
+
+  gulong in_probe;
+  gulong out_probe;
+  guint check_source;
+};
+
+static GstPadProbeReturn
+icstr_queue_count_probe (GstPad *pad, GstPadProbeInfo *info, gpointer data)
+{
+  atomic_uint_fast64_t *counter = data;
+  guint n = 1;
+
+  if (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST)
+    n = gst_buffer_list_length (GST_PAD_PROBE_INFO_BUFFER_LIST (info));
+
+  atomic_fetch_add_explicit (counter, n, memory_order_relaxed);
+  return GST_PAD_PROBE_OK;
+}
+
+static void
+icstr_queue_overrun (GstElement *element, gpointer data)
+{
+  IcstrQueue *queue = data;
+
+  atomic_fetch_add_explicit (&queue->overruns, 1, memory_order_relaxed);
+}
+
+void
+icstr_queue_get_stats (IcstrQueue *queue, IcstrQueueStats *stats)
+{
+  guint64 in, out;
+  guint overruns;
+
+  out = atomic_load_explicit (&queue->out, memory_order_relaxed);
+  g_object_get (queue->element,
+      "current-level-buffers", &stats->level_buffers,
+      "current-level-bytes", &stats->level_bytes,
+      "current-level-time", &stats->level_time,
+      NULL);
+  in = atomic_load_explicit (&queue->in, memory_order_relaxed);
+  overruns = atomic_load_explicit (&queue->overruns, memory_order_relaxed);
+
+  /*
+   * The queue does not tell how many buffers it leaks, so they are what
+   * went in, minus what came out and what is still there. The counters
+   * are not read atomically with the level, so this is only trusted once
+   * the queue has actually overrun, and each overrun dropped at least one.
+   */
+  if (overruns > 0 && in > out + stats->level_buffers)
+    queue->dropped = MAX (queue->dropped, in - out - stats->level_buffers);
+  queue->dropped = MAX (queue->dropped, overruns);
+
+  stats->dropped = queue->dropped;
+  stats->overruns = overruns;
+}
+
+static void
+icstr_queue_set_time (IcstrQueue *queue, GstClockTime time)
+{
+  GST_INFO ("%s: queue limit is now %" GST_TIME_FORMAT, queue->name,
+            GST_TIME_ARGS (time));
+  queue->time = time;
+  g_object_set (queue->element, "max-size-time", time, NULL);
+}
+
+static gboolean
+icstr_queue_check (gpointer data)
+{
+  IcstrQueue *queue = data;
+  gint64 now = g_get_monotonic_time ();
+  IcstrQueueStats stats;
+
+  icstr_queue_get_stats (queue, &stats);
+
+  if (stats.overruns != queue->last_overruns) {
+    queue->last_overruns = stats.overruns;
+    queue->last_overrun = now;
+
+    /* make room for the backlog of a stream that is catching up */
+    if (queue->adaptive && queue->time < queue->max_time)
+      icstr_queue_set_time (queue, MIN (queue->time * 2, queue->max_time));
+  } else if (queue->adaptive && queue->time > queue->min_time &&
+      now - queue->last_overrun > QUEUE_SHRINK_TIME * G_TIME_SPAN_SECOND &&
+      stats.level_time < queue->time / 4) {
+    /* idle for a while; the level stays well below the new limit,
+     * so that shrinking does not drop anything by itself */
+    icstr_queue_set_time (queue, MAX (queue->time / 2, queue->min_time));
+    queue->last_overrun = now;
+  }
+
+  /* report drops at most once every QUEUE_REPORT_INTERVAL */
+  if (stats.dropped > queue->reported &&
+      now - queue->last_report >= QUEUE_REPORT_INTERVAL * G_TIME_SPAN_SECOND) {
+    GstStructure *s;
+
+    GST_WARNING ("%s: dropped %" G_GUINT64_FORMAT " buffers "
+        "(%" G_GUINT64_FORMAT " in total), the queue is full", queue->name,
+        stats.dropped - queue->reported, stats.dropped);
+
+    s = gst_structure_new ("icestreamer-queue-drops",
+        "queue", G_TYPE_STRING, queue->name,
+        "dropped", G_TYPE_UINT64, stats.dropped - queue->reported,
+        "total", G_TYPE_UINT64, stats.dropped,
+        NULL);
+    gst_element_post_message (queue->element,
+        gst_message_new_element (GST_OBJECT (queue->element), s));
+
+    queue->reported = stats.dropped;
+    queue->last_report = now;
+  }
+
+  return G_SOURCE_CONTINUE;
+}
+
+static gulong
+icstr_queue_watch_pad (IcstrQueue *queue, const gchar *pad_name,
+    atomic_uint_fast64_t *counter)
+{
+  g_autoptr (GstPad) pad = gst_element_get_static_pad (queue->element,
+                                                       pad_name);
+
+  return gst_pad_add_probe (pad,
+      GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST,
+      icstr_queue_count_probe, counter, NULL);
+}
+
+static void
+icstr_queue_unwatch_pad (IcstrQueue *queue, const gchar *pad_name,
+    gulong probe)
+{
+  g_autoptr (GstPad) pad = gst_element_get_static_pad (queue->element,
+                                                       pad_name);
+
+  gst_pad_remove_probe (pad, probe);
+}
+
+static gboolean
+icstr_queue_get_boolean (GKeyFile *keyfile, const gchar *group,
+    const gchar *fallback_group, const gchar *key, gboolean fallback)
+{
+  if (g_key_file_has_key (keyfile, group, key, NULL))
+    return g_key_file_get_boolean (keyfile, group, key, NULL);
+  if (g_key_file_has_key (keyfile, fallback_group, key, NULL))
+    return g_key_file_get_boolean (keyfile, fallback_group, key, NULL);
+  return fallback;
+}
+
+IcstrQueue *
+icstr_queue_new (GKeyFile *keyfile, const gchar *group,
+    const gchar *parent_group, const gchar *name)
+{
+  IcstrQueue *queue = g_new0 (IcstrQueue, 1);
+  const gchar *fallback_group = parent_group ? parent_group : group;
+  gint time_ms, max_time_ms, bytes;
+  gboolean leaky;
+
+  /* limits, as with the rest, inherited from the stream */
+  time_ms = icstr_keyfile_get_integer_with_fallback (keyfile, group,
+      "queue-time", icstr_keyfile_get_integer_with_fallback (keyfile,
+          fallback_group, "queue-time", QUEUE_TIME));
+  max_time_ms = icstr_keyfile_get_integer_with_fallback (keyfile, group,
+      "queue-max-time", icstr_keyfile_get_integer_with_fallback (keyfile,
+          fallback_group, "queue-max-time", 0));
+  bytes = icstr_keyfile_get_integer_with_fallback (keyfile, group,
+      "queue-bytes", icstr_keyfile_get_integer_with_fallback (keyfile,
+          fallback_group, "queue-bytes", QUEUE_BYTES));
+
+  time_ms = MAX (time_ms, 1);
+  if (max_time_ms <= 0)
+    max_time_ms = time_ms * 4;
+
+  queue->name = g_strdup (name);
+  queue->element = icstr_element_factory_make_with_group_name ("queue", group);
+  queue->min_time = time_ms * GST_MSECOND;
+  queue->max_time = MAX (max_time_ms, time_ms) * GST_MSECOND;
+  queue->time = queue->min_time;
+  queue->adaptive = icstr_queue_get_boolean (keyfile, group, fallback_group,
+      "queue-adaptive", FALSE);
+
+  /* queues that do not leak block upstream instead, e.g. when benchmarking
+   * faster than real time */
+  leaky = icstr_queue_get_boolean (keyfile, group, fallback_group,
+      "queue-leaky", TRUE);
+
+  /* allow dropping old buffers if processing is taking too long;
+   * only time and bytes limit the queue, the buffer sizes vary */
+  g_object_set (queue->element,
+      "leaky", leaky ? 2 : 0,
+      "max-size-buffers", 0,
+      "max-size-bytes", MAX (bytes, 0),
+      "max-size-time", queue->time,
+      NULL);
+
+  g_signal_connect (queue->element, "overrun",
+                    G_CALLBACK (icstr_queue_overrun), queue);
+  queue->in_probe = icstr_queue_watch_pad (queue, "sink", &queue->in);
+  queue->out_probe = icstr_queue_watch_pad (queue, "src", &queue->out);
+
+  queue->check_source = g_timeout_add_seconds (QUEUE_CHECK_INTERVAL,
+      icstr_queue_check, queue);
+
+  return queue;
+}
+
+void
+icstr_queue_free (IcstrQueue *queue)
+{
+  g_source_remove (queue->check_source);
+  g_signal_handlers_disconnect_by_data (queue->element, queue);
+  icstr_queue_unwatch_pad (queue, "sink", queue->in_probe);
+  icstr_queue_unwatch_pad (queue, "src", queue->out_probe);
+  gst_object_unref (queue->element);
+  g_free (queue->name);
+  g_free (queue);
+}
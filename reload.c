@@ -0,0 +1,377 @@
+/*
+ * IceStreamer - A simple live audio streamer
+ *
+ * Copyright (C) 2017 George Kiagiadakis <gkiagia@tolabaki.gr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "icestreamer.h"
+
+/*
+ * Configuration reload, on SIGHUP. The new configuration is compared with
+ * the running one, group by group, and only what changed is touched:
+ *
+ *  - streams that are gone are detached and disposed, new ones are
+ *    constructed and attached, and the ones whose encoder, format, queue
+ *    or threads changed are rebuilt;
+ *  - encoder properties that can change while playing (e.g. the bitrate
+ *    of opus) are set in place;
+ *  - destinations that are gone, new or changed are removed, added or
+ *    rebuilt on their own, while the encoder of their stream keeps running;
+ *  - the metadata file is watched anew if it changed.
+ *
+ * Everything else keeps running untouched. The other reserved groups
+ * (input, metrics, silence...) are only read at startup.
+ */
+
+/* keys of a stream group that are only applied when it is constructed */
+static const gchar *stream_keys[] = {
+  "encoder", "container", "format", "channels", "rate",
+  "queue-time", "queue-bytes", "queue-max-time", "queue-adaptive",
+  "queue-leaky", "cpu-affinity", "scheduling-policy", "scheduling-priority",
+  "nice", NULL
+};
+
+/* returns the keys that were added, removed or changed in the group */
+static GPtrArray *
+icstr_reload_changed_keys (GKeyFile *old, GKeyFile *new, const gchar *group)
+{
+  GPtrArray *changed = g_ptr_array_new_with_free_func (g_free);
+  g_auto (GStrv) old_keys = g_key_file_get_keys (old, group, NULL, NULL);
+  g_auto (GStrv) new_keys = g_key_file_get_keys (new, group, NULL, NULL);
+  gchar **key;
+
+  for (key = old_keys; key && *key; key++) {
+    g_autofree gchar *old_value = g_key_file_get_value (old, group, *key,
+                                                        NULL);
+    g_autofree gchar *new_value = g_key_file_get_value (new, group, *key,
+                                                        NULL);
+
+    if (g_strcmp0 (old_value, new_value) != 0)
+      g_ptr_array_add (changed, g_strdup (*key));
+  }
+
+  for (key = new_keys; key && *key; key++) {
+    if (!g_key_file_has_key (old, group, *key, NULL))
+      g_ptr_array_add (changed, g_strdup (*key));
+  }
+
+  return changed;
+}
+
+static gboolean
+icstr_reload_group_changed (GKeyFile *old, GKeyFile *new, const gchar *group)
+{
+  g_autoptr (GPtrArray) changed = icstr_reload_changed_keys (old, new, group);
+
+  return changed->len > 0 ||
+      g_key_file_has_group (old, group) != g_key_file_has_group (new, group);
+}
+
+static IcstrStream *
+icstr_reload_find_stream (IceStreamer *self, const gchar *name)
+{
+  GList *curr;
+
+  for (curr = self->streams; curr != NULL; curr = g_list_next (curr)) {
+    IcstrStream *stream = curr->data;
+    if (g_str_equal (stream->name, name))
+      return stream;
+  }
+
+  return NULL;
+}
+
+static IcstrDestination *
+icstr_reload_find_destination (IcstrStream *stream, const gchar *name)
+{
+  GList *curr;
+
+  for (curr = stream->destinations; curr != NULL; curr = g_list_next (curr)) {
+    IcstrDestination *dest = curr->data;
+    if (g_str_equal (dest->name, name))
+      return dest;
+  }
+
+  return NULL;
+}
+
+static void
+icstr_reload_remove_destination (IceStreamer *self, IcstrStream *stream,
+    IcstrDestination *dest)
+{
+  GST_INFO ("Removing destination %s of stream %s", dest->name, stream->name);
+
+  if (self->metrics)
+    icstr_metrics_remove_destination (self->metrics, dest);
+  icstr_stream_remove_destination (stream, dest);
+}
+
+static void
+icstr_reload_add_destination (IceStreamer *self, GKeyFile *keyfile,
+    IcstrStream *stream, const gchar *group)
+{
+  g_autoptr (GError) error = NULL;
+  IcstrDestination *dest;
+
+  GST_INFO ("Adding destination %s to stream %s", group, stream->name);
+
+  dest = icstr_stream_add_destination (stream, keyfile, group, &error);
+  if (!dest) {
+    GST_WARNING ("Failed to add destination: %s", error->message);
+    return;
+  }
+
+  if (self->metrics)
+    icstr_metrics_add_destination (self->metrics, dest);
+  icstr_metadata_apply (self->metadata, dest);
+}
+
+static void
+icstr_reload_remove_stream (IceStreamer *self, IcstrStream *stream)
+{
+  GST_INFO ("Removing stream %s", stream->name);
+
+  if (self->metrics)
+    icstr_metrics_remove_stream (self->metrics, stream);
+
+  icstr_unlink_stream (self, stream);
+  gst_element_set_state (stream->bin, GST_STATE_NULL);
+  gst_bin_remove (GST_BIN (self->pipeline), stream->bin);
+
+  self->streams = g_list_remove (self->streams, stream);
+  icstr_stream_free (stream);
+}
+
+static void
+icstr_reload_add_stream (IceStreamer *self, GKeyFile *keyfile,
+    const gchar *group)
+{
+  g_autoptr (GError) error = NULL;
+  IcstrStream *stream;
+  GList *curr;
+
+  GST_INFO ("Adding stream %s", group);
+
+  stream = icstr_construct_stream (self, keyfile, group, &error);
+  if (!stream) {
+    GST_WARNING ("Failed to construct stream: %s", error->message);
+    return;
+  }
+
+  /* it has to be ready before it gets data from the input */
+  gst_bin_add (GST_BIN (self->pipeline), stream->bin);
+  gst_element_sync_state_with_parent (stream->bin);
+
+  if (!icstr_link_stream (self, keyfile, stream, &error)) {
+    GST_WARNING ("Failed to link stream: %s", error->message);
+    icstr_unlink_stream (self, stream);
+    gst_element_set_state (stream->bin, GST_STATE_NULL);
+    gst_bin_remove (GST_BIN (self->pipeline), stream->bin);
+    icstr_stream_free (stream);
+    return;
+  }
+
+  self->streams = g_list_append (self->streams, stream);
+  if (self->metrics)
+    icstr_metrics_add_stream (self->metrics, stream);
+
+  /* the other streams got the current metadata long ago */
+  for (curr = stream->destinations; curr != NULL; curr = g_list_next (curr))
+    icstr_metadata_apply (self->metadata, curr->data);
+}
+
+static void
+icstr_reload_set_property (GstElement *element, GParamSpec *pspec,
+    GKeyFile *keyfile, const gchar *group)
+{
+  g_autofree gchar *value = g_key_file_get_value (keyfile, group,
+                                                  pspec->name, NULL);
+
+  GST_INFO ("Setting %s of %s to %s", pspec->name, GST_OBJECT_NAME (element),
+            value ? value : "its default");
+
+  if (value) {
+    gst_util_set_object_arg (G_OBJECT (element), pspec->name, value);
+  } else {
+    GValue default_value = G_VALUE_INIT;
+
+    g_value_init (&default_value, pspec->value_type);
+    g_param_value_set_default (pspec, &default_value);
+    g_object_set_property (G_OBJECT (element), pspec->name, &default_value);
+    g_value_unset (&default_value);
+  }
+}
+
+/* applies the changes of a stream that it survives, or returns FALSE if it
+ * has to be rebuilt */
+static gboolean
+icstr_reload_stream (IceStreamer *self, GKeyFile *old, GKeyFile *new,
+    IcstrStream *stream)
+{
+  g_autoptr (GPtrArray) changed = NULL;
+  g_autoptr (GHashTable) rebuild = NULL;
+  g_auto (GStrv) destinations = NULL;
+  GObjectClass *encoder_class = G_OBJECT_GET_CLASS (stream->encoder);
+  GList *curr, *next;
+  gchar **group;
+  guint i;
+
+  changed = icstr_reload_changed_keys (old, new, stream->name);
+
+  /* check everything before changing anything */
+  for (i = 0; i < changed->len; i++) {
+    const gchar *key = g_ptr_array_index (changed, i);
+    GParamSpec *pspec = g_object_class_find_property (encoder_class, key);
+
+    if (g_strv_contains (stream_keys, key) ||
+        (pspec && !(pspec->flags & GST_PARAM_MUTABLE_PLAYING)))
+      return FALSE;
+  }
+
+  /* the destinations to rebuild, by name */
+  rebuild = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  for (i = 0; i < changed->len; i++) {
+    const gchar *key = g_ptr_array_index (changed, i);
+    GParamSpec *pspec = g_object_class_find_property (encoder_class, key);
+
+    if (pspec) {
+      icstr_reload_set_property (stream->encoder, pspec, new, stream->name);
+      continue;
+    }
+
+    if (g_str_equal (key, "destinations"))
+      continue;
+
+    /* anything else is inherited by the destinations that do not set it */
+    for (curr = stream->destinations; curr != NULL; curr = g_list_next (curr)) {
+      IcstrDestination *dest = curr->data;
+
+      if (g_str_equal (dest->name, stream->name) ||
+          !g_key_file_has_key (new, dest->name, key, NULL))
+        g_hash_table_add (rebuild, g_strdup (dest->name));
+    }
+  }
+
+  destinations = icstr_keyfile_get_destinations (new, stream->name);
+
+  for (curr = stream->destinations; curr != NULL; curr = next) {
+    IcstrDestination *dest = curr->data;
+    next = g_list_next (curr);
+
+    if (!g_strv_contains ((const gchar * const *) destinations, dest->name)) {
+      icstr_reload_remove_destination (self, stream, dest);
+    } else if (g_hash_table_contains (rebuild, dest->name) ||
+        (!g_str_equal (dest->name, stream->name) &&
+         icstr_reload_group_changed (old, new, dest->name))) {
+      /* added back below */
+      icstr_reload_remove_destination (self, stream, dest);
+    }
+  }
+
+  for (group = destinations; *group; group++) {
+    if (!icstr_reload_find_destination (stream, *group))
+      icstr_reload_add_destination (self, new, stream, *group);
+  }
+
+  return TRUE;
+}
+
+static void
+icstr_reload_metadata (IceStreamer *self, GKeyFile *keyfile)
+{
+  g_autoptr (GError) error = NULL;
+
+  GST_INFO ("Reloading the metadata handler");
+
+  icstr_metadata_stop (self->metadata);
+
+  if (g_key_file_has_group (keyfile, "metadata") &&
+      !icstr_metadata_setup (self->metadata, keyfile, &error))
+    GST_WARNING ("%s", error->message);
+}
+
+void
+icstr_reload (IceStreamer *self)
+{
+  g_autoptr (GKeyFile) keyfile = g_key_file_new ();
+  g_autoptr (GError) error = NULL;
+  g_auto (GStrv) old_groups = NULL;
+  g_auto (GStrv) new_groups = NULL;
+  g_auto (GStrv) groups = NULL;
+  GList *curr, *next;
+  gchar **group;
+
+  GST_INFO ("Reloading configuration file: %s", self->conf_file);
+
+  if (!g_key_file_load_from_file (keyfile, self->conf_file, G_KEY_FILE_NONE,
+                                  &error)) {
+    GST_WARNING ("Failed to reload configuration file '%s': %s",
+                 self->conf_file, error->message);
+    return;
+  }
+
+  /* the reserved groups that can not change while running */
+  old_groups = g_key_file_get_groups (self->keyfile, NULL);
+  new_groups = g_key_file_get_groups (keyfile, NULL);
+  for (group = new_groups; *group; group++) {
+    if (icstr_keyfile_is_reserved_group (*group) &&
+        !g_str_equal (*group, "metadata") &&
+        icstr_reload_group_changed (self->keyfile, keyfile, *group))
+      GST_WARNING ("Changes to [%s] take effect after a restart", *group);
+  }
+  for (group = old_groups; *group; group++) {
+    if (icstr_keyfile_is_reserved_group (*group) &&
+        !g_key_file_has_group (keyfile, *group))
+      GST_WARNING ("Removing [%s] takes effect after a restart", *group);
+  }
+
+  if (icstr_reload_group_changed (self->keyfile, keyfile, "metadata"))
+    icstr_reload_metadata (self, keyfile);
+
+  /* streams that are gone or have to be rebuilt */
+  groups = icstr_keyfile_get_stream_groups (keyfile);
+  for (curr = self->streams; curr != NULL; curr = next) {
+    IcstrStream *stream = curr->data;
+    next = g_list_next (curr);
+
+    if (!g_strv_contains ((const gchar * const *) groups, stream->name) ||
+        !icstr_reload_stream (self, self->keyfile, keyfile, stream))
+      icstr_reload_remove_stream (self, stream);
+  }
+
+  /* new streams, and the ones that were removed to be rebuilt */
+  for (group = groups; *group; group++) {
+    if (!icstr_reload_find_stream (self, *group))
+      icstr_reload_add_stream (self, keyfile, *group);
+  }
+
+  if (!self->streams)
+    GST_WARNING ("No streams left after reloading the configuration");
+
+  icstr_log_conversions (self);
+
+  /* the traced points follow the streams */
+  if (self->latency) {
+    g_clear_pointer (&self->latency, icstr_latency_free);
+    if (!icstr_latency_setup (self, keyfile, &error)) {
+      GST_WARNING ("%s", error->message);
+      g_clear_error (&error);
+    }
+  }
+
+  g_key_file_unref (self->keyfile);
+  self->keyfile = g_steal_pointer (&keyfile);
+}
@@ -0,0 +1,236 @@
+/*
+ * IceStreamer - A simple live audio streamer
+ *
+ * Copyright (C) 2017 George Kiagiadakis <gkiagia@tolabaki.gr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "icestreamer.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+typedef struct _IcstrSchedParams IcstrSchedParams;
+struct _IcstrSchedParams
+{
+  cpu_set_t cpus;               /* empty to leave the affinity alone */
+  gint policy;                  /* -1 to leave the policy alone */
+  gint priority;
+  gint nice;
+  gboolean has_nice;
+};
+
+static G_DEFINE_QUARK (icestreamer-sched-params, icstr_sched_params);
+
+/* what the threads of the process run with unless told otherwise, to
+ * restore on the threads of the pool once they are done with a task */
+static IcstrSchedParams sched_defaults;
+
+/* set in the threads that run with parameters of their own */
+static GPrivate sched_applied;
+
+static void
+icstr_sched_init_defaults (void)
+{
+  static gsize initialized = 0;
+
+  if (!g_once_init_enter (&initialized))
+    return;
+
+  /* from the main thread, which is never changed */
+  CPU_ZERO (&sched_defaults.cpus);
+  if (sched_getaffinity (0, sizeof (cpu_set_t), &sched_defaults.cpus) < 0)
+    CPU_ZERO (&sched_defaults.cpus);
+  sched_defaults.policy = SCHED_OTHER;
+  sched_defaults.priority = 0;
+  errno = 0;
+  sched_defaults.nice = getpriority (PRIO_PROCESS, 0);
+  sched_defaults.has_nice = (errno == 0);
+
+  g_once_init_leave (&initialized, 1);
+}
+
+gboolean
+icstr_sched_attach (GstElement *bin, GKeyFile *keyfile, const gchar *group,
+    GError **error)
+{
+  g_autofree IcstrSchedParams *params = NULL;
+  g_autofree gint *cpus = NULL;
+  g_autofree gchar *policy = NULL;
+  g_autoptr (GError) internal_error = NULL;
+  gsize n_cpus = 0, i;
+
+  icstr_sched_init_defaults ();
+
+  params = g_new0 (IcstrSchedParams, 1);
+  CPU_ZERO (&params->cpus);
+  params->policy = -1;
+
+  if (g_key_file_has_key (keyfile, group, "cpu-affinity", NULL)) {
+    cpus = g_key_file_get_integer_list (keyfile, group, "cpu-affinity",
+                                        &n_cpus, &internal_error);
+    if (!cpus) {
+      g_propagate_prefixed_error (error, g_steal_pointer (&internal_error),
+          "Invalid cpu-affinity for '%s':", group);
+      return FALSE;
+    }
+
+    for (i = 0; i < n_cpus; i++) {
+      if (cpus[i] < 0 || cpus[i] >= CPU_SETSIZE) {
+        g_set_error (error, ICSTR_ERROR, 0,
+            "Invalid cpu-affinity for '%s': no such CPU %d", group, cpus[i]);
+        return FALSE;
+      }
+      CPU_SET (cpus[i], &params->cpus);
+    }
+  }
+
+  policy = g_key_file_get_string (keyfile, group, "scheduling-policy", NULL);
+  if (policy) {
+    if (g_str_equal (policy, "other"))
+      params->policy = SCHED_OTHER;
+    else if (g_str_equal (policy, "fifo"))
+      params->policy = SCHED_FIFO;
+    else if (g_str_equal (policy, "rr"))
+      params->policy = SCHED_RR;
+    else {
+      g_set_error (error, ICSTR_ERROR, 0,
+          "Unknown scheduling-policy for '%s': %s", group, policy);
+      return FALSE;
+    }
+  }
+
+  if (g_key_file_has_key (keyfile, group, "scheduling-priority", NULL)) {
+    params->priority = g_key_file_get_integer (keyfile, group,
+                                               "scheduling-priority", NULL);
+
+    if (params->policy != SCHED_FIFO && params->policy != SCHED_RR) {
+      g_set_error (error, ICSTR_ERROR, 0,
+          "scheduling-priority for '%s' requires a realtime "
+          "scheduling-policy (fifo or rr)", group);
+      return FALSE;
+    }
+
+    if (params->priority < sched_get_priority_min (params->policy) ||
+        params->priority > sched_get_priority_max (params->policy)) {
+      g_set_error (error, ICSTR_ERROR, 0,
+          "Invalid scheduling-priority for '%s': %d", group, params->priority);
+      return FALSE;
+    }
+  } else if (params->policy == SCHED_FIFO || params->policy == SCHED_RR) {
+    params->priority = sched_get_priority_min (params->policy);
+  }
+
+  if (g_key_file_has_key (keyfile, group, "nice", NULL)) {
+    params->nice = g_key_file_get_integer (keyfile, group, "nice", NULL);
+    params->has_nice = TRUE;
+  }
+
+  /* nothing to do for this group */
+  if (CPU_COUNT (&params->cpus) == 0 && params->policy < 0 &&
+      !params->has_nice)
+    return TRUE;
+
+  g_object_set_qdata_full (G_OBJECT (bin), icstr_sched_params_quark (),
+                           g_steal_pointer (&params), g_free);
+  return TRUE;
+}
+
+static void
+icstr_sched_apply (const IcstrSchedParams *params, const gchar *name)
+{
+  gint res;
+
+  if (CPU_COUNT (&params->cpus) > 0) {
+    res = pthread_setaffinity_np (pthread_self (), sizeof (cpu_set_t),
+                                  &params->cpus);
+    if (res != 0)
+      GST_WARNING ("Failed to set the CPU affinity of %s: %s", name,
+                   g_strerror (res));
+  }
+
+  if (params->policy >= 0) {
+    struct sched_param sp = { .sched_priority = params->priority };
+
+    res = pthread_setschedparam (pthread_self (), params->policy, &sp);
+    if (res != 0)
+      GST_WARNING ("Failed to set the scheduling policy of %s: %s", name,
+                   g_strerror (res));
+  }
+
+  /* on linux, the nice value is a per-thread attribute */
+  if (params->has_nice) {
+    if (setpriority (PRIO_PROCESS, (id_t) syscall (SYS_gettid),
+                     params->nice) < 0)
+      GST_WARNING ("Failed to set the nice value of %s: %s", name,
+                   g_strerror (errno));
+  }
+
+  GST_DEBUG ("Applied scheduling parameters to %s", name);
+}
+
+/*
+ * Called synchronously from the streaming thread that posted the
+ * stream-status message, so the parameters apply to the thread itself.
+ */
+void
+icstr_sched_handle_stream_status (GstMessage *msg)
+{
+  GstStreamStatusType type;
+  GstElement *owner = NULL;
+  GstObject *obj = NULL;
+  GstObject *parent = NULL;
+  IcstrSchedParams *params = NULL;
+
+  gst_message_parse_stream_status (msg, &type, &owner);
+
+  /* the thread goes back to the pool, where any task may pick it up */
+  if (type == GST_STREAM_STATUS_TYPE_LEAVE &&
+      g_private_get (&sched_applied)) {
+    g_autofree gchar *name = gst_object_get_path_string (GST_OBJECT (owner));
+    icstr_sched_apply (&sched_defaults, name);
+    g_private_set (&sched_applied, NULL);
+    return;
+  }
+
+  if (type != GST_STREAM_STATUS_TYPE_ENTER)
+    return;
+
+  /* find the closest bin that has parameters for its threads */
+  obj = gst_object_ref (GST_OBJECT (owner));
+  while (obj) {
+    params = g_object_get_qdata (G_OBJECT (obj), icstr_sched_params_quark ());
+    if (params)
+      break;
+
+    parent = gst_object_get_parent (obj);
+    gst_object_unref (obj);
+    obj = parent;
+  }
+
+  if (params) {
+    g_autofree gchar *name = gst_object_get_path_string (GST_OBJECT (owner));
+    icstr_sched_apply (params, name);
+    g_private_set (&sched_applied, GINT_TO_POINTER (TRUE));
+    gst_object_unref (obj);
+  } else if (g_private_get (&sched_applied)) {
+    /* in case the previous task of this thread did not post its LEAVE */
+    g_autofree gchar *name = gst_object_get_path_string (GST_OBJECT (owner));
+    icstr_sched_apply (&sched_defaults, name);
+    g_private_set (&sched_applied, NULL);
+  }
+}
@@ -0,0 +1,1330 @@
+/*
+ * IceStreamer - A simple live audio streamer
+ *
+ * Copyright (C) 2017 George Kiagiadakis <gkiagia@tolabaki.gr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "icestreamer.h"
+#include <gst/base/gstbasesink.h>
+#include <sys/socket.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * A replacement for shout2send that never blocks on the network once it is
+ * connected. The streaming thread only queues the buffers and tries to send
+ * them right away; whatever the socket does not accept is sent later from
+ * the shared I/O thread, when the socket becomes writable again. If nothing
+ * can be sent for write-timeout milliseconds, the connection is considered
+ * dead and an error is posted, so that the destination is reconnected.
+ *
+ * It has the same properties as shout2send, so that configuration files
+ * keep working with either of them.
+ */
+
+#define ICSTR_TYPE_SHOUT_SINK (icstr_shout_sink_get_type ())
+#define ICSTR_SHOUT_SINK(obj) \
+  (G_TYPE_CHECK_INSTANCE_CAST ((obj), ICSTR_TYPE_SHOUT_SINK, IcstrShoutSink))
+
+#define ICSTR_TYPE_SHOUT_PROTOCOL (icstr_shout_protocol_get_type ())
+
+typedef enum
+{
+  ICSTR_SHOUT_PROTOCOL_XAUDIOCAST = 1,
+  ICSTR_SHOUT_PROTOCOL_ICY,
+  ICSTR_SHOUT_PROTOCOL_HTTP,
+  ICSTR_SHOUT_PROTOCOL_PUT,
+} IcstrShoutProtocol;
+
+/* the maximum number of buffers sent with a single writev */
+#define MAX_VECTORS 64
+
+#define MAX_RESPONSE_SIZE 4096
+
+#define DEFAULT_IP "127.0.0.1"
+#define DEFAULT_PORT 8000
+#define DEFAULT_PASSWORD "hackme"
+#define DEFAULT_USERNAME "source"
+#define DEFAULT_PROTOCOL ICSTR_SHOUT_PROTOCOL_HTTP
+#define DEFAULT_TIMEOUT 10000           /* ms */
+#define DEFAULT_WRITE_TIMEOUT 5000      /* ms */
+#define DEFAULT_MAX_PENDING (256 * 1024)
+
+/* servers drop sources that stay silent after connecting, e.g. icecast
+ * after its header-timeout of 15 s, so a connection made ahead is only
+ * used for the handshake if it is more recent than this */
+#define PRECONNECT_MAX_AGE (5 * G_USEC_PER_SEC)
+
+enum
+{
+  PROP_0,
+  PROP_IP,
+  PROP_PORT,
+  PROP_PASSWORD,
+  PROP_USERNAME,
+  PROP_MOUNT,
+  PROP_STREAMNAME,
+  PROP_DESCRIPTION,
+  PROP_GENRE,
+  PROP_URL,
+  PROP_PUBLIC,
+  PROP_PROTOCOL,
+  PROP_USER_AGENT,
+  PROP_SEND_TITLE_INFO,
+  PROP_TIMEOUT,
+  PROP_SNDBUF,
+  PROP_WRITE_TIMEOUT,
+  PROP_MAX_PENDING,
+};
+
+typedef struct _IcstrShoutPacket IcstrShoutPacket;
+struct _IcstrShoutPacket
+{
+  GstBuffer *buffer;
+  GstMapInfo map;
+  gsize offset;                 /* bytes of map already sent */
+};
+
+typedef struct _IcstrShoutSink IcstrShoutSink;
+typedef struct _IcstrShoutSinkClass IcstrShoutSinkClass;
+
+struct _IcstrShoutSink
+{
+  GstBaseSink parent;
+
+  /* properties, protected by the object lock */
+  gchar *ip;
+  gint port;
+  gchar *password;
+  gchar *username;
+  gchar *mount;
+  gchar *streamname;
+  gchar *description;
+  gchar *genre;
+  gchar *url;
+  gboolean public;
+  IcstrShoutProtocol protocol;
+  gchar *user_agent;
+  gboolean send_title_info;
+  guint timeout;                /* ms, for connecting */
+  gint sndbuf;                  /* bytes, 0 for the system default */
+  guint write_timeout;          /* ms, 0 to never time out */
+  guint max_pending;            /* bytes */
+
+  /* also protected by the object lock */
+  gchar *content_type;
+  gboolean url_metadata;        /* the server takes titles via the admin url */
+  gchar *song;
+
+  /* the connection, protected by lock */
+  GMutex lock;
+  GCond cond;
+  GSocketConnection *connection;
+  GQueue pending;
+  gsize pending_bytes;
+  GSource *write_source;
+  GSource *stall_source;
+  gint64 last_progress;         /* monotonic time */
+  gboolean failed;
+  gboolean flushing;
+  guint64 bytes_sent;
+
+  /* the connection made ahead by start(), also protected by lock */
+  GCancellable *preconnect_cancellable;
+  GSocketConnection *preconnection;     /* NULL if it failed or was used */
+  gint64 preconnected_at;               /* monotonic time */
+  gboolean preconnecting;
+};
+
+typedef struct _IcstrShoutPreconnect IcstrShoutPreconnect;
+struct _IcstrShoutPreconnect
+{
+  IcstrShoutSink *sink;         /* a reference */
+  gchar *host;
+  guint port;
+  guint timeout;                /* ms */
+  GCancellable *cancellable;
+};
+
+struct _IcstrShoutSinkClass
+{
+  GstBaseSinkClass parent_class;
+};
+
+static GType icstr_shout_sink_get_type (void);
+
+G_DEFINE_TYPE_WITH_CODE (IcstrShoutSink, icstr_shout_sink, GST_TYPE_BASE_SINK,
+    G_IMPLEMENT_INTERFACE (GST_TYPE_TAG_SETTER, NULL));
+
+static GstStaticPadTemplate sink_template = GST_STATIC_PAD_TEMPLATE ("sink",
+    GST_PAD_SINK,
+    GST_PAD_ALWAYS,
+    GST_STATIC_CAPS ("application/ogg; audio/ogg; audio/webm; video/webm; "
+        "audio/mpeg"));
+
+static GType
+icstr_shout_protocol_get_type (void)
+{
+  static gsize type = 0;
+  static const GEnumValue values[] = {
+    {ICSTR_SHOUT_PROTOCOL_XAUDIOCAST,
+        "Xaudiocast Protocol (icecast 1.3.x)", "xaudiocast"},
+    {ICSTR_SHOUT_PROTOCOL_ICY, "Icy Protocol (ShoutCast)", "icy"},
+    {ICSTR_SHOUT_PROTOCOL_HTTP, "Http Protocol (icecast 2.x)", "http"},
+    {ICSTR_SHOUT_PROTOCOL_PUT, "Http PUT Protocol (icecast 2.4.x)", "put"},
+    {0, NULL, NULL},
+  };
+
+  if (g_once_init_enter (&type)) {
+    GType new_type = g_enum_register_static ("IcstrShoutProtocol", values);
+    g_once_init_leave (&type, new_type);
+  }
+
+  return type;
+}
+
+static void
+icstr_shout_packet_free (IcstrShoutPacket *packet)
+{
+  gst_buffer_unmap (packet->buffer, &packet->map);
+  gst_buffer_unref (packet->buffer);
+  g_free (packet);
+}
+
+/*
+ * Must be called with the lock held. Returning an error from render()
+ * would stop the encoder and all the other destinations of the stream,
+ * so the data is dropped from now on instead and the application is
+ * notified through the bus to cycle this destination.
+ */
+static void
+icstr_shout_sink_fail_locked (IcstrShoutSink *sink, const gchar *reason)
+{
+  if (sink->failed)
+    return;
+
+  sink->failed = TRUE;
+  g_cond_broadcast (&sink->cond);
+
+  GST_ELEMENT_ERROR (sink, RESOURCE, WRITE,
+      ("Failed to send data to the server"), ("%s", reason));
+}
+
+static void icstr_shout_sink_write_locked (IcstrShoutSink *sink);
+
+static gboolean
+icstr_shout_sink_writable (GSocket *socket, GIOCondition condition,
+    gpointer data)
+{
+  IcstrShoutSink *sink = data;
+
+  g_mutex_lock (&sink->lock);
+  /* the connection may have been closed while we were waiting for the lock */
+  if (!g_source_is_destroyed (g_main_current_source ())) {
+    g_clear_pointer (&sink->write_source, g_source_unref);
+    icstr_shout_sink_write_locked (sink);
+  }
+  g_mutex_unlock (&sink->lock);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+icstr_shout_sink_write_locked (IcstrShoutSink *sink)
+{
+  GOutputVector vectors[MAX_VECTORS];
+  g_autoptr (GError) error = NULL;
+  IcstrShoutPacket *packet;
+  GSocket *socket;
+  GList *curr;
+  gssize written;
+  gsize left;
+  gint n;
+
+  if (!sink->connection || sink->write_source)
+    return;
+
+  socket = g_socket_connection_get_socket (sink->connection);
+
+  while (!sink->failed && !g_queue_is_empty (&sink->pending)) {
+    for (curr = sink->pending.head, n = 0; curr && n < MAX_VECTORS;
+        curr = g_list_next (curr), n++) {
+      packet = curr->data;
+      vectors[n].buffer = packet->map.data + packet->offset;
+      vectors[n].size = packet->map.size - packet->offset;
+    }
+
+    written = g_socket_send_message (socket, NULL, vectors, n, NULL, 0, 0,
+                                     NULL, &error);
+    if (written < 0) {
+      if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK)) {
+        icstr_shout_sink_fail_locked (sink, error->message);
+        break;
+      }
+
+      /* continue from the I/O thread once the server has caught up */
+      sink->write_source = g_socket_create_source (socket, G_IO_OUT, NULL);
+      g_source_set_callback (sink->write_source,
+          (GSourceFunc) icstr_shout_sink_writable, gst_object_ref (sink),
+          gst_object_unref);
+      g_source_attach (sink->write_source, icstr_io_context ());
+      break;
+    }
+
+    sink->last_progress = g_get_monotonic_time ();
+    sink->bytes_sent += written;
+    sink->pending_bytes -= written;
+
+    while (written > 0) {
+      packet = g_queue_peek_head (&sink->pending);
+      left = packet->map.size - packet->offset;
+      if ((gsize) written < left) {
+        packet->offset += written;
+        break;
+      }
+      written -= left;
+      icstr_shout_packet_free (g_queue_pop_head (&sink->pending));
+    }
+  }
+
+  g_cond_broadcast (&sink->cond);
+}
+
+static gboolean
+icstr_shout_sink_check_stall (gpointer data)
+{
+  IcstrShoutSink *sink = data;
+  g_autofree gchar *reason = NULL;
+  gint64 stalled;
+  guint write_timeout;
+
+  GST_OBJECT_LOCK (sink);
+  write_timeout = sink->write_timeout;
+  GST_OBJECT_UNLOCK (sink);
+
+  g_mutex_lock (&sink->lock);
+  if (write_timeout > 0 && !g_source_is_destroyed (g_main_current_source ())
+      && !sink->failed && !g_queue_is_empty (&sink->pending)) {
+    stalled = (g_get_monotonic_time () - sink->last_progress)
+        / G_TIME_SPAN_MILLISECOND;
+    if (stalled >= write_timeout) {
+      reason = g_strdup_printf ("The server did not accept any data for %"
+          G_GINT64_FORMAT " ms", stalled);
+      icstr_shout_sink_fail_locked (sink, reason);
+    }
+  }
+  g_mutex_unlock (&sink->lock);
+
+  return G_SOURCE_CONTINUE;
+}
+
+/* metadata updates, for formats that do not carry them in the stream */
+
+typedef struct _IcstrShoutMetadata IcstrShoutMetadata;
+struct _IcstrShoutMetadata
+{
+  gchar *host;
+  guint port;
+  guint timeout;                /* seconds */
+  gchar *request;
+  GSocketConnection *connection;
+  gchar response[256];
+};
+
+static void
+icstr_shout_metadata_free (IcstrShoutMetadata *md)
+{
+  g_clear_object (&md->connection);
+  g_free (md->host);
+  g_free (md->request);
+  g_free (md);
+}
+
+static void
+icstr_shout_metadata_read_done (GObject *stream, GAsyncResult *res,
+    gpointer data)
+{
+  IcstrShoutMetadata *md = data;
+  g_autoptr (GError) error = NULL;
+  gssize n_read;
+  gint code = 0;
+
+  n_read = g_input_stream_read_finish (G_INPUT_STREAM (stream), res, &error);
+  if (n_read >= 0) {
+    md->response[n_read] = '\0';
+    sscanf (md->response, "HTTP/%*u.%*u %d", &code);
+  }
+
+  if (code != 200)
+    GST_WARNING ("Metadata update on %s:%u failed: %s", md->host, md->port,
+                 error ? error->message : md->response);
+
+  icstr_shout_metadata_free (md);
+}
+
+static void
+icstr_shout_metadata_write_done (GObject *stream, GAsyncResult *res,
+    gpointer data)
+{
+  IcstrShoutMetadata *md = data;
+  g_autoptr (GError) error = NULL;
+  GInputStream *input;
+
+  if (!g_output_stream_write_all_finish (G_OUTPUT_STREAM (stream), res, NULL,
+                                         &error)) {
+    GST_WARNING ("Metadata update on %s:%u failed: %s", md->host, md->port,
+                 error->message);
+    icstr_shout_metadata_free (md);
+    return;
+  }
+
+  input = g_io_stream_get_input_stream (G_IO_STREAM (md->connection));
+  g_input_stream_read_async (input, md->response, sizeof (md->response) - 1,
+      G_PRIORITY_DEFAULT, NULL, icstr_shout_metadata_read_done, md);
+}
+
+static void
+icstr_shout_metadata_connected (GObject *client, GAsyncResult *res,
+    gpointer data)
+{
+  IcstrShoutMetadata *md = data;
+  g_autoptr (GError) error = NULL;
+  GOutputStream *output;
+
+  md->connection = g_socket_client_connect_to_host_finish (
+      G_SOCKET_CLIENT (client), res, &error);
+  if (!md->connection) {
+    GST_WARNING ("Metadata update on %s:%u failed: %s", md->host, md->port,
+                 error->message);
+    icstr_shout_metadata_free (md);
+    return;
+  }
+
+  output = g_io_stream_get_output_stream (G_IO_STREAM (md->connection));
+  g_output_stream_write_all_async (output, md->request, strlen (md->request),
+      G_PRIORITY_DEFAULT, NULL, icstr_shout_metadata_write_done, md);
+}
+
+/* runs in the I/O thread */
+static gboolean
+icstr_shout_metadata_start (gpointer data)
+{
+  IcstrShoutMetadata *md = data;
+  g_autoptr (GSocketClient) client = g_socket_client_new ();
+
+  g_socket_client_set_timeout (client, md->timeout);
+  g_socket_client_connect_to_host_async (client, md->host, md->port, NULL,
+      icstr_shout_metadata_connected, md);
+
+  return G_SOURCE_REMOVE;
+}
+
+static gchar *
+icstr_shout_sink_get_mount_locked (IcstrShoutSink *sink)
+{
+  const gchar *mount = sink->mount ? sink->mount : "";
+
+  if (mount[0] == '/')
+    return g_strdup (mount);
+  return g_strconcat ("/", mount, NULL);
+}
+
+static gchar *
+icstr_shout_sink_get_credentials_locked (IcstrShoutSink *sink)
+{
+  g_autofree gchar *credentials = g_strdup_printf ("%s:%s",
+      sink->username ? sink->username : "",
+      sink->password ? sink->password : "");
+
+  return g_base64_encode ((const guchar *) credentials, strlen (credentials));
+}
+
+static void
+icstr_shout_sink_update_metadata (IcstrShoutSink *sink)
+{
+  g_autofree gchar *song = NULL;
+  g_autofree gchar *mount = NULL;
+  g_autofree gchar *password = NULL;
+  g_autofree gchar *credentials = NULL;
+  IcstrShoutMetadata *md = NULL;
+
+  GST_OBJECT_LOCK (sink);
+  if (!sink->send_title_info || !sink->url_metadata || !sink->song) {
+    GST_OBJECT_UNLOCK (sink);
+    return;
+  }
+
+  song = g_uri_escape_string (sink->song, NULL, FALSE);
+  mount = g_uri_escape_string (sink->mount ? sink->mount : "", "/", FALSE);
+  password = g_uri_escape_string (sink->password ? sink->password : "",
+                                  NULL, FALSE);
+
+  md = g_new0 (IcstrShoutMetadata, 1);
+  md->host = g_strdup (sink->ip);
+  md->port = sink->port;
+  md->timeout = MAX ((sink->timeout + 999) / 1000, 1);
+
+  switch (sink->protocol) {
+    case ICSTR_SHOUT_PROTOCOL_ICY:
+      md->request = g_strdup_printf (
+          "GET /admin.cgi?pass=%s&mode=updinfo&song=%s HTTP/1.0\r\n"
+          "User-Agent: %s (Mozilla compatible)\r\n\r\n",
+          password, song, sink->user_agent);
+      break;
+    case ICSTR_SHOUT_PROTOCOL_XAUDIOCAST:
+      md->request = g_strdup_printf (
+          "GET /admin.cgi?pass=%s&mode=updinfo&mount=%s%s&song=%s HTTP/1.0\r\n"
+          "User-Agent: %s\r\n\r\n",
+          password, mount[0] == '/' ? "" : "/", mount, song, sink->user_agent);
+      break;
+    default:
+      credentials = icstr_shout_sink_get_credentials_locked (sink);
+      md->request = g_strdup_printf (
+          "GET /admin/metadata?mode=updinfo&mount=%s%s&song=%s HTTP/1.0\r\n"
+          "Host: %s:%d\r\n"
+          "Authorization: Basic %s\r\n"
+          "User-Agent: %s\r\n\r\n",
+          mount[0] == '/' ? "" : "/", mount, song, sink->ip, sink->port,
+          credentials, sink->user_agent);
+      break;
+  }
+  GST_OBJECT_UNLOCK (sink);
+
+  g_main_context_invoke (icstr_io_context (), icstr_shout_metadata_start, md);
+}
+
+/* connection handshake, in the streaming thread */
+
+static gchar *
+icstr_shout_sink_build_request (IcstrShoutSink *sink,
+    IcstrShoutProtocol protocol)
+{
+  g_autoptr (GString) req = g_string_new (NULL);
+  g_autofree gchar *mount = NULL;
+  g_autofree gchar *credentials = NULL;
+
+  GST_OBJECT_LOCK (sink);
+  mount = icstr_shout_sink_get_mount_locked (sink);
+
+  switch (protocol) {
+    case ICSTR_SHOUT_PROTOCOL_XAUDIOCAST:
+      g_string_append_printf (req, "SOURCE %s %s\n", sink->password, mount);
+      g_string_append_printf (req, "x-audiocast-name: %s\n", sink->streamname);
+      g_string_append_printf (req, "x-audiocast-url: %s\n", sink->url);
+      g_string_append_printf (req, "x-audiocast-genre: %s\n", sink->genre);
+      g_string_append_printf (req, "x-audiocast-description: %s\n",
+                              sink->description);
+      g_string_append_printf (req, "x-audiocast-public: %d\n", sink->public);
+      g_string_append (req, "\n");
+      break;
+    case ICSTR_SHOUT_PROTOCOL_ICY:
+      /* sent after the password has been accepted */
+      g_string_append_printf (req, "content-type:%s\r\n", sink->content_type);
+      g_string_append_printf (req, "icy-name:%s\r\n", sink->streamname);
+      g_string_append_printf (req, "icy-genre:%s\r\n", sink->genre);
+      g_string_append_printf (req, "icy-url:%s\r\n", sink->url);
+      g_string_append_printf (req, "icy-pub:%d\r\n", sink->public);
+      g_string_append (req, "\r\n");
+      break;
+    default:
+      credentials = icstr_shout_sink_get_credentials_locked (sink);
+      if (protocol == ICSTR_SHOUT_PROTOCOL_PUT)
+        g_string_append_printf (req, "PUT %s HTTP/1.1\r\n", mount);
+      else
+        g_string_append_printf (req, "SOURCE %s HTTP/1.0\r\n", mount);
+      g_string_append_printf (req, "Host: %s:%d\r\n", sink->ip, sink->port);
+      g_string_append_printf (req, "Authorization: Basic %s\r\n", credentials);
+      g_string_append_printf (req, "User-Agent: %s\r\n", sink->user_agent);
+      g_string_append_printf (req, "Content-Type: %s\r\n", sink->content_type);
+      if (protocol == ICSTR_SHOUT_PROTOCOL_PUT)
+        g_string_append (req, "Expect: 100-continue\r\n");
+      g_string_append_printf (req, "ice-name: %s\r\n", sink->streamname);
+      g_string_append_printf (req, "ice-description: %s\r\n",
+                              sink->description);
+      g_string_append_printf (req, "ice-genre: %s\r\n", sink->genre);
+      g_string_append_printf (req, "ice-url: %s\r\n", sink->url);
+      g_string_append_printf (req, "ice-public: %d\r\n", sink->public);
+      g_string_append (req, "\r\n");
+      break;
+  }
+  GST_OBJECT_UNLOCK (sink);
+
+  return g_string_free (g_steal_pointer (&req), FALSE);
+}
+
+static gboolean
+icstr_shout_send_all (GSocket *socket, const gchar *data, GError **error)
+{
+  gsize len = strlen (data);
+  gssize sent;
+
+  while (len > 0) {
+    sent = g_socket_send (socket, data, len, NULL, error);
+    if (sent < 0)
+      return FALSE;
+    data += sent;
+    len -= sent;
+  }
+
+  return TRUE;
+}
+
+/* reads until the given terminator; the server sends nothing after it */
+static gchar *
+icstr_shout_receive_response (GSocket *socket, const gchar *terminator,
+    GError **error)
+{
+  g_autoptr (GString) response = g_string_new (NULL);
+  gchar buf[512];
+  gssize n_read;
+
+  while (!strstr (response->str, terminator)) {
+    if (response->len >= MAX_RESPONSE_SIZE) {
+      g_set_error (error, ICSTR_ERROR, 0, "Server response too long");
+      return NULL;
+    }
+
+    n_read = g_socket_receive (socket, buf, sizeof (buf), NULL, error);
+    if (n_read < 0)
+      return NULL;
+    if (n_read == 0) {
+      g_set_error (error, ICSTR_ERROR, 0, "Server closed the connection");
+      return NULL;
+    }
+    g_string_append_len (response, buf, n_read);
+  }
+
+  return g_string_free (g_steal_pointer (&response), FALSE);
+}
+
+static gboolean
+icstr_shout_check_response (IcstrShoutProtocol protocol,
+    const gchar *response, GError **error)
+{
+  gint code = 0;
+
+  if (protocol == ICSTR_SHOUT_PROTOCOL_XAUDIOCAST ||
+      protocol == ICSTR_SHOUT_PROTOCOL_ICY) {
+    if (g_str_has_prefix (response, "OK"))
+      return TRUE;
+  } else {
+    sscanf (response, "HTTP/%*u.%*u %d", &code);
+    if (code == 100 || (code >= 200 && code < 300))
+      return TRUE;
+  }
+
+  g_set_error (error, ICSTR_ERROR, 0, "Server refused the stream: %.*s",
+               (gint) strcspn (response, "\r\n"), response);
+  return FALSE;
+}
+
+static void
+icstr_shout_preconnect_free (IcstrShoutPreconnect *pc)
+{
+  gst_object_unref (pc->sink);
+  g_free (pc->host);
+  g_object_unref (pc->cancellable);
+  g_free (pc);
+}
+
+static void
+icstr_shout_sink_preconnected (GObject *client, GAsyncResult *res,
+    gpointer data)
+{
+  IcstrShoutPreconnect *pc = data;
+  IcstrShoutSink *sink = pc->sink;
+  g_autoptr (GSocketConnection) connection = NULL;
+  g_autoptr (GError) error = NULL;
+
+  connection = g_socket_client_connect_to_host_finish (
+      G_SOCKET_CLIENT (client), res, &error);
+  if (!connection)
+    GST_DEBUG_OBJECT (sink, "Failed to connect ahead: %s", error->message);
+
+  /* unless stopped in the meantime; connect() tries again otherwise */
+  g_mutex_lock (&sink->lock);
+  if (!g_cancellable_is_cancelled (pc->cancellable)) {
+    sink->preconnection = g_steal_pointer (&connection);
+    sink->preconnected_at = g_get_monotonic_time ();
+    sink->preconnecting = FALSE;
+    g_cond_broadcast (&sink->cond);
+  }
+  g_mutex_unlock (&sink->lock);
+
+  icstr_shout_preconnect_free (pc);
+}
+
+/* in the I/O thread */
+static gboolean
+icstr_shout_sink_preconnect (gpointer data)
+{
+  IcstrShoutPreconnect *pc = data;
+  g_autoptr (GSocketClient) client = g_socket_client_new ();
+
+  g_socket_client_set_timeout (client, MAX ((pc->timeout + 999) / 1000, 1));
+  g_socket_client_connect_to_host_async (client, pc->host, pc->port,
+      pc->cancellable, icstr_shout_sink_preconnected, pc);
+
+  return G_SOURCE_REMOVE;
+}
+
+static gboolean
+icstr_shout_sink_connect (IcstrShoutSink *sink)
+{
+  g_autoptr (GSocketClient) client = NULL;
+  g_autoptr (GSocketConnection) connection = NULL;
+  g_autoptr (GError) error = NULL;
+  g_autofree gchar *host = NULL;
+  g_autofree gchar *password = NULL;
+  g_autofree gchar *request = NULL;
+  g_autofree gchar *response = NULL;
+  IcstrShoutProtocol protocol;
+  GSocket *socket;
+  guint port, timeout, write_timeout;
+  gint sndbuf;
+
+  GST_OBJECT_LOCK (sink);
+  host = g_strdup (sink->ip);
+  port = sink->port;
+  password = g_strdup_printf ("%s\r\n", sink->password);
+  protocol = sink->protocol;
+  timeout = sink->timeout;
+  write_timeout = sink->write_timeout;
+  sndbuf = sink->sndbuf;
+  GST_OBJECT_UNLOCK (sink);
+
+  /* ShoutCast v1 takes sources on the port after the listeners' one */
+  if (protocol == ICSTR_SHOUT_PROTOCOL_ICY)
+    port++;
+
+  GST_INFO_OBJECT (sink, "Connecting to %s:%u", host, port);
+
+  /* made ahead by start(), while the stream was starting up */
+  g_mutex_lock (&sink->lock);
+  while (sink->preconnecting && !sink->flushing)
+    g_cond_wait (&sink->cond, &sink->lock);
+  connection = g_steal_pointer (&sink->preconnection);
+  if (connection &&
+      g_get_monotonic_time () - sink->preconnected_at > PRECONNECT_MAX_AGE)
+    g_clear_object (&connection);
+  g_mutex_unlock (&sink->lock);
+
+  /* the handshake is blocking, with the timeout applied to each step */
+  client = g_socket_client_new ();
+  g_socket_client_set_timeout (client, MAX ((timeout + 999) / 1000, 1));
+  if (!connection)
+    connection = g_socket_client_connect_to_host (client, host, port, NULL,
+                                                  &error);
+  if (!connection)
+    goto failed;
+
+  socket = g_socket_connection_get_socket (connection);
+
+  if (protocol == ICSTR_SHOUT_PROTOCOL_ICY) {
+    if (!icstr_shout_send_all (socket, password, &error) ||
+        !(response = icstr_shout_receive_response (socket, "\n", &error)) ||
+        !icstr_shout_check_response (protocol, response, &error))
+      goto failed;
+
+    request = icstr_shout_sink_build_request (sink, protocol);
+    if (!icstr_shout_send_all (socket, request, &error))
+      goto failed;
+  } else {
+    request = icstr_shout_sink_build_request (sink, protocol);
+    if (!icstr_shout_send_all (socket, request, &error) ||
+        !(response = icstr_shout_receive_response (socket,
+            (protocol == ICSTR_SHOUT_PROTOCOL_XAUDIOCAST) ? "\n" : "\r\n\r\n",
+            &error)) ||
+        !icstr_shout_check_response (protocol, response, &error))
+      goto failed;
+  }
+
+  if (sndbuf > 0 &&
+      !g_socket_set_option (socket, SOL_SOCKET, SO_SNDBUF, sndbuf, &error)) {
+    GST_WARNING_OBJECT (sink, "Failed to set the send buffer size: %s",
+                        error->message);
+    g_clear_error (&error);
+  }
+
+  g_socket_set_blocking (socket, FALSE);
+  g_socket_set_timeout (socket, 0);
+
+  g_mutex_lock (&sink->lock);
+  sink->connection = g_steal_pointer (&connection);
+  sink->last_progress = g_get_monotonic_time ();
+
+  sink->stall_source = g_timeout_source_new (
+      write_timeout ? MAX (write_timeout / 4, 10) : 1000);
+  g_source_set_callback (sink->stall_source, icstr_shout_sink_check_stall,
+      gst_object_ref (sink), gst_object_unref);
+  g_source_attach (sink->stall_source, icstr_io_context ());
+  g_mutex_unlock (&sink->lock);
+
+  GST_INFO_OBJECT (sink, "Connected to %s:%u", host, port);
+  gst_element_post_message (GST_ELEMENT (sink),
+      gst_message_new_element (GST_OBJECT (sink),
+          gst_structure_new_empty ("icestreamer-connected")));
+
+  /* the new connection starts without a title */
+  icstr_shout_sink_update_metadata (sink);
+
+  return TRUE;
+
+failed:
+  GST_ELEMENT_ERROR (sink, RESOURCE, OPEN_WRITE,
+      ("Could not connect to %s:%u", host, port), ("%s", error->message));
+
+  g_mutex_lock (&sink->lock);
+  sink->failed = TRUE;
+  g_mutex_unlock (&sink->lock);
+
+  return FALSE;
+}
+
+static void
+icstr_shout_sink_close (IcstrShoutSink *sink)
+{
+  g_mutex_lock (&sink->lock);
+
+  if (sink->write_source) {
+    g_source_destroy (sink->write_source);
+    g_clear_pointer (&sink->write_source, g_source_unref);
+  }
+  if (sink->stall_source) {
+    g_source_destroy (sink->stall_source);
+    g_clear_pointer (&sink->stall_source, g_source_unref);
+  }
+
+  g_queue_clear_full (&sink->pending, (GDestroyNotify) icstr_shout_packet_free);
+  sink->pending_bytes = 0;
+
+  if (sink->connection) {
+    g_io_stream_close (G_IO_STREAM (sink->connection), NULL, NULL);
+    g_clear_object (&sink->connection);
+  }
+
+  sink->failed = FALSE;
+
+  /* a connection made ahead that was not used */
+  if (sink->preconnect_cancellable)
+    g_cancellable_cancel (sink->preconnect_cancellable);
+  g_clear_object (&sink->preconnect_cancellable);
+  g_clear_object (&sink->preconnection);
+  sink->preconnecting = FALSE;
+
+  g_mutex_unlock (&sink->lock);
+}
+
+/* GstBaseSink vfuncs */
+
+static gboolean
+icstr_shout_sink_start (GstBaseSink *bsink)
+{
+  IcstrShoutSink *sink = ICSTR_SHOUT_SINK (bsink);
+  IcstrShoutPreconnect *pc = g_new0 (IcstrShoutPreconnect, 1);
+
+  /* the handshake needs the caps, so it is left for the first buffer, in
+   * the streaming thread, and state changes never wait on the network;
+   * the server is connected to in the meantime, from the I/O thread, while
+   * the input and the encoder are starting up */
+  GST_OBJECT_LOCK (sink);
+  pc->host = g_strdup (sink->ip);
+  pc->port = sink->port;
+  if (sink->protocol == ICSTR_SHOUT_PROTOCOL_ICY)
+    pc->port++;
+  pc->timeout = sink->timeout;
+  GST_OBJECT_UNLOCK (sink);
+
+  pc->sink = gst_object_ref (sink);
+  pc->cancellable = g_cancellable_new ();
+
+  g_mutex_lock (&sink->lock);
+  sink->preconnect_cancellable = g_object_ref (pc->cancellable);
+  sink->preconnecting = TRUE;
+  g_mutex_unlock (&sink->lock);
+
+  g_main_context_invoke (icstr_io_context (), icstr_shout_sink_preconnect, pc);
+
+  return TRUE;
+}
+
+static gboolean
+icstr_shout_sink_stop (GstBaseSink *bsink)
+{
+  IcstrShoutSink *sink = ICSTR_SHOUT_SINK (bsink);
+
+  icstr_shout_sink_close (sink);
+
+  GST_OBJECT_LOCK (sink);
+  g_clear_pointer (&sink->content_type, g_free);
+  GST_OBJECT_UNLOCK (sink);
+
+  return TRUE;
+}
+
+static gboolean
+icstr_shout_sink_set_caps (GstBaseSink *bsink, GstCaps *caps)
+{
+  IcstrShoutSink *sink = ICSTR_SHOUT_SINK (bsink);
+  GstStructure *s = gst_caps_get_structure (caps, 0);
+  const gchar *content_type = NULL;
+  gboolean url_metadata = FALSE;
+  gint mpegversion = 1;
+
+  if (gst_structure_has_name (s, "application/ogg") ||
+      gst_structure_has_name (s, "audio/ogg")) {
+    content_type = "application/ogg";
+  } else if (gst_structure_has_name (s, "audio/webm") ||
+      gst_structure_has_name (s, "video/webm")) {
+    content_type = "audio/webm";
+  } else if (gst_structure_has_name (s, "audio/mpeg")) {
+    gst_structure_get_int (s, "mpegversion", &mpegversion);
+    content_type = (mpegversion == 1) ? "audio/mpeg" : "audio/aac";
+    url_metadata = TRUE;
+  } else {
+    GST_ERROR_OBJECT (sink, "Unsupported caps %" GST_PTR_FORMAT, caps);
+    return FALSE;
+  }
+
+  GST_OBJECT_LOCK (sink);
+  g_free (sink->content_type);
+  sink->content_type = g_strdup (content_type);
+  sink->url_metadata = url_metadata;
+  GST_OBJECT_UNLOCK (sink);
+
+  return TRUE;
+}
+
+static GstFlowReturn
+icstr_shout_sink_render (GstBaseSink *bsink, GstBuffer *buffer)
+{
+  IcstrShoutSink *sink = ICSTR_SHOUT_SINK (bsink);
+  GstFlowReturn ret = GST_FLOW_OK;
+  IcstrShoutPacket *packet = NULL;
+  guint write_timeout, max_pending;
+  gint64 deadline;
+
+  /* only this thread and stop() touch the connection pointer */
+  if (!sink->connection && !sink->failed && !icstr_shout_sink_connect (sink))
+    return GST_FLOW_OK;
+
+  GST_OBJECT_LOCK (sink);
+  write_timeout = sink->write_timeout;
+  max_pending = sink->max_pending;
+  GST_OBJECT_UNLOCK (sink);
+
+  g_mutex_lock (&sink->lock);
+
+  /* hold back the queue while the server is not keeping up */
+  deadline = g_get_monotonic_time () +
+      write_timeout * G_TIME_SPAN_MILLISECOND;
+  while (!sink->failed && !sink->flushing &&
+      sink->pending_bytes >= max_pending) {
+    if (write_timeout == 0)
+      g_cond_wait (&sink->cond, &sink->lock);
+    else if (!g_cond_wait_until (&sink->cond, &sink->lock, deadline))
+      icstr_shout_sink_fail_locked (sink, "The server is not keeping up");
+  }
+
+  if (sink->flushing) {
+    ret = GST_FLOW_FLUSHING;
+  } else if (!sink->failed) {
+    packet = g_new0 (IcstrShoutPacket, 1);
+    packet->buffer = gst_buffer_ref (buffer);
+    gst_buffer_map (buffer, &packet->map, GST_MAP_READ);
+
+    if (g_queue_is_empty (&sink->pending))
+      sink->last_progress = g_get_monotonic_time ();
+
+    g_queue_push_tail (&sink->pending, packet);
+    sink->pending_bytes += packet->map.size;
+
+    icstr_shout_sink_write_locked (sink);
+  }
+
+  g_mutex_unlock (&sink->lock);
+
+  return ret;
+}
+
+static void
+icstr_shout_sink_set_song (IcstrShoutSink *sink, const gchar *artist,
+    const gchar *title)
+{
+  gboolean connected;
+  gchar *song = NULL;
+
+  if (artist && title)
+    song = g_strdup_printf ("%s - %s", artist, title);
+  else if (title || artist)
+    song = g_strdup (title ? title : artist);
+
+  if (!song)
+    return;
+
+  GST_OBJECT_LOCK (sink);
+  g_free (sink->song);
+  sink->song = song;
+  GST_OBJECT_UNLOCK (sink);
+
+  /* otherwise it is sent once connected */
+  g_mutex_lock (&sink->lock);
+  connected = sink->connection != NULL;
+  g_mutex_unlock (&sink->lock);
+
+  if (connected)
+    icstr_shout_sink_update_metadata (sink);
+}
+
+static gboolean
+icstr_shout_sink_event (GstBaseSink *bsink, GstEvent *event)
+{
+  IcstrShoutSink *sink = ICSTR_SHOUT_SINK (bsink);
+  GstTagSetter *setter = GST_TAG_SETTER (sink);
+  g_autoptr (GstTagList) tags = NULL;
+  g_autofree gchar *artist = NULL;
+  g_autofree gchar *title = NULL;
+  GstTagList *list = NULL;
+
+  if (GST_EVENT_TYPE (event) == GST_EVENT_TAG) {
+    gst_event_parse_tag (event, &list);
+    tags = gst_tag_list_merge (gst_tag_setter_get_tag_list (setter), list,
+                               gst_tag_setter_get_tag_merge_mode (setter));
+
+    gst_tag_list_get_string (tags, GST_TAG_ARTIST, &artist);
+    gst_tag_list_get_string (tags, GST_TAG_TITLE, &title);
+
+    icstr_shout_sink_set_song (sink, artist, title);
+  }
+
+  return GST_BASE_SINK_CLASS (icstr_shout_sink_parent_class)->event (bsink,
+      event);
+}
+
+static gboolean
+icstr_shout_sink_unlock (GstBaseSink *bsink)
+{
+  IcstrShoutSink *sink = ICSTR_SHOUT_SINK (bsink);
+
+  g_mutex_lock (&sink->lock);
+  sink->flushing = TRUE;
+  g_cond_broadcast (&sink->cond);
+  g_mutex_unlock (&sink->lock);
+
+  return TRUE;
+}
+
+static gboolean
+icstr_shout_sink_unlock_stop (GstBaseSink *bsink)
+{
+  IcstrShoutSink *sink = ICSTR_SHOUT_SINK (bsink);
+
+  g_mutex_lock (&sink->lock);
+  sink->flushing = FALSE;
+  g_mutex_unlock (&sink->lock);
+
+  return TRUE;
+}
+
+/* GObject */
+
+static void
+icstr_shout_sink_set_string (IcstrShoutSink *sink, gchar **field,
+    const GValue *value)
+{
+  GST_OBJECT_LOCK (sink);
+  g_free (*field);
+  *field = g_value_dup_string (value);
+  GST_OBJECT_UNLOCK (sink);
+}
+
+static void
+icstr_shout_sink_set_property (GObject *object, guint prop_id,
+    const GValue *value, GParamSpec *pspec)
+{
+  IcstrShoutSink *sink = ICSTR_SHOUT_SINK (object);
+
+  switch (prop_id) {
+    case PROP_IP:
+      icstr_shout_sink_set_string (sink, &sink->ip, value);
+      break;
+    case PROP_PASSWORD:
+      icstr_shout_sink_set_string (sink, &sink->password, value);
+      break;
+    case PROP_USERNAME:
+      icstr_shout_sink_set_string (sink, &sink->username, value);
+      break;
+    case PROP_MOUNT:
+      icstr_shout_sink_set_string (sink, &sink->mount, value);
+      break;
+    case PROP_STREAMNAME:
+      icstr_shout_sink_set_string (sink, &sink->streamname, value);
+      break;
+    case PROP_DESCRIPTION:
+      icstr_shout_sink_set_string (sink, &sink->description, value);
+      break;
+    case PROP_GENRE:
+      icstr_shout_sink_set_string (sink, &sink->genre, value);
+      break;
+    case PROP_URL:
+      icstr_shout_sink_set_string (sink, &sink->url, value);
+      break;
+    case PROP_USER_AGENT:
+      icstr_shout_sink_set_string (sink, &sink->user_agent, value);
+      break;
+    default:
+      GST_OBJECT_LOCK (sink);
+      switch (prop_id) {
+        case PROP_PORT:
+          sink->port = g_value_get_int (value);
+          break;
+        case PROP_PUBLIC:
+          sink->public = g_value_get_boolean (value);
+          break;
+        case PROP_PROTOCOL:
+          sink->protocol = g_value_get_enum (value);
+          break;
+        case PROP_SEND_TITLE_INFO:
+          sink->send_title_info = g_value_get_boolean (value);
+          break;
+        case PROP_TIMEOUT:
+          sink->timeout = g_value_get_uint (value);
+          break;
+        case PROP_SNDBUF:
+          sink->sndbuf = g_value_get_int (value);
+          break;
+        case PROP_WRITE_TIMEOUT:
+          sink->write_timeout = g_value_get_uint (value);
+          break;
+        case PROP_MAX_PENDING:
+          sink->max_pending = g_value_get_uint (value);
+          break;
+        default:
+          G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+          break;
+      }
+      GST_OBJECT_UNLOCK (sink);
+      break;
+  }
+}
+
+static void
+icstr_shout_sink_get_property (GObject *object, guint prop_id,
+    GValue *value, GParamSpec *pspec)
+{
+  IcstrShoutSink *sink = ICSTR_SHOUT_SINK (object);
+
+  GST_OBJECT_LOCK (sink);
+  switch (prop_id) {
+    case PROP_IP:
+      g_value_set_string (value, sink->ip);
+      break;
+    case PROP_PORT:
+      g_value_set_int (value, sink->port);
+      break;
+    case PROP_PASSWORD:
+      g_value_set_string (value, sink->password);
+      break;
+    case PROP_USERNAME:
+      g_value_set_string (value, sink->username);
+      break;
+    case PROP_MOUNT:
+      g_value_set_string (value, sink->mount);
+      break;
+    case PROP_STREAMNAME:
+      g_value_set_string (value, sink->streamname);
+      break;
+    case PROP_DESCRIPTION:
+      g_value_set_string (value, sink->description);
+      break;
+    case PROP_GENRE:
+      g_value_set_string (value, sink->genre);
+      break;
+    case PROP_URL:
+      g_value_set_string (value, sink->url);
+      break;
+    case PROP_PUBLIC:
+      g_value_set_boolean (value, sink->public);
+      break;
+    case PROP_PROTOCOL:
+      g_value_set_enum (value, sink->protocol);
+      break;
+    case PROP_USER_AGENT:
+      g_value_set_string (value, sink->user_agent);
+      break;
+    case PROP_SEND_TITLE_INFO:
+      g_value_set_boolean (value, sink->send_title_info);
+      break;
+    case PROP_TIMEOUT:
+      g_value_set_uint (value, sink->timeout);
+      break;
+    case PROP_SNDBUF:
+      g_value_set_int (value, sink->sndbuf);
+      break;
+    case PROP_WRITE_TIMEOUT:
+      g_value_set_uint (value, sink->write_timeout);
+      break;
+    case PROP_MAX_PENDING:
+      g_value_set_uint (value, sink->max_pending);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+  GST_OBJECT_UNLOCK (sink);
+}
+
+static void
+icstr_shout_sink_finalize (GObject *object)
+{
+  IcstrShoutSink *sink = ICSTR_SHOUT_SINK (object);
+
+  icstr_shout_sink_close (sink);
+
+  g_free (sink->ip);
+  g_free (sink->password);
+  g_free (sink->username);
+  g_free (sink->mount);
+  g_free (sink->streamname);
+  g_free (sink->description);
+  g_free (sink->genre);
+  g_free (sink->url);
+  g_free (sink->user_agent);
+  g_free (sink->content_type);
+  g_free (sink->song);
+  g_mutex_clear (&sink->lock);
+  g_cond_clear (&sink->cond);
+
+  G_OBJECT_CLASS (icstr_shout_sink_parent_class)->finalize (object);
+}
+
+static void
+icstr_shout_sink_init (IcstrShoutSink *sink)
+{
+  sink->ip = g_strdup (DEFAULT_IP);
+  sink->port = DEFAULT_PORT;
+  sink->password = g_strdup (DEFAULT_PASSWORD);
+  sink->username = g_strdup (DEFAULT_USERNAME);
+  sink->mount = g_strdup ("");
+  sink->streamname = g_strdup ("");
+  sink->description = g_strdup ("");
+  sink->genre = g_strdup ("");
+  sink->url = g_strdup ("");
+  sink->protocol = DEFAULT_PROTOCOL;
+  sink->user_agent = g_strdup_printf ("%s/%s", PACKAGE_NAME, PACKAGE_VERSION);
+  sink->send_title_info = TRUE;
+  sink->timeout = DEFAULT_TIMEOUT;
+  sink->write_timeout = DEFAULT_WRITE_TIMEOUT;
+  sink->max_pending = DEFAULT_MAX_PENDING;
+
+  g_mutex_init (&sink->lock);
+  g_cond_init (&sink->cond);
+  g_queue_init (&sink->pending);
+
+  /* this is a live stream, send it as soon as it arrives */
+  gst_base_sink_set_sync (GST_BASE_SINK (sink), FALSE);
+}
+
+static void
+icstr_shout_sink_class_init (IcstrShoutSinkClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+  GstElementClass *element_class = GST_ELEMENT_CLASS (klass);
+  GstBaseSinkClass *basesink_class = GST_BASE_SINK_CLASS (klass);
+  const GParamFlags flags = G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS;
+
+  gobject_class->set_property = icstr_shout_sink_set_property;
+  gobject_class->get_property = icstr_shout_sink_get_property;
+  gobject_class->finalize = icstr_shout_sink_finalize;
+
+  g_object_class_install_property (gobject_class, PROP_IP,
+      g_param_spec_string ("ip", "ip", "IP address or hostname of the server",
+          DEFAULT_IP, flags));
+  g_object_class_install_property (gobject_class, PROP_PORT,
+      g_param_spec_int ("port", "port", "Port of the server",
+          1, G_MAXUINT16, DEFAULT_PORT, flags));
+  g_object_class_install_property (gobject_class, PROP_PASSWORD,
+      g_param_spec_string ("password", "password", "Source password",
+          DEFAULT_PASSWORD, flags));
+  g_object_class_install_property (gobject_class, PROP_USERNAME,
+      g_param_spec_string ("username", "username", "Source username",
+          DEFAULT_USERNAME, flags));
+  g_object_class_install_property (gobject_class, PROP_MOUNT,
+      g_param_spec_string ("mount", "mount", "Mount point", "", flags));
+  g_object_class_install_property (gobject_class, PROP_STREAMNAME,
+      g_param_spec_string ("streamname", "streamname", "Name of the stream",
+          "", flags));
+  g_object_class_install_property (gobject_class, PROP_DESCRIPTION,
+      g_param_spec_string ("description", "description",
+          "Description of the stream", "", flags));
+  g_object_class_install_property (gobject_class, PROP_GENRE,
+      g_param_spec_string ("genre", "genre", "Genre of the stream", "",
+          flags));
+  g_object_class_install_property (gobject_class, PROP_URL,
+      g_param_spec_string ("url", "url", "URL of the stream's website", "",
+          flags));
+  g_object_class_install_property (gobject_class, PROP_PUBLIC,
+      g_param_spec_boolean ("public", "public",
+          "Whether the stream is listed in directories", FALSE, flags));
+  g_object_class_install_property (gobject_class, PROP_PROTOCOL,
+      g_param_spec_enum ("protocol", "protocol", "Connection protocol",
+          ICSTR_TYPE_SHOUT_PROTOCOL, DEFAULT_PROTOCOL, flags));
+  g_object_class_install_property (gobject_class, PROP_USER_AGENT,
+      g_param_spec_string ("user-agent", "User-Agent",
+          "User agent of the source", NULL, flags));
+  g_object_class_install_property (gobject_class, PROP_SEND_TITLE_INFO,
+      g_param_spec_boolean ("send-title-info", "send-title-info",
+          "Update the title of the stream from tags", TRUE, flags));
+  g_object_class_install_property (gobject_class, PROP_TIMEOUT,
+      g_param_spec_uint ("timeout", "timeout",
+          "Timeout for connecting to the server (in ms)",
+          1, G_MAXUINT, DEFAULT_TIMEOUT, flags));
+  g_object_class_install_property (gobject_class, PROP_SNDBUF,
+      g_param_spec_int ("sndbuf", "sndbuf",
+          "Size of the socket send buffer (0 = system default)",
+          0, G_MAXINT, 0, flags));
+  g_object_class_install_property (gobject_class, PROP_WRITE_TIMEOUT,
+      g_param_spec_uint ("write-timeout", "write-timeout",
+          "Time after which a connection that accepts no data is considered "
+          "dead (in ms, 0 = never)", 0, G_MAXUINT, DEFAULT_WRITE_TIMEOUT,
+          flags));
+  g_object_class_install_property (gobject_class, PROP_MAX_PENDING,
+      g_param_spec_uint ("max-pending", "max-pending",
+          "Bytes kept in the sink while the socket is full, before the "
+          "upstream queue is held back", 1, G_MAXUINT, DEFAULT_MAX_PENDING,
+          flags));
+
+  gst_element_class_add_static_pad_template (element_class, &sink_template);
+  gst_element_class_set_static_metadata (element_class,
+      "Icecast/ShoutCast sink", "Sink/Network",
+      "Sends data to an Icecast or ShoutCast server without blocking",
+      "George Kiagiadakis <gkiagia@tolabaki.gr>");
+
+  basesink_class->start = GST_DEBUG_FUNCPTR (icstr_shout_sink_start);
+  basesink_class->stop = GST_DEBUG_FUNCPTR (icstr_shout_sink_stop);
+  basesink_class->set_caps = GST_DEBUG_FUNCPTR (icstr_shout_sink_set_caps);
+  basesink_class->render = GST_DEBUG_FUNCPTR (icstr_shout_sink_render);
+  basesink_class->event = GST_DEBUG_FUNCPTR (icstr_shout_sink_event);
+  basesink_class->unlock = GST_DEBUG_FUNCPTR (icstr_shout_sink_unlock);
+  basesink_class->unlock_stop =
+      GST_DEBUG_FUNCPTR (icstr_shout_sink_unlock_stop);
+}
+
+gboolean
+icstr_shout_sink_register (void)
+{
+  return gst_element_register (NULL, "icstrshoutsink", GST_RANK_NONE,
+                               ICSTR_TYPE_SHOUT_SINK);
+}
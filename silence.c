@@ -0,0 +1,212 @@
+/*
+ * IceStreamer - A simple live audio streamer
+ *
+ * Copyright (C) 2017 George Kiagiadakis <gkiagia@tolabaki.gr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "icestreamer.h"
+#include <stdatomic.h>
+
+/*
+ * Dead air detection. The meter of the input hands every window of audio
+ * to us on the capture thread, with its RMS level already computed, so
+ * that the input is not scanned twice. When the loudest channel stays
+ * below the threshold for long enough, the input is considered silent;
+ * it stops being silent once it has been above the threshold for a while.
+ *
+ * The transitions are counted in audio time, on the capture thread, and
+ * acted upon (logging, running the hook) in the main thread.
+ *
+ * With a backup input, it is the primary input that is watched, also while
+ * it is not on air, and the backup takes over while it is silent.
+ */
+
+#define SILENCE_THRESHOLD -50.0
+#define SILENCE_DURATION 10
+#define SILENCE_RECOVERY 2
+
+struct _IcstrSilence
+{
+  gdouble threshold;            /* dBFS */
+  GstClockTime duration;
+  GstClockTime recovery;
+  gchar **command;
+  IcstrFailover *failover;      /* weak pointer, NULL if not switching */
+
+  /* only used from the capture thread */
+  gboolean detected;
+  GstClockTime below;
+  GstClockTime above;
+
+  /* published by the capture thread */
+  atomic_bool silent;
+  atomic_uint events;
+
+  /* main thread */
+  gboolean reported;
+  gint64 since;                 /* monotonic time the silence started */
+};
+
+static void
+icstr_silence_run_command (IcstrSilence *silence, gboolean silent)
+{
+  g_autoptr (GError) error = NULL;
+  g_auto (GStrv) envp = g_get_environ ();
+  g_autofree gchar *seconds = g_strdup_printf ("%" G_GINT64_FORMAT,
+      (g_get_monotonic_time () - silence->since) / G_TIME_SPAN_SECOND);
+
+  envp = g_environ_setenv (envp, "ICESTREAMER_SILENCE", silent ? "1" : "0",
+                           TRUE);
+  envp = g_environ_setenv (envp, "ICESTREAMER_SILENCE_SECONDS", seconds,
+                           TRUE);
+
+  if (!g_spawn_async (NULL, silence->command, envp, G_SPAWN_SEARCH_PATH,
+                      NULL, NULL, NULL, &error))
+    GST_WARNING ("Failed to run the silence command: %s", error->message);
+}
+
+static gboolean
+icstr_silence_notify (gpointer data)
+{
+  IcstrSilence *silence = data;
+  gboolean silent = atomic_load_explicit (&silence->silent,
+                                          memory_order_relaxed);
+
+  /* several notifications may be pending; only act on changes */
+  if (silent == silence->reported)
+    return G_SOURCE_REMOVE;
+  silence->reported = silent;
+
+  if (silent) {
+    /* the silence was detected after it had already lasted this long */
+    silence->since = g_get_monotonic_time () -
+        silence->duration / GST_USECOND;
+    GST_WARNING ("Dead air: the input has been below %.1f dBFS for %"
+        G_GUINT64_FORMAT " seconds", silence->threshold,
+        silence->duration / GST_SECOND);
+  } else {
+    GST_WARNING ("The input is not silent anymore, after %" G_GINT64_FORMAT
+        " seconds", (g_get_monotonic_time () - silence->since) /
+        G_TIME_SPAN_SECOND);
+  }
+
+  if (silence->failover)
+    icstr_failover_set_silent (silence->failover, silent);
+
+  if (silence->command)
+    icstr_silence_run_command (silence, silent);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* called by the meter, from the capture thread */
+static void
+icstr_silence_window (const gdouble *rms, guint channels,
+    GstClockTime duration, gpointer data)
+{
+  IcstrSilence *silence = data;
+  gdouble loudest = ICSTR_METER_FLOOR;
+  guint c;
+
+  for (c = 0; c < channels; c++)
+    loudest = MAX (loudest, rms[c]);
+
+  if (loudest < silence->threshold) {
+    silence->below += duration;
+    silence->above = 0;
+  } else {
+    silence->above += duration;
+    if (!silence->detected || silence->above >= silence->recovery)
+      silence->below = 0;
+  }
+
+  if (!silence->detected && silence->below >= silence->duration) {
+    silence->detected = TRUE;
+    atomic_fetch_add_explicit (&silence->events, 1, memory_order_relaxed);
+  } else if (silence->detected && silence->above >= silence->recovery) {
+    silence->detected = FALSE;
+  } else {
+    return;
+  }
+
+  atomic_store_explicit (&silence->silent, silence->detected,
+                         memory_order_relaxed);
+  g_main_context_invoke (NULL, icstr_silence_notify, silence);
+}
+
+gboolean
+icstr_silence_setup (IceStreamer *self, GKeyFile *keyfile, GError **error)
+{
+  IcstrSilence *silence;
+  IcstrMeter *meter = self->meter;
+  g_autofree gchar *command = NULL;
+  g_auto (GStrv) argv = NULL;
+  gdouble threshold;
+  gint duration, recovery;
+
+  threshold = icstr_keyfile_get_double_with_fallback (keyfile, "silence",
+      "threshold", SILENCE_THRESHOLD);
+  duration = icstr_keyfile_get_integer_with_fallback (keyfile, "silence",
+      "duration", SILENCE_DURATION);
+  recovery = icstr_keyfile_get_integer_with_fallback (keyfile, "silence",
+      "recovery", SILENCE_RECOVERY);
+
+  command = g_key_file_get_string (keyfile, "silence", "command", NULL);
+  if (command && !g_shell_parse_argv (command, NULL, &argv, error)) {
+    g_prefix_error (error, "Invalid silence command: ");
+    return FALSE;
+  }
+
+  silence = g_new0 (IcstrSilence, 1);
+  silence->threshold = threshold;
+  silence->duration = MAX (duration, 1) * GST_SECOND;
+  silence->recovery = MAX (recovery, 0) * GST_SECOND;
+  silence->command = g_steal_pointer (&argv);
+  atomic_init (&silence->silent, FALSE);
+  atomic_init (&silence->events, 0);
+
+  /* switch to the backup input while silent, unless asked not to */
+  if (self->failover &&
+      (!g_key_file_has_key (keyfile, "silence", "failover", NULL) ||
+       g_key_file_get_boolean (keyfile, "silence", "failover", NULL))) {
+    silence->failover = self->failover;
+    meter = icstr_failover_get_primary_meter (self->failover);
+  }
+
+  self->silence = silence;
+  icstr_meter_add_watch (meter, icstr_silence_window, silence);
+
+  GST_DEBUG ("Detecting silence below %.1f dBFS for %d seconds", threshold,
+             duration);
+
+  return TRUE;
+}
+
+void
+icstr_silence_free (IcstrSilence *silence)
+{
+  g_strfreev (silence->command);
+  g_free (silence);
+}
+
+/* returns whether the input is silent, and the number of times it has
+ * gone silent so far */
+gboolean
+icstr_silence_get_state (IcstrSilence *silence, guint *events)
+{
+  if (events)
+    *events = atomic_load_explicit (&silence->events, memory_order_relaxed);
+  return atomic_load_explicit (&silence->silent, memory_order_relaxed);
+}
@@ -20,19 +20,65 @@
 #include "icestreamer.h"
 #include <gst/audio/audio.h>
 
-static GstElement *
-icstr_source_add_capsfilter (GstElement *element, GKeyFile *keyfile)
+/* the codecs of an input that is relayed without decoding it, named as the
+ * encoders of the streams, so that the streams in the same one pass it
+ * through and the others decode it; see icstr_construct_stream() */
+typedef struct
 {
-  GstElement *bin = NULL;
-  GstElement *capsfilter = NULL;
-  GstPad *pad, *gpad;
-  g_autoptr (GstCaps) caps = NULL;
+  const gchar *codec;
+  const gchar *caps;
+  const gchar *decoder;
+} IcstrRelayCodec;
 
-  bin = gst_bin_new ("source_bin");
-  capsfilter = gst_element_factory_make ("capsfilter", NULL);
+static const IcstrRelayCodec relay_codecs[] = {
+  { "opus", "audio/x-opus", "opusdec" },
+  { "vorbis", "audio/x-vorbis", "vorbisdec" },
+  { "mp3", "audio/mpeg, mpegversion = (int) 1, layer = (int) 3",
+    "mpg123audiodec" },
+  { "flac", "audio/x-flac", "flacdec" },
+};
 
-  gst_bin_add_many (GST_BIN (bin), element, capsfilter, NULL);
-  gst_element_link (element, capsfilter);
+static const IcstrRelayCodec *
+icstr_source_lookup_codec (const gchar *codec)
+{
+  guint i;
+
+  for (i = 0; codec && i < G_N_ELEMENTS (relay_codecs); i++) {
+    if (g_str_equal (relay_codecs[i].codec, codec))
+      return &relay_codecs[i];
+  }
+  return NULL;
+}
+
+/* the codec of the primary input if it is relayed, NULL if it is raw */
+gchar *
+icstr_source_get_relay_codec (GKeyFile *keyfile)
+{
+  g_autofree gchar *source = g_key_file_get_string (keyfile, "input",
+                                                    "source", NULL);
+
+  if (g_strcmp0 (source, "relay") != 0)
+    return NULL;
+  return g_key_file_get_string (keyfile, "input", "codec", NULL);
+}
+
+const gchar *
+icstr_source_get_relay_decoder (const gchar *codec)
+{
+  const IcstrRelayCodec *entry = icstr_source_lookup_codec (codec);
+
+  return entry ? entry->decoder : NULL;
+}
+
+GstCaps *
+icstr_source_get_caps (GKeyFile *keyfile)
+{
+  g_autofree gchar *codec = icstr_source_get_relay_codec (keyfile);
+  const IcstrRelayCodec *entry = icstr_source_lookup_codec (codec);
+  GstCaps *caps = NULL;
+
+  if (entry)
+    return gst_caps_from_string (entry->caps);
 
   caps = gst_caps_new_simple ("audio/x-raw", NULL);
 
@@ -53,6 +99,37 @@ icstr_source_add_capsfilter (GstElement *element, GKeyFile *keyfile)
         g_key_file_get_integer (keyfile, "input", "rate", NULL), NULL);
   }
 
+  return caps;
+}
+
+static GstElement *
+icstr_source_add_capsfilter (GstElement *element, GKeyFile *keyfile,
+    const gchar *group)
+{
+  GstElement *bin = NULL;
+  GstElement *capsfilter = NULL;
+  GstPad *pad, *gpad;
+  g_autoptr (GstCaps) caps = NULL;
+  gboolean backup = !g_str_equal (group, "input");
+
+  bin = gst_bin_new (backup ? "backup_source_bin" : "source_bin");
+  capsfilter = gst_element_factory_make ("capsfilter", NULL);
+
+  gst_bin_add_many (GST_BIN (bin), element, capsfilter, NULL);
+
+  /* the backup input is converted to the format of the primary one,
+   * so that switching between them does not renegotiate the streams */
+  if (backup) {
+    GstElement *convert = gst_element_factory_make ("audioconvert", NULL);
+    GstElement *resample = gst_element_factory_make ("audioresample", NULL);
+
+    gst_bin_add_many (GST_BIN (bin), convert, resample, NULL);
+    gst_element_link_many (element, convert, resample, capsfilter, NULL);
+  } else {
+    gst_element_link (element, capsfilter);
+  }
+
+  caps = icstr_source_get_caps (keyfile);
 
   g_object_set (capsfilter, "caps", caps, NULL);
 
@@ -64,18 +141,111 @@ icstr_source_add_capsfilter (GstElement *element, GKeyFile *keyfile)
   return gst_object_ref_sink (bin);
 }
 
+/* urisourcebin and parsebin expose their pads once they know what the data
+ * is; the first one that fits is relayed and the others are left alone */
+static void
+icstr_source_relay_pad_added (GstElement *element, GstPad *pad,
+    gpointer data)
+{
+  GstElement *next = data;
+  g_autoptr (GstPad) sinkpad = gst_element_get_static_pad (next, "sink");
+
+  if (gst_pad_is_linked (sinkpad))
+    return;
+
+  if (gst_pad_link (pad, sinkpad) != GST_PAD_LINK_OK)
+    GST_DEBUG ("Not relaying %s:%s", GST_DEBUG_PAD_NAME (pad));
+}
+
+/* an input that is already encoded, e.g. from another Icecast server or a
+ * pipe, parsed into packets but not decoded */
+static GstElement *
+icstr_construct_relay (GKeyFile *keyfile, const gchar *group,
+    GError **error)
+{
+  g_autoptr (GstElement) bin = NULL;
+  g_autoptr (GstCaps) caps = NULL;
+  g_autoptr (GError) internal_error = NULL;
+  g_autofree gchar *codec = NULL;
+  GstElement *source, *parse, *capsfilter;
+  GstPad *pad;
+
+  /* the backup input is switched to as raw audio */
+  if (!g_str_equal (group, "input")) {
+    g_set_error (error, ICSTR_ERROR, 0, "Only the primary input can relay");
+    return NULL;
+  }
+
+  codec = g_key_file_get_string (keyfile, group, "codec", NULL);
+  if (!icstr_source_lookup_codec (codec)) {
+    g_set_error (error, ICSTR_ERROR, 0, "Unknown relay codec: %s",
+                 codec ? codec : "(none)");
+    return NULL;
+  }
+
+  if (!g_key_file_has_key (keyfile, group, "uri", NULL)) {
+    g_set_error (error, ICSTR_ERROR, 0, "No uri to relay");
+    return NULL;
+  }
+
+  bin = gst_object_ref_sink (gst_bin_new ("source_bin"));
+
+  source = gst_element_factory_make ("urisourcebin", NULL);
+  parse = gst_element_factory_make ("parsebin", NULL);
+  capsfilter = gst_element_factory_make ("capsfilter", NULL);
+  if (!source || !parse) {
+    g_set_error (error, ICSTR_ERROR, 0,
+                 "Failed to construct the relay (urisourcebin, parsebin)");
+    return NULL;
+  }
+
+  gst_bin_add_many (GST_BIN (bin), source, parse, capsfilter, NULL);
+
+  /* uri, and e.g. buffer-size */
+  if (!icstr_object_set_properties_from_keyfile (source, keyfile, group,
+                                                 &internal_error)) {
+    g_propagate_prefixed_error (error, g_steal_pointer (&internal_error),
+                                "Failed to read %s properties:", group);
+    return NULL;
+  }
+
+  /* only the codec that the streams expect gets through */
+  caps = icstr_source_get_caps (keyfile);
+  g_object_set (capsfilter, "caps", caps, NULL);
+
+  g_signal_connect_object (source, "pad-added",
+      G_CALLBACK (icstr_source_relay_pad_added), parse, 0);
+  g_signal_connect_object (parse, "pad-added",
+      G_CALLBACK (icstr_source_relay_pad_added), capsfilter, 0);
+
+  pad = gst_element_get_static_pad (capsfilter, "src");
+  gst_element_add_pad (bin, gst_ghost_pad_new ("src", pad));
+  gst_object_unref (pad);
+
+  if (!icstr_sched_attach (bin, keyfile, group, error))
+    return NULL;
+
+  return g_steal_pointer (&bin);
+}
+
+/* constructs the input described by group, i.e. "input" or "input.backup";
+ * its format is always the one of the primary input */
 GstElement *
-icstr_construct_source (IceStreamer *self, GKeyFile *keyfile, GError **error)
+icstr_construct_source (IceStreamer *self, GKeyFile *keyfile,
+    const gchar *group, GError **error)
 {
   g_autoptr (GstElement) element = NULL;
+  g_autoptr (GstElement) bin = NULL;
   g_autofree gchar *value = NULL;
   const gchar *element_factory = NULL;
   g_autoptr (GError) internal_error = NULL;
 
   /* find out which element to construct and construct it */
-  value = icstr_keyfile_get_string_with_fallback (keyfile, "input", "source",
+  value = icstr_keyfile_get_string_with_fallback (keyfile, group, "source",
                                                   "auto");
-  if (g_str_equal (value, "auto"))
+  if (g_str_equal (value, "relay"))
+    return icstr_construct_relay (keyfile, group, error);
+  else if (g_str_equal (value, "auto"))
     element_factory = "autoaudiosrc";
   else if (g_str_equal (value, "jack"))
     element_factory = "jackaudiosrc";
@@ -108,30 +278,40 @@ icstr_construct_source (IceStreamer *self, GKeyFile *keyfile, GError **error)
   gst_object_ref_sink (element);
 
   /* set its properties */
-  if (!icstr_object_set_properties_from_keyfile (element, keyfile, "input",
+  if (!icstr_object_set_properties_from_keyfile (element, keyfile, group,
                                                  &internal_error)) {
     /* group not found is ok - for anything else, bail out */
     if (internal_error->code != G_KEY_FILE_ERROR_GROUP_NOT_FOUND) {
       g_propagate_prefixed_error (error, g_steal_pointer (&internal_error),
-                                  "Failed to read input properties:");
+                                  "Failed to read %s properties:", group);
       return NULL;
     }
   }
 
-  /* force audiotestsrc to behave like a live source */
-  if (g_str_equal (element_factory, "audiotestsrc"))
+  /* force audiotestsrc to behave like a live source, unless asked not to,
+   * e.g. for benchmarking faster than real time */
+  if (g_str_equal (element_factory, "audiotestsrc") &&
+      !g_key_file_has_key (keyfile, group, "is-live", NULL))
     g_object_set (element, "is-live", TRUE, NULL);
 
   /* make sure it works */
   if (gst_element_set_state (element, GST_STATE_READY)
       != GST_STATE_CHANGE_SUCCESS) {
-    g_set_error (error, ICSTR_ERROR, 0, "Failed to activate input element");
+    g_set_error (error, ICSTR_ERROR, 0, "Failed to activate %s element",
+                 group);
     return NULL;
   }
 
-  /* bring back to NULL state, for the case where we have to dispose before going to PLAYING */
-  gst_element_set_state (element, GST_STATE_NULL);
+  /* and keep it open, for the pipeline to take it from there rather than
+   * opening the device a second time; it is brought back to NULL along
+   * with the pipeline, or here if it does not get that far */
+  bin = icstr_source_add_capsfilter (element, keyfile, group);
+
+  /* scheduling parameters of the capture thread, if any */
+  if (!icstr_sched_attach (bin, keyfile, group, error)) {
+    gst_element_set_state (element, GST_STATE_NULL);
+    return NULL;
+  }
 
-  /* wrap in a bin with a capsfilter */
-  return icstr_source_add_capsfilter (element, keyfile);
+  return g_steal_pointer (&bin);
 }
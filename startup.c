@@ -0,0 +1,159 @@
+/*
+ * IceStreamer - A simple live audio streamer
+ *
+ * Copyright (C) 2017 George Kiagiadakis <gkiagia@tolabaki.gr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "icestreamer.h"
+#include <stdarg.h>
+#include <stdatomic.h>
+
+/*
+ * The startup timeline. Each step of the bring-up is logged with the time
+ * since the process started: the configuration, the input, the streams,
+ * the first captured buffer and, for each destination, its first buffer
+ * and, for our shout sink, the end of its handshake with the server.
+ * It ends once every destination is up, so that reconnections later on
+ * are not logged as part of it.
+ */
+
+typedef struct _IcstrStartupDestination IcstrStartupDestination;
+struct _IcstrStartupDestination
+{
+  gchar *name;                  /* stream/destination */
+  gboolean handshake;           /* up once connected, not on its 1st buffer */
+  atomic_bool up;
+};
+
+static gint64 startup_time = 0;         /* monotonic time */
+static atomic_uint startup_pending;     /* destinations that are not up */
+static atomic_bool startup_done;
+
+#define STARTUP_DATA "icestreamer-startup"
+
+void
+icstr_startup_begin (void)
+{
+  startup_time = g_get_monotonic_time ();
+  atomic_init (&startup_pending, 0);
+  atomic_init (&startup_done, FALSE);
+}
+
+void
+icstr_startup_mark (const gchar *format, ...)
+{
+  g_autofree gchar *what = NULL;
+  va_list args;
+
+  if (atomic_load (&startup_done))
+    return;
+
+  va_start (args, format);
+  what = g_strdup_vprintf (format, args);
+  va_end (args);
+
+  GST_INFO ("Startup +%.1f ms: %s",
+            (g_get_monotonic_time () - startup_time) / 1000.0, what);
+}
+
+static void
+icstr_startup_destination_free (IcstrStartupDestination *sd)
+{
+  g_free (sd->name);
+  g_free (sd);
+}
+
+static void
+icstr_startup_destination_up (IcstrStartupDestination *sd, const gchar *how)
+{
+  if (atomic_exchange (&sd->up, TRUE))
+    return;
+
+  icstr_startup_mark ("%s %s", sd->name, how);
+
+  if (atomic_fetch_sub (&startup_pending, 1) == 1) {
+    icstr_startup_mark ("all destinations are up");
+    atomic_store (&startup_done, TRUE);
+  }
+}
+
+/* in the streaming thread of the destination */
+static GstPadProbeReturn
+icstr_startup_first_buffer (GstPad *pad, GstPadProbeInfo *info,
+    gpointer data)
+{
+  IcstrStartupDestination *sd = data;
+
+  if (sd->handshake)
+    icstr_startup_mark ("%s has its first buffer, connecting", sd->name);
+  else
+    icstr_startup_destination_up (sd, "has its first buffer");
+
+  return GST_PAD_PROBE_REMOVE;
+}
+
+static GstPadProbeReturn
+icstr_startup_first_input (GstPad *pad, GstPadProbeInfo *info,
+    gpointer data)
+{
+  icstr_startup_mark ("first buffer from the input");
+  return GST_PAD_PROBE_REMOVE;
+}
+
+/* follows the destinations that are there when the pipeline starts */
+void
+icstr_startup_watch (IceStreamer *self)
+{
+  g_autoptr (GstPad) tee_pad = gst_element_get_static_pad (self->tee, "sink");
+  GList *curr, *dcurr;
+
+  gst_pad_add_probe (tee_pad, GST_PAD_PROBE_TYPE_BUFFER,
+      icstr_startup_first_input, NULL, NULL);
+
+  for (curr = self->streams; curr != NULL; curr = g_list_next (curr)) {
+    IcstrStream *stream = curr->data;
+
+    for (dcurr = stream->destinations; dcurr != NULL;
+        dcurr = g_list_next (dcurr)) {
+      IcstrDestination *dest = dcurr->data;
+      IcstrStartupDestination *sd = g_new0 (IcstrStartupDestination, 1);
+      g_autoptr (GstPad) pad = gst_element_get_static_pad (dest->sink,
+                                                           "sink");
+      GstElementFactory *factory = gst_element_get_factory (dest->sink);
+
+      sd->name = g_strdup_printf ("%s/%s", stream->name, dest->name);
+      sd->handshake = g_str_equal (GST_OBJECT_NAME (factory),
+                                   "icstrshoutsink");
+      atomic_init (&sd->up, FALSE);
+      atomic_fetch_add (&startup_pending, 1);
+
+      g_object_set_data_full (G_OBJECT (dest->sink), STARTUP_DATA, sd,
+          (GDestroyNotify) icstr_startup_destination_free);
+      gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER,
+          icstr_startup_first_buffer, sd, NULL);
+    }
+  }
+}
+
+/* the icestreamer-connected message of our shout sink */
+void
+icstr_startup_handle_connected (GstMessage *msg)
+{
+  IcstrStartupDestination *sd = g_object_get_data (
+      G_OBJECT (GST_MESSAGE_SRC (msg)), STARTUP_DATA);
+
+  if (sd)
+    icstr_startup_destination_up (sd, "is connected");
+}
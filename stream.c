@@ -18,25 +18,570 @@
  */
 #include "icestreamer.h"
 
-GstElement *
+static void
+icstr_destination_free (IcstrDestination *dest)
+{
+  if (dest->reconnect_source)
+    g_source_remove (dest->reconnect_source);
+  if (dest->tee_pad) {
+    gst_element_release_request_pad (dest->stream->tee, dest->tee_pad);
+    gst_object_unref (dest->tee_pad);
+  }
+  g_clear_pointer (&dest->backlog, icstr_backlog_free);
+  g_clear_pointer (&dest->metadata, icstr_metadata_target_free);
+  g_clear_pointer (&dest->queue, icstr_queue_free);
+  g_free (dest->name);
+  g_free (dest);
+}
+
+void
+icstr_stream_free (IcstrStream *stream)
+{
+  g_list_free_full (stream->destinations,
+                    (GDestroyNotify) icstr_destination_free);
+  g_clear_pointer (&stream->queue, icstr_queue_free);
+  g_clear_object (&stream->bin);
+  g_free (stream->name);
+  g_free (stream);
+}
+
+IcstrDestination *
+icstr_lookup_destination (IceStreamer *self, GstObject *sink)
+{
+  GList *curr, *dcurr;
+
+  for (curr = self->streams; curr != NULL; curr = g_list_next (curr)) {
+    IcstrStream *stream = curr->data;
+
+    for (dcurr = stream->destinations; dcurr != NULL;
+        dcurr = g_list_next (dcurr)) {
+      IcstrDestination *dest = dcurr->data;
+      if (GST_OBJECT (dest->sink) == sink)
+        return dest;
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * After a reconnection, the muxer has long sent the stream headers
+ * (Ogg/Vorbis/Opus header pages, WebM EBML header), so send the copies that
+ * it keeps in the caps before the first buffer that reaches the new connection.
+ */
+static GstPadProbeReturn
+icstr_destination_replay_headers (GstPad *pad, GstPadProbeInfo *info,
+    gpointer data)
+{
+  IcstrDestination *dest = data;
+  GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+  g_autoptr (GstCaps) caps = NULL;
+  const GValue *headers = NULL;
+  guint i, n_headers;
+
+  if (!g_atomic_int_compare_and_exchange (&dest->needs_headers, TRUE, FALSE))
+    return GST_PAD_PROBE_OK;
+
+  /* the muxer is sending them itself */
+  if (GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_HEADER))
+    return GST_PAD_PROBE_OK;
+
+  caps = gst_pad_get_current_caps (pad);
+  if (!caps)
+    return GST_PAD_PROBE_OK;
+
+  headers = gst_structure_get_value (gst_caps_get_structure (caps, 0),
+                                     "streamheader");
+  if (!headers || !GST_VALUE_HOLDS_ARRAY (headers))
+    return GST_PAD_PROBE_OK;
+
+  n_headers = gst_value_array_get_size (headers);
+  GST_DEBUG ("Sending %u stream headers to %s", n_headers, dest->name);
+
+  for (i = 0; i < n_headers; i++) {
+    const GValue *header = gst_value_array_get_value (headers, i);
+    gst_pad_chain (pad, gst_buffer_ref (gst_value_get_buffer (header)));
+  }
+
+  return GST_PAD_PROBE_OK;
+}
+
+/*
+ * While the destination is down, its share of the encoded stream is kept
+ * in the backlog (if enabled) instead of being lost. Once it is back, the
+ * backlog is sent first, at a multiple of the real-time rate, and the live
+ * buffers queue up behind it until it has caught up.
+ */
+static GstPadProbeReturn
+icstr_destination_backlog_probe (GstPad *pad, GstPadProbeInfo *info,
+    gpointer data)
+{
+  IcstrDestination *dest = data;
+  GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+  gsize budget;
+
+  /* this is one of our own pushes below */
+  if (dest->draining)
+    return GST_PAD_PROBE_OK;
+
+  if (!g_atomic_int_get (&dest->connected)) {
+    if (dest->backlog &&
+        !GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_HEADER))
+      icstr_backlog_push (dest->backlog, gst_buffer_ref (buffer));
+    return GST_PAD_PROBE_DROP;
+  }
+
+  if (!dest->backlog || icstr_backlog_is_empty (dest->backlog))
+    return GST_PAD_PROBE_OK;
+
+  icstr_backlog_push (dest->backlog, gst_buffer_ref (buffer));
+  budget = gst_buffer_get_size (buffer) * dest->backlog_burst;
+
+  dest->draining = TRUE;
+  while (!icstr_backlog_is_empty (dest->backlog) &&
+      g_atomic_int_get (&dest->connected)) {
+    GstBuffer *queued = icstr_backlog_pop (dest->backlog);
+    gsize size = gst_buffer_get_size (queued);
+
+    if (gst_pad_push (pad, queued) != GST_FLOW_OK || size >= budget)
+      break;
+    budget -= size;
+  }
+  dest->draining = FALSE;
+
+  return GST_PAD_PROBE_DROP;
+}
+
+static void icstr_destination_schedule_reconnect (IcstrDestination *dest);
+
+static gboolean
+icstr_destination_reconnect_callback (gpointer data)
+{
+  IcstrDestination *dest = data;
+  g_autoptr (GstPad) bin_sinkpad = NULL;
+
+  dest->reconnect_source = 0;
+  dest->connected_since = g_get_monotonic_time ();
+  dest->reconnects++;
+
+  GST_INFO ("Reconnecting %s (attempt %u)", dest->name, dest->failures);
+
+  /* the server needs the stream headers again before any data */
+  g_atomic_int_set (&dest->needs_headers, TRUE);
+
+  if (gst_element_set_state (dest->bin, GST_STATE_PLAYING)
+      == GST_STATE_CHANGE_FAILURE) {
+    gst_element_set_state (dest->bin, GST_STATE_READY);
+    icstr_destination_schedule_reconnect (dest);
+    return G_SOURCE_REMOVE;
+  }
+
+  bin_sinkpad = gst_element_get_static_pad (dest->bin, "sink");
+  gst_pad_link (dest->tee_pad, bin_sinkpad);
+  g_atomic_int_set (&dest->connected, TRUE);
+  return G_SOURCE_REMOVE;
+}
+
+static void
+icstr_destination_schedule_reconnect (IcstrDestination *dest)
+{
+  guint64 delay;
+
+  /* a stopped stream retries when it starts again */
+  if (dest->reconnect_source || dest->stream->stopped)
+    return;
+
+  /*
+   * Retry quickly after the first failure, then back off exponentially.
+   * The jitter spreads out the destinations that failed together,
+   * e.g. when a server restarts, so that they do not all retry at once.
+   */
+  if (dest->failures == 0) {
+    delay = g_random_int_range (0, RECONNECT_FAST_DELAY);
+  } else {
+    delay = (guint64) dest->reconnect_delay << MIN (dest->failures - 1, 16);
+    delay = MIN (delay, dest->reconnect_max_delay);
+    delay = delay / 2 + g_random_int_range (0, delay / 2 + 1);
+  }
+
+  dest->failures++;
+
+  GST_INFO ("Reconnecting %s in %" G_GUINT64_FORMAT " ms", dest->name, delay);
+  dest->reconnect_source = g_timeout_add (delay,
+      icstr_destination_reconnect_callback, dest);
+}
+
+void
+icstr_destination_disconnect (IcstrDestination *dest)
+{
+  g_autoptr (GstPad) bin_sinkpad = NULL;
+
+  /* from now on, buffers go to the backlog */
+  g_atomic_int_set (&dest->connected, FALSE);
+  dest->last_error = g_get_monotonic_time ();
+
+  bin_sinkpad = gst_element_get_static_pad (dest->bin, "sink");
+  if (gst_pad_is_linked (bin_sinkpad))
+    gst_pad_unlink (dest->tee_pad, bin_sinkpad);
+
+  /* only the connection is closed, the encoder of the stream keeps running */
+  gst_element_set_state (dest->bin, GST_STATE_READY);
+
+  /* a destination that stayed up for a while starts over with fast retries */
+  if (g_get_monotonic_time () - dest->connected_since >
+      RECONNECT_STABLE_TIME * G_TIME_SPAN_SECOND)
+    dest->failures = 0;
+
+  icstr_destination_schedule_reconnect (dest);
+}
+
+static IcstrDestination *
+icstr_construct_destination (IcstrStream *stream, GKeyFile *keyfile,
+    const gchar *group, GError **error)
+{
+  g_autoptr (GstElement) bin = NULL;
+  g_autoptr (IcstrQueue) queue = NULL;
+  g_autoptr (GstElement) sink = NULL;
+  g_autoptr (GError) internal_error = NULL;
+  g_autoptr (GstPad) target = NULL;
+  g_autofree gchar *bin_name = NULL;
+  g_autofree gchar *queue_name = NULL;
+  g_autofree gchar *output = NULL;
+  g_autofree gchar *sink_name = NULL;
+  const gchar *sink_factory = NULL;
+  IcstrDestination *dest = NULL;
+  GstPad *ghostpad = NULL;
+  GstPad *tee_pad = NULL;
+  gint backlog_bytes, backlog_seconds;
+  gint reconnect_delay, reconnect_max_delay;
+  gint metadata_offset;
+  GstTagSetter *tagsetter = NULL;
+
+  GST_DEBUG ("Attempting to construct destination %s for stream %s",
+             group, stream->name);
+
+  /* find out which sink to construct; the destination is sent to a server
+   * with our own sink unless asked otherwise, or served to listeners,
+   * or archived, or published as HLS, or thrown away, for benchmarking */
+  output = icstr_keyfile_get_string_with_fallback (keyfile, group, "output",
+                                                   NULL);
+  if (!output)
+    output = icstr_keyfile_get_string_with_fallback (keyfile, stream->name,
+        "output", "icecast");
+  if (g_str_equal (output, "http")) {
+    sink_factory = "icstrhttpsink";
+  } else if (g_str_equal (output, "file")) {
+    sink_factory = "icstrfilesink";
+  } else if (g_str_equal (output, "hls")) {
+    sink_factory = "icstrhlssink";
+  } else if (g_str_equal (output, "discard")) {
+    sink_factory = "fakesink";
+  } else if (!g_str_equal (output, "icecast")) {
+    g_set_error (error, ICSTR_ERROR, 0, "Unknown output: %s", output);
+    return NULL;
+  }
+
+  if (!sink_factory) {
+    sink_name = icstr_keyfile_get_string_with_fallback (keyfile, group, "sink",
+        NULL);
+    if (!sink_name)
+      sink_name = icstr_keyfile_get_string_with_fallback (keyfile,
+          stream->name, "sink", "icecast");
+
+    if (g_str_equal (sink_name, "icecast")) {
+      sink_factory = "icstrshoutsink";
+    } else if (g_str_equal (sink_name, "shout2send")) {
+      sink_factory = "shout2send";
+    }
+
+    if (!sink_factory) {
+      g_set_error (error, ICSTR_ERROR, 0, "Unknown sink: %s", sink_name);
+      return NULL;
+    }
+  }
+
+  /* construct the sink */
+  sink = icstr_element_factory_make_with_group_name (sink_factory, group);
+  if (!sink) {
+    g_set_error (error, ICSTR_ERROR, 0,
+        "Failed to construct %s element "
+        "- verify your GStreamer installation", sink_factory);
+    return NULL;
+  }
+
+  if (g_object_class_find_property (G_OBJECT_GET_CLASS (sink), "streamname"))
+    g_object_set (sink, "streamname", group, NULL);
+  else
+    g_object_set (sink, "sync", FALSE, NULL);
+
+  /* set its properties; destinations inherit the ones of their stream */
+  if (!icstr_object_set_properties_from_keyfile (sink, keyfile,
+                                                 stream->name,
+                                                 &internal_error) ||
+      (!g_str_equal (group, stream->name) &&
+       !icstr_object_set_properties_from_keyfile (sink, keyfile, group,
+                                                  &internal_error))) {
+    g_propagate_prefixed_error (error, g_steal_pointer (&internal_error),
+        "Failed to read %s properties for destination '%s':", sink_factory,
+        group);
+    return NULL;
+  }
+
+  /* each destination has its own queue, so that a slow server
+   * does not hold back the rest */
+  bin_name = g_strdup_printf ("destination-%s", group);
+  bin = gst_object_ref_sink (gst_bin_new (bin_name));
+
+  /* it drops old buffers if transmission is taking too long */
+  queue_name = g_str_equal (group, stream->name) ? g_strdup (group) :
+      g_strdup_printf ("%s/%s", stream->name, group);
+  queue = icstr_queue_new (keyfile, group, stream->name, queue_name);
+
+  /* allow the destination to go to PLAYING independently of its stream */
+  g_object_set (bin, "async-handling", TRUE, NULL);
+
+  /* scheduling parameters of the destination's thread, if any */
+  if (!icstr_sched_attach (bin, keyfile, group, error))
+    return NULL;
+
+  gst_bin_add_many (GST_BIN (bin), queue->element, sink, NULL);
+  if (!gst_element_link (queue->element, sink)) {
+    g_set_error (error, ICSTR_ERROR, 0,
+        "Failed to link pipeline for destination '%s'", group);
+    return NULL;
+  }
+
+  target = gst_element_get_static_pad (queue->element, "sink");
+  ghostpad = gst_ghost_pad_new ("sink", target);
+  gst_element_add_pad (bin, ghostpad);
+
+  if (GST_IS_TAG_SETTER (sink)) {
+    tagsetter = GST_TAG_SETTER (sink);
+    gst_tag_setter_set_tag_merge_mode (tagsetter, GST_TAG_MERGE_REPLACE);
+  }
+
+  /* the tee pad stays around while the destination is disconnected;
+   * when added to a running stream, it has to be ready before it gets data */
+  tee_pad = gst_element_get_request_pad (stream->tee, "src_%u");
+  gst_bin_add (GST_BIN (stream->bin), bin);
+  gst_element_sync_state_with_parent (bin);
+  if (GST_PAD_LINK_FAILED (gst_pad_link (tee_pad, ghostpad))) {
+    gst_element_set_state (bin, GST_STATE_NULL);
+    gst_bin_remove (GST_BIN (stream->bin), bin);
+    gst_element_release_request_pad (stream->tee, tee_pad);
+    gst_object_unref (tee_pad);
+    g_set_error (error, ICSTR_ERROR, 0,
+        "Failed to link destination '%s' with stream '%s'", group,
+        stream->name);
+    return NULL;
+  }
+
+  dest = g_new0 (IcstrDestination, 1);
+  dest->name = g_strdup (group);
+  dest->stream = stream;
+  dest->bin = bin;
+  dest->queue = g_steal_pointer (&queue);
+  dest->sink = sink;
+  dest->tee_pad = tee_pad;
+  dest->connected = TRUE;
+  dest->connected_since = g_get_monotonic_time ();
+
+  gst_pad_add_probe (ghostpad, GST_PAD_PROBE_TYPE_BUFFER,
+                     icstr_destination_replay_headers, dest, NULL);
+
+  /* outage backlog, as with the rest, inherited from the stream */
+  backlog_bytes = icstr_keyfile_get_integer_with_fallback (keyfile, group,
+      "backlog-bytes", icstr_keyfile_get_integer_with_fallback (keyfile,
+          stream->name, "backlog-bytes", 0));
+  backlog_seconds = icstr_keyfile_get_integer_with_fallback (keyfile, group,
+      "backlog-seconds", icstr_keyfile_get_integer_with_fallback (keyfile,
+          stream->name, "backlog-seconds", 0));
+  dest->backlog_burst = icstr_keyfile_get_double_with_fallback (keyfile,
+      group, "backlog-burst", icstr_keyfile_get_double_with_fallback (keyfile,
+          stream->name, "backlog-burst", BACKLOG_BURST));
+
+  if (backlog_bytes > 0 || backlog_seconds > 0) {
+    dest->backlog = icstr_backlog_new (
+        backlog_bytes > 0 ? backlog_bytes : BACKLOG_MAX_BYTES,
+        backlog_seconds > 0 ? backlog_seconds * GST_SECOND :
+            GST_CLOCK_TIME_NONE);
+    dest->backlog_burst = MAX (dest->backlog_burst, 1.0);
+  }
+
+  gst_pad_add_probe (tee_pad, GST_PAD_PROBE_TYPE_BUFFER,
+                     icstr_destination_backlog_probe, dest, NULL);
+
+  /* reconnection delays, as with the rest, inherited from the stream */
+  reconnect_delay = icstr_keyfile_get_integer_with_fallback (keyfile,
+      group, "reconnect-delay", icstr_keyfile_get_integer_with_fallback (
+          keyfile, stream->name, "reconnect-delay", RECONNECT_DELAY));
+  reconnect_max_delay = icstr_keyfile_get_integer_with_fallback (keyfile,
+      group, "reconnect-max-delay", icstr_keyfile_get_integer_with_fallback (
+          keyfile, stream->name, "reconnect-max-delay", RECONNECT_MAX_DELAY));
+  dest->reconnect_delay = MAX (reconnect_delay, 1);
+  dest->reconnect_max_delay = MAX (reconnect_max_delay,
+      (gint) dest->reconnect_delay);
+  if ((gint) dest->reconnect_delay != reconnect_delay ||
+      (gint) dest->reconnect_max_delay != reconnect_max_delay) {
+    GST_WARNING ("Invalid reconnection delays for %s, using %u to %u ms",
+        group, dest->reconnect_delay, dest->reconnect_max_delay);
+  }
+
+  /* when the metadata reaches the sink relative to its audio, in ms */
+  metadata_offset = icstr_keyfile_get_integer_with_fallback (keyfile, group,
+      "metadata-offset", icstr_keyfile_get_integer_with_fallback (keyfile,
+          stream->name, "metadata-offset", 0));
+  dest->metadata = icstr_metadata_target_new (sink,
+      metadata_offset * GST_MSECOND);
+
+  return dest;
+}
+
+IcstrDestination *
+icstr_stream_add_destination (IcstrStream *stream, GKeyFile *keyfile,
+    const gchar *group, GError **error)
+{
+  IcstrDestination *dest;
+
+  dest = icstr_construct_destination (stream, keyfile, group, error);
+  if (dest)
+    stream->destinations = g_list_append (stream->destinations, dest);
+
+  return dest;
+}
+
+/* stops the destination and removes it from its stream, which keeps
+ * running, and frees it */
+void
+icstr_stream_remove_destination (IcstrStream *stream, IcstrDestination *dest)
+{
+  g_autoptr (GstPad) bin_sinkpad = NULL;
+
+  g_atomic_int_set (&dest->connected, FALSE);
+
+  bin_sinkpad = gst_element_get_static_pad (dest->bin, "sink");
+  if (gst_pad_is_linked (bin_sinkpad))
+    gst_pad_unlink (dest->tee_pad, bin_sinkpad);
+
+  gst_element_set_state (dest->bin, GST_STATE_NULL);
+  gst_bin_remove (GST_BIN (stream->bin), dest->bin);
+
+  stream->destinations = g_list_remove (stream->destinations, dest);
+  icstr_destination_free (dest);
+}
+
+/*
+ * Stops a running stream on request: it is cut off from its input and its
+ * elements are shut down, but it keeps its place in the pipeline, which
+ * does not bring it back when its own state changes.
+ */
+void
+icstr_stream_stop (IceStreamer *self, IcstrStream *stream)
+{
+  GList *curr;
+
+  if (stream->stopped)
+    return;
+
+  GST_INFO ("Stopping stream %s", stream->name);
+
+  /* pending reconnections are retried when it starts again */
+  for (curr = stream->destinations; curr != NULL; curr = g_list_next (curr)) {
+    IcstrDestination *dest = curr->data;
+    if (dest->reconnect_source) {
+      g_source_remove (dest->reconnect_source);
+      dest->reconnect_source = 0;
+    }
+  }
+
+  icstr_unlink_stream (self, stream);
+  gst_element_set_locked_state (stream->bin, TRUE);
+  gst_element_set_state (stream->bin, GST_STATE_NULL);
+  stream->stopped = TRUE;
+}
+
+gboolean
+icstr_stream_start (IceStreamer *self, IcstrStream *stream, GError **error)
+{
+  GList *curr;
+
+  if (!stream->stopped)
+    return TRUE;
+
+  GST_INFO ("Starting stream %s", stream->name);
+
+  gst_element_set_locked_state (stream->bin, FALSE);
+  if (!gst_element_sync_state_with_parent (stream->bin)) {
+    g_set_error (error, ICSTR_ERROR, 0, "Failed to start stream '%s'",
+                 stream->name);
+    goto fail;
+  }
+
+  if (!icstr_link_stream (self, self->keyfile, stream, error))
+    goto fail;
+
+  stream->stopped = FALSE;
+
+  for (curr = stream->destinations; curr != NULL; curr = g_list_next (curr)) {
+    IcstrDestination *dest = curr->data;
+    if (!g_atomic_int_get (&dest->connected)) {
+      dest->failures = 0;
+      icstr_destination_schedule_reconnect (dest);
+    }
+  }
+
+  return TRUE;
+
+fail:
+  icstr_unlink_stream (self, stream);
+  gst_element_set_locked_state (stream->bin, TRUE);
+  gst_element_set_state (stream->bin, GST_STATE_NULL);
+  return FALSE;
+}
+
+/* the first AAC encoder that is installed, by preference */
+static const gchar *
+icstr_find_aac_encoder (void)
+{
+  static const gchar *factories[] = { "fdkaacenc", "voaacenc", "avenc_aac" };
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (factories); i++) {
+    g_autoptr (GstElementFactory) factory =
+        gst_element_factory_find (factories[i]);
+    if (factory)
+      return factories[i];
+  }
+  return NULL;
+}
+
+IcstrStream *
 icstr_construct_stream (IceStreamer *self,
     GKeyFile *keyfile, const gchar *group, GError **error)
 {
+  g_autoptr (IcstrStream) stream = NULL;
   g_autoptr (GstElement) bin = NULL;
-  g_autoptr (GstElement) queue = NULL;
+  g_autoptr (IcstrQueue) queue = NULL;
   g_autoptr (GstElement) convert = NULL;
   g_autoptr (GstElement) resample = NULL;
+  g_autoptr (GstElement) decoder = NULL;
   g_autoptr (GstElement) encoder = NULL;
+  g_autoptr (GstElement) parser = NULL;
   g_autoptr (GstElement) mux = NULL;
-  g_autoptr (GstElement) shout2send = NULL;
+  g_autoptr (GstElement) tee = NULL;
   g_autoptr (GError) internal_error = NULL;
   g_autoptr (GstPad) target = NULL;
   g_autofree gchar *value = NULL;
+  g_auto (GStrv) destinations = NULL;
   const gchar *encoder_factory = NULL;
+  const gchar *decoder_factory = NULL;
+  const gchar *parser_factory = NULL;   /* mpegtsmux takes parsed frames */
   const gchar *mux_factory = NULL;
-  GstTagSetter *tagsetter = NULL;
+  const gchar *default_container = "ogg";
   gboolean mux_required = TRUE;
+  gboolean passthrough = FALSE;
   gboolean link_res = FALSE;
+  gchar **dest_group;
 
   /* find out which encoder & mux to construct */
   value = icstr_keyfile_get_string_with_fallback (keyfile, group, "encoder",
@@ -45,9 +590,26 @@ icstr_construct_stream (IceStreamer *self,
     encoder_factory = "vorbisenc";
   } else if (g_str_equal (value, "opus")) {
     encoder_factory = "opusenc";
+    parser_factory = "opusparse";
   } else if (g_str_equal (value, "mp3")) {
     encoder_factory = "lamemp3enc";
+    parser_factory = "mpegaudioparse";
+    mux_required = FALSE;
+  } else if (g_str_equal (value, "flac")) {
+    /* lossless, mostly for archiving; native FLAC needs no muxer */
+    encoder_factory = "flacenc";
     mux_required = FALSE;
+  } else if (g_str_equal (value, "aac")) {
+    /* mostly for HLS, in MPEG-TS, with whichever encoder is installed */
+    encoder_factory = icstr_find_aac_encoder ();
+    parser_factory = "aacparse";
+    default_container = "mpegts";
+    if (!encoder_factory) {
+      g_set_error (error, ICSTR_ERROR, 0,
+          "No AAC encoder (fdkaacenc, voaacenc or avenc_aac) for stream '%s'",
+          group);
+      return NULL;
+    }
   }
 
   if (!encoder_factory) {
@@ -55,14 +617,31 @@ icstr_construct_stream (IceStreamer *self,
     return NULL;
   }
 
+  /* a relayed input is passed through to the streams in its own codec,
+   * and only decoded for the others */
+  if (self->relay_codec && g_str_equal (value, self->relay_codec)) {
+    encoder_factory = "identity";
+    passthrough = TRUE;
+  } else if (self->relay_codec) {
+    decoder_factory = icstr_source_get_relay_decoder (self->relay_codec);
+  }
+
+  /* MP3 and FLAC are sent as they are, unless asked for MPEG-TS */
+  g_free (value);
+  value = icstr_keyfile_get_string_with_fallback (keyfile, group, "container",
+                                                  default_container);
+  if (g_str_equal (value, "mpegts"))
+    mux_required = TRUE;
+  else
+    parser_factory = NULL;
+
   if (mux_required) {
-    g_free (value);
-    value = icstr_keyfile_get_string_with_fallback (keyfile, group, "container",
-                                                    "ogg");
     if (g_str_equal (value, "ogg")) {
       mux_factory = "oggmux";
     } else if (g_str_equal (value, "webm")) {
       mux_factory = "webmmux";
+    } else if (g_str_equal (value, "mpegts")) {
+      mux_factory = "mpegtsmux";
     }
 
     if (!mux_factory) {
@@ -86,7 +665,8 @@ icstr_construct_stream (IceStreamer *self,
   }
 
   /* set encoder properties */
-  if (!icstr_object_set_properties_from_keyfile (encoder, keyfile, group,
+  if (!passthrough &&
+      !icstr_object_set_properties_from_keyfile (encoder, keyfile, group,
                                                  &internal_error)) {
     g_propagate_prefixed_error (error, g_steal_pointer (&internal_error),
         "Failed to read shout2send properties for stream '%s':", group);
@@ -111,58 +691,103 @@ icstr_construct_stream (IceStreamer *self,
   if (mux && g_str_equal (mux_factory, "webmmux"))
     g_object_set (mux, "streamable", TRUE, NULL);
 
-  /* construct shout2send */
-  shout2send = icstr_element_factory_make_with_group_name ("shout2send", group);
-  if (!shout2send) {
-    g_set_error (error, ICSTR_ERROR, 0,
-        "Failed to construct shout2send element "
-        "- verify your GStreamer installation");
-    return NULL;
+  if (parser_factory) {
+    parser = icstr_element_factory_make_with_group_name (parser_factory,
+                                                         group);
+    if (!parser) {
+      g_set_error (error, ICSTR_ERROR, 0,
+          "Failed to construct parser element (%s) for stream '%s'",
+          parser_factory, group);
+      return NULL;
+    }
   }
-  g_object_set (shout2send, "streamname", group, NULL);
 
-  /* set its properties */
-  if (!icstr_object_set_properties_from_keyfile (shout2send, keyfile, group,
-                                                 &internal_error)) {
-    g_propagate_prefixed_error (error, g_steal_pointer (&internal_error),
-        "Failed to read shout2send properties for stream '%s':", group);
-    return NULL;
+  if (decoder_factory) {
+    decoder = icstr_element_factory_make_with_group_name (decoder_factory,
+                                                          group);
+    if (!decoder) {
+      g_set_error (error, ICSTR_ERROR, 0,
+          "Failed to construct decoder element (%s) for stream '%s'",
+          decoder_factory, group);
+      return NULL;
+    }
   }
 
   /* construct the rest of the pipeline for this stream */
   bin = icstr_element_factory_make_with_group_name ("bin", group);
-  queue = icstr_element_factory_make_with_group_name ("queue", group);
-  convert = icstr_element_factory_make_with_group_name ("audioconvert", group);
-  resample = icstr_element_factory_make_with_group_name ("audioresample", group);
+
+  /* raw input is converted by a conversion shared with the streams that
+   * need the same format, see icstr_link_stream(), so only the output of
+   * a decoder has to be converted here */
+  if (decoder) {
+    convert = icstr_element_factory_make_with_group_name ("audioconvert",
+                                                          group);
+    resample = icstr_element_factory_make_with_group_name ("audioresample",
+                                                           group);
+  }
+  tee = icstr_element_factory_make_with_group_name ("tee", group);
 
   /* allow the bin to go to PLAYING independently of the pipeline or other bins */
   g_object_set (bin, "async-handling", TRUE, NULL);
 
-  /* allow dropping old buffers if transmission is taking too long */
-  g_object_set (queue, "leaky", 2, NULL);
+  /* it drops old buffers if encoding is taking too long */
+  queue = icstr_queue_new (keyfile, group, NULL, group);
+
+  /* keep encoding while all destinations are disconnected */
+  g_object_set (tee, "allow-not-linked", TRUE, NULL);
+
+  /* scheduling parameters of the encoder's thread, if any */
+  if (!icstr_sched_attach (bin, keyfile, group, error))
+    return NULL;
 
-  gst_bin_add_many (GST_BIN (bin), queue, convert, resample, encoder,
-                    shout2send, NULL);
+  gst_bin_add_many (GST_BIN (bin), queue->element, encoder, tee, NULL);
+  if (decoder)
+    gst_bin_add_many (GST_BIN (bin), decoder, convert, resample, NULL);
+  if (parser)
+    gst_bin_add (GST_BIN (bin), parser);
   if (mux)
     gst_bin_add (GST_BIN (bin), mux);
 
-  if (mux)
-    link_res = gst_element_link_many (queue, convert, resample, encoder, mux,
-                                      shout2send, NULL);
+  /* queue ! [decoder ! audioconvert ! audioresample !] encoder ! [parser !]
+   * [mux !] tee, with a decoder only for a relay in another codec, and
+   * nothing but an identity in place of the encoder for a relay in the
+   * same one */
+  if (decoder)
+    link_res = gst_element_link_many (queue->element, decoder, convert,
+                                      resample, encoder, NULL);
   else
-    link_res = gst_element_link_many (queue, convert, resample, encoder,
-                                      shout2send, NULL);
+    link_res = gst_element_link (queue->element, encoder);
+
+  if (link_res && parser)
+    link_res = gst_element_link_many (encoder, parser, mux, tee, NULL);
+  else if (link_res && mux)
+    link_res = gst_element_link_many (encoder, mux, tee, NULL);
+  else if (link_res)
+    link_res = gst_element_link (encoder, tee);
+
   if (!link_res) {
     g_set_error (error, ICSTR_ERROR, 0,
         "Failed to link pipeline for stream '%s'", group);
     return NULL;
   }
 
-  target = gst_element_get_static_pad (queue, "sink");
+  target = gst_element_get_static_pad (queue->element, "sink");
   gst_element_add_pad (bin, gst_ghost_pad_new ("sink", target));
 
-  tagsetter = GST_TAG_SETTER (shout2send);
-  gst_tag_setter_set_tag_merge_mode (tagsetter, GST_TAG_MERGE_REPLACE);
+  stream = g_new0 (IcstrStream, 1);
+  stream->name = g_strdup (group);
+  stream->bin = g_steal_pointer (&bin);
+  stream->queue = g_steal_pointer (&queue);
+  stream->encoder = encoder;
+  stream->tee = tee;
+
+  /* the encoded stream is sent to all the listed destinations,
+   * or to the stream group itself if there is no such list */
+  destinations = icstr_keyfile_get_destinations (keyfile, group);
+  for (dest_group = destinations; *dest_group; dest_group++) {
+    if (!icstr_stream_add_destination (stream, keyfile, *dest_group, error))
+      return NULL;
+  }
 
-  return g_steal_pointer (&bin);
+  return g_steal_pointer (&stream);
 }